@@ -0,0 +1,692 @@
+/*
+ *   aclient.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+
+#include "utils.h"
+#include "aclient.h"
+#include "ringbuffer.h"
+
+#define MAX_LATENCY (8192 * 2)	//As in jclient.c
+
+#define ACLIENT_PCM_WAIT_TIME_MS 1000
+
+static const snd_pcm_format_t ACLIENT_FORMATS[] = {
+  SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S16_LE
+};
+
+//ALSA timestamps use the monotonic clock too.
+static uint64_t
+aclient_get_time ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline float
+aclient_clip (float v)
+{
+  return v > 1.0 ? 1.0 : v < -1.0 ? -1.0 : v;
+}
+
+static inline void
+aclient_write_sample (void *dst, snd_pcm_format_t format, float v)
+{
+  switch (format)
+    {
+    case SND_PCM_FORMAT_FLOAT_LE:
+      *(float *) dst = v;
+      break;
+    case SND_PCM_FORMAT_S32_LE:
+      *(int32_t *) dst = aclient_clip (v) * (INT32_MAX - 1.0);
+      break;
+    default:
+      *(int16_t *) dst = aclient_clip (v) * INT16_MAX;
+    }
+}
+
+static inline float
+aclient_read_sample (const void *src, snd_pcm_format_t format)
+{
+  switch (format)
+    {
+    case SND_PCM_FORMAT_FLOAT_LE:
+      return *(float *) src;
+    case SND_PCM_FORMAT_S32_LE:
+      return *(int32_t *) src / (float) INT32_MAX;
+    default:
+      return *(int16_t *) src / (float) INT16_MAX;
+    }
+}
+
+static inline void *
+aclient_get_area_addr (const snd_pcm_channel_area_t * area,
+		       snd_pcm_uframes_t frame)
+{
+  return (char *) area->addr + (area->first + frame * area->step) / 8;
+}
+
+static int
+aclient_open_pcm (struct aclient *aclient, struct aclient_pcm *pcm,
+		  snd_pcm_stream_t stream, unsigned int channels)
+{
+  int err;
+  unsigned int rate = aclient->samplerate;
+  unsigned int periods = aclient->periods;
+  snd_pcm_uframes_t period_size = aclient->period_size;
+  snd_pcm_hw_params_t *hw_params;
+  snd_pcm_sw_params_t *sw_params;
+  const char *name = stream == SND_PCM_STREAM_PLAYBACK ? "playback" :
+    "capture";
+
+  err = snd_pcm_open (&pcm->pcm, aclient->device_name, stream, 0);
+  if (err < 0)
+    {
+      error_print ("Cannot open %s PCM %s: %s", name, aclient->device_name,
+		   snd_strerror (err));
+      return err;
+    }
+
+  snd_pcm_hw_params_alloca (&hw_params);
+  snd_pcm_hw_params_any (pcm->pcm, hw_params);
+
+  err = snd_pcm_hw_params_set_access (pcm->pcm, hw_params,
+				      SND_PCM_ACCESS_MMAP_INTERLEAVED);
+  if (err < 0)
+    {
+      error_print ("Cannot use mmap access on %s PCM: %s", name,
+		   snd_strerror (err));
+      goto error;
+    }
+
+  err = -EINVAL;
+  for (int i = 0; i < sizeof (ACLIENT_FORMATS) / sizeof (snd_pcm_format_t);
+       i++)
+    {
+      if (!snd_pcm_hw_params_set_format (pcm->pcm, hw_params,
+					 ACLIENT_FORMATS[i]))
+	{
+	  pcm->format = ACLIENT_FORMATS[i];
+	  err = 0;
+	  break;
+	}
+    }
+  if (err < 0)
+    {
+      error_print ("No supported sample format on %s PCM", name);
+      goto error;
+    }
+
+  pcm->channels = channels;
+  snd_pcm_hw_params_set_channels_near (pcm->pcm, hw_params, &pcm->channels);
+  snd_pcm_hw_params_set_rate_near (pcm->pcm, hw_params, &rate, NULL);
+  snd_pcm_hw_params_set_period_size_near (pcm->pcm, hw_params, &period_size,
+					  NULL);
+  snd_pcm_hw_params_set_periods_near (pcm->pcm, hw_params, &periods, NULL);
+
+  err = snd_pcm_hw_params (pcm->pcm, hw_params);
+  if (err < 0)
+    {
+      error_print ("Cannot set %s PCM hardware parameters: %s", name,
+		   snd_strerror (err));
+      goto error;
+    }
+
+  //The playback PCM sets the configuration the capture PCM must follow.
+  if (stream == SND_PCM_STREAM_PLAYBACK)
+    {
+      aclient->samplerate = rate;
+      aclient->period_size = period_size;
+      aclient->periods = periods;
+    }
+  else if (rate != aclient->samplerate || period_size != aclient->period_size)
+    {
+      error_print
+	("Capture PCM configuration (%d Hz, %lu frames) differs from playback PCM configuration (%d Hz, %lu frames)",
+	 rate, period_size, aclient->samplerate, aclient->period_size);
+      err = -EINVAL;
+      goto error;
+    }
+
+  debug_print (1,
+	       "Using %s PCM with %d channels, format %s, %d Hz, %lu frames and %d periods...",
+	       name, pcm->channels, snd_pcm_format_name (pcm->format), rate,
+	       period_size, periods);
+
+  //The stream is started explicitly and the timestamps are taken from the monotonic clock as the engine time.
+  snd_pcm_sw_params_alloca (&sw_params);
+  snd_pcm_sw_params_current (pcm->pcm, sw_params);
+  snd_pcm_sw_params_set_avail_min (pcm->pcm, sw_params, period_size);
+  snd_pcm_sw_params_set_start_threshold (pcm->pcm, sw_params, LONG_MAX);
+  snd_pcm_sw_params_set_tstamp_mode (pcm->pcm, sw_params,
+				     SND_PCM_TSTAMP_ENABLE);
+  snd_pcm_sw_params_set_tstamp_type (pcm->pcm, sw_params,
+				     SND_PCM_TSTAMP_TYPE_MONOTONIC);
+
+  err = snd_pcm_sw_params (pcm->pcm, sw_params);
+  if (err < 0)
+    {
+      error_print ("Cannot set %s PCM software parameters: %s", name,
+		   snd_strerror (err));
+      goto error;
+    }
+
+  return 0;
+
+error:
+  snd_pcm_close (pcm->pcm);
+  pcm->pcm = NULL;
+  return err;
+}
+
+static int
+aclient_write_playback (struct aclient *aclient, float *f,
+			snd_pcm_uframes_t frames, int silence)
+{
+  int err;
+  snd_pcm_uframes_t offset, size;
+  const snd_pcm_channel_area_t *areas;
+  struct ow_engine *engine = ow_resampler_get_engine (aclient->resampler);
+  const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
+  struct aclient_pcm *pcm = &aclient->playback;
+
+  while (frames)
+    {
+      size = frames;
+      err = snd_pcm_mmap_begin (pcm->pcm, &areas, &offset, &size);
+      if (err < 0)
+	{
+	  return err;
+	}
+
+      for (int i = 0; i < size; i++)
+	{
+	  for (int j = 0; j < pcm->channels; j++)
+	    {
+	      float v = silence || j >= desc->outputs ? 0.0 : f[j];
+	      aclient_write_sample (aclient_get_area_addr (&areas[j],
+							   offset + i),
+				    pcm->format, v);
+	    }
+	  f += silence ? 0 : desc->outputs;
+	}
+
+      err = snd_pcm_mmap_commit (pcm->pcm, offset, size);
+      if (err < 0)
+	{
+	  return err;
+	}
+
+      frames -= size;
+    }
+
+  return 0;
+}
+
+static int
+aclient_read_capture (struct aclient *aclient, float *f,
+		      snd_pcm_uframes_t frames)
+{
+  int err;
+  snd_pcm_uframes_t offset, size;
+  const snd_pcm_channel_area_t *areas;
+  struct ow_engine *engine = ow_resampler_get_engine (aclient->resampler);
+  const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
+  struct aclient_pcm *pcm = &aclient->capture;
+
+  while (frames)
+    {
+      size = frames;
+      err = snd_pcm_mmap_begin (pcm->pcm, &areas, &offset, &size);
+      if (err < 0)
+	{
+	  return err;
+	}
+
+      for (int i = 0; i < size; i++)
+	{
+	  for (int j = 0; j < desc->inputs; j++)
+	    {
+	      *f = j >= pcm->channels ? 0.0 :
+		aclient_read_sample (aclient_get_area_addr (&areas[j],
+							    offset + i),
+				     pcm->format);
+	      f++;
+	    }
+	}
+
+      err = snd_pcm_mmap_commit (pcm->pcm, offset, size);
+      if (err < 0)
+	{
+	  return err;
+	}
+
+      frames -= size;
+    }
+
+  return 0;
+}
+
+//The playback buffer is filled with silence before starting so the first period can be processed while the previous ones are being played.
+static int
+aclient_start_pcms (struct aclient *aclient)
+{
+  int err;
+
+  err = snd_pcm_prepare (aclient->playback.pcm);
+  if (err < 0)
+    {
+      return err;
+    }
+
+  if (!aclient->linked)
+    {
+      err = snd_pcm_prepare (aclient->capture.pcm);
+      if (err < 0)
+	{
+	  return err;
+	}
+    }
+
+  err = aclient_write_playback (aclient, NULL,
+				aclient->period_size * aclient->periods, 1);
+  if (err < 0)
+    {
+      return err;
+    }
+
+  err = snd_pcm_start (aclient->playback.pcm);
+  if (err < 0)
+    {
+      return err;
+    }
+
+  if (!aclient->linked)
+    {
+      err = snd_pcm_start (aclient->capture.pcm);
+    }
+
+  return err;
+}
+
+static int
+aclient_recover (struct aclient *aclient)
+{
+  error_print ("ALSA xrun");
+
+  snd_pcm_drop (aclient->playback.pcm);
+  if (!aclient->linked)
+    {
+      snd_pcm_drop (aclient->capture.pcm);
+    }
+
+  return aclient_start_pcms (aclient);
+}
+
+static void
+aclient_audio_running (void *data)
+{
+  debug_print (1, "Audio running");
+}
+
+static inline int
+aclient_is_pcm_running (struct aclient *aclient)
+{
+  int running;
+  pthread_spin_lock (&aclient->lock);
+  running = aclient->pcm_running;
+  pthread_spin_unlock (&aclient->lock);
+  return running;
+}
+
+//This is the equivalent to the JACK process callback. Every period, the cycle time is taken from the playback PCM timestamp.
+static void *
+aclient_pcm_runner (void *data)
+{
+  int err, xrun = 0;
+  uint64_t current_usecs;
+  snd_pcm_sframes_t avail, cavail;
+  snd_pcm_uframes_t tavail;
+  snd_htimestamp_t ts;
+  struct aclient *aclient = data;
+  snd_pcm_uframes_t period_size = aclient->period_size;
+
+  err = aclient_start_pcms (aclient);
+  if (err < 0)
+    {
+      error_print ("Cannot start PCMs: %s", snd_strerror (err));
+      goto end;
+    }
+
+  while (aclient_is_pcm_running (aclient))
+    {
+      err = snd_pcm_wait (aclient->playback.pcm, ACLIENT_PCM_WAIT_TIME_MS);
+      if (err < 0)
+	{
+	  goto recover;
+	}
+
+      avail = snd_pcm_avail_update (aclient->playback.pcm);
+      cavail = snd_pcm_avail_update (aclient->capture.pcm);
+      if (avail < 0 || cavail < 0)
+	{
+	  goto recover;
+	}
+
+      if (avail < period_size || cavail < period_size)
+	{
+	  if (!aclient->linked && avail >= period_size)
+	    {
+	      snd_pcm_wait (aclient->capture.pcm, ACLIENT_PCM_WAIT_TIME_MS);
+	    }
+	  continue;
+	}
+
+      if (snd_pcm_htimestamp (aclient->playback.pcm, &tavail, &ts))
+	{
+	  current_usecs = aclient_get_time ();
+	}
+      else
+	{
+	  //This is the time when the period became available.
+	  current_usecs = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	  if (tavail > period_size)
+	    {
+	      current_usecs -= (tavail - period_size) * USEC_PER_SEC /
+		aclient->samplerate;
+	    }
+	}
+
+      if (ow_resampler_compute_ratios (aclient->resampler, current_usecs,
+				       xrun, aclient_audio_running, aclient))
+	{
+	  break;
+	}
+      xrun = 0;
+
+      //o2h
+
+      if (ow_resampler_read_audio (aclient->resampler))
+	{
+	  break;
+	}
+
+      err = aclient_write_playback (aclient,
+				    ow_resampler_get_o2h_audio_buffer
+				    (aclient->resampler), period_size, 0);
+      if (err < 0)
+	{
+	  goto recover;
+	}
+
+      //h2o
+
+      err = aclient_read_capture (aclient,
+				  ow_resampler_get_h2o_audio_buffer
+				  (aclient->resampler), period_size);
+      if (err < 0)
+	{
+	  goto recover;
+	}
+
+      if (ow_resampler_write_audio (aclient->resampler))
+	{
+	  break;
+	}
+
+      continue;
+
+    recover:
+      xrun = 1;
+      err = aclient_recover (aclient);
+      if (err < 0)
+	{
+	  error_print ("Cannot recover PCMs: %s", snd_strerror (err));
+	  break;
+	}
+    }
+
+end:
+  snd_pcm_drop (aclient->playback.pcm);
+  snd_pcm_drop (aclient->capture.pcm);
+  aclient_stop (aclient);
+  return NULL;
+}
+
+void
+aclient_stop (struct aclient *aclient)
+{
+  debug_print (1, "Stopping client...");
+  ow_resampler_stop (aclient->resampler);
+}
+
+int
+aclient_init (struct aclient *aclient, struct ow_device *device,
+	      unsigned int blocks_per_transfer, unsigned int xfr_timeout,
+	      int quality, int priority, const char *device_name,
+	      snd_pcm_uframes_t period_size, unsigned int periods)
+{
+  ow_err_t err;
+  struct ow_resampler *resampler;
+
+  aclient->device = device;
+  aclient->priority = priority;
+  aclient->device_name = device_name;
+  aclient->period_size = period_size;
+  aclient->periods = periods;
+  aclient->samplerate = OB_SAMPLE_RATE;
+  aclient->running = 0;
+
+  pthread_spin_init (&aclient->lock, PTHREAD_PROCESS_PRIVATE);
+  sem_init (&aclient->started, 0, 0);
+
+  err = ow_resampler_init_from_device (&resampler, device,
+				       blocks_per_transfer, xfr_timeout,
+				       quality);
+
+  if (err)
+    {
+      error_print ("Overwitch error: %s", ow_get_err_str (err));
+      return -1;
+    }
+
+  aclient->resampler = resampler;
+
+  return 0;
+}
+
+void
+aclient_destroy (struct aclient *aclient)
+{
+  ow_resampler_destroy (aclient->resampler);
+  pthread_spin_destroy (&aclient->lock);
+  sem_destroy (&aclient->started);
+}
+
+static ow_err_t
+aclient_run (struct aclient *aclient)
+{
+  ow_err_t err = OW_OK;
+  struct ow_engine *engine;
+  const struct ow_device_desc *desc;
+
+  aclient->playback.pcm = NULL;
+  aclient->capture.pcm = NULL;
+  aclient->context.h2o_audio = NULL;
+  aclient->context.o2h_audio = NULL;
+
+  pthread_spin_lock (&aclient->lock);
+  aclient->running = 1;
+  pthread_spin_unlock (&aclient->lock);
+  sem_post (&aclient->started);
+
+  engine = ow_resampler_get_engine (aclient->resampler);
+  desc = &ow_engine_get_device (engine)->desc;
+
+  if (aclient_open_pcm (aclient, &aclient->playback, SND_PCM_STREAM_PLAYBACK,
+			desc->outputs))
+    {
+      return OW_GENERIC_ERROR;
+    }
+
+  if (aclient_open_pcm (aclient, &aclient->capture, SND_PCM_STREAM_CAPTURE,
+			desc->inputs))
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_pcm;
+    }
+
+  //Linked PCMs start and stop at the same time. This is only possible on the same card.
+  aclient->linked = !snd_pcm_link (aclient->playback.pcm,
+				   aclient->capture.pcm);
+  debug_print (1, "PCMs %slinked", aclient->linked ? "" : "not ");
+
+  aclient->context.o2h_audio = ow_ringbuffer_new (MAX_LATENCY *
+						  ow_resampler_get_o2h_frame_size
+						  (aclient->resampler));
+  aclient->context.h2o_audio = ow_ringbuffer_new (MAX_LATENCY *
+						  ow_resampler_get_h2o_frame_size
+						  (aclient->resampler));
+
+  aclient->context.read_space = ow_ringbuffer_read_space;
+  aclient->context.write_space = ow_ringbuffer_write_space;
+  aclient->context.read = ow_ringbuffer_read;
+  aclient->context.write = ow_ringbuffer_write;
+  aclient->context.get_time = aclient_get_time;
+
+  if (aclient->priority < 0)
+    {
+      aclient->priority = OW_DEFAULT_RT_PRIORITY;
+    }
+  debug_print (1, "Using RT priority %d...", aclient->priority);
+
+  aclient->context.set_rt_priority = ow_set_thread_rt_priority;
+  aclient->context.priority = aclient->priority;
+
+  aclient->context.options = OW_ENGINE_OPTION_O2H_AUDIO |
+    OW_ENGINE_OPTION_H2O_AUDIO;
+
+  ow_resampler_set_host_name (aclient->resampler, aclient->device_name);
+
+  err = ow_resampler_start (aclient->resampler, &aclient->context,
+			    aclient->samplerate, aclient->period_size);
+  if (err)
+    {
+      goto cleanup_pcm;
+    }
+
+  aclient->pcm_running = 1;
+  if (pthread_create (&aclient->pcm_thread, NULL, aclient_pcm_runner,
+		      aclient))
+    {
+      error_print ("Cannot start PCM thread");
+      err = OW_GENERIC_ERROR;
+      ow_resampler_stop (aclient->resampler);
+    }
+  else
+    {
+      pthread_setname_np (aclient->pcm_thread, "aclient-pcm");
+      ow_set_thread_rt_priority (aclient->pcm_thread, aclient->priority);
+    }
+
+  ow_resampler_wait (aclient->resampler);
+
+  debug_print (1, "Exiting...");
+
+  if (!err)
+    {
+      pthread_spin_lock (&aclient->lock);
+      aclient->pcm_running = 0;
+      pthread_spin_unlock (&aclient->lock);
+      pthread_join (aclient->pcm_thread, NULL);
+    }
+
+cleanup_pcm:
+  if (aclient->context.h2o_audio)
+    {
+      ow_ringbuffer_free (aclient->context.h2o_audio);
+    }
+  if (aclient->context.o2h_audio)
+    {
+      ow_ringbuffer_free (aclient->context.o2h_audio);
+    }
+  if (aclient->capture.pcm)
+    {
+      if (aclient->linked)
+	{
+	  snd_pcm_unlink (aclient->capture.pcm);
+	}
+      snd_pcm_close (aclient->capture.pcm);
+    }
+  snd_pcm_close (aclient->playback.pcm);
+  return err;
+}
+
+static void *
+aclient_thread_runner (void *data)
+{
+  struct aclient *aclient = data;
+  aclient_run (aclient);
+  return NULL;
+}
+
+int
+aclient_start (struct aclient *aclient)
+{
+  char buf[OW_LABEL_MAX_LEN];
+
+  debug_print (1, "Starting thread...");
+
+  if (pthread_create (&aclient->thread, NULL, aclient_thread_runner, aclient))
+    {
+      return -1;
+    }
+
+  snprintf (buf, OW_LABEL_MAX_LEN, "aclient-%.7s", aclient->device->desc.name);
+  pthread_setname_np (aclient->thread, buf);
+
+  debug_print (2, "Waiting for the thread to be ready...");
+
+  //Posted by the thread as soon as it runs so there is no polling delay.
+  while (sem_wait (&aclient->started))
+    {
+      if (errno != EINTR)
+	{
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+void
+aclient_wait (struct aclient *aclient)
+{
+  pthread_join (aclient->thread, NULL);
+  aclient->running = 0;
+}
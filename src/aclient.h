@@ -0,0 +1,72 @@
+/*
+ *   aclient.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <semaphore.h>
+#include <alsa/asoundlib.h>
+#include "overwitch.h"
+
+#define ACLIENT_DEFAULT_DEVICE "default"
+#define ACLIENT_DEFAULT_PERIOD_SIZE 128
+#define ACLIENT_DEFAULT_PERIODS 2
+
+struct aclient_pcm
+{
+  snd_pcm_t *pcm;
+  snd_pcm_format_t format;
+  unsigned int channels;
+};
+
+struct aclient
+{
+  //ALSA stuff
+  struct aclient_pcm playback;
+  struct aclient_pcm capture;
+  int linked;
+  unsigned int samplerate;
+  snd_pcm_uframes_t period_size;
+  unsigned int periods;
+  pthread_t pcm_thread;
+  int pcm_running;
+  //Parameters
+  struct ow_device *device;
+  const char *device_name;
+  int priority;
+  // Overwitch stuff
+  struct ow_resampler *resampler;
+  struct ow_context context;
+  // Thread stuff
+  pthread_spinlock_t lock;
+  int running;
+  sem_t started;
+  pthread_t thread;
+};
+
+int aclient_init (struct aclient *aclient, struct ow_device *device,
+		  unsigned int blocks_per_transfer, unsigned int xfr_timeout,
+		  int quality, int priority, const char *device_name,
+		  snd_pcm_uframes_t period_size, unsigned int periods);
+
+int aclient_start (struct aclient *);
+
+void aclient_destroy (struct aclient *);
+
+void aclient_wait (struct aclient *);
+
+void aclient_stop (struct aclient *);
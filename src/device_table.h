@@ -0,0 +1,35 @@
+/*
+ *   device_table.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "overwitch.h"
+
+//The table is generated at build time from res/devices.json by devices-gen.
+
+extern const struct ow_device_desc OW_DEVICE_TABLE[];
+extern const int OW_DEVICE_TABLE_LEN;
+
+//Position in OW_DEVICE_TABLE of every PID from OW_DEVICE_TABLE_PID_MIN or -1.
+extern const int16_t OW_DEVICE_TABLE_INDEX[];
+extern const int OW_DEVICE_TABLE_INDEX_LEN;
+extern const uint16_t OW_DEVICE_TABLE_PID_MIN;
+
+const struct ow_device_desc *ow_device_table_get (uint16_t pid);
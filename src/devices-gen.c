@@ -0,0 +1,266 @@
+/*
+ *   devices-gen.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This generates the device table compiled into liboverwitch from the
+// devices.json file so that no JSON is parsed at runtime for the known
+// devices. Any error fails the build.
+
+#include <stdio.h>
+#include <string.h>
+#include <json-glib/json-glib.h>
+#include "overwitch.h"
+
+#define DEV_TAG_PID "pid"
+#define DEV_TAG_NAME "name"
+#define DEV_TAG_TYPE "type"
+#define DEV_TAG_INPUT_TRACKS "input_tracks"
+#define DEV_TAG_OUTPUT_TRACKS "output_tracks"
+#define DEV_TAG_TRACK_NAME "name"
+#define DEV_TAG_TRACK_SIZE "size"
+
+#define PID_MAX 0xffff
+
+static void
+print_string (const gchar *s)
+{
+  gchar *escaped = g_strescape (s, NULL);
+  printf ("\"%s\"", escaped);
+  g_free (escaped);
+}
+
+static gint
+check_label (const gchar *label, gint device)
+{
+  if (!label || !*label)
+    {
+      fprintf (stderr, "Device %d: empty name\n", device);
+      return -1;
+    }
+
+  if (strlen (label) >= OW_LABEL_MAX_LEN)
+    {
+      fprintf (stderr, "Device %d: name '%s' too long\n", device, label);
+      return -1;
+    }
+
+  return 0;
+}
+
+static gint
+print_tracks (JsonReader *reader, const gchar *member, gint device)
+{
+  gint tracks;
+  const gchar *name;
+  gint64 size;
+
+  if (!json_reader_read_member (reader, member) ||
+      !json_reader_is_array (reader))
+    {
+      fprintf (stderr, "Device %d: no '%s' array\n", device, member);
+      return -1;
+    }
+
+  tracks = json_reader_count_elements (reader);
+  if (!tracks || tracks > OB_MAX_TRACKS)
+    {
+      fprintf (stderr, "Device %d: invalid track count %d\n", device, tracks);
+      return -1;
+    }
+
+  printf ("   .%s = {\n", member);
+  for (gint i = 0; i < tracks; i++)
+    {
+      json_reader_read_element (reader, i);
+
+      json_reader_read_member (reader, DEV_TAG_TRACK_NAME);
+      name = json_reader_get_string_value (reader);
+      json_reader_end_member (reader);
+
+      json_reader_read_member (reader, DEV_TAG_TRACK_SIZE);
+      size = json_reader_get_int_value (reader);
+      json_reader_end_member (reader);
+
+      json_reader_end_element (reader);
+
+      if (check_label (name, device))
+	{
+	  return -1;
+	}
+
+      if (size < 1 || size > 4)
+	{
+	  fprintf (stderr, "Device %d: invalid track size %" G_GINT64_FORMAT
+		   "\n", device, size);
+	  return -1;
+	}
+
+      printf ("     {");
+      print_string (name);
+      printf (", %" G_GINT64_FORMAT "},\n", size);
+    }
+  printf ("   },\n");
+
+  json_reader_end_member (reader);
+
+  return tracks;
+}
+
+gint
+main (gint argc, gchar *argv[])
+{
+  gint devices, inputs, outputs, err = EXIT_FAILURE;
+  gint64 pid, type;
+  const gchar *name;
+  gint index[PID_MAX + 1];
+  gint pid_min = PID_MAX, pid_max = 0;
+  JsonParser *parser;
+  JsonReader *reader;
+  GError *error = NULL;
+
+  if (argc != 2)
+    {
+      fprintf (stderr, "Usage: %s devices.json\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  parser = json_parser_new_immutable ();
+  if (!json_parser_load_from_file (parser, argv[1], &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      goto cleanup_parser;
+    }
+
+  reader = json_reader_new (json_parser_get_root (parser));
+  if (!json_reader_is_array (reader))
+    {
+      fprintf (stderr, "Not an array\n");
+      goto cleanup_reader;
+    }
+
+  for (gint i = 0; i <= PID_MAX; i++)
+    {
+      index[i] = -1;
+    }
+
+  printf ("//Generated by devices-gen from devices.json. Do not edit.\n\n");
+  printf ("#include \"device_table.h\"\n\n");
+  printf ("const struct ow_device_desc OW_DEVICE_TABLE[] = {\n");
+
+  devices = json_reader_count_elements (reader);
+  for (gint i = 0; i < devices; i++)
+    {
+      json_reader_read_element (reader, i);
+
+      json_reader_read_member (reader, DEV_TAG_PID);
+      pid = json_reader_get_int_value (reader);
+      json_reader_end_member (reader);
+
+      json_reader_read_member (reader, DEV_TAG_NAME);
+      name = json_reader_get_string_value (reader);
+      json_reader_end_member (reader);
+
+      json_reader_read_member (reader, DEV_TAG_TYPE);
+      type = json_reader_get_int_value (reader);
+      json_reader_end_member (reader);
+
+      if (pid <= 0 || pid > PID_MAX)
+	{
+	  fprintf (stderr, "Device %d: invalid PID %" G_GINT64_FORMAT "\n",
+		   i, pid);
+	  goto cleanup_reader;
+	}
+
+      if (index[pid] >= 0)
+	{
+	  fprintf (stderr, "Device %d: duplicated PID %" G_GINT64_FORMAT "\n",
+		   i, pid);
+	  goto cleanup_reader;
+	}
+
+      if (type < OW_DEVICE_TYPE_1 || type > OW_DEVICE_TYPE_3)
+	{
+	  fprintf (stderr, "Device %d: invalid type %" G_GINT64_FORMAT "\n",
+		   i, type);
+	  goto cleanup_reader;
+	}
+
+      if (check_label (name, i))
+	{
+	  goto cleanup_reader;
+	}
+
+      index[pid] = i;
+      pid_min = MIN (pid_min, pid);
+      pid_max = MAX (pid_max, pid);
+
+      printf ("  {\n");
+      printf ("   .pid = %" G_GINT64_FORMAT ",\n", pid);
+      printf ("   .name = ");
+      print_string (name);
+      printf (",\n");
+      printf ("   .type = %" G_GINT64_FORMAT ",\n", type);
+
+      inputs = print_tracks (reader, DEV_TAG_INPUT_TRACKS, i);
+      if (inputs < 0)
+	{
+	  goto cleanup_reader;
+	}
+
+      outputs = print_tracks (reader, DEV_TAG_OUTPUT_TRACKS, i);
+      if (outputs < 0)
+	{
+	  goto cleanup_reader;
+	}
+
+      printf ("   .inputs = %d,\n", inputs);
+      printf ("   .outputs = %d,\n", outputs);
+      printf ("  },\n");
+
+      json_reader_end_element (reader);
+    }
+
+  if (!devices)
+    {
+      fprintf (stderr, "No devices found\n");
+      goto cleanup_reader;
+    }
+
+  printf ("};\n\n");
+  printf ("const int OW_DEVICE_TABLE_LEN = %d;\n\n", devices);
+
+  printf ("const int16_t OW_DEVICE_TABLE_INDEX[] = {\n");
+  for (gint i = pid_min; i <= pid_max; i++)
+    {
+      printf ("  %d,\n", index[i]);
+    }
+  printf ("};\n\n");
+  printf ("const int OW_DEVICE_TABLE_INDEX_LEN = %d;\n\n",
+	  pid_max - pid_min + 1);
+  printf ("const uint16_t OW_DEVICE_TABLE_PID_MIN = %d;\n", pid_min);
+
+  err = EXIT_SUCCESS;
+
+cleanup_reader:
+  g_object_unref (reader);
+cleanup_parser:
+  g_object_unref (parser);
+  return err;
+}
@@ -30,6 +30,17 @@
 
 #define MAX_RATIO_ERROR 2
 
+//The Overbridge side starts with a wide loop filter, which is narrowed once
+//the least squares fit has seen enough timestamps.
+#define OB_WIDE_BANDWIDTH 1.0
+#define OB_BANDWIDTH 0.1
+
+//Time span needed by the least squares fits to give a rate estimation.
+#define LS_PERIOD 1.0
+
+//Time constant of the error statistics
+#define ERR_STATS_TAU 0.1
+
 double
 wrap_time (double d, double q)
 {
@@ -44,11 +55,67 @@ wrap_time (double d, double q)
   return d;
 }
 
+static void
+ow_dll_ls_reset (struct ow_dll_ls *ls)
+{
+  ls->n = 0;
+  ls->time = 0;
+  ls->frames = 0;
+  ls->st = 0;
+  ls->sf = 0;
+  ls->stt = 0;
+  ls->stf = 0;
+}
+
+static void
+ow_dll_ls_add (struct ow_dll_ls *ls, double time, uint32_t frames, double q)
+{
+  if (ls->n)
+    {
+      ls->time += wrap_time (time - ls->last, q);
+      ls->frames += frames;
+    }
+  ls->last = time;
+  ls->n++;
+  ls->st += ls->time;
+  ls->sf += ls->frames;
+  ls->stt += ls->time * ls->time;
+  ls->stf += ls->time * ls->frames;
+}
+
+//Returns the slope of the fit in frames per second or 0 if there is not enough data.
+static double
+ow_dll_ls_get_rate (struct ow_dll_ls *ls)
+{
+  double d;
+
+  if (ls->time < LS_PERIOD)
+    {
+      return 0;
+    }
+
+  d = ls->n * ls->stt - ls->st * ls->st;
+  if (d <= 0)
+    {
+      return 0;
+    }
+
+  return (ls->n * ls->stf - ls->st * ls->sf) / d;
+}
+
 //Taken from https://github.com/jackaudio/tools/blob/master/zalsa/alsathread.cc.
+static void
+ow_dll_overbridge_set_loop_filter (struct ow_dll_overbridge *dll_ob,
+				   double bw)
+{
+  double w = 2 * M_PI * bw * dll_ob->dt;
+  dll_ob->w1 = 1.6 * w;
+  dll_ob->w2 = w * w;
+}
+
 inline void
 ow_dll_overbridge_init (void *data, double samplerate, uint32_t frames)
 {
-  double w;
   struct ow_dll *dll = data;
   struct ow_dll_overbridge *dll_ob = &dll->dll_overbridge;
 
@@ -56,10 +123,16 @@ ow_dll_overbridge_init (void *data, double samplerate, uint32_t frames)
 	       "Initializing Overbridge side of DLL (%.1f Hz, %d frames)...",
 	       samplerate, frames);
 
+  dll_ob->frames = frames;
+  if (dll->warm && dll->warm_ob_rate > 0)
+    {
+      debug_print (3, "Using previous Overbridge side rate (%.3f Hz)...",
+		   dll->warm_ob_rate);
+      samplerate = dll->warm_ob_rate;
+    }
   dll_ob->dt = frames / samplerate;
-  w = 2 * M_PI * 0.1 * dll_ob->dt;
-  dll_ob->w1 = 1.6 * w;
-  dll_ob->w2 = w * w;
+  dll_ob->wide = 1;
+  ow_dll_overbridge_set_loop_filter (dll_ob, OB_WIDE_BANDWIDTH);
 }
 
 //Taken from https://github.com/jackaudio/tools/blob/master/zalsa/alsathread.cc.
@@ -83,6 +156,32 @@ ow_dll_overbridge_update (void *data, uint32_t frames, uint64_t t)
       dll_ob->i0.frames = 0;
       dll_ob->i1.frames = frames;
       dll_ob->boot = 0;
+
+      ow_dll_ls_reset (&dll_ob->ls);
+      ow_dll_ls_add (&dll_ob->ls, time, frames, dll->t_quantum);
+      if (!dll_ob->wide)
+	{
+	  dll_ob->wide = 1;
+	  ow_dll_overbridge_set_loop_filter (dll_ob, OB_WIDE_BANDWIDTH);
+	}
+
+      //Updating the loop here would start it with a whole period of error.
+      return;
+    }
+
+  if (dll_ob->wide)
+    {
+      double rate;
+
+      ow_dll_ls_add (&dll_ob->ls, time, frames, dll->t_quantum);
+      rate = ow_dll_ls_get_rate (&dll_ob->ls);
+      if (rate > 0)
+	{
+	  debug_print (4, "Overbridge side rate estimation: %f Hz", rate);
+	  dll_ob->dt = dll_ob->frames / rate;
+	  dll_ob->wide = 0;
+	  ow_dll_overbridge_set_loop_filter (dll_ob, OB_BANDWIDTH);
+	}
     }
 
   err = time - dll_ob->i1.time;
@@ -121,6 +220,11 @@ ow_dll_host_update_error (struct ow_dll *dll, uint64_t t)
   delta_frames_act = dll->i0.frames - dll->frames;	// - (dll->frames + dll->i0.frames)
   dll->err = delta_frames_act + delta_overbridge - dll->target_delay;
 
+  if (!dll->seeded)
+    {
+      ow_dll_ls_add (&dll->ls, time, dll->output_frames, dll->t_quantum);
+    }
+
   if (dll->boot)
     {
       debug_print (4, "Booting host side of DLL...");
@@ -136,13 +240,75 @@ ow_dll_host_update_error (struct ow_dll *dll, uint64_t t)
 	       dll->target_delay, dll->err);
 }
 
+//This makes the error refer to a buffer with the given frames so the target delay becomes the actual buffer occupancy.
+//This must be called right after ow_dll_host_update_error.
+inline void
+ow_dll_host_align (struct ow_dll *dll, int frames)
+{
+  int n = (int) (floor (dll->err + dll->target_delay + 0.5)) - frames;
+  debug_print (3, "Aligning DLL to %d frames (%d frames of difference)...",
+	       frames, n);
+  dll->frames += n;
+  dll->err -= n;
+}
+
+//The loop moves the buffer occupancy towards the new target at its own pace.
+inline void
+ow_dll_host_set_target_delay (struct ow_dll *dll, int target_delay)
+{
+  debug_print (3, "Setting DLL target delay to %d frames...", target_delay);
+  dll->target_delay = target_delay;
+}
+
+//The initial ratio is estimated from the least squares fits of both clocks
+//and loaded into the integrator so the loop only needs to correct the phase.
+static void
+ow_dll_host_seed (struct ow_dll *dll)
+{
+  double host_rate, ratio;
+
+  if (dll->ob_rate <= 0)
+    {
+      return;
+    }
+
+  host_rate = ow_dll_ls_get_rate (&dll->ls);
+  if (host_rate <= 0)
+    {
+      return;
+    }
+
+  dll->seeded = 1;
+
+  ratio = host_rate / dll->ob_rate;
+  if (ratio > dll->max_ratio || ratio < dll->min_ratio)
+    {
+      error_print ("Ignoring DLL estimated ratio %f", ratio);
+      return;
+    }
+
+  debug_print (3, "Seeding DLL with estimated ratio %f...", ratio);
+
+  dll->z3 = 1.0 - ratio - dll->z2;
+}
+
 inline int
 ow_dll_host_update (struct ow_dll *dll)
 {
   int err = 0;
+  double d;
 
   debug_print (5, "Updating host side of DLL...");
 
+  if (!dll->seeded)
+    {
+      ow_dll_host_seed (dll);
+    }
+
+  d = dll->err - dll->err_mean;
+  dll->err_mean += dll->err_w * d;
+  dll->err_var = (1.0 - dll->err_w) * (dll->err_var + dll->err_w * d * d);
+
   dll->z1 += dll->w0 * (dll->w1 * dll->err - dll->z1);
   dll->z2 += dll->w0 * (dll->z1 - dll->z2);
   dll->z3 += dll->w2 * dll->z2;
@@ -172,6 +338,11 @@ ow_dll_host_init (struct ow_dll *dll)
   dll->boot = 1;
   dll->t_quantum = ldexp (1e-6, 28);	//28 bits as used in UINT64_USEC_TO_DOUBLE_SEC
   dll->dll_overbridge.boot = 1;
+  dll->ob_rate = 0;
+  dll->seeded = 0;
+  dll->warm = 0;
+  dll->warm_ob_rate = 0;
+  ow_dll_ls_reset (&dll->ls);
 }
 
 inline void
@@ -181,19 +352,53 @@ ow_dll_host_reset (struct ow_dll *dll, double output_samplerate,
 {
   debug_print (3, "Resetting the DLL...");
 
+  dll->ratio = output_samplerate / input_samplerate;
+
   dll->z1 = 0.0;
   dll->z2 = 0.0;
-  dll->z3 = 0.0;
+  dll->z3 = 1.0 - dll->ratio;	//This makes the loop start from the nominal ratio.
 
-  dll->ratio = output_samplerate / input_samplerate;
   dll->max_ratio = dll->ratio * MAX_RATIO_ERROR;
   dll->min_ratio = dll->ratio / MAX_RATIO_ERROR;
 
-  dll->frames = -input_frames / dll->ratio;
+  dll->frames = -(int32_t) (input_frames / dll->ratio);
+  dll->output_frames = output_frames;
 
   dll->target_delay = 2.0 * input_frames + 1.5 * output_frames;
 }
 
+//This must be called after ow_dll_host_reset with the ratio and Overbridge rate of a previous run.
+inline void
+ow_dll_host_warm_start (struct ow_dll *dll, double ratio, double ob_rate)
+{
+  if (ratio > dll->max_ratio || ratio < dll->min_ratio)
+    {
+      error_print ("Ignoring previous DLL ratio %f", ratio);
+      return;
+    }
+
+  debug_print (3, "Warm starting the DLL with ratio %f...", ratio);
+
+  dll->ratio = ratio;
+  dll->z3 = 1.0 - ratio;
+  dll->seeded = 1;
+  dll->warm = 1;
+  dll->warm_ob_rate = ob_rate;
+}
+
+//The integrator is loaded with a known good ratio and the filter states are
+//cleared so the loop recovers from a disturbance without running away again.
+inline void
+ow_dll_host_set_ratio (struct ow_dll *dll, double ratio)
+{
+  debug_print (3, "Setting DLL ratio to %f...", ratio);
+
+  dll->ratio = ratio;
+  dll->z1 = 0.0;
+  dll->z2 = 0.0;
+  dll->z3 = 1.0 - ratio;
+}
+
 //Taken from https://github.com/jackaudio/tools/blob/master/zalsa/jackclient.cc.
 inline void
 ow_dll_host_set_loop_filter (struct ow_dll *dll, double bw,
@@ -204,17 +409,29 @@ ow_dll_host_set_loop_filter (struct ow_dll *dll, double bw,
   w = 2.0 * M_PI * bw * dll->ratio / output_samplerate;
   dll->w1 = w * 1.6;
   dll->w2 = w * output_frames / 1.6;
+
+  dll->err_w = 1.0 - exp (-(output_frames / output_samplerate) /
+			  ERR_STATS_TAU);
+  dll->err_mean = dll->err;
+  dll->err_var = 0;
 }
 
+//This must be called while holding the engine lock.
 inline void
 ow_dll_host_load_dll_overbridge (struct ow_dll *dll)
 {
   dll->i0 = dll->dll_overbridge.i0;
   dll->i1 = dll->dll_overbridge.i1;
+
+  if (!dll->seeded && dll->ob_rate <= 0)
+    {
+      dll->ob_rate = ow_dll_ls_get_rate (&dll->dll_overbridge.ls);
+    }
 }
 
+//The error is considered steady when its mean and its standard deviation are below the given values in frames.
 inline int
-ow_dll_tuned (struct ow_dll *dll, double err)
+ow_dll_tuned (struct ow_dll *dll, double err, double dev)
 {
-  return abs (dll->err) < err;
+  return fabs (dll->err_mean) < err && dll->err_var < dev * dev;
 }
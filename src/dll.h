@@ -22,12 +22,41 @@
 
 #include <stdint.h>
 
+//These are used by the resampler and the DLL simulator.
+
+//Minimum time spent in each phase. Transitions happen as soon as the DLL error statistics are good enough.
+#define BOOTING_PERIOD_US (0.25 * USEC_PER_SEC)
+#define TUNING_PERIOD_US (0.25 * USEC_PER_SEC)
+
+//Maximum mean and standard deviation of the DLL error in frames
+#define BOOTING_ERROR 4.0
+#define BOOTING_DEVIATION 8.0
+#define TUNING_ERROR 1.0
+#define TUNING_DEVIATION 3.0
+
+#define BOOTING_BANDWIDTH 1.0
+#define TUNING_BANDWIDTH 0.5
+#define RUNNING_BANDWIDTH 0.05
+
 struct instant
 {
   double time;
   uint32_t frames;
 };
 
+//Least squares fit of frames against time used to estimate a clock rate.
+struct ow_dll_ls
+{
+  uint32_t n;
+  double last;
+  double time;
+  double frames;
+  double st;
+  double sf;
+  double stt;
+  double stf;
+};
+
 struct ow_dll_overbridge
 {
   struct instant i0;
@@ -35,6 +64,9 @@ struct ow_dll_overbridge
   double dt;
   double w1;
   double w2;
+  uint32_t frames;
+  int wide;
+  struct ow_dll_ls ls;
   int boot;
 };
 
@@ -53,6 +85,17 @@ struct ow_dll
   double z3;
   double t_quantum;
   double err;
+  //Exponentially weighted error statistics used to detect convergence
+  double err_mean;
+  double err_var;
+  double err_w;
+  uint32_t output_frames;
+  double ob_rate;
+  struct ow_dll_ls ls;
+  int seeded;
+  //Set when the loop starts from a previously converged state
+  int warm;
+  double warm_ob_rate;
   struct instant i0;
   struct instant i1;
   struct ow_dll_overbridge dll_overbridge;
@@ -69,10 +112,19 @@ void ow_dll_host_reset (struct ow_dll *, double, double, uint32_t, uint32_t);
 
 void ow_dll_host_set_loop_filter (struct ow_dll *, double, uint32_t, double);
 
+void ow_dll_host_warm_start (struct ow_dll *dll, double ratio,
+			     double ob_rate);
+
+void ow_dll_host_set_ratio (struct ow_dll *dll, double ratio);
+
 void ow_dll_host_update_error (struct ow_dll *dll, uint64_t time);
 
+void ow_dll_host_align (struct ow_dll *dll, int frames);
+
+void ow_dll_host_set_target_delay (struct ow_dll *dll, int target_delay);
+
 int ow_dll_host_update (struct ow_dll *dll);
 
 void ow_dll_host_load_dll_overbridge (struct ow_dll *dll);
 
-int ow_dll_tuned (struct ow_dll *dll, double err);
+int ow_dll_tuned (struct ow_dll *dll, double err, double dev);
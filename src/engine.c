@@ -29,7 +29,9 @@
 #include <endian.h>
 #include <time.h>
 #include <unistd.h>
+#include <sched.h>
 #include "engine.h"
+#include "stats.h"
 
 #define AUDIO_OUT_EP 0x03
 #define AUDIO_OUT_INTERFACE 2
@@ -41,6 +43,11 @@
 
 #define USB_CONTROL_LEN (sizeof (struct libusb_control_setup) + OB_NAME_MAX_LEN)
 
+//Backoff between attempts to open the device again after an USB error
+#define RECONNECT_MIN_DELAY_US 5000
+#define RECONNECT_MAX_DELAY_US 160000
+#define RECONNECT_DRAIN_ATTEMPTS 10
+
 static void prepare_cycle_in_audio (struct ow_engine *engine);
 static void prepare_cycle_out_audio (struct ow_engine *engine);
 static void ow_engine_load_overbridge_name (struct ow_engine *engine);
@@ -84,6 +91,43 @@ prepare_transfers (struct ow_engine *engine)
   return LIBUSB_SUCCESS;
 }
 
+//Samples are only decoded so they are bit exact. 16 and 24 bits samples are
+//left aligned.
+static inline void
+ow_engine_read_usb_input_blocks_int (struct ow_engine *engine)
+{
+  uint32_t hv;
+  uint8_t *s;
+  struct ow_engine_usb_blk *blk;
+  int32_t *v = (int32_t *) engine->o2h_transfer_buf;
+
+  for (int i = 0; i < engine->blocks_per_transfer; i++)
+    {
+      blk = GET_NTH_INPUT_USB_BLK (engine, i);
+      s = (uint8_t *) blk->data;
+      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
+	{
+	  for (int k = 0; k < engine->device->desc.outputs; k++)
+	    {
+	      int size = engine->device->desc.output_tracks[k].size;
+
+	      hv = 0;
+	      memcpy (&hv, s, size);
+	      hv = be32toh (hv);
+
+	      if (engine->device->desc.type == OW_DEVICE_TYPE_3 && size == 4)
+		{
+		  hv <<= 8;
+		}
+
+	      *v = (int32_t) hv;
+	      v++;
+	      s += size;
+	    }
+	}
+    }
+}
+
 inline void
 ow_engine_read_usb_input_blocks (struct ow_engine *engine)
 {
@@ -92,6 +136,12 @@ ow_engine_read_usb_input_blocks (struct ow_engine *engine)
   struct ow_engine_usb_blk *blk;
   float *f = engine->o2h_transfer_buf;
 
+  if (engine->o2h_int)
+    {
+      ow_engine_read_usb_input_blocks_int (engine);
+      return;
+    }
+
   for (int i = 0; i < engine->blocks_per_transfer; i++)
     {
       blk = GET_NTH_INPUT_USB_BLK (engine, i);
@@ -119,6 +169,36 @@ ow_engine_read_usb_input_blocks (struct ow_engine *engine)
     }
 }
 
+static const struct ow_engine_counters OW_ENGINE_ZERO_COUNTERS;
+
+static inline void
+ow_engine_count (atomic_uint_least64_t *counter)
+{
+  atomic_fetch_add_explicit (counter, 1, memory_order_relaxed);
+}
+
+static inline void
+ow_engine_copy_counter (atomic_uint_least64_t *dst,
+			const atomic_uint_least64_t *src)
+{
+  atomic_store_explicit (dst, atomic_load_explicit (src,
+						    memory_order_relaxed),
+			 memory_order_relaxed);
+}
+
+//Every counter is copied on its own as they are not related.
+static void
+ow_engine_copy_counters (struct ow_engine_counters *dst,
+			 const struct ow_engine_counters *src)
+{
+  ow_engine_copy_counter (&dst->o2h_transfers, &src->o2h_transfers);
+  ow_engine_copy_counter (&dst->h2o_transfers, &src->h2o_transfers);
+  ow_engine_copy_counter (&dst->o2h_overflows, &src->o2h_overflows);
+  ow_engine_copy_counter (&dst->h2o_underflows, &src->h2o_underflows);
+  ow_engine_copy_counter (&dst->usb_errors, &src->usb_errors);
+  ow_engine_copy_counter (&dst->usb_reconnections, &src->usb_reconnections);
+}
+
 static void
 set_usb_input_data_blks (struct ow_engine *engine)
 {
@@ -137,7 +217,7 @@ set_usb_input_data_blks (struct ow_engine *engine)
 
   ow_engine_read_usb_input_blocks (engine);
 
-  if (status < OW_ENGINE_STATUS_RUN)
+  if (status != OW_ENGINE_STATUS_RUN)
     {
       return;
     }
@@ -152,6 +232,7 @@ set_usb_input_data_blks (struct ow_engine *engine)
   else
     {
       error_print ("o2h: Audio ring buffer overflow. Discarding data...");
+      ow_engine_count (&engine->counters.o2h_overflows);
     }
 
   pthread_spin_lock (&engine->lock);
@@ -257,6 +338,7 @@ set_usb_output_data_blks (struct ow_engine *engine)
     }
   else if (rsh2o > engine->h2o_frame_size)	//At least 2 frames to apply resampling to
     {
+      ow_engine_count (&engine->counters.h2o_underflows);
       debug_print (3,
 		   "h2o: Audio ring buffer underflow (%zu B < %zu B). Fixed by resampling.",
 		   rsh2o, engine->h2o_transfer_size);
@@ -292,6 +374,7 @@ set_usb_output_data_blks (struct ow_engine *engine)
     }
   else
     {
+      ow_engine_count (&engine->counters.h2o_underflows);
       debug_print (3, "h2o: Not enough data (%zu B). Waiting...", rsh2o);
       memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
     }
@@ -300,11 +383,26 @@ set_blocks:
   ow_engine_write_usb_output_blocks (engine);
 }
 
+static void
+ow_engine_add_usb_cycle (struct ow_engine *engine)
+{
+  uint64_t now = engine->context->get_time ();
+
+  if (engine->usb_cycle_usecs)
+    {
+      ow_stats_hist_add (engine->stats->usb_cycles,
+			 now - engine->usb_cycle_usecs);
+    }
+  engine->usb_cycle_usecs = now;
+}
+
 static void LIBUSB_CALL
 cb_xfr_audio_in (struct libusb_transfer *xfr)
 {
   struct ow_engine *engine = xfr->user_data;
 
+  engine->usb.xfrs_in_flight--;
+
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
       if (xfr->length < xfr->actual_length)
@@ -315,6 +413,12 @@ cb_xfr_audio_in (struct libusb_transfer *xfr)
 	}
 
       struct ow_engine *engine = xfr->user_data;
+      ow_engine_count (&engine->counters.o2h_transfers);
+      if (engine->stats && engine->context->get_time)
+	{
+	  ow_engine_add_usb_cycle (engine);
+	}
+
       if (engine->context->options & OW_ENGINE_OPTION_O2H_AUDIO)
 	{
 	  set_usb_input_data_blks (engine);
@@ -324,6 +428,7 @@ cb_xfr_audio_in (struct libusb_transfer *xfr)
     {
       error_print ("o2h: Error on USB audio transfer (%d B): %s",
 		   xfr->actual_length, libusb_error_name (xfr->status));
+      ow_engine_count (&engine->counters.usb_errors);
     }
 
   if (ow_engine_get_status (engine) > OW_ENGINE_STATUS_STOP)
@@ -338,6 +443,8 @@ cb_xfr_audio_out (struct libusb_transfer *xfr)
 {
   struct ow_engine *engine = xfr->user_data;
 
+  engine->usb.xfrs_in_flight--;
+
   if (xfr->status == LIBUSB_TRANSFER_COMPLETED)
     {
       if (xfr->length < xfr->actual_length)
@@ -346,11 +453,13 @@ cb_xfr_audio_out (struct libusb_transfer *xfr)
 	    ("h2o: incomplete USB audio transfer (%d B < %d B)", xfr->length,
 	     xfr->actual_length);
 	}
+      ow_engine_count (&engine->counters.h2o_transfers);
     }
   else
     {
       error_print ("h2o: Error on USB audio transfer (%d B): %s",
 		   xfr->actual_length, libusb_error_name (xfr->status));
+      ow_engine_count (&engine->counters.usb_errors);
     }
 
   set_usb_output_data_blks (xfr->user_data);
@@ -380,6 +489,10 @@ prepare_cycle_out_audio (struct ow_engine *engine)
 		   libusb_strerror (err));
       ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
     }
+  else
+    {
+      engine->usb.xfrs_in_flight++;
+    }
 }
 
 static void
@@ -399,14 +512,28 @@ prepare_cycle_in_audio (struct ow_engine *engine)
 		   libusb_strerror (err));
       ow_engine_set_status (engine, OW_ENGINE_STATUS_ERROR);
     }
+  else
+    {
+      engine->usb.xfrs_in_flight++;
+    }
 }
 
 static void
-usb_shutdown (struct ow_engine *engine)
+usb_close (struct ow_engine *engine)
 {
-  libusb_release_interface (engine->usb.device_handle, 1);
-  libusb_release_interface (engine->usb.device_handle, 3);
+  libusb_release_interface (engine->usb.device_handle, AUDIO_IN_INTERFACE);
+  libusb_release_interface (engine->usb.device_handle, AUDIO_OUT_INTERFACE);
   libusb_close (engine->usb.device_handle);
+  engine->usb.device_handle = NULL;
+}
+
+static void
+usb_shutdown (struct ow_engine *engine)
+{
+  if (engine->usb.device_handle)
+    {
+      usb_close (engine);
+    }
   libusb_unref_device (engine->usb.device);
   libusb_free_transfer (engine->usb.xfr_audio_in);
   libusb_free_transfer (engine->usb.xfr_audio_out);
@@ -423,6 +550,7 @@ ow_engine_init_mem (struct ow_engine *engine,
   struct ow_engine_usb_blk *blk;
 
   engine->context = NULL;
+  engine->o2h_int = 0;
 
   pthread_spin_init (&engine->lock, PTHREAD_PROCESS_SHARED);
 
@@ -528,25 +656,13 @@ ow_engine_init_mem (struct ow_engine *engine,
   return OW_OK;
 }
 
-// initialization taken from sniffed session
-
+//This is also used to claim the device again after an USB error.
 static ow_err_t
-ow_engine_init (struct ow_engine *engine, struct ow_device *device,
-		unsigned int blocks_per_transfer, unsigned int xfr_timeout)
+ow_engine_claim (struct ow_engine *engine, int *err_)
 {
   int err;
   ow_err_t ret = OW_OK;
 
-  engine->status = OW_ENGINE_STATUS_STOP;
-  engine->device = device;
-  engine->usb.xfr_audio_in = NULL;
-  engine->usb.xfr_audio_out = NULL;
-  engine->usb.xfr_control_in = NULL;
-  engine->usb.xfr_control_out = NULL;
-
-  engine->usb.xfr_timeout = xfr_timeout;
-  debug_print (1, "USB transfer timeout: %u", engine->usb.xfr_timeout);
-
   libusb_detach_kernel_driver (engine->usb.device_handle, 4);
   libusb_detach_kernel_driver (engine->usb.device_handle, 5);
 
@@ -601,6 +717,39 @@ ow_engine_init (struct ow_engine *engine, struct ow_device *device,
       goto end;
     }
 
+  libusb_attach_kernel_driver (engine->usb.device_handle, 4);
+  libusb_attach_kernel_driver (engine->usb.device_handle, 5);
+
+end:
+  *err_ = err;
+  return ret;
+}
+
+// initialization taken from sniffed session
+
+static ow_err_t
+ow_engine_init (struct ow_engine *engine, struct ow_device *device,
+		unsigned int blocks_per_transfer, unsigned int xfr_timeout)
+{
+  int err;
+  ow_err_t ret = OW_OK;
+
+  engine->status = OW_ENGINE_STATUS_STOP;
+  engine->device = device;
+  engine->usb.xfr_audio_in = NULL;
+  engine->usb.xfr_audio_out = NULL;
+  engine->usb.xfr_control_in = NULL;
+  engine->usb.xfr_control_out = NULL;
+  engine->stats = NULL;
+  engine->usb_cycle_usecs = 0;
+  engine->reconnect = 0;
+  engine->cpus = 0;
+  engine->usb.xfrs_in_flight = 0;
+  ow_engine_copy_counters (&engine->counters, &OW_ENGINE_ZERO_COUNTERS);
+
+  engine->usb.xfr_timeout = xfr_timeout;
+  debug_print (1, "USB transfer timeout: %u", engine->usb.xfr_timeout);
+
   err = prepare_transfers (engine);
   if (LIBUSB_SUCCESS != err)
     {
@@ -608,8 +757,11 @@ ow_engine_init (struct ow_engine *engine, struct ow_device *device,
       goto end;
     }
 
-  libusb_attach_kernel_driver (engine->usb.device_handle, 4);
-  libusb_attach_kernel_driver (engine->usb.device_handle, 5);
+  ret = ow_engine_claim (engine, &err);
+  if (ret)
+    {
+      goto end;
+    }
 
 #if LIBUSB_API_VERSION >= 0x0100010A
   engine->usb.audio_in_blk_len =
@@ -638,76 +790,88 @@ end:
   return ret;
 }
 
+//The engine takes the ownership of the context once the device is open.
 ow_err_t
-ow_engine_init_from_device (struct ow_engine **engine_,
-			    struct ow_device *ow_device,
-			    unsigned int blocks_per_transfer,
-			    unsigned int xfr_timeout)
+ow_engine_init_from_libusb_device (struct ow_engine **engine_,
+				   struct ow_device *ow_device,
+				   libusb_context *context,
+				   libusb_device *usb_device,
+				   unsigned int blocks_per_transfer,
+				   unsigned int xfr_timeout)
 {
   int err;
   ow_err_t ret;
-  ssize_t total = 0;
-  libusb_device **devices;
-  libusb_device **device;
   struct ow_engine *engine;
-  struct libusb_device_descriptor desc;
 
   engine = malloc (sizeof (struct ow_engine));
+  engine->usb.context = context;
 
-  if (libusb_init (&engine->usb.context) != LIBUSB_SUCCESS)
+  err = libusb_open (usb_device, &engine->usb.device_handle);
+  if (err)
     {
-      ret = OW_USB_ERROR_LIBUSB_INIT_FAILED;
-      goto error;
+      error_print ("Error while opening device: %s", libusb_error_name (err));
+      free (engine);
+      return OW_USB_ERROR_CANT_OPEN_DEV;
     }
 
-  engine->usb.device_handle = NULL;
-  total = libusb_get_device_list (engine->usb.context, &devices);
-  device = devices;
-  for (int i = 0; i < total; i++, device++)
+  libusb_ref_device (usb_device);
+  engine->usb.device = usb_device;
+
+  *engine_ = engine;
+  ret = ow_engine_init (engine, ow_device, blocks_per_transfer, xfr_timeout);
+  if (!ret)
     {
-      err = libusb_get_device_descriptor (*device, &desc);
-      if (err)
-	{
-	  error_print ("Error while getting device description: %s",
-		       libusb_error_name (err));
-	  continue;
-	}
+      ow_engine_init_name (engine);
+    }
+  return ret;
+}
 
-      if (libusb_get_bus_number (*device) == ow_device->bus &&
-	  libusb_get_device_address (*device) == ow_device->address)
-	{
-	  err = libusb_open (*device, &engine->usb.device_handle);
-	  if (err)
-	    {
-	      error_print ("Error while opening device: %s",
-			   libusb_error_name (err));
-	      continue;
-	    }
+ow_err_t
+ow_engine_init_from_device (struct ow_engine **engine,
+			    struct ow_device *ow_device,
+			    unsigned int blocks_per_transfer,
+			    unsigned int xfr_timeout)
+{
+  ow_err_t ret;
+  ssize_t total = 0;
+  libusb_context *context;
+  libusb_device **devices;
+  libusb_device *usb_device = NULL;
 
-	  libusb_ref_device (*device);
-	  engine->usb.device = *device;
+  //Every engine has its own context so that its transfers are only handled
+  //in its own thread.
+  if (libusb_init (&context) != LIBUSB_SUCCESS)
+    {
+      return OW_USB_ERROR_LIBUSB_INIT_FAILED;
+    }
+
+  total = libusb_get_device_list (context, &devices);
+  for (int i = 0; i < total; i++)
+    {
+      if (libusb_get_bus_number (devices[i]) == ow_device->bus &&
+	  libusb_get_device_address (devices[i]) == ow_device->address)
+	{
+	  usb_device = libusb_ref_device (devices[i]);
 	  break;
 	}
     }
-
   libusb_free_device_list (devices, 1);
 
-  if (!engine->usb.device_handle)
+  if (!usb_device)
     {
-      ret = OW_USB_ERROR_CANT_FIND_DEV;
-      goto error;
+      libusb_exit (context);
+      return OW_USB_ERROR_CANT_FIND_DEV;
     }
 
-  *engine_ = engine;
-  ret = ow_engine_init (engine, ow_device, blocks_per_transfer, xfr_timeout);
-  if (!ret)
+  ret = ow_engine_init_from_libusb_device (engine, ow_device, context,
+					   usb_device, blocks_per_transfer,
+					   xfr_timeout);
+  libusb_unref_device (usb_device);
+  if (ret == OW_USB_ERROR_CANT_OPEN_DEV)
     {
-      ow_engine_init_name (engine);
+      libusb_exit (context);
     }
-  return ret;
 
-error:
-  free (engine);
   return ret;
 }
 
@@ -733,32 +897,38 @@ static const char *ob_err_strgs[] = {
   "'dll' not set in context"
 };
 
-static void *
-run_audio (void *data)
+//Returns when the engine is stopped or on error.
+static void
+ow_engine_run (struct ow_engine *engine, int reconnecting)
 {
   int err;
   size_t rsh2o, bytes;
-  struct timeval tv = { 1, 0UL };
-  struct ow_engine *engine = data;
 
   // This needs to be set before the host side. We ensure this by changing the state after.
   // The state is monitored at ow_engine_start and only returns after this transition.
 
   if (engine->context->dll)
     {
+      pthread_spin_lock (&engine->lock);
       engine->context->dll_overbridge_init (engine->context->dll,
 					    OB_SAMPLE_RATE,
 					    engine->frames_per_transfer);
+      pthread_spin_unlock (&engine->lock);
     }
 
   // These calls are needed to initialize the Overbridge side before the host side.
   prepare_cycle_in_audio (engine);
   prepare_cycle_out_audio (engine);
 
-  // status == OW_ENGINE_STATUS_STOP
+  // status == OW_ENGINE_STATUS_STOP || status == OW_ENGINE_STATUS_RECONNECT
 
   // This can NOT use ow_engine_set_status as the transition is not allowed from OW_ENGINE_STATUS_STOP.
   pthread_spin_lock (&engine->lock);
+  if (reconnecting && engine->status != OW_ENGINE_STATUS_RECONNECT)
+    {
+      pthread_spin_unlock (&engine->lock);
+      return;
+    }
   engine->status = OW_ENGINE_STATUS_READY;
   pthread_spin_unlock (&engine->lock);
 
@@ -766,10 +936,15 @@ run_audio (void *data)
 
   if (engine->context->dll)
     {
+      ow_engine_status_t status;
+
       // This needs to be fast to ensure the lowest latency.
-      while (ow_engine_get_status (engine) != OW_ENGINE_STATUS_STEADY)
+      do
 	{
+	  status = ow_engine_get_status (engine);
 	}
+      while (status != OW_ENGINE_STATUS_STEADY &&
+	     status > OW_ENGINE_STATUS_STOP);
 
       debug_print (1, "Notification of readiness received from resampler");
     }
@@ -784,7 +959,7 @@ run_audio (void *data)
   if (engine->status <= OW_ENGINE_STATUS_STOP)
     {
       pthread_spin_unlock (&engine->lock);
-      return NULL;
+      return;
     }
   engine->status = OW_ENGINE_STATUS_BOOT;
   pthread_spin_unlock (&engine->lock);
@@ -806,7 +981,7 @@ run_audio (void *data)
       if (engine->status <= OW_ENGINE_STATUS_STOP)
 	{
 	  pthread_spin_unlock (&engine->lock);
-	  return NULL;
+	  return;
 	}
 
       if (engine->status == OW_ENGINE_STATUS_CLEAR)
@@ -850,13 +1025,119 @@ run_audio (void *data)
       engine->context->read (engine->context->h2o_audio, NULL, bytes);
       memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
     }
+}
+
+//The device is closed and opened again keeping the host side untouched.
+//While this happens, the resampler is restarted and outputs silence.
+static int
+ow_engine_reconnect (struct ow_engine *engine)
+{
+  int err;
+  ow_err_t ret;
+  struct timeval tv = { 0, 100000UL };
+  useconds_t delay = RECONNECT_MIN_DELAY_US;
+
+  //No new transfers are submitted while in error.
+  libusb_cancel_transfer (engine->usb.xfr_audio_in);
+  libusb_cancel_transfer (engine->usb.xfr_audio_out);
+  for (int i = 0; engine->usb.xfrs_in_flight && i < RECONNECT_DRAIN_ATTEMPTS;
+       i++)
+    {
+      libusb_handle_events_timeout_completed (engine->usb.context, &tv, NULL);
+    }
+
+  if (engine->usb.xfrs_in_flight)
+    {
+      error_print ("%s: USB transfers still in flight. Not reconnecting...",
+		   engine->name);
+      return -1;
+    }
+
+  pthread_spin_lock (&engine->lock);
+  if (engine->status != OW_ENGINE_STATUS_ERROR)
+    {
+      pthread_spin_unlock (&engine->lock);
+      return -1;
+    }
+  engine->status = OW_ENGINE_STATUS_RECONNECT;
+  pthread_spin_unlock (&engine->lock);
+
+  debug_print (1, "%s: Reconnecting...", engine->name);
+
+  usb_close (engine);
+
+  while (ow_engine_get_status (engine) == OW_ENGINE_STATUS_RECONNECT)
+    {
+      err = libusb_open (engine->usb.device, &engine->usb.device_handle);
+      if (err == LIBUSB_ERROR_NO_DEVICE)
+	{
+	  error_print ("%s: Device is gone. Not reconnecting...",
+		       engine->name);
+	  break;
+	}
+
+      if (!err)
+	{
+	  ret = ow_engine_claim (engine, &err);
+	  if (!ret)
+	    {
+	      ow_engine_count (&engine->counters.usb_reconnections);
+	      debug_print (1, "%s: Reconnected", engine->name);
+	      return 0;
+	    }
+	  usb_close (engine);
+	}
+
+      debug_print (1, "%s: Error while reconnecting (%s). Retrying in %u us...",
+		   engine->name, libusb_error_name (err), delay);
+
+      usleep (delay);
+      delay = delay * 2 > RECONNECT_MAX_DELAY_US ? RECONNECT_MAX_DELAY_US :
+	delay * 2;
+    }
+
+  pthread_spin_lock (&engine->lock);
+  if (engine->status == OW_ENGINE_STATUS_RECONNECT)
+    {
+      engine->status = OW_ENGINE_STATUS_ERROR;
+    }
+  pthread_spin_unlock (&engine->lock);
+
+  return -1;
+}
+
+static void *
+run_audio (void *data)
+{
+  struct timeval tv = { 1, 0UL };
+  struct ow_engine *engine = data;
+  int reconnecting = 0;
+
+  while (1)
+    {
+      ow_engine_run (engine, reconnecting);
+
+      if (!engine->reconnect ||
+	  ow_engine_get_status (engine) != OW_ENGINE_STATUS_ERROR ||
+	  ow_engine_reconnect (engine))
+	{
+	  break;
+	}
+
+      reconnecting = 1;
+      engine->usb.audio_frames_counter = 0;
+      memset (engine->h2o_transfer_buf, 0, engine->h2o_transfer_size);
+    }
 
   // status == OW_ENGINE_STATUS_STOP || status == OW_ENGINE_STATUS_ERROR
 
   //Handle completed events but not actually processed.
   //No new transfers will be submitted due to the status.
   debug_print (2, "Processing remaining events...");
-  libusb_handle_events_timeout_completed (engine->usb.context, &tv, NULL);
+  if (engine->usb.device_handle)
+    {
+      libusb_handle_events_timeout_completed (engine->usb.context, &tv, NULL);
+    }
 
   return NULL;
 }
@@ -880,10 +1161,32 @@ ow_engine_set_thread_name (struct ow_engine *engine, const char *name)
   pthread_setname_np (engine->thread, buf);
 }
 
+static void
+ow_engine_set_thread_affinity (struct ow_engine *engine)
+{
+  cpu_set_t set;
+
+  CPU_ZERO (&set);
+  for (int i = 0; i < 64 && i < CPU_SETSIZE; i++)
+    {
+      if (engine->cpus & (1ULL << i))
+	{
+	  CPU_SET (i, &set);
+	}
+    }
+
+  if (pthread_setaffinity_np (engine->thread, sizeof (cpu_set_t), &set))
+    {
+      error_print ("Could not set the CPU affinity");
+    }
+}
+
 ow_err_t
 ow_engine_start (struct ow_engine *engine, struct ow_context *context)
 {
   engine->context = context;
+  engine->usb_cycle_usecs = 0;
+  engine->o2h_int = (context->options & OW_ENGINE_OPTION_O2H_INT) != 0;
 
   if (context->options & OW_ENGINE_OPTION_O2H_AUDIO)
     {
@@ -946,6 +1249,10 @@ ow_engine_start (struct ow_engine *engine, struct ow_context *context)
       return OW_GENERIC_ERROR;
     }
   ow_engine_set_thread_name (engine, engine->overbridge_name);
+  if (engine->cpus)
+    {
+      ow_engine_set_thread_affinity (engine);
+    }
   if (context->set_rt_priority)
     {
       context->set_rt_priority (engine->thread,
@@ -1055,6 +1362,13 @@ ow_bytes_to_frame_bytes (int bytes, int bytes_per_frame)
   return frames * bytes_per_frame;
 }
 
+void
+ow_engine_get_counters (struct ow_engine *engine,
+			struct ow_engine_counters *counters)
+{
+  ow_engine_copy_counters (counters, &engine->counters);
+}
+
 const struct ow_device *
 ow_engine_get_device (struct ow_engine *engine)
 {
@@ -1068,6 +1382,20 @@ ow_engine_stop (struct ow_engine *engine)
   ow_engine_set_status (engine, OW_ENGINE_STATUS_STOP);
 }
 
+//This must be set before starting the engine.
+void
+ow_engine_set_reconnect (struct ow_engine *engine, int reconnect)
+{
+  engine->reconnect = reconnect;
+}
+
+//This must be set before starting the engine. 0 means any CPU.
+void
+ow_engine_set_cpus (struct ow_engine *engine, uint64_t cpus)
+{
+  engine->cpus = cpus;
+}
+
 static void
 ow_engine_load_overbridge_name (struct ow_engine *engine)
 {
@@ -1157,107 +1485,3 @@ ow_engine_get_overbridge_name (struct ow_engine *engine)
 {
   return engine->overbridge_name;
 }
-
-static int
-ow_hotplug_callback (struct libusb_context *ctx, struct libusb_device *device,
-		     libusb_hotplug_event event, void *user_data)
-{
-  ow_hotplug_callback_t cb = user_data;
-  static libusb_device_handle *dev_handle = NULL;
-  struct libusb_device_descriptor desc;
-  int rc;
-
-  libusb_get_device_descriptor (device, &desc);
-
-  if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event)
-    {
-      debug_print (1, "USB hotplug: device arrived");
-      rc = libusb_open (device, &dev_handle);
-      if (rc == LIBUSB_SUCCESS)
-	{
-	  struct ow_device *ow_device;
-	  if (!ow_get_device_from_device_attrs (-1, NULL,
-						libusb_get_bus_number
-						(device),
-						libusb_get_device_address
-						(device), &ow_device))
-	    {
-	      cb (ow_device);
-	    }
-	}
-      else
-	{
-	  error_print ("Could not open USB device\n");
-	}
-    }
-  else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event)
-    {
-      debug_print (1, "USB hotplug: device left");
-    }
-  else
-    {
-      debug_print (1, "Unhandled event %d", event);
-    }
-
-  return 0;
-}
-
-int
-ow_hotplug_loop (int *running, pthread_spinlock_t *lock,
-		 ow_hotplug_callback_t cb)
-{
-  libusb_hotplug_callback_handle callback_handle;
-  int rc, end;
-
-  struct timeval tv = { 1, 0UL };
-
-#if LIBUSBX_API_VERSION >= 0x0100010A
-  if (libusb_init_context (NULL, NULL, 0))
-    {
-      return OW_USB_ERROR_LIBUSB_INIT_FAILED;
-    }
-#else
-  if (libusb_init (NULL) != LIBUSB_SUCCESS)
-    {
-      return OW_USB_ERROR_LIBUSB_INIT_FAILED;
-    }
-#endif
-
-  debug_print (1, "Registering USB hotplug callback...");
-
-  rc = libusb_hotplug_register_callback (NULL,
-					 LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
-					 LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0,
-					 ELEKTRON_VID,
-					 LIBUSB_HOTPLUG_MATCH_ANY,
-					 LIBUSB_HOTPLUG_MATCH_ANY,
-					 ow_hotplug_callback, cb,
-					 &callback_handle);
-  if (LIBUSB_SUCCESS != rc)
-    {
-      error_print ("Error creating a hotplug callback");
-      libusb_exit (NULL);
-      return OW_USB_ERROR_LIBUSB_INIT_FAILED;
-    }
-
-  while (1)
-    {
-      libusb_handle_events_timeout_completed (NULL, &tv, NULL);
-
-      pthread_spin_lock (lock);
-      end = !*running;
-      pthread_spin_unlock (lock);
-
-      if (end)
-	{
-	  break;
-	}
-    }
-
-  debug_print (1, "Deregistering USB hotplug callback...");
-
-  libusb_hotplug_deregister_callback (NULL, callback_handle);
-  libusb_exit (NULL);
-
-  return 0;
-}
@@ -183,6 +183,7 @@ struct ow_engine
   size_t o2h_transfer_size;
   float *h2o_transfer_buf;
   float *o2h_transfer_buf;
+  int o2h_int;			//o2h_transfer_buf holds int32 samples
   size_t o2h_frame_size;
   size_t h2o_frame_size;
   struct
@@ -201,6 +202,7 @@ struct ow_engine
     size_t audio_out_blk_len;
     int xfr_audio_in_data_len;
     int xfr_audio_out_data_len;
+    int xfrs_in_flight;
     //Control
     struct libusb_transfer *xfr_control_out;
     struct libusb_transfer *xfr_control_in;
@@ -212,6 +214,12 @@ struct ow_engine
   SRC_DATA h2o_data;
   int reading_at_h2o_end;
   struct ow_context *context;
+  int reconnect;		//Open the device again after USB errors
+  uint64_t cpus;		//Thread CPU affinity mask
+  //Live statistics
+  struct ow_engine_counters counters;
+  struct ow_stats_device *stats;
+  uint64_t usb_cycle_usecs;
 };
 
 struct ow_engine_usb_blk
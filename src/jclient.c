@@ -20,6 +20,7 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,7 +37,7 @@
 
 #define MAX_LATENCY (8192 * 2)	//This is twice the maximum JACK latency.
 
-#define JCLIENT_WAIT_TIME_US 500000
+#define JAGGREGATE_GRACE_US 1000
 
 size_t
 jclient_buffer_read (void *buffer, char *src, size_t size)
@@ -61,11 +62,25 @@ jclient_thread_xrun_cb (void *cb_data)
   return 0;
 }
 
+static jack_port_t *
+jclient_get_first_port (jack_port_t **ports, int len)
+{
+  for (int i = 0; i < len; i++)
+    {
+      if (ports[i])
+	{
+	  return ports[i];
+	}
+    }
+  return NULL;
+}
+
 static void
-jclient_set_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
+jclient_set_latency (struct jclient *jclient,
+		     jack_latency_callback_mode_t mode)
 {
+  jack_port_t *port;
   jack_latency_range_t range;
-  struct jclient *jclient = cb_data;
   struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
   const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
   struct ow_resampler_state *state =
@@ -78,9 +93,19 @@ jclient_set_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
       debug_print (2, "o2h latency: [ %d, %d ]", state->f_latency_o2h_min,
 		   state->f_latency_o2h_max);
 
+      port = jclient_get_first_port (jclient->input_ports, desc->inputs);
       for (int i = 0; i < desc->outputs; i++)
 	{
-	  jack_port_get_latency_range (jclient->input_ports[0], mode, &range);
+	  if (!jclient->output_ports[i])
+	    {
+	      continue;
+	    }
+	  range.min = 0;
+	  range.max = 0;
+	  if (port)
+	    {
+	      jack_port_get_latency_range (port, mode, &range);
+	    }
 	  range.min += state->f_latency_o2h_min;
 	  range.max += state->f_latency_o2h_max;
 	  jack_port_set_latency_range (jclient->output_ports[i], mode,
@@ -92,10 +117,19 @@ jclient_set_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
       debug_print (2, "h2o latency: [ %d, %d ]", state->f_latency_h2o_min,
 		   state->f_latency_h2o_max);
 
+      port = jclient_get_first_port (jclient->output_ports, desc->outputs);
       for (int i = 0; i < desc->inputs; i++)
 	{
-	  jack_port_get_latency_range (jclient->output_ports[0], mode,
-				       &range);
+	  if (!jclient->input_ports[i])
+	    {
+	      continue;
+	    }
+	  range.min = 0;
+	  range.max = 0;
+	  if (port)
+	    {
+	      jack_port_get_latency_range (port, mode, &range);
+	    }
 	  range.min += state->f_latency_h2o_min;
 	  range.max += state->f_latency_h2o_max;
 	  jack_port_set_latency_range (jclient->input_ports[i], mode, &range);
@@ -103,6 +137,12 @@ jclient_set_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
     }
 }
 
+static void
+jclient_set_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
+{
+  jclient_set_latency (cb_data, mode);
+}
+
 static void
 jclient_port_connect_cb (jack_port_id_t a, jack_port_id_t b, int connect,
 			 void *cb_data)
@@ -166,7 +206,10 @@ jclient_copy_o2j_audio (float *f, jack_nframes_t nframes,
     {
       for (int j = 0; j < desc->outputs; j++)
 	{
-	  buffer[j][i] = *f;
+	  if (buffer[j])
+	    {
+	      buffer[j][i] = *f;
+	    }
 	  f++;
 	}
     }
@@ -181,7 +224,7 @@ jclient_copy_j2o_audio (float *f, jack_nframes_t nframes,
     {
       for (int j = 0; j < desc->inputs; j++)
 	{
-	  *f = buffer[j][i];
+	  *f = buffer[j] ? buffer[j][i] : 0;
 	  f++;
 	}
     }
@@ -194,29 +237,14 @@ jclient_audio_running (void *data)
 }
 
 static inline int
-jclient_process_cb (jack_nframes_t nframes, void *arg)
+jclient_process (struct jclient *jclient, jack_nframes_t nframes,
+		 jack_time_t current_usecs, int xrun)
 {
   float *f;
-  int xrun;
   jack_default_audio_sample_t *buffer[OB_MAX_TRACKS];
-  struct jclient *jclient = arg;
-  jack_nframes_t current_frames;
-  jack_time_t current_usecs;
-  jack_time_t next_usecs;
-  float period_usecs;
   struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
   const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
 
-  xrun = jclient->xrun;
-  jclient->xrun = 0;
-
-  if (jack_get_cycle_times (jclient->client, &current_frames, &current_usecs,
-			    &next_usecs, &period_usecs))
-    {
-      error_print ("Error while getting JACK time");
-      goto err;
-    }
-
   if (ow_resampler_compute_ratios (jclient->resampler, current_usecs, xrun,
 				   jclient_audio_running, jclient->client))
     {
@@ -227,7 +255,8 @@ jclient_process_cb (jack_nframes_t nframes, void *arg)
 
   for (int i = 0; i < desc->outputs; i++)
     {
-      buffer[i] = jack_port_get_buffer (jclient->output_ports[i], nframes);
+      jack_port_t *port = jclient->output_ports[i];
+      buffer[i] = port ? jack_port_get_buffer (port, nframes) : NULL;
     }
 
   f = ow_resampler_get_o2h_audio_buffer (jclient->resampler);
@@ -241,7 +270,8 @@ jclient_process_cb (jack_nframes_t nframes, void *arg)
 
   for (int i = 0; i < desc->inputs; i++)
     {
-      buffer[i] = jack_port_get_buffer (jclient->input_ports[i], nframes);
+      jack_port_t *port = jclient->input_ports[i];
+      buffer[i] = port ? jack_port_get_buffer (port, nframes) : NULL;
     }
 
   f = ow_resampler_get_h2o_audio_buffer (jclient->resampler);
@@ -258,6 +288,30 @@ err:
   return 1;
 }
 
+static int
+jclient_process_cb (jack_nframes_t nframes, void *arg)
+{
+  int xrun;
+  struct jclient *jclient = arg;
+  jack_nframes_t current_frames;
+  jack_time_t current_usecs;
+  jack_time_t next_usecs;
+  float period_usecs;
+
+  xrun = jclient->xrun;
+  jclient->xrun = 0;
+
+  if (jack_get_cycle_times (jclient->client, &current_frames, &current_usecs,
+			    &next_usecs, &period_usecs))
+    {
+      error_print ("Error while getting JACK time");
+      jclient_stop (jclient);
+      return 1;
+    }
+
+  return jclient_process (jclient, nframes, current_usecs, xrun);
+}
+
 static void
 set_rt_priority (pthread_t thread, int priority)
 {
@@ -286,8 +340,13 @@ jclient_init (struct jclient *jclient, struct ow_device *device,
   jclient->device = device;
   jclient->priority = priority;
   jclient->running = 0;
+  jclient->aggregate = NULL;
+  jclient->connections = NULL;
+  jclient->output_mask = UINT64_MAX;
+  jclient->input_mask = UINT64_MAX;
 
   pthread_spin_init (&jclient->lock, PTHREAD_PROCESS_PRIVATE);
+  sem_init (&jclient->started, 0, 0);
 
   err = ow_resampler_init_from_device (&resampler, device,
 				       blocks_per_transfer, xfr_timeout,
@@ -304,39 +363,119 @@ jclient_init (struct jclient *jclient, struct ow_device *device,
   return 0;
 }
 
+void
+jclient_set_aggregate (struct jclient *jclient, struct jaggregate *aggregate)
+{
+  jclient->aggregate = aggregate;
+}
+
+//Disabled tracks are still transferred but are not exposed.
+void
+jclient_set_track_masks (struct jclient *jclient, uint64_t output_mask,
+			 uint64_t input_mask)
+{
+  jclient->output_mask = output_mask;
+  jclient->input_mask = input_mask;
+}
+
 void
 jclient_destroy (struct jclient *jclient)
 {
   ow_resampler_destroy (jclient->resampler);
   pthread_spin_destroy (&jclient->lock);
+  sem_destroy (&jclient->started);
+  if (jclient->connections)
+    {
+      g_ptr_array_unref (jclient->connections);
+    }
 }
 
-static ow_err_t
-jclient_run (struct jclient *jclient)
+//The first physical capture port identifies the sound card driving the JACK server.
+static void
+jclient_set_host_name (struct jclient *jclient)
 {
-  jack_status_t status;
-  ow_err_t err = OW_OK;
-  char *client_name;
-  const char *name;
-  struct ow_engine *engine;
-  const struct ow_device_desc *desc;
+  int size;
+  char *name, *sep;
+  char *aliases[2];
+  const char **ports;
+  jack_port_t *port;
+
+  ports = jack_get_ports (jclient->client, NULL, JACK_DEFAULT_AUDIO_TYPE,
+			  JackPortIsPhysical | JackPortIsOutput);
+  if (!ports)
+    {
+      debug_print (1, "No physical ports found");
+      return;
+    }
 
-  jclient->xrun = 0;
-  jclient->output_ports = NULL;
-  jclient->input_ports = NULL;
-  jclient->context.h2o_audio = NULL;
-  jclient->context.o2h_audio = NULL;
+  size = jack_port_name_size ();
+  aliases[0] = malloc (size);
+  aliases[1] = malloc (size);
 
-  pthread_spin_lock (&jclient->lock);
-  jclient->running = 1;
-  pthread_spin_unlock (&jclient->lock);
+  port = jack_port_by_name (jclient->client, ports[0]);
+  if (port && jack_port_get_aliases (port, aliases) > 0)
+    {
+      name = strdup (aliases[0]);
+    }
+  else
+    {
+      name = strdup (ports[0]);
+    }
 
-  engine = ow_resampler_get_engine (jclient->resampler);
-  desc = &ow_engine_get_device (engine)->desc;
-  name = ow_engine_get_overbridge_name (engine);
+  sep = strrchr (name, ':');
+  if (sep)
+    {
+      *sep = 0;
+    }
 
-  jclient->client = jack_client_open (name, JackNoStartServer, &status, NULL);
-  if (jclient->client == NULL)
+  debug_print (1, "Using host name '%s'...", name);
+  ow_resampler_set_host_name (jclient->resampler, name);
+
+  free (name);
+  free (aliases[0]);
+  free (aliases[1]);
+  jack_free (ports);
+}
+
+//Callbacks shared by the standalone and the aggregate clients
+static void
+jclient_set_common_callbacks (jack_client_t *client, void *cb_data)
+{
+  if (jack_set_port_connect_callback (client, jclient_port_connect_cb,
+				      cb_data))
+    {
+      error_print
+	("Cannot set port connect callback so j2o audio will not be possible");
+    }
+
+  if (jack_set_freewheel_callback (client, jclient_jack_freewheel, cb_data))
+    {
+      error_print ("Cannot set JACK freewheel callback");
+    }
+
+  if (jack_set_graph_order_callback (client, jclient_jack_graph_order_cb,
+				     cb_data))
+    {
+      error_print ("Cannot set JACK graph order callback");
+    }
+
+  if (jack_set_client_registration_callback (client,
+					     jclient_jack_client_registration_cb,
+					     cb_data))
+    {
+      error_print ("Cannot set JACK client registration callback");
+    }
+}
+
+static jack_client_t *
+jclient_open_client (const char *name)
+{
+  jack_status_t status;
+  char *client_name;
+  jack_client_t *client;
+
+  client = jack_client_open (name, JackNoStartServer, &status, NULL);
+  if (client == NULL)
     {
       if (status & JackServerFailed)
 	{
@@ -346,7 +485,7 @@ jclient_run (struct jclient *jclient)
 	{
 	  error_print ("Unable to open client. Error 0x%2.0x", status);
 	}
-      return OW_GENERIC_ERROR;
+      return NULL;
     }
 
   if (status & JackServerStarted)
@@ -356,10 +495,22 @@ jclient_run (struct jclient *jclient)
 
   if (status & JackNameNotUnique)
     {
-      client_name = jack_get_client_name (jclient->client);
+      client_name = jack_get_client_name (client);
       debug_print (0, "Name client in use. Using %s...", client_name);
     }
 
+  return client;
+}
+
+static ow_err_t
+jclient_open (struct jclient *jclient, const char *name)
+{
+  jclient->client = jclient_open_client (name);
+  if (jclient->client == NULL)
+    {
+      return OW_GENERIC_ERROR;
+    }
+
   if (jack_set_process_callback (jclient->client, jclient_process_cb,
 				 jclient))
     {
@@ -378,46 +529,248 @@ jclient_run (struct jclient *jclient)
       goto cleanup_jack;
     }
 
-  if (jack_set_port_connect_callback (jclient->client,
-				      jclient_port_connect_cb, jclient))
+  jack_on_info_shutdown (jclient->client, jclient_jack_shutdown_cb, jclient);
+
+  jclient_set_common_callbacks (jclient->client, jclient);
+
+  if (jack_set_buffer_size_callback (jclient->client,
+				     jclient_set_buffer_size_cb, jclient))
     {
-      error_print
-	("Cannot set port connect callback so j2o audio will not be possible");
+      goto cleanup_jack;
     }
 
-  jack_on_info_shutdown (jclient->client, jclient_jack_shutdown_cb, jclient);
+  if (jack_set_sample_rate_callback (jclient->client,
+				     jclient_set_sample_rate_cb, jclient))
+    {
+      goto cleanup_jack;
+    }
+
+  return OW_OK;
+
+cleanup_jack:
+  jack_client_close (jclient->client);
+  return OW_GENERIC_ERROR;
+}
+
+//In the aggregate client, the port names are prefixed with the device name.
+//If that is already used by another device, the bus and address are added.
+static jack_port_t *
+jclient_register_port (struct jclient *jclient, const char *track,
+		       unsigned long flags)
+{
+  jack_port_t *port;
+  char name[OW_LABEL_MAX_LEN * 2];
+  struct ow_engine *engine = ow_resampler_get_engine (jclient->resampler);
 
-  if (jack_set_freewheel_callback (jclient->client, jclient_jack_freewheel,
-				   jclient))
+  if (!jclient->aggregate)
     {
-      error_print ("Cannot set JACK freewheel callback");
+      return jack_port_register (jclient->client, track,
+				 JACK_DEFAULT_AUDIO_TYPE,
+				 flags | JackPortIsTerminal, 0);
     }
 
-  if (jack_set_graph_order_callback (jclient->client,
-				     jclient_jack_graph_order_cb, jclient))
+  snprintf (name, sizeof (name), "%s %s",
+	    ow_engine_get_overbridge_name (engine), track);
+  port = jack_port_register (jclient->client, name, JACK_DEFAULT_AUDIO_TYPE,
+			     flags | JackPortIsTerminal, 0);
+  if (port)
     {
-      error_print ("Cannot set JACK graph order callback");
+      return port;
     }
 
-  if (jack_set_client_registration_callback (jclient->client,
-					     jclient_jack_client_registration_cb,
-					     jclient))
+  snprintf (name, sizeof (name), "%s %03d,%03d %s",
+	    ow_engine_get_overbridge_name (engine), jclient->device->bus,
+	    jclient->device->address, track);
+  return jack_port_register (jclient->client, name, JACK_DEFAULT_AUDIO_TYPE,
+			     flags | JackPortIsTerminal, 0);
+}
+
+static void
+jclient_unregister_ports (struct jclient *jclient,
+			  const struct ow_device_desc *desc)
+{
+  for (int i = 0; jclient->output_ports && i < desc->outputs; i++)
     {
-      error_print ("Cannot set JACK client registration callback");
+      if (jclient->output_ports[i])
+	{
+	  jack_port_unregister (jclient->client, jclient->output_ports[i]);
+	}
     }
 
-  if (jack_set_buffer_size_callback (jclient->client,
-				     jclient_set_buffer_size_cb, jclient))
+  for (int i = 0; jclient->input_ports && i < desc->inputs; i++)
     {
-      err = OW_GENERIC_ERROR;
-      goto cleanup_jack;
+      if (jclient->input_ports[i])
+	{
+	  jack_port_unregister (jclient->client, jclient->input_ports[i]);
+	}
     }
+}
 
-  if (jack_set_sample_rate_callback (jclient->client,
-				     jclient_set_sample_rate_cb, jclient))
+//This must be called while holding the aggregate lock.
+//The previous slots are freed once the process callback has stopped using them
+//so a removed jclient is never processed after this returns.
+static void
+jaggregate_publish (struct jaggregate *aggregate,
+		    struct jaggregate_slots *slots)
+{
+  unsigned int cycles;
+  struct jaggregate_slots *old = atomic_exchange (&aggregate->slots, slots);
+
+  cycles = atomic_load (&aggregate->cycles);
+  while ((cycles & 1) && atomic_load (&aggregate->cycles) == cycles)
     {
-      err = OW_GENERIC_ERROR;
-      goto cleanup_jack;
+      usleep (JAGGREGATE_GRACE_US);
+    }
+
+  free (old);
+}
+
+static void
+jclient_save_port_connections (struct jclient *jclient, jack_port_t *port,
+			       int output)
+{
+  const char **peers;
+
+  if (!port)
+    {
+      return;
+    }
+
+  peers = jack_port_get_connections (port);
+
+  if (!peers)
+    {
+      return;
+    }
+
+  for (const char **peer = peers; *peer; peer++)
+    {
+      const char *name = jack_port_name (port);
+      g_ptr_array_add (jclient->connections, g_strdup (output ? name : *peer));
+      g_ptr_array_add (jclient->connections, g_strdup (output ? *peer : name));
+    }
+
+  jack_free (peers);
+}
+
+static void
+jclient_save_connections (struct jclient *jclient,
+			  const struct ow_device_desc *desc)
+{
+  if (jclient->connections)
+    {
+      g_ptr_array_unref (jclient->connections);
+    }
+  jclient->connections = g_ptr_array_new_with_free_func (g_free);
+
+  for (int i = 0; jclient->output_ports && i < desc->outputs; i++)
+    {
+      jclient_save_port_connections (jclient, jclient->output_ports[i], 1);
+    }
+
+  for (int i = 0; jclient->input_ports && i < desc->inputs; i++)
+    {
+      jclient_save_port_connections (jclient, jclient->input_ports[i], 0);
+    }
+
+  debug_print (1, "%d connections saved", jclient->connections->len / 2);
+}
+
+static void
+jclient_restore_connections (struct jclient *jclient)
+{
+  const char *src, *dst;
+
+  if (!jclient->connections)
+    {
+      return;
+    }
+
+  debug_print (1, "Restoring %d connections...",
+	       jclient->connections->len / 2);
+
+  for (guint i = 0; i < jclient->connections->len; i += 2)
+    {
+      src = g_ptr_array_index (jclient->connections, i);
+      dst = g_ptr_array_index (jclient->connections, i + 1);
+      if (jack_connect (jclient->client, src, dst))
+	{
+	  debug_print (1, "Could not connect '%s' to '%s'", src, dst);
+	}
+    }
+}
+
+static void
+jaggregate_add (struct jaggregate *aggregate, struct jclient *jclient)
+{
+  struct jaggregate_slots *slots = malloc (sizeof (struct jaggregate_slots));
+
+  pthread_mutex_lock (&aggregate->lock);
+  *slots = *atomic_load (&aggregate->slots);
+  if (slots->len < JAGGREGATE_MAX_CLIENTS)
+    {
+      slots->jclients[slots->len] = jclient;
+      slots->len++;
+    }
+  else
+    {
+      error_print ("Too many clients in the aggregate client");
+    }
+  jaggregate_publish (aggregate, slots);
+  pthread_mutex_unlock (&aggregate->lock);
+}
+
+static void
+jaggregate_remove (struct jaggregate *aggregate, struct jclient *jclient)
+{
+  struct jaggregate_slots *slots = malloc (sizeof (struct jaggregate_slots));
+
+  pthread_mutex_lock (&aggregate->lock);
+  *slots = *atomic_load (&aggregate->slots);
+  for (int i = 0; i < slots->len; i++)
+    {
+      if (slots->jclients[i] == jclient)
+	{
+	  slots->len--;
+	  slots->jclients[i] = slots->jclients[slots->len];
+	  break;
+	}
+    }
+  jaggregate_publish (aggregate, slots);
+  pthread_mutex_unlock (&aggregate->lock);
+}
+
+static ow_err_t
+jclient_run (struct jclient *jclient)
+{
+  ow_err_t err = OW_OK;
+  const char *name;
+  struct ow_engine *engine;
+  const struct ow_device_desc *desc;
+
+  jclient->xrun = 0;
+  jclient->output_ports = NULL;
+  jclient->input_ports = NULL;
+  jclient->context.h2o_audio = NULL;
+  jclient->context.o2h_audio = NULL;
+
+  pthread_spin_lock (&jclient->lock);
+  jclient->running = 1;
+  pthread_spin_unlock (&jclient->lock);
+  sem_post (&jclient->started);
+
+  engine = ow_resampler_get_engine (jclient->resampler);
+  desc = &ow_engine_get_device (engine)->desc;
+  name = ow_engine_get_overbridge_name (engine);
+
+  if (jclient->aggregate)
+    {
+      debug_print (1, "Using aggregate client...");
+      jclient->client = jclient->aggregate->client;
+    }
+  else if (jclient_open (jclient, name))
+    {
+      return OW_GENERIC_ERROR;
     }
 
   if (jclient->priority < 0)
@@ -427,16 +780,18 @@ jclient_run (struct jclient *jclient)
   debug_print (1, "Using RT priority %d...", jclient->priority);
 
   debug_print (1, "Registering ports...");
-  jclient->output_ports = malloc (sizeof (jack_port_t *) * desc->outputs);
+  jclient->output_ports = calloc (desc->outputs, sizeof (jack_port_t *));
   for (int i = 0; i < desc->outputs; i++)
     {
       const char *name = desc->output_tracks[i].name;
+      if (!(jclient->output_mask & (1ULL << i)))
+	{
+	  debug_print (2, "Skipping disabled output port %s...", name);
+	  continue;
+	}
       debug_print (2, "Registering output port %s...", name);
-      jclient->output_ports[i] = jack_port_register (jclient->client,
-						     name,
-						     JACK_DEFAULT_AUDIO_TYPE,
-						     JackPortIsOutput |
-						     JackPortIsTerminal, 0);
+      jclient->output_ports[i] = jclient_register_port (jclient, name,
+							JackPortIsOutput);
 
       if (jclient->output_ports[i] == NULL)
 	{
@@ -446,16 +801,18 @@ jclient_run (struct jclient *jclient)
 	}
     }
 
-  jclient->input_ports = malloc (sizeof (jack_port_t *) * desc->inputs);
+  jclient->input_ports = calloc (desc->inputs, sizeof (jack_port_t *));
   for (int i = 0; i < desc->inputs; i++)
     {
       const char *name = desc->input_tracks[i].name;
+      if (!(jclient->input_mask & (1ULL << i)))
+	{
+	  debug_print (2, "Skipping disabled input port %s...", name);
+	  continue;
+	}
       debug_print (2, "Registering input port %s...", name);
-      jclient->input_ports[i] = jack_port_register (jclient->client,
-						    name,
-						    JACK_DEFAULT_AUDIO_TYPE,
-						    JackPortIsInput |
-						    JackPortIsTerminal, 0);
+      jclient->input_ports[i] = jclient_register_port (jclient, name,
+						       JackPortIsInput);
 
       if (jclient->input_ports[i] == NULL)
 	{
@@ -489,6 +846,8 @@ jclient_run (struct jclient *jclient)
   jclient->context.options = OW_ENGINE_OPTION_O2H_AUDIO |
     OW_ENGINE_OPTION_H2O_AUDIO;
 
+  jclient_set_host_name (jclient);
+
   err = ow_resampler_start (jclient->resampler, &jclient->context,
 			    jack_get_sample_rate (jclient->client),
 			    jack_get_buffer_size (jclient->client));
@@ -497,16 +856,27 @@ jclient_run (struct jclient *jclient)
       goto cleanup_jack;
     }
 
-  debug_print (1, "Activating...");
-
-  if (jack_activate (jclient->client))
+  if (jclient->aggregate)
     {
-      error_print ("Cannot activate client");
-      err = OW_GENERIC_ERROR;
-      goto wait_resampler;
+      //The aggregate client is already active.
+      jaggregate_add (jclient->aggregate, jclient);
+      jclient_restore_connections (jclient);
     }
+  else
+    {
+      debug_print (1, "Activating...");
+
+      if (jack_activate (jclient->client))
+	{
+	  error_print ("Cannot activate client");
+	  err = OW_GENERIC_ERROR;
+	  goto wait_resampler;
+	}
 
-  debug_print (1, "Activated");
+      debug_print (1, "Activated");
+
+      jclient_restore_connections (jclient);
+    }
 
 wait_resampler:
   ow_resampler_wait (jclient->resampler);
@@ -514,11 +884,24 @@ wait_resampler:
   debug_print (1, "Exiting...");
 
   if (!err)
+    {
+      jclient_save_connections (jclient, desc);
+    }
+
+  if (jclient->aggregate)
+    {
+      jaggregate_remove (jclient->aggregate, jclient);
+    }
+  else if (!err)
     {
       jack_deactivate (jclient->client);
     }
 
 cleanup_jack:
+  if (jclient->aggregate)
+    {
+      jclient_unregister_ports (jclient, desc);
+    }
   if (jclient->context.h2o_audio)
     {
       jack_ringbuffer_free (jclient->context.h2o_audio);
@@ -527,7 +910,10 @@ cleanup_jack:
     {
       jack_ringbuffer_free (jclient->context.o2h_audio);
     }
-  jack_client_close (jclient->client);
+  if (!jclient->aggregate)
+    {
+      jack_client_close (jclient->client);
+    }
   free (jclient->output_ports);
   free (jclient->input_ports);
   return err;
@@ -544,34 +930,28 @@ jclient_thread_runner (void *data)
 int
 jclient_start (struct jclient *jclient)
 {
-  int running, err;
   gchar buf[OW_LABEL_MAX_LEN];
 
   debug_print (1, "Starting thread...");
 
   if (pthread_create (&jclient->thread, NULL, jclient_thread_runner, jclient))
     {
-      return err;
+      return -1;
     }
 
   snprintf (buf, OW_LABEL_MAX_LEN, "jclient-%.7s",
 	    jclient->device->desc.name);
   pthread_setname_np (jclient->thread, buf);
 
-  while (1)
-    {
-      pthread_spin_lock (&jclient->lock);
-      running = jclient->running;
-      pthread_spin_unlock (&jclient->lock);
+  debug_print (2, "Waiting for the thread to be ready...");
 
-      if (running)
+  //Posted by the thread as soon as it runs so there is no polling delay.
+  while (sem_wait (&jclient->started))
+    {
+      if (errno != EINTR)
 	{
-	  break;
+	  return -1;
 	}
-
-      debug_print (2, "Waiting for the thread to be ready...");
-
-      usleep (JCLIENT_WAIT_TIME_US);
     }
 
   return 0;
@@ -583,3 +963,195 @@ jclient_wait (struct jclient *jclient)
   pthread_join (jclient->thread, NULL);
   jclient->running = 0;
 }
+
+static int
+jaggregate_process_cb (jack_nframes_t nframes, void *arg)
+{
+  int xrun;
+  struct jaggregate *aggregate = arg;
+  struct jaggregate_slots *slots;
+  jack_nframes_t current_frames;
+  jack_time_t current_usecs;
+  jack_time_t next_usecs;
+  float period_usecs;
+
+  xrun = aggregate->xrun;
+  aggregate->xrun = 0;
+
+  if (jack_get_cycle_times (aggregate->client, &current_frames,
+			    &current_usecs, &next_usecs, &period_usecs))
+    {
+      error_print ("Error while getting JACK time");
+      return 0;
+    }
+
+  //All the resamplers share the cycle times so they are only read once.
+  atomic_fetch_add (&aggregate->cycles, 1);
+  slots = atomic_load (&aggregate->slots);
+  for (int i = 0; i < slots->len; i++)
+    {
+      jclient_process (slots->jclients[i], nframes, current_usecs, xrun);
+    }
+  atomic_fetch_add_explicit (&aggregate->cycles, 1, memory_order_release);
+
+  return 0;
+}
+
+static int
+jaggregate_xrun_cb (void *cb_data)
+{
+  struct jaggregate *aggregate = cb_data;
+  error_print ("JACK xrun");
+  aggregate->xrun = 1;
+  return 0;
+}
+
+static void
+jaggregate_set_latency_cb (jack_latency_callback_mode_t mode, void *cb_data)
+{
+  struct jaggregate *aggregate = cb_data;
+  struct jaggregate_slots *slots;
+
+  pthread_mutex_lock (&aggregate->lock);
+  slots = atomic_load (&aggregate->slots);
+  for (int i = 0; i < slots->len; i++)
+    {
+      jclient_set_latency (slots->jclients[i], mode);
+    }
+  pthread_mutex_unlock (&aggregate->lock);
+}
+
+static int
+jaggregate_set_buffer_size_cb (jack_nframes_t nframes, void *cb_data)
+{
+  struct jaggregate *aggregate = cb_data;
+  struct jaggregate_slots *slots;
+
+  debug_print (1, "JACK buffer size: %d", nframes);
+
+  pthread_mutex_lock (&aggregate->lock);
+  slots = atomic_load (&aggregate->slots);
+  for (int i = 0; i < slots->len; i++)
+    {
+      ow_resampler_set_buffer_size (slots->jclients[i]->resampler, nframes);
+    }
+  pthread_mutex_unlock (&aggregate->lock);
+
+  return 0;
+}
+
+static int
+jaggregate_set_sample_rate_cb (jack_nframes_t nframes, void *cb_data)
+{
+  struct jaggregate *aggregate = cb_data;
+  struct jaggregate_slots *slots;
+
+  debug_print (1, "JACK sample rate: %d", nframes);
+
+  pthread_mutex_lock (&aggregate->lock);
+  slots = atomic_load (&aggregate->slots);
+  for (int i = 0; i < slots->len; i++)
+    {
+      ow_resampler_set_samplerate (slots->jclients[i]->resampler, nframes);
+    }
+  pthread_mutex_unlock (&aggregate->lock);
+
+  return 0;
+}
+
+static void
+jaggregate_shutdown_cb (jack_status_t code, const char *reason,
+			void *cb_data)
+{
+  struct jaggregate *aggregate = cb_data;
+  struct jaggregate_slots *slots;
+
+  debug_print (1, "JACK is shutting down: %s", reason);
+
+  pthread_mutex_lock (&aggregate->lock);
+  slots = atomic_load (&aggregate->slots);
+  for (int i = 0; i < slots->len; i++)
+    {
+      jclient_stop (slots->jclients[i]);
+    }
+  pthread_mutex_unlock (&aggregate->lock);
+}
+
+int
+jaggregate_init (struct jaggregate *aggregate)
+{
+  aggregate->xrun = 0;
+
+  aggregate->client = jclient_open_client (JAGGREGATE_CLIENT_NAME);
+  if (aggregate->client == NULL)
+    {
+      return -1;
+    }
+
+  pthread_mutex_init (&aggregate->lock, NULL);
+  atomic_init (&aggregate->slots,
+	       calloc (1, sizeof (struct jaggregate_slots)));
+  atomic_init (&aggregate->cycles, 0);
+
+  if (jack_set_process_callback (aggregate->client, jaggregate_process_cb,
+				 aggregate))
+    {
+      goto cleanup_jack;
+    }
+
+  if (jack_set_xrun_callback (aggregate->client, jaggregate_xrun_cb,
+			      aggregate))
+    {
+      goto cleanup_jack;
+    }
+
+  if (jack_set_latency_callback (aggregate->client,
+				 jaggregate_set_latency_cb, aggregate))
+    {
+      goto cleanup_jack;
+    }
+
+  jack_on_info_shutdown (aggregate->client, jaggregate_shutdown_cb,
+			 aggregate);
+
+  jclient_set_common_callbacks (aggregate->client, aggregate);
+
+  if (jack_set_buffer_size_callback (aggregate->client,
+				     jaggregate_set_buffer_size_cb, aggregate))
+    {
+      goto cleanup_jack;
+    }
+
+  if (jack_set_sample_rate_callback (aggregate->client,
+				     jaggregate_set_sample_rate_cb, aggregate))
+    {
+      goto cleanup_jack;
+    }
+
+  debug_print (1, "Activating aggregate client...");
+
+  if (jack_activate (aggregate->client))
+    {
+      error_print ("Cannot activate client");
+      goto cleanup_jack;
+    }
+
+  return 0;
+
+cleanup_jack:
+  jack_client_close (aggregate->client);
+  pthread_mutex_destroy (&aggregate->lock);
+  free (atomic_load (&aggregate->slots));
+  return -1;
+}
+
+//The jclients must have been stopped and waited before.
+void
+jaggregate_destroy (struct jaggregate *aggregate)
+{
+  debug_print (1, "Closing aggregate client...");
+  jack_deactivate (aggregate->client);
+  jack_client_close (aggregate->client);
+  pthread_mutex_destroy (&aggregate->lock);
+  free (atomic_load (&aggregate->slots));
+}
@@ -18,6 +18,9 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <glib.h>
 #include <jack/ringbuffer.h>
 #include <jack/types.h>
 #include "overwitch.h"
@@ -26,9 +29,31 @@
 
 #define JCLIENT_DEFAULT_PRIORITY -1
 
+#define JAGGREGATE_MAX_CLIENTS 64
+#define JAGGREGATE_CLIENT_NAME "Overwitch"
+
 typedef void (*jclient_end_notifier_t) (uint8_t, uint8_t);
 typedef void (*jclient_notify_status_t) (int, jack_nframes_t, jack_nframes_t);
 
+struct jclient;
+
+struct jaggregate_slots
+{
+  int len;
+  struct jclient *jclients[JAGGREGATE_MAX_CLIENTS];
+};
+
+//A single JACK client that runs the resamplers of several jclients in the same process callback.
+//The slots are never modified but replaced so the process callback does not need any lock.
+struct jaggregate
+{
+  jack_client_t *client;
+  pthread_mutex_t lock;		//Serializes the slots replacements
+  _Atomic (struct jaggregate_slots *) slots;
+  atomic_uint cycles;		//Odd while the process callback uses the slots
+  int xrun;
+};
+
 struct jclient
 {
   //JACK stuff
@@ -38,14 +63,23 @@ struct jclient
   //Parameters
   struct ow_device *device;
   int priority;
+  //Tracks without a bit set have no port
+  uint64_t output_mask;
+  uint64_t input_mask;
   // Overwitch stuff
   struct ow_resampler *resampler;
   struct ow_context context;
   // Thread stuff
   pthread_spinlock_t lock;
   int running;
+  sem_t started;
   pthread_t thread;
   int xrun;
+  //When set, the ports are registered in the aggregate JACK client.
+  struct jaggregate *aggregate;
+  //Pairs of source and destination port names saved when the client ends
+  //and restored when it starts.
+  GPtrArray *connections;
 };
 
 void jclient_check_jack_server (jclient_notify_status_t);
@@ -62,6 +96,14 @@ void jclient_wait (struct jclient *);
 
 void jclient_stop (struct jclient *);
 
+void jclient_set_aggregate (struct jclient *, struct jaggregate *);
+
+void jclient_set_track_masks (struct jclient *, uint64_t, uint64_t);
+
+int jaggregate_init (struct jaggregate *);
+
+void jaggregate_destroy (struct jaggregate *);
+
 void jclient_print_latencies (struct ow_resampler *, const char *);
 
 void jclient_copy_o2j_audio (float *, jack_nframes_t,
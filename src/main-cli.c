@@ -24,6 +24,7 @@
 #include "jclient.h"
 #include "utils.h"
 #include "common.h"
+#include "stats.h"
 
 #define DEFAULT_QUALITY 2
 
@@ -31,6 +32,8 @@ static int blocks_per_transfer = OW_DEFAULT_BLOCKS;
 static int quality = DEFAULT_QUALITY;
 static int priority = JCLIENT_DEFAULT_PRIORITY;
 static int xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
+static int low_latency = 0;
+static int reconnect = 0;
 
 struct jclient jclient;
 static int stop;
@@ -46,6 +49,8 @@ static struct option options[] = {
   {"usb-transfer-timeout", 1, NULL, 't'},
   {"rt-priority", 1, NULL, 'p'},
   {"rename", 1, NULL, 'r'},
+  {"low-latency", 0, NULL, 'L'},
+  {"reconnect", 0, NULL, 'R'},
   {"list-devices", 0, NULL, 'l'},
   {"verbose", 0, NULL, 'v'},
   {"help", 0, NULL, 'h'},
@@ -88,6 +93,7 @@ run_jclient (int device_num, const char *device_name, uint8_t bus,
 	     uint8_t address)
 {
   struct ow_device *device;
+  struct ow_stats_page *stats_page;
   int err;
 
   if (ow_get_device_from_device_attrs (device_num, device_name, bus, address,
@@ -111,6 +117,15 @@ run_jclient (int device_num, const char *device_name, uint8_t bus,
       return EXIT_FAILURE;
     }
 
+  ow_resampler_set_low_latency (jclient.resampler, low_latency);
+  ow_resampler_set_reconnect (jclient.resampler, reconnect);
+
+  stats_page = ow_stats_page_new ("overwitch-cli");
+  if (stats_page)
+    {
+      ow_resampler_set_stats (jclient.resampler, &stats_page->devices[0]);
+    }
+
   jclient_start (&jclient);
 
   pthread_spin_lock (&lock);
@@ -127,6 +142,11 @@ run_jclient (int device_num, const char *device_name, uint8_t bus,
   jclient_wait (&jclient);
   jclient_destroy (&jclient);
 
+  if (stats_page)
+    {
+      ow_stats_page_free (stats_page);
+    }
+
   return err;
 }
 
@@ -208,7 +228,7 @@ main (int argc, char *argv[])
   sigaction (SIGUSR1, &action, NULL);
   sigaction (SIGUSR2, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "sn:d:a:q:b:t:p:r:lvh",
+  while ((opt = getopt_long (argc, argv, "sn:d:a:q:b:t:p:r:LRlvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -266,6 +286,12 @@ main (int argc, char *argv[])
 	  name = optarg;
 	  rflg++;
 	  break;
+	case 'L':
+	  low_latency = 1;
+	  break;
+	case 'R':
+	  reconnect = 1;
+	  break;
 	case 'l':
 	  lflg++;
 	  break;
@@ -23,52 +23,180 @@
 #include <sndfile.h>
 #include <unistd.h>
 #include <time.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/eventfd.h>
 #include "../config.h"
 #include "utils.h"
 #include "common.h"
+#include "ringbuffer.h"
+#include "wavwriter.h"
 
 #define TRACK_BUF_KB 256
+#define WRITER_CHUNK_FRAMES 4096
 #define MAX_FILENAME_LEN 128
 #define MAX_TIME_LEN 32
+#define MAX_WRITERS 16
+#define DEFAULT_WRITERS 4
+#define MAX_PREROLL_SECONDS 600
+#define MAX_WRITE_ERRORS 16
+
+//The name is also the file extension.
+struct record_format
+{
+  const char *name;
+  int sf_format;
+  int compressed;
+  int max_channels;
+  int max_pcm_bits;		//Integer samples stored without loss
+};
+
+static const struct record_format FORMATS[] = {
+  {"wav", SF_FORMAT_RF64 | SF_FORMAT_FLOAT, 0, 0, 32},
+  {"w64", SF_FORMAT_W64 | SF_FORMAT_FLOAT, 0, 0, 32},
+  {"flac", SF_FORMAT_FLAC | SF_FORMAT_PCM_24, 1, 8, 24},
+  {"opus", SF_FORMAT_OGG | SF_FORMAT_OPUS, 1, 8, 0},
+  {NULL}
+};
+
+struct record_file
+{
+  SNDFILE *sf;
+  int fd;
+  struct ow_wav_writer *wav_writer;
+  uint64_t frames;
+  int errors;			//Consecutive write errors
+  char name[MAX_FILENAME_LEN];
+};
+
+//Files with the same tracks. When rotating, the next file is opened, and
+//the previous one closed, by the rotator thread so that the writer only
+//swaps them. While the rotator is opening the next file, request is still
+//set.
+struct record_stream
+{
+  char name[OW_LABEL_MAX_LEN];	//Track name when splitting
+  int channels;
+  int part;
+  struct record_file *file;
+  struct record_file *next;
+  struct record_file *prev;
+  int request;			//The next file is needed
+};
 
 static struct ow_context context;
 static struct ow_engine *engine;
-static SF_INFO sfinfo;
-static SNDFILE *sf;
+static int direct_io;
+static int pcm;
+static int pcm_bits;		//Set if the samples are integers
+static const struct record_format *format = FORMATS;
+static uint64_t rotate_frames;
+static uint64_t rotate_bytes;
 static const struct ow_device_desc *desc;
 static const char *track_mask;
 static size_t track_buf_size_kb = TRACK_BUF_KB;
 static float max[OB_MAX_TRACKS];
 static float min[OB_MAX_TRACKS];
-static char filename[MAX_FILENAME_LEN];
+static char file_prefix[MAX_FILENAME_LEN];
+static struct record_stream streams[OB_MAX_TRACKS];
+static int streams_len;
+static int split_tracks;
+static int writers;
 
-typedef enum
+static struct
 {
-  END = -1,
-  EMPTY,
-  READY
-} buffer_status_t;
+  pthread_t pthread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_cond_t ready;		//A file has been opened or closed
+  int running;
+} rotator;
 
+//The USB callback only copies the recorded tracks into a lock-free ring and
+//the writer thread, woken up by an eventfd, writes them to disk. If the disk
+//is too slow, whole transfers are dropped and counted but the engine thread
+//never waits.
 static struct
 {
-  char *mem;
-  char *disk;
-  size_t len;
+  struct ow_ringbuffer *rb;
+  char *frames;			//Recorded tracks of a transfer
+  char *chunk;			//Writer buffer
+  size_t chunk_size;
+  size_t frame_size;
+  int wakeup;
+  atomic_int running;
   pthread_t pthread;
-  size_t disk_samples;
-  size_t disk_frames;
-  pthread_spinlock_t lock;
-  buffer_status_t status;
+  atomic_uint_least64_t frames_written;
+  atomic_uint_least64_t overflows;
+  atomic_uint_least64_t overflow_frames;
+  atomic_uint_least64_t write_errors;
+  atomic_uint_least64_t write_error_frames;
+  atomic_size_t max_fill;
+  atomic_size_t wakeup_fill;
   int outputs;
   int outputs_mask_len;
 } buffer;
 
+//Retroactive capture. While waiting for the trigger, the ring is bigger by
+//the pre-roll, which is all that is kept, and nothing is written.
+static struct
+{
+  int enabled;
+  uint64_t preroll_seconds;
+  size_t preroll_size;
+  float level;
+  atomic_int triggered;
+} retro;
+
+struct record_track
+{
+  struct ow_ringbuffer *rb;
+  uint64_t gap;			//Lost frames to be written as silence
+  atomic_uint_least64_t lost_frames;
+  atomic_size_t max_fill;
+};
+
+struct record_writer
+{
+  pthread_t pthread;
+  int index;
+  int wakeup;
+  char *chunk;
+};
+
+//When splitting, the recorder thread deinterleaves the tracks into a ring
+//per track and a pool of writers, each one with a subset of the tracks,
+//writes them to disk.
+static struct
+{
+  struct record_track tracks[OB_MAX_TRACKS];
+  struct record_writer writers[MAX_WRITERS];
+  int writers_len;
+  int writers_started;
+  size_t chunk_size;
+  float *samples;
+  float *zeros;
+  atomic_int running;
+} split;
+
 static struct option options[] = {
   {"use-device-number", 1, NULL, 'n'},
   {"use-device", 1, NULL, 'd'},
   {"bus-device-address", 1, NULL, 'a'},
   {"track-mask", 1, NULL, 'm'},
   {"track-buffer-size-kilobytes", 1, NULL, 's'},
+  {"direct-io", 0, NULL, 'i'},
+  {"format", 1, NULL, 'f'},
+  {"rotate-seconds", 1, NULL, 'r'},
+  {"rotate-megabytes", 1, NULL, 'R'},
+  {"split-tracks", 0, NULL, 'S'},
+  {"writer-threads", 1, NULL, 'w'},
+  {"pcm", 0, NULL, 'p'},
+  {"pre-roll-seconds", 1, NULL, 'P'},
+  {"trigger-level", 1, NULL, 'T'},
   {"blocks-per-transfer", 1, NULL, 'b'},
   {"usb-transfer-timeout", 1, NULL, 't'},
   {"list-devices", 0, NULL, 'l'},
@@ -80,7 +208,40 @@ static struct option options[] = {
 static void
 print_status ()
 {
-  fprintf (stderr, "%lu frames written\n", sfinfo.frames);
+  uint64_t overflows = atomic_load (&buffer.overflows);
+  uint64_t write_errors = atomic_load (&buffer.write_errors);
+
+  fprintf (stderr, "%" PRIu64 " frames written\n",
+	   atomic_load (&buffer.frames_written));
+  if (overflows)
+    {
+      fprintf (stderr, "%" PRIu64 " buffer overflows (%" PRIu64
+	       " frames lost)\n", overflows,
+	       atomic_load (&buffer.overflow_frames));
+    }
+  if (write_errors)
+    {
+      fprintf (stderr, "%" PRIu64 " write errors (%" PRIu64
+	       " frames lost)\n", write_errors,
+	       atomic_load (&buffer.write_error_frames));
+    }
+  for (int i = 0; i < streams_len && split.samples; i++)
+    {
+      struct record_track *t = &split.tracks[i];
+      uint64_t lost = atomic_load (&t->lost_frames);
+      if (lost)
+	{
+	  fprintf (stderr, "%s: %" PRIu64 " frames replaced by silence\n",
+		   streams[i].name, lost);
+	}
+      debug_print (1, "%s: buffer usage peak: %zu of %zu bytes",
+		   streams[i].name, atomic_load (&t->max_fill), t->rb->size);
+    }
+  if (buffer.rb)
+    {
+      debug_print (1, "Buffer usage peak: %zu of %zu bytes",
+		   atomic_load (&buffer.max_fill), buffer.rb->size);
+    }
 }
 
 static size_t
@@ -90,69 +251,726 @@ buffer_dummy_rw_space (void *data)
     OW_BYTES_PER_SAMPLE;
 }
 
-static buffer_status_t
-get_buffer_status ()
+static void
+set_stream_name (struct record_stream *s, const char *track_name)
+{
+  char *c;
+
+  snprintf (s->name, OW_LABEL_MAX_LEN, "%s", track_name);
+  for (c = s->name; *c; c++)
+    {
+      if (!isalnum ((unsigned char) *c))
+	{
+	  *c = '_';
+	}
+    }
+}
+
+//The direct I/O writer always uses 32 bits containers.
+static int
+get_file_sample_bytes ()
+{
+  return pcm_bits && !direct_io ? pcm_bits / 8 : OW_BYTES_PER_SAMPLE;
+}
+
+static struct record_file *
+record_file_open (struct record_stream *s)
+{
+  SF_INFO sfinfo;
+  const char *ext = format->name;
+  struct record_file *f = malloc (sizeof (struct record_file));
+
+  f->sf = NULL;
+  f->wav_writer = NULL;
+  f->frames = 0;
+  f->errors = 0;
+
+  if (rotate_frames)
+    {
+      snprintf (f->name, MAX_FILENAME_LEN, "%s%s%s_%03d.%s", file_prefix,
+		*s->name ? "_" : "", s->name, s->part, ext);
+    }
+  else
+    {
+      snprintf (f->name, MAX_FILENAME_LEN, "%s%s%s.%s", file_prefix,
+		*s->name ? "_" : "", s->name, ext);
+    }
+  s->part++;
+
+  debug_print (1, "Creating %s (%d channels)...", f->name, s->channels);
+
+  if (direct_io)
+    {
+      f->wav_writer = ow_wav_writer_open (f->name, pcm_bits ?
+					  OW_WAV_FORMAT_PCM :
+					  OW_WAV_FORMAT_FLOAT, s->channels,
+					  OW_BYTES_PER_SAMPLE,
+					  pcm_bits ? pcm_bits :
+					  OW_BYTES_PER_SAMPLE * 8);
+      if (!f->wav_writer)
+	{
+	  goto error;
+	}
+      return f;
+    }
+
+  f->fd = open (f->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (f->fd < 0)
+    {
+      goto error;
+    }
+
+  //When rotating, the size is known in advance.
+  if (rotate_frames && !format->compressed &&
+      fallocate (f->fd, FALLOC_FL_KEEP_SIZE, 0,
+		 rotate_frames * s->channels * get_file_sample_bytes ()))
+    {
+      debug_print (1, "Could not preallocate file: %s", strerror (errno));
+    }
+
+  sfinfo.samplerate = OB_SAMPLE_RATE;
+  sfinfo.channels = s->channels;
+  sfinfo.format = format->sf_format;
+  if (pcm_bits)
+    {
+      sfinfo.format &= SF_FORMAT_TYPEMASK;
+      sfinfo.format |= pcm_bits == 16 ? SF_FORMAT_PCM_16 :
+	pcm_bits == 24 ? SF_FORMAT_PCM_24 : SF_FORMAT_PCM_32;
+    }
+
+  f->sf = sf_open_fd (f->fd, SFM_WRITE, &sfinfo, SF_FALSE);
+  if (!f->sf)
+    {
+      close (f->fd);
+      goto error;
+    }
+
+  //Files smaller than 4 GiB are plain WAVE files.
+  if ((format->sf_format & SF_FORMAT_TYPEMASK) == SF_FORMAT_RF64)
+    {
+      sf_command (f->sf, SFC_RF64_AUTO_DOWNGRADE, NULL, SF_TRUE);
+    }
+
+  //Overs must not wrap around when converting to integers.
+  if (format->compressed)
+    {
+      sf_command (f->sf, SFC_SET_CLIPPING, NULL, SF_TRUE);
+    }
+
+  return f;
+
+error:
+  error_print ("Could not create file '%s'", f->name);
+  free (f);
+  return NULL;
+}
+
+static void
+record_file_close (struct record_file *f, int discard)
+{
+  if (f->wav_writer)
+    {
+      ow_wav_writer_close (f->wav_writer);
+    }
+  else
+    {
+      sf_close (f->sf);
+      //This releases the preallocated space not used.
+      if (ftruncate (f->fd, lseek (f->fd, 0, SEEK_END)))
+	{
+	  debug_print (1, "Could not truncate file: %s", strerror (errno));
+	}
+      close (f->fd);
+    }
+
+  if (discard)
+    {
+      unlink (f->name);
+    }
+  else
+    {
+      fprintf (stderr, "%s file created\n", f->name);
+    }
+
+  free (f);
+}
+
+//Frames that could not be written are counted as lost but the file position
+//still advances so that rotation keeps its timing. If the errors persist,
+//the recording is stopped.
+static int
+record_file_write (struct record_file *f, const char *data, size_t frames)
+{
+  int err;
+
+  if (f->wav_writer)
+    {
+      err = ow_wav_writer_write (f->wav_writer, data, frames);
+    }
+  else
+    {
+      if (pcm_bits)
+	{
+	  err = sf_writef_int (f->sf, (const int *) data, frames) != frames;
+	}
+      else
+	{
+	  err = sf_writef_float (f->sf, (const float *) data, frames) !=
+	    frames;
+	}
+    }
+  f->frames += frames;
+
+  if (!err)
+    {
+      f->errors = 0;
+      return 0;
+    }
+
+  atomic_fetch_add_explicit (&buffer.write_errors, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&buffer.write_error_frames, frames,
+			     memory_order_relaxed);
+
+  f->errors++;
+  if (f->errors == 1)
+    {
+      error_print ("Error while writing to '%s': %s", f->name,
+		   f->sf ? sf_strerror (f->sf) : "I/O error");
+    }
+  else if (f->errors == MAX_WRITE_ERRORS)
+    {
+      error_print ("Too many errors while writing to '%s'. Stopping...",
+		   f->name);
+      ow_engine_stop (engine);
+    }
+
+  return -1;
+}
+
+static void *
+rotate_files (void *data)
+{
+  int busy;
+  struct record_file *f;
+  struct record_stream *s;
+
+  pthread_mutex_lock (&rotator.mutex);
+  while (1)
+    {
+      busy = 0;
+      for (int i = 0; i < streams_len; i++)
+	{
+	  s = &streams[i];
+
+	  if (s->prev)
+	    {
+	      f = s->prev;
+	      s->prev = NULL;
+	      pthread_mutex_unlock (&rotator.mutex);
+	      record_file_close (f, 0);
+	      pthread_mutex_lock (&rotator.mutex);
+	      pthread_cond_broadcast (&rotator.ready);
+	      busy = 1;
+	    }
+
+	  if (s->request && !s->next)
+	    {
+	      pthread_mutex_unlock (&rotator.mutex);
+	      f = record_file_open (s);
+	      pthread_mutex_lock (&rotator.mutex);
+	      s->next = f;
+	      s->request = 0;
+	      pthread_cond_broadcast (&rotator.ready);
+	      busy = 1;
+	    }
+	}
+
+      if (busy)
+	{
+	  continue;
+	}
+
+      if (!rotator.running)
+	{
+	  break;
+	}
+
+      pthread_cond_wait (&rotator.cond, &rotator.mutex);
+    }
+  pthread_mutex_unlock (&rotator.mutex);
+
+  for (int i = 0; i < streams_len; i++)
+    {
+      if (streams[i].next)
+	{
+	  record_file_close (streams[i].next, 1);
+	  streams[i].next = NULL;
+	}
+    }
+
+  return NULL;
+}
+
+//The next file is normally ready but, if it is not, the writer waits for it
+//as a file must never grow past the rotation size. Meanwhile, the audio is
+//kept in the ring.
+static int
+record_stream_rotate (struct record_stream *s)
+{
+  int err = 0;
+
+  pthread_mutex_lock (&rotator.mutex);
+  //The previous attempt failed.
+  if (!s->next && !s->request)
+    {
+      s->request = 1;
+    }
+  pthread_cond_signal (&rotator.cond);
+
+  if ((!s->next && s->request) || s->prev)
+    {
+      debug_print (1, "Waiting for the next file...");
+    }
+  while ((!s->next && s->request) || s->prev)
+    {
+      pthread_cond_wait (&rotator.ready, &rotator.mutex);
+    }
+
+  if (s->next)
+    {
+      s->prev = s->file;
+      s->file = s->next;
+      s->next = NULL;
+      s->request = 1;
+      pthread_cond_signal (&rotator.cond);
+    }
+  else
+    {
+      err = -1;
+    }
+  pthread_mutex_unlock (&rotator.mutex);
+
+  return err;
+}
+
+//Files are rotated at an exact frame count so that no frame is lost or
+//duplicated at the boundary. This returns the frames actually written.
+static size_t
+record_stream_write (struct record_stream *s, const char *data,
+		     size_t frames)
+{
+  size_t n;
+  size_t written = 0;
+  size_t frame_size = s->channels * OW_BYTES_PER_SAMPLE;
+
+  while (frames)
+    {
+      //Without a next file, the frames are lost.
+      if (rotate_frames && s->file->frames >= rotate_frames &&
+	  record_stream_rotate (s))
+	{
+	  atomic_fetch_add_explicit (&buffer.write_errors, 1,
+				     memory_order_relaxed);
+	  atomic_fetch_add_explicit (&buffer.write_error_frames, frames,
+				     memory_order_relaxed);
+	  ow_engine_stop (engine);
+	  break;
+	}
+
+      n = frames;
+      if (rotate_frames && s->file->frames + n > rotate_frames)
+	{
+	  n = rotate_frames - s->file->frames;
+	}
+
+      if (!record_file_write (s->file, data, n))
+	{
+	  written += n;
+	}
+      data += n * frame_size;
+      frames -= n;
+    }
+
+  return written;
+}
+
+static void
+wakeup (int fd)
+{
+  uint64_t v = 1;
+  if (write (fd, &v, sizeof (v)) < 0)
+    {
+      error_print ("Could not wake up the writer");
+    }
+}
+
+static void
+wait_wakeup (int fd)
+{
+  uint64_t v;
+  if (read (fd, &v, sizeof (v)) < 0)
+    {
+      error_print ("Could not wait for the buffer");
+    }
+}
+
+//If the ring of a track is full, its frames are written as silence as soon
+//as there is space again. This keeps all the files aligned without the
+//slower files delaying the others.
+static void
+split_write (const char *data, size_t frames)
+{
+  size_t space, n;
+  float *dst;
+  const float *src;
+  struct record_track *t;
+
+  for (int i = 0; i < streams_len; i++)
+    {
+      t = &split.tracks[i];
+
+      src = (const float *) data + i;
+      dst = split.samples;
+      for (int j = 0; j < frames; j++, src += streams_len)
+	{
+	  *dst = *src;
+	  dst++;
+	}
+
+      space = ow_ringbuffer_write_space (t->rb) / OW_BYTES_PER_SAMPLE;
+      while (t->gap && space)
+	{
+	  n = t->gap > space ? space : t->gap;
+	  n = n > WRITER_CHUNK_FRAMES ? WRITER_CHUNK_FRAMES : n;
+	  ow_ringbuffer_write (t->rb, (char *) split.zeros,
+			       n * OW_BYTES_PER_SAMPLE);
+	  t->gap -= n;
+	  space -= n;
+	}
+
+      if (t->gap || space < frames)
+	{
+	  t->gap += frames;
+	  atomic_fetch_add_explicit (&t->lost_frames, frames,
+				     memory_order_relaxed);
+	}
+      else
+	{
+	  ow_ringbuffer_write (t->rb, (char *) split.samples,
+			       frames * OW_BYTES_PER_SAMPLE);
+	}
+
+      //How far behind the writer of this track is.
+      n = ow_ringbuffer_read_space (t->rb);
+      if (n > atomic_load_explicit (&t->max_fill, memory_order_relaxed))
+	{
+	  atomic_store_explicit (&t->max_fill, n, memory_order_relaxed);
+	}
+    }
+
+  for (int i = 0; i < split.writers_started; i++)
+    {
+      wakeup (split.writers[i].wakeup);
+    }
+}
+
+static void *
+write_tracks (void *data)
+{
+  int running;
+  int written;
+  size_t size;
+  struct record_track *t;
+  struct record_writer *w = data;
+
+  while (1)
+    {
+      running = atomic_load_explicit (&split.running, memory_order_acquire);
+      written = 0;
+
+      for (int i = w->index; i < streams_len; i += split.writers_len)
+	{
+	  t = &split.tracks[i];
+	  size = ow_ringbuffer_read_space (t->rb);
+	  if (!size || (size < split.chunk_size && running))
+	    {
+	      continue;
+	    }
+
+	  size = size > split.chunk_size ? split.chunk_size : size;
+	  ow_ringbuffer_read (t->rb, w->chunk, size);
+	  record_stream_write (&streams[i], w->chunk,
+			       size / OW_BYTES_PER_SAMPLE);
+	  written = 1;
+	}
+
+      if (written)
+	{
+	  continue;
+	}
+
+      if (!running)
+	{
+	  break;
+	}
+
+      wait_wakeup (w->wakeup);
+    }
+
+  return NULL;
+}
+
+static int
+split_start ()
+{
+  struct record_writer *w;
+  size_t size = track_buf_size_kb * 1024;
+
+  atomic_init (&split.running, 1);
+
+  split.samples = malloc (WRITER_CHUNK_FRAMES * OW_BYTES_PER_SAMPLE);
+  split.zeros = calloc (WRITER_CHUNK_FRAMES, OW_BYTES_PER_SAMPLE);
+
+  for (int i = 0; i < streams_len; i++)
+    {
+      split.tracks[i].rb = ow_ringbuffer_new (size);
+      if (!split.tracks[i].rb)
+	{
+	  error_print ("Could not allocate the track buffers");
+	  return -1;
+	}
+      split.tracks[i].gap = 0;
+      atomic_init (&split.tracks[i].lost_frames, 0);
+      atomic_init (&split.tracks[i].max_fill, 0);
+    }
+
+  split.chunk_size = WRITER_CHUNK_FRAMES * OW_BYTES_PER_SAMPLE;
+  if (split.chunk_size > split.tracks[0].rb->size / 4)
+    {
+      split.chunk_size = split.tracks[0].rb->size / 4;
+    }
+
+  //Encoding is CPU bound so there are as many writers as CPUs by default.
+  if (!writers)
+    {
+      writers = format->compressed ? sysconf (_SC_NPROCESSORS_ONLN) :
+	DEFAULT_WRITERS;
+      writers = writers > MAX_WRITERS ? MAX_WRITERS : writers;
+    }
+
+  //The tracks are assigned to the writers by their index.
+  split.writers_len = writers < streams_len ? writers : streams_len;
+  split.writers_started = 0;
+
+  for (int i = 0; i < split.writers_len; i++)
+    {
+      w = &split.writers[i];
+      w->index = i;
+      w->chunk = malloc (split.chunk_size);
+      w->wakeup = eventfd (0, EFD_CLOEXEC);
+      if (w->wakeup < 0 ||
+	  pthread_create (&w->pthread, NULL, write_tracks, w))
+	{
+	  error_print ("Could not start writer thread");
+	  if (w->wakeup >= 0)
+	    {
+	      close (w->wakeup);
+	    }
+	  free (w->chunk);
+	  return -1;
+	}
+
+      char name[OW_LABEL_MAX_LEN];
+      snprintf (name, OW_LABEL_MAX_LEN, "writer-%d", i);
+      pthread_setname_np (w->pthread, name);
+
+      split.writers_started++;
+    }
+
+  debug_print (1, "Writing %d tracks with %d threads...", streams_len,
+	       split.writers_len);
+
+  return 0;
+}
+
+//The writers empty the track buffers before exiting.
+static void
+split_stop ()
+{
+  struct record_writer *w;
+
+  float *samples = split.samples;
+
+  if (!samples)
+    {
+      return;
+    }
+
+  //The status is not printed anymore for the tracks.
+  split.samples = NULL;
+
+  atomic_store_explicit (&split.running, 0, memory_order_release);
+
+  for (int i = 0; i < split.writers_started; i++)
+    {
+      w = &split.writers[i];
+      wakeup (w->wakeup);
+      pthread_join (w->pthread, NULL);
+      close (w->wakeup);
+      free (w->chunk);
+    }
+  split.writers_started = 0;
+
+  for (int i = 0; i < streams_len; i++)
+    {
+      ow_ringbuffer_free (split.tracks[i].rb);
+    }
+
+  free (samples);
+  free (split.zeros);
+}
+
+static int
+open_streams ()
 {
-  buffer_status_t status;
+  char curr_time_string[MAX_TIME_LEN];
+  time_t curr_time;
+  struct tm tm;
+
+  curr_time = time (NULL);
+  localtime_r (&curr_time, &tm);
+  strftime (curr_time_string, MAX_TIME_LEN, "%FT%T", &tm);
+
+  snprintf (file_prefix, MAX_FILENAME_LEN, "%s_%s", desc->name,
+	    curr_time_string);
+
+  for (int i = 0; i < streams_len; i++)
+    {
+      streams[i].file = record_file_open (&streams[i]);
+      if (!streams[i].file)
+	{
+	  return -1;
+	}
+    }
 
-  pthread_spin_lock (&buffer.lock);
-  status = buffer.status;
-  pthread_spin_unlock (&buffer.lock);
+  if (rotate_frames)
+    {
+      debug_print (1, "Rotating files every %" PRIu64 " frames...",
+		   rotate_frames);
+      for (int i = 0; i < streams_len; i++)
+	{
+	  streams[i].request = 1;
+	}
+      rotator.running = 1;
+      pthread_mutex_init (&rotator.mutex, NULL);
+      pthread_cond_init (&rotator.cond, NULL);
+      pthread_cond_init (&rotator.ready, NULL);
+      if (pthread_create (&rotator.pthread, NULL, rotate_files, NULL))
+	{
+	  error_print ("Could not start rotator thread");
+	  rotator.running = 0;
+	  return -1;
+	}
+      pthread_setname_np (rotator.pthread, "rotator");
+    }
 
-  return status;
+  return 0;
 }
 
 static void *
 dump_buffer (void *data)
 {
-  buffer_status_t status = get_buffer_status ();
-  while (status >= EMPTY)
+  int running;
+  size_t size;
+  size_t frames;
+
+  while (1)
     {
-      if (status == READY)
+      running = atomic_load_explicit (&buffer.running, memory_order_acquire);
+      size = ow_ringbuffer_read_space (buffer.rb);
+
+      if (retro.enabled &&
+	  !atomic_load_explicit (&retro.triggered, memory_order_acquire))
+	{
+	  if (size > retro.preroll_size)
+	    {
+	      ow_ringbuffer_read (buffer.rb, NULL, size - retro.preroll_size);
+	    }
+	  if (!running)
+	    {
+	      break;
+	    }
+	  wait_wakeup (buffer.wakeup);
+	  continue;
+	}
+
+      if (!streams[0].file)
 	{
-	  pthread_spin_lock (&buffer.lock);
-	  debug_print (2, "Writing %ld frames to disk...",
-		       buffer.disk_frames);
-	  sf_write_float (sf, (float *) buffer.disk, buffer.disk_samples);
-	  debug_print (2, "Done");
+	  fprintf (stderr, "Recording triggered\n");
+	  if (open_streams ())
+	    {
+	      ow_engine_stop (engine);
+	      break;
+	    }
+	}
 
-	  buffer.status = EMPTY;
-	  pthread_spin_unlock (&buffer.lock);
+      if (size < buffer.chunk_size && running)
+	{
+	  wait_wakeup (buffer.wakeup);
+	  continue;
 	}
 
-      usleep (100);
+      if (!size)
+	{
+	  break;
+	}
 
-      status = get_buffer_status ();
+      size = size > buffer.chunk_size ? buffer.chunk_size : size;
+      ow_ringbuffer_read (buffer.rb, buffer.chunk, size);
+
+      //No lock is held while writing.
+      frames = size / buffer.frame_size;
+      debug_print (2, "Writing %zu frames to disk...", frames);
+      if (split_tracks)
+	{
+	  split_write (buffer.chunk, frames);
+	}
+      else
+	{
+	  frames = record_stream_write (&streams[0], buffer.chunk, frames);
+	}
+      atomic_fetch_add_explicit (&buffer.frames_written, frames,
+				 memory_order_relaxed);
     }
+
   return NULL;
 }
 
+//This is called from the signal handler and from the USB thread so it only
+//uses atomics and an eventfd.
+static void
+retro_trigger ()
+{
+  if (!atomic_exchange (&retro.triggered, 1))
+    {
+      atomic_store_explicit (&buffer.wakeup_fill, buffer.chunk_size,
+			     memory_order_relaxed);
+      wakeup (buffer.wakeup);
+    }
+}
+
 static size_t
 buffer_write (void *data, const char *buf, size_t size)
 {
   static int print_control = 0;
-  static size_t pos = 0;
-  size_t new_pos;
-  void *dst;
+  size_t fill, len;
+  float peak = 0.0f;		//Of this transfer for the trigger
+  char *dst = buffer.frames;
   size_t frames = size / (desc->outputs * OW_BYTES_PER_SAMPLE);
 
   debug_print (2, "Writing %ld bytes (%ld frames) to buffer...", size,
 	       frames);
-  new_pos = pos + frames * buffer.outputs * OW_BYTES_PER_SAMPLE;
-  if (new_pos >= buffer.len)
-    {
-      pthread_spin_lock (&buffer.lock);
-      buffer.status = READY;
-      buffer.disk_samples = pos / OW_BYTES_PER_SAMPLE;
-      buffer.disk_frames = buffer.disk_samples / buffer.outputs;
-      memcpy (buffer.disk, buffer.mem,
-	      buffer.disk_frames * buffer.outputs * OW_BYTES_PER_SAMPLE);
-      pthread_spin_unlock (&buffer.lock);
-      sfinfo.frames += buffer.disk_frames;
-      pos = 0;
-    }
 
-  dst = &buffer.mem[pos];
   for (int i = 0; i < frames; i++)
     {
       for (int j = 0; j < desc->outputs; j++)
@@ -162,8 +980,12 @@ buffer_write (void *data, const char *buf, size_t size)
 	    {
 	      memcpy (dst, buf, OW_BYTES_PER_SAMPLE);
 	      dst += OW_BYTES_PER_SAMPLE;
-	      pos += OW_BYTES_PER_SAMPLE;
-	      float x = *((float *) buf);
+	      float x = pcm_bits ? *((int32_t *) buf) / (float) INT32_MAX :
+		*((float *) buf);
+	      if (fabsf (x) > peak)
+		{
+		  peak = fabsf (x);
+		}
 	      if (x >= 0.0)
 		{
 		  if (x > max[j])
@@ -183,6 +1005,42 @@ buffer_write (void *data, const char *buf, size_t size)
 	}
     }
 
+  len = dst - buffer.frames;
+  fill = ow_ringbuffer_read_space (buffer.rb);
+  if (len > buffer.rb->size - fill)
+    {
+      atomic_fetch_add_explicit (&buffer.overflows, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit (&buffer.overflow_frames, frames,
+				 memory_order_relaxed);
+    }
+  else
+    {
+      ow_ringbuffer_write (buffer.rb, buffer.frames, len);
+      //The writer only needs to be woken up when a chunk is complete, or when
+      //the pre-roll is complete. As the fill only grows while the writer
+      //sleeps, this always happens.
+      size_t wakeup_fill = atomic_load_explicit (&buffer.wakeup_fill,
+						 memory_order_relaxed);
+      if (fill < wakeup_fill && fill + len >= wakeup_fill)
+	{
+	  wakeup (buffer.wakeup);
+	}
+      if (fill + len > atomic_load_explicit (&buffer.max_fill,
+					     memory_order_relaxed))
+	{
+	  atomic_store_explicit (&buffer.max_fill, fill + len,
+				 memory_order_relaxed);
+	}
+    }
+
+  //The maximum and minimum are kept since the start so only the peak of
+  //this transfer tells the current level.
+  if (retro.level && peak >= retro.level &&
+      !atomic_load_explicit (&retro.triggered, memory_order_relaxed))
+    {
+      retro_trigger ();
+    }
+
   if (debug_level)
     {
       print_control += frames;
@@ -199,6 +1057,15 @@ buffer_write (void *data, const char *buf, size_t size)
 static void
 signal_handler (int signo)
 {
+  if (signo == SIGUSR2)
+    {
+      if (retro.enabled)
+	{
+	  retro_trigger ();
+	}
+      return;
+    }
+
   print_status ();
   if (debug_level)
     {
@@ -216,7 +1083,6 @@ signal_handler (int signo)
       || signo == SIGTSTP)
     {
       ow_engine_stop (engine);
-      fprintf (stderr, "%s file created\n", filename);
     }
 }
 
@@ -225,9 +1091,6 @@ run_record (int device_num, const char *device_name, uint8_t bus,
 	    uint8_t address, unsigned int blocks_per_transfer,
 	    unsigned int xfr_timeout)
 {
-  char curr_time_string[MAX_TIME_LEN];
-  time_t curr_time;
-  struct tm tm;
   ow_err_t err;
   struct ow_device *device;
 
@@ -270,38 +1133,137 @@ run_record (int device_num, const char *device_name, uint8_t bus,
       goto cleanup_engine;
     }
 
-  sfinfo.frames = 0;
-  sfinfo.samplerate = OB_SAMPLE_RATE;
-  sfinfo.channels = buffer.outputs;
-  sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+  buffer.outputs_mask_len = track_mask ? strlen (track_mask) : 0;
 
-  curr_time = time (NULL);
-  localtime_r (&curr_time, &tm);
-  strftime (curr_time_string, MAX_TIME_LEN, "%FT%T", &tm);
+  //Samples are stored with the biggest depth of the recorded tracks.
+  if (pcm)
+    {
+      pcm_bits = 0;
+      for (int i = 0; i < desc->outputs; i++)
+	{
+	  if (!track_mask
+	      || (i < buffer.outputs_mask_len && (track_mask[i] != '0')))
+	    {
+	      int size = desc->output_tracks[i].size;
+	      int bits = desc->type == OW_DEVICE_TYPE_3 && size == 4 ?
+		24 : size * 8;
+	      pcm_bits = bits > pcm_bits ? bits : pcm_bits;
+	    }
+	}
+      if (pcm_bits > format->max_pcm_bits)
+	{
+	  error_print ("%s files can not store %d bits samples without loss",
+		       format->name, pcm_bits);
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_engine;
+	}
+      debug_print (1, "Recording %d bits integer samples...", pcm_bits);
+    }
 
-  snprintf (filename, MAX_FILENAME_LEN, "%s_%s.wav", device->desc.name,
-	    curr_time_string);
+  if (rotate_bytes)
+    {
+      int channels = split_tracks ? 1 : buffer.outputs;
+      uint64_t frames = rotate_bytes / (channels * get_file_sample_bytes ());
+      if (!rotate_frames || frames < rotate_frames)
+	{
+	  rotate_frames = frames ? frames : 1;
+	}
+    }
+
+  if (split_tracks)
+    {
+      streams_len = 0;
+      for (int i = 0; i < desc->outputs; i++)
+	{
+	  if (!track_mask
+	      || (i < buffer.outputs_mask_len && (track_mask[i] != '0')))
+	    {
+	      set_stream_name (&streams[streams_len],
+			       desc->output_tracks[i].name);
+	      streams[streams_len].channels = 1;
+	      streams_len++;
+	    }
+	}
+    }
+  else
+    {
+      streams_len = 1;
+      streams[0].channels = buffer.outputs;
+    }
 
-  debug_print (1, "Creating sample (%d channels)...", buffer.outputs);
-  sf = sf_open (filename, SFM_WRITE, &sfinfo);
+  if (format->max_channels && streams[0].channels > format->max_channels)
+    {
+      error_print ("%s files can not have more than %d channels. "
+		   "Use a track mask or split the tracks.", format->name,
+		   format->max_channels);
+      err = OW_GENERIC_ERROR;
+      goto cleanup_engine;
+    }
+
+  //With retroactive capture, the files are opened when triggered.
+  if (!retro.enabled && open_streams ())
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup_file;
+    }
 
   context.dll = NULL;
   context.write_space = buffer_dummy_rw_space;
   context.read_space = buffer_dummy_rw_space;
   context.write = buffer_write;
-  context.o2h_audio = sf;
+  context.o2h_audio = &buffer;
   context.options = OW_ENGINE_OPTION_O2H_AUDIO;
+  if (pcm_bits)
+    {
+      context.options |= OW_ENGINE_OPTION_O2H_INT;
+    }
 
-  err = ow_engine_start (engine, &context);
-  if (err)
+  //The memory budget is given per recorded track.
+  buffer.frame_size = buffer.outputs * OW_BYTES_PER_SAMPLE;
+  retro.preroll_size = retro.preroll_seconds * OB_SAMPLE_RATE *
+    buffer.frame_size;
+  buffer.rb = ow_ringbuffer_new (track_buf_size_kb * 1024 * buffer.outputs +
+				 retro.preroll_size);
+  if (!buffer.rb)
     {
-      goto cleanup;
+      error_print ("Could not allocate the buffer");
+      err = OW_GENERIC_ERROR;
+      goto cleanup_file;
+    }
+  buffer.chunk_size = WRITER_CHUNK_FRAMES * buffer.frame_size;
+  if (buffer.chunk_size > buffer.rb->size / 4)
+    {
+      buffer.chunk_size = buffer.rb->size / 4 / buffer.frame_size *
+	buffer.frame_size;
     }
+  buffer.chunk = malloc (buffer.chunk_size);
+  buffer.frames = malloc (blocks_per_transfer * OB_FRAMES_PER_BLOCK *
+			  buffer.frame_size);
+  buffer.wakeup = eventfd (0, EFD_CLOEXEC);
+  atomic_init (&buffer.running, 1);
+  atomic_init (&buffer.frames_written, 0);
+  atomic_init (&buffer.overflows, 0);
+  atomic_init (&buffer.overflow_frames, 0);
+  atomic_init (&buffer.write_errors, 0);
+  atomic_init (&buffer.write_error_frames, 0);
+  atomic_init (&buffer.max_fill, 0);
+  atomic_init (&buffer.wakeup_fill, buffer.chunk_size);
+  atomic_init (&retro.triggered, 0);
 
-  buffer.len = track_buf_size_kb * 1000 * buffer.outputs;
-  buffer.mem = malloc (buffer.len * OW_BYTES_PER_SAMPLE);
-  buffer.disk = malloc (buffer.len * OW_BYTES_PER_SAMPLE);
-  buffer.outputs_mask_len = track_mask ? strlen (track_mask) : 0;
+  if (retro.enabled)
+    {
+      //The ring is locked in memory but the pages are touched anyway so
+      //that the USB thread never causes a page fault.
+      memset (buffer.rb->data, 0, buffer.rb->size);
+      atomic_init (&buffer.wakeup_fill,
+		   retro.preroll_size + buffer.chunk_size);
+      fprintf (stderr, "Keeping the last %" PRIu64 " s in %zu MiB. "
+	       "Send SIGUSR2 to record...\n", retro.preroll_seconds,
+	       buffer.rb->size / (1024 * 1024));
+    }
+
+  debug_print (1, "Using a %zu bytes buffer and %zu bytes writes...",
+	       buffer.rb->size, buffer.chunk_size);
 
   for (int i = 0; i < device->desc.outputs; i++)
     {
@@ -309,29 +1271,72 @@ run_record (int device_num, const char *device_name, uint8_t bus,
       min[i] = 0.0f;
     }
 
-  buffer.status = READY;
-  pthread_spin_init (&buffer.lock, PTHREAD_PROCESS_SHARED);
+  if (buffer.wakeup < 0 || !buffer.chunk_size || !buffer.chunk ||
+      !buffer.frames)
+    {
+      error_print ("Could not initialize the buffer");
+      err = OW_GENERIC_ERROR;
+      goto cleanup;
+    }
+
+  if (split_tracks && split_start ())
+    {
+      err = OW_GENERIC_ERROR;
+      goto cleanup;
+    }
+
   if (pthread_create (&buffer.pthread, NULL, dump_buffer, NULL))
     {
       error_print ("Could not start recording thread");
+      err = OW_GENERIC_ERROR;
       goto cleanup;
     }
 
+  //The writer does disk I/O and encoding so it runs at normal priority. A
+  //slow disk can not delay the USB thread as the ring is lock-free.
   pthread_setname_np (buffer.pthread, "recorder");
-  ow_set_thread_rt_priority (buffer.pthread, OW_DEFAULT_RT_PRIORITY);
 
-  ow_engine_wait (engine);
+  err = ow_engine_start (engine, &context);
+  if (!err)
+    {
+      ow_engine_wait (engine);
+    }
 
-  pthread_spin_lock (&buffer.lock);
-  buffer.status = END;
-  pthread_spin_unlock (&buffer.lock);
+  //The writer empties the buffer before exiting.
+  atomic_store_explicit (&buffer.running, 0, memory_order_release);
+  wakeup (buffer.wakeup);
   pthread_join (buffer.pthread, NULL);
 
+  if (retro.enabled && !streams[0].file)
+    {
+      fprintf (stderr, "Recording not triggered. Nothing recorded\n");
+    }
+
 cleanup:
-  pthread_spin_destroy (&buffer.lock);
-  free (buffer.mem);
-  free (buffer.disk);
-  sf_close (sf);
+  split_stop ();
+  if (buffer.wakeup >= 0)
+    {
+      close (buffer.wakeup);
+    }
+  free (buffer.chunk);
+  free (buffer.frames);
+  ow_ringbuffer_free (buffer.rb);
+cleanup_file:
+  if (rotator.running)
+    {
+      pthread_mutex_lock (&rotator.mutex);
+      rotator.running = 0;
+      pthread_cond_signal (&rotator.cond);
+      pthread_mutex_unlock (&rotator.mutex);
+      pthread_join (rotator.pthread, NULL);
+    }
+  for (int i = 0; i < streams_len; i++)
+    {
+      if (streams[i].file)
+	{
+	  record_file_close (streams[i].file, 0);
+	}
+    }
 cleanup_engine:
   ow_engine_destroy (engine);
 end:
@@ -357,6 +1362,7 @@ main (int argc, char *argv[])
   int device_num = -1;
   unsigned int blocks_per_transfer = OW_DEFAULT_BLOCKS;
   unsigned int xfr_timeout = OW_DEFAULT_XFR_TIMEOUT;
+  uint64_t rotate_seconds = 0, rotate_megabytes = 0;
 
   action.sa_handler = signal_handler;
   sigemptyset (&action.sa_mask);
@@ -365,9 +1371,10 @@ main (int argc, char *argv[])
   sigaction (SIGINT, &action, NULL);
   sigaction (SIGTERM, &action, NULL);
   sigaction (SIGUSR1, &action, NULL);
+  sigaction (SIGUSR2, &action, NULL);
   sigaction (SIGTSTP, &action, NULL);
 
-  while ((opt = getopt_long (argc, argv, "n:d:a:m:s:b:t:lvh",
+  while ((opt = getopt_long (argc, argv, "n:d:a:m:s:if:r:R:Sw:pP:T:b:t:lvh",
 			     options, &long_index)) != -1)
     {
       switch (opt)
@@ -392,6 +1399,59 @@ main (int argc, char *argv[])
 	  track_buf_size_kb = atoi (optarg);
 	  sflg++;
 	  break;
+	case 'i':
+	  direct_io = 1;
+	  break;
+	case 'f':
+	  for (format = FORMATS; format->name; format++)
+	    {
+	      if (!strcmp (optarg, format->name))
+		{
+		  break;
+		}
+	    }
+	  if (!format->name)
+	    {
+	      fprintf (stderr, "Invalid format '%s'\n", optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+	case 'r':
+	  rotate_seconds = strtoull (optarg, &endstr, 10);
+	  break;
+	case 'R':
+	  rotate_megabytes = strtoull (optarg, &endstr, 10);
+	  break;
+	case 'S':
+	  split_tracks = 1;
+	  break;
+	case 'p':
+	  pcm = 1;
+	  break;
+	case 'P':
+	  retro.preroll_seconds = strtoull (optarg, &endstr, 10);
+	  if (retro.preroll_seconds > MAX_PREROLL_SECONDS)
+	    {
+	      fprintf (stderr, "Pre-roll must be up to %d s\n",
+		       MAX_PREROLL_SECONDS);
+	      exit (EXIT_FAILURE);
+	    }
+	  retro.enabled = 1;
+	  break;
+	case 'T':
+	  //In dBFS
+	  retro.level = powf (10.0f, strtof (optarg, &endstr) / 20.0f);
+	  retro.enabled = 1;
+	  break;
+	case 'w':
+	  writers = atoi (optarg);
+	  if (writers < 1 || writers > MAX_WRITERS)
+	    {
+	      fprintf (stderr, "Writer threads must be between 1 and %d\n",
+		       MAX_WRITERS);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
 	case 'b':
 	  blocks_per_transfer = get_ow_blocks_per_transfer_argument (optarg);
 	  bflg++;
@@ -454,6 +1514,16 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
     }
 
+  if (format != FORMATS && direct_io)
+    {
+      fprintf (stderr, "Only WAVE files can be written with direct I/O\n");
+      exit (EXIT_FAILURE);
+    }
+
+  //The size limit is converted to frames once the tracks are known.
+  rotate_frames = rotate_seconds * OB_SAMPLE_RATE;
+  rotate_bytes = rotate_megabytes * 1024 * 1024;
+
   if (nflg + dflg + aflg == 1)
     {
       return run_record (device_num, device_name, bus, address,
@@ -25,35 +25,72 @@
 #include <systemd/sd-daemon.h>
 #endif
 #include <time.h>
+#include <glib-unix.h>
 #include "../config.h"
 #include "jclient.h"
 #include "utils.h"
 #include "preferences.h"
 #include "message.h"
+#include "stats.h"
+#include "metrics.h"
 
 #define POOLED_JCLIENT_LEN 64
 
+#define STATE_CHECK_MS 250
+#define STATE_THROTTLE_US 1000000	//Only applies to latencies and ratios
+
 typedef enum
 {
   PJC_AVAILABLE = 0,
   PJC_RUNNING = 1,
   PJC_STOPPED = 2,
+  PJC_STARTING = 3,		//Reserved while the device is initialized
 } pooled_jclient_status_t;
 
 struct pooled_jclient
 {
   pooled_jclient_status_t status;
   pthread_t thread;
+  struct ow_device *device;
+  guint8 bus;
+  guint8 address;
+  //Profile the jclient was started with
+  struct ow_device_profile profile;
   struct jclient jclient;
+  //State kept when the device leaves, or is restarted, to reuse the slot
+  gboolean left;
+  guint16 left_pid;
+  guint8 left_bus;
+  gboolean dll_cached;
+  gdouble dll_ratio;
+  gdouble dll_ob_rate;
+  GPtrArray *connections;
+  //Last state sent in a StateChanged signal
+  gboolean published;
+  gchar published_name[OW_LABEL_MAX_LEN];
+  struct ow_resampler_state published_state;
+};
+
+struct published_server_state
+{
+  guint32 samplerate;
+  guint32 buffer_size;
+  gdouble target_delay_ms;
 };
 
 static struct ow_preferences preferences;
 static struct pooled_jclient jcpool[POOLED_JCLIENT_LEN];
 static pthread_spinlock_t lock;	//Needed for signal handling
+static struct jaggregate aggregate;
+static gint aggregate_active;
 static gint hotplug_running;
 static pthread_t hotplug_thread;
 static gint force_stop;
 static GApplication *app;
+static struct published_server_state published_server;
+static struct ow_stats_page *stats_page;
+static struct ow_enumerator *enumerator;
+static gint64 published_usecs;
 
 static GDBusNodeInfo *introspection_data = NULL;
 
@@ -66,18 +103,35 @@ static const gchar introspection_xml[] =
   "    </method>"
   "    <method name='Stop'>"
   "    </method>"
+  "    <method name='Reload'>"
+  "    </method>"
   "    <method name='GetState'>"
   "      <arg type='s' name='status' direction='out'/>"
   "    </method>"
+  "    <method name='GetFullState'>"
+  "      <arg type='a" MESSAGE_DEVICE_TYPE "' name='devices' direction='out'/>"
+  "      <arg type='au' name='removed' direction='out'/>"
+  "      <arg type='u' name='samplerate' direction='out'/>"
+  "      <arg type='u' name='buffer_size' direction='out'/>"
+  "      <arg type='d' name='target_delay_ms' direction='out'/>"
+  "    </method>"
   "    <method name='SetDeviceName'>"
   "      <arg type='u' name='id' direction='in'/>"
   "      <arg type='s' name='name' direction='in'/>"
   "      <arg type='i' name='error' direction='out'/>"
-  "    </method>" "  </interface>" "</node>";
+  "    </method>"
+  "    <signal name='StateChanged'>"
+  "      <arg type='a" MESSAGE_DEVICE_TYPE "' name='devices'/>"
+  "      <arg type='au' name='removed'/>"
+  "      <arg type='u' name='samplerate'/>"
+  "      <arg type='u' name='buffer_size'/>"
+  "      <arg type='d' name='target_delay_ms'/>"
+  "    </signal>" "  </interface>" "</node>";
 
 static void startup ();
 static void handle_stop ();
 static void handle_start ();
+static void handle_reload ();
 
 static gboolean
 overwitch_increment_debug_level (const gchar *option_name,
@@ -139,33 +193,164 @@ signal_handler (int signum)
       g_application_release (app);
       handling = 0;
     }
-  else if (signum == SIGHUP)
+  else
     {
-      struct timespec ts;
-      clock_gettime (CLOCK_MONOTONIC, &ts);
+      error_print ("Signal not handled");
+    }
+}
+
+//Reloading allocates and takes locks so it runs in the main loop and not in
+//the signal handler.
+static gboolean
+sighup_handler (gpointer user_data)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
 #ifdef HAVE_SYSTEMD
-      sd_notifyf (0, "RELOADING=1\nMONOTONIC_USEC=%" PRIdMAX "%06d",
-		  (intmax_t) ts.tv_sec, (int) (ts.tv_nsec / 1000));
+  sd_notifyf (0, "RELOADING=1\nMONOTONIC_USEC=%" PRIdMAX "%06d",
+	      (intmax_t) ts.tv_sec, (int) (ts.tv_nsec / 1000));
 #endif
-      handle_start ();
+  handle_reload ();
 #ifdef HAVE_SYSTEMD
-      sd_notify (0, "READY=1");
+  sd_notify (0, "READY=1");
 #endif
+  return G_SOURCE_CONTINUE;
+}
+
+static gint
+pooled_jclient_init (struct pooled_jclient *pjc)
+{
+  struct ow_device_profile profile;
+  struct ow_device *copy;
+  struct ow_engine *engine;
+  const gchar *name;
+
+  copy = malloc (sizeof (struct ow_device));
+  memcpy (copy, pjc->device, sizeof (struct ow_device));
+
+  if (jclient_init (&pjc->jclient, pjc->device, pjc->profile.blocks,
+		    pjc->profile.timeout, pjc->profile.quality,
+		    pjc->profile.priority))
+    {
+      free (pjc->device);
+      free (copy);
+      return -1;
+    }
+
+  //Profiles matching the Overbridge name can only be resolved now.
+  engine = ow_resampler_get_engine (pjc->jclient.resampler);
+  name = ow_engine_get_overbridge_name (engine);
+
+  pthread_spin_lock (&lock);
+  ow_preferences_get_device_profile (&preferences, copy->pid, name,
+				     &profile);
+  pthread_spin_unlock (&lock);
+
+  if (profile.blocks != pjc->profile.blocks ||
+      profile.timeout != pjc->profile.timeout)
+    {
+      debug_print (1, "Opening %s again with its profile...", name);
+      jclient_destroy (&pjc->jclient);
+      pjc->device = copy;
+      if (jclient_init (&pjc->jclient, pjc->device, profile.blocks,
+			profile.timeout, profile.quality, profile.priority))
+	{
+	  free (pjc->device);
+	  return -1;
+	}
+      engine = ow_resampler_get_engine (pjc->jclient.resampler);
     }
   else
     {
-      error_print ("Signal not handled");
+      free (copy);
+      if (profile.quality != pjc->profile.quality)
+	{
+	  ow_resampler_set_quality (pjc->jclient.resampler, profile.quality);
+	}
+      pjc->jclient.priority = profile.priority;
     }
+
+  ow_resampler_set_low_latency (pjc->jclient.resampler, profile.low_latency);
+  ow_engine_set_cpus (engine, profile.cpus);
+  jclient_set_track_masks (&pjc->jclient, profile.output_mask,
+			   profile.input_mask);
+
+  pthread_spin_lock (&lock);
+  pjc->profile = profile;
+  pthread_spin_unlock (&lock);
+
+  return 0;
 }
 
+static void
+pooled_jclient_clear_left (struct pooled_jclient *pjc)
+{
+  pjc->left = FALSE;
+  pjc->dll_cached = FALSE;
+  if (pjc->connections)
+    {
+      g_ptr_array_unref (pjc->connections);
+      pjc->connections = NULL;
+    }
+}
+
+//The device initialization happens here, and not in start_single, so that
+//the USB enumeration, the control transfers and the mandatory delays of
+//different devices overlap.
 static void *
 jclient_runner (void *data)
 {
+  gint64 start_usecs;
   struct pooled_jclient *pjc = data;
+  guint id = pjc - jcpool;
+
+  start_usecs = g_get_monotonic_time ();
+
+  if (pooled_jclient_init (pjc))
+    {
+      goto error;
+    }
 
-  jclient_start (&pjc->jclient);
+  //A device attached again gets its connections and DLL state back.
+  if (pjc->left)
+    {
+      debug_print (1, "Reattaching pooled jclient %d...", id);
+      pjc->jclient.connections = pjc->connections;
+      pjc->connections = NULL;
+      if (pjc->dll_cached)
+	{
+	  ow_resampler_set_dll_state (pjc->jclient.resampler,
+				      pjc->dll_ratio, pjc->dll_ob_rate);
+	}
+      pooled_jclient_clear_left (pjc);
+    }
+
+  ow_resampler_set_reconnect (pjc->jclient.resampler, preferences.reconnect);
+
+  if (aggregate_active)
+    {
+      jclient_set_aggregate (&pjc->jclient, &aggregate);
+    }
+
+  if (stats_page)
+    {
+      ow_resampler_set_stats (pjc->jclient.resampler,
+			      &stats_page->devices[id]);
+    }
+
+  if (jclient_start (&pjc->jclient))
+    {
+      error_print ("Could not start jclient");
+      jclient_destroy (&pjc->jclient);
+      goto error;
+    }
+
+  debug_print (1, "Pooled jclient %d (%s) started in %.1f ms", id,
+	       pjc->device->desc.name,
+	       (g_get_monotonic_time () - start_usecs) / 1000.0);
 
   pthread_spin_lock (&lock);
+  pjc->status = PJC_RUNNING;
   if (force_stop)
     {
       jclient_stop (&pjc->jclient);
@@ -173,9 +358,32 @@ jclient_runner (void *data)
   pthread_spin_unlock (&lock);
 
   jclient_wait (&pjc->jclient);
-  jclient_destroy (&pjc->jclient);
 
+  //From now on, the jclient is not used by anyone else. A slot reserved
+  //again by handle_set_device_name is joined there.
+  pthread_spin_lock (&lock);
+  if (pjc->status == PJC_RUNNING)
+    {
+      pjc->status = PJC_STOPPED;
+    }
+  if (pjc->left)
+    {
+      pjc->connections = pjc->jclient.connections;
+      pjc->jclient.connections = NULL;
+    }
   pthread_spin_unlock (&lock);
+
+  jclient_destroy (&pjc->jclient);
+
+  if (stats_page)
+    {
+      ow_stats_device_clear (&stats_page->devices[id]);
+    }
+
+  return NULL;
+
+error:
+  pthread_spin_lock (&lock);
   pjc->status = PJC_STOPPED;
   pthread_spin_unlock (&lock);
 
@@ -185,21 +393,18 @@ jclient_runner (void *data)
 static void
 start_single (struct pooled_jclient *pjc, guint id, struct ow_device *device)
 {
-  if (jclient_init (&pjc->jclient, device, preferences.blocks,
-		    preferences.timeout, preferences.quality,
-		    JCLIENT_DEFAULT_PRIORITY))
-    {
-      free (device);
-      return;
-    }
-
   debug_print (1, "Starting pooled jclient %d...", id);
-  pjc->status = PJC_RUNNING;
+  pjc->device = device;
+  pjc->bus = device->bus;
+  pjc->address = device->address;
+  ow_preferences_get_device_profile (&preferences, device->desc.pid,
+				     device->desc.name, &pjc->profile);
+  pjc->status = PJC_STARTING;
   if (pthread_create (&pjc->thread, NULL, jclient_runner, pjc))
     {
       error_print ("Could not start thread");
-      jclient_destroy (&pjc->jclient);
-      pjc->status = PJC_STOPPED;
+      free (device);
+      pjc->status = PJC_AVAILABLE;
       return;
     }
 
@@ -216,7 +421,9 @@ start_all ()
   struct pooled_jclient *pjc;
   size_t jclient_total_count;
 
-  if (ow_get_device_list (&devices, &jclient_total_count))
+  if (!enumerator ||
+      ow_enumerator_get_device_list (enumerator, &devices,
+				     &jclient_total_count))
     {
       return EXIT_FAILURE;
     }
@@ -271,6 +478,8 @@ wait_all ()
 	  pjc->status = PJC_AVAILABLE;
 	}
 
+      pooled_jclient_clear_left (pjc);
+
       pjc++;
     }
 }
@@ -304,31 +513,40 @@ hotplug_callback (struct ow_device *device)
       pjc++;
     }
 
-  pjc = jcpool;
-
+  //The slot of a device that left is reused when the same device is back.
+  //The address changes on every plug so the PID and the bus are used.
+  pjc = NULL;
   for (i = 0; i < POOLED_JCLIENT_LEN; i++)
     {
-      pooled_jclient_status_t status;
+      struct pooled_jclient *candidate = &jcpool[i];
 
       pthread_spin_lock (&lock);
-      status = pjc->status;
-      pthread_spin_unlock (&lock);
-
-      if (status == PJC_AVAILABLE)
+      if (candidate->status == PJC_AVAILABLE)
 	{
-	  debug_print (1, "Pooled jclient %d available...", i);
-	  break;
+	  if (candidate->left && candidate->left_pid == device->pid &&
+	      candidate->left_bus == device->bus)
+	    {
+	      pjc = candidate;
+	      pthread_spin_unlock (&lock);
+	      break;
+	    }
+	  if (!pjc || (pjc->left && !candidate->left))
+	    {
+	      pjc = candidate;
+	    }
 	}
-
-      pjc++;
+      pthread_spin_unlock (&lock);
     }
 
-  if (i == POOLED_JCLIENT_LEN)
+  if (!pjc)
     {
       error_print ("No pooled jclients available");
       return;
     }
 
+  i = pjc - jcpool;
+  debug_print (1, "Pooled jclient %d available...", i);
+
   pthread_spin_lock (&lock);
   if (force_stop)
     {
@@ -336,15 +554,52 @@ hotplug_callback (struct ow_device *device)
       return;
     }
 
+  if (pjc->left && (pjc->left_pid != device->pid ||
+		    pjc->left_bus != device->bus))
+    {
+      pooled_jclient_clear_left (pjc);
+    }
+
   start_single (pjc, i, device);
   pthread_spin_unlock (&lock);
 }
 
+//Called as soon as the device is unplugged so that the jclient does not wait
+//for the USB transfers to time out.
+static void
+hotplug_left_callback (const struct ow_device *device)
+{
+  struct pooled_jclient *pjc = jcpool;
+
+  pthread_spin_lock (&lock);
+
+  for (guint32 i = 0; i < POOLED_JCLIENT_LEN; i++, pjc++)
+    {
+      if (pjc->status == PJC_RUNNING && pjc->bus == device->bus &&
+	  pjc->address == device->address)
+	{
+	  debug_print (1, "Device %s left. Stopping pooled jclient %d...",
+		       device->desc.name, i);
+	  pjc->left = TRUE;
+	  pjc->left_pid = device->pid;
+	  pjc->left_bus = device->bus;
+	  pjc->dll_cached =
+	    !ow_resampler_get_dll_state (pjc->jclient.resampler,
+					 &pjc->dll_ratio, &pjc->dll_ob_rate);
+	  jclient_stop (&pjc->jclient);
+	  break;
+	}
+    }
+
+  pthread_spin_unlock (&lock);
+}
+
 static void *
 hotplug_runner (void *data)
 {
   hotplug_running = 1;
-  ow_hotplug_loop (&hotplug_running, &lock, hotplug_callback);
+  ow_enumerator_hotplug_loop (enumerator, &hotplug_running, &lock,
+			      hotplug_callback, hotplug_left_callback);
   return NULL;
 }
 
@@ -357,6 +612,11 @@ handle_stop ()
     {
       pthread_join (hotplug_thread, NULL);
     }
+  if (aggregate_active)
+    {
+      jaggregate_destroy (&aggregate);
+      aggregate_active = 0;
+    }
 }
 
 static void
@@ -367,6 +627,130 @@ handle_start ()
   startup ();
 }
 
+//The device is restarted in the same slot keeping its connections and its
+//DLL state. It must be called with the lock held and it is released while
+//joining the thread.
+static void
+restart_single (struct pooled_jclient *pjc, guint id)
+{
+  struct ow_device *copy = malloc (sizeof (struct ow_device));
+  memcpy (copy, pjc->jclient.device, sizeof (struct ow_device));
+
+  debug_print (1, "Restarting pooled jclient %d...", id);
+
+  pooled_jclient_clear_left (pjc);
+  pjc->left = TRUE;
+  pjc->left_pid = copy->pid;
+  pjc->left_bus = copy->bus;
+  pjc->dll_cached = !ow_resampler_get_dll_state (pjc->jclient.resampler,
+						 &pjc->dll_ratio,
+						 &pjc->dll_ob_rate);
+
+  jclient_stop (&pjc->jclient);
+  //The slot is kept reserved while the lock is released for the join.
+  pjc->status = PJC_STARTING;
+  pthread_spin_unlock (&lock);
+
+  pthread_join (pjc->thread, NULL);
+
+  pthread_spin_lock (&lock);
+  start_single (pjc, id, copy);
+}
+
+static gboolean
+str_changed (const gchar *a, const gchar *b)
+{
+  return g_strcmp0 (a, b) != 0;
+}
+
+//Only what changed is applied. The resampler quality is changed in place and
+//only the devices whose USB parameters changed are restarted.
+static void
+handle_reload ()
+{
+  struct ow_preferences prev;
+  struct ow_preferences next;
+  struct ow_device_profile profile;
+  struct ow_engine *engine;
+  struct pooled_jclient *pjc = jcpool;
+
+  debug_print (1, "Reloading preferences...");
+
+  ow_load_preferences (&next);
+
+  //The runners resolve the profiles under the lock.
+  pthread_spin_lock (&lock);
+  prev = preferences;
+  preferences = next;
+  pthread_spin_unlock (&lock);
+
+  //The JACK clients need to be created again.
+  if (preferences.aggregate != prev.aggregate ||
+      str_changed (preferences.pipewire_props, prev.pipewire_props))
+    {
+      debug_print (1, "JACK client preferences changed. Restarting...");
+      ow_free_preferences (&prev);
+      handle_start ();
+      return;
+    }
+
+  if (str_changed (preferences.metrics_address, prev.metrics_address))
+    {
+      metrics_stop ();
+      if (preferences.metrics_address)
+	{
+	  metrics_start (preferences.metrics_address, stats_page);
+	}
+    }
+
+  pthread_spin_lock (&lock);
+
+  for (guint32 i = 0; i < POOLED_JCLIENT_LEN; i++, pjc++)
+    {
+      if (pjc->status != PJC_RUNNING || force_stop)
+	{
+	  continue;
+	}
+
+      engine = ow_resampler_get_engine (pjc->jclient.resampler);
+      ow_preferences_get_device_profile (&preferences,
+					 pjc->jclient.device->pid,
+					 ow_engine_get_overbridge_name
+					 (engine), &profile);
+
+      if (profile.blocks != pjc->profile.blocks ||
+	  profile.timeout != pjc->profile.timeout ||
+	  profile.priority != pjc->profile.priority ||
+	  profile.cpus != pjc->profile.cpus ||
+	  profile.output_mask != pjc->profile.output_mask ||
+	  profile.input_mask != pjc->profile.input_mask)
+	{
+	  restart_single (pjc, i);
+	  continue;
+	}
+
+      if (profile.quality != pjc->profile.quality &&
+	  !ow_resampler_set_quality (pjc->jclient.resampler, profile.quality))
+	{
+	  pjc->profile.quality = profile.quality;
+	}
+
+      if (profile.low_latency != pjc->profile.low_latency)
+	{
+	  ow_resampler_set_low_latency (pjc->jclient.resampler,
+					profile.low_latency);
+	  pjc->profile.low_latency = profile.low_latency;
+	}
+
+      ow_resampler_set_reconnect (pjc->jclient.resampler,
+				  preferences.reconnect);
+    }
+
+  pthread_spin_unlock (&lock);
+
+  ow_free_preferences (&prev);
+}
+
 static gchar *
 handle_get_state ()
 {
@@ -410,6 +794,139 @@ handle_get_state ()
 				    target_delay_ms);
 }
 
+static gboolean
+is_device_changed (struct pooled_jclient *pjc, const gchar *name,
+		   struct ow_resampler_state *state, gboolean throttled)
+{
+  if (!pjc->published || pjc->published_state.status != state->status ||
+      strcmp (pjc->published_name, name))
+    {
+      return TRUE;
+    }
+
+  //Latencies and ratios change continuously so they are not sent that often.
+  if (throttled)
+    {
+      return FALSE;
+    }
+
+  return memcmp (&pjc->published_state, state, sizeof (*state)) != 0;
+}
+
+//When full is set, every running device is included. Otherwise, only the
+//changes since the last StateChanged signal are included, the published
+//state is updated and NULL is returned if there are no changes.
+static GVariant *
+get_state_variant (gboolean full)
+{
+  guint changes = 0;
+  gboolean throttled;
+  GVariantBuilder devices, removed;
+  struct published_server_state server = { 0, 0, 0 };
+  struct pooled_jclient *pjc = jcpool;
+  struct ow_resampler *resampler = NULL;
+  gint64 now = g_get_monotonic_time ();
+
+  throttled = now - published_usecs < STATE_THROTTLE_US;
+
+  g_variant_builder_init (&devices, G_VARIANT_TYPE ("a" MESSAGE_DEVICE_TYPE));
+  g_variant_builder_init (&removed, G_VARIANT_TYPE ("au"));
+
+  pthread_spin_lock (&lock);
+
+  for (guint32 i = 0; i < POOLED_JCLIENT_LEN; i++, pjc++)
+    {
+      if (pjc->status == PJC_RUNNING)
+	{
+	  struct ow_resampler_state state;
+	  resampler = pjc->jclient.resampler;
+	  struct ow_engine *engine = ow_resampler_get_engine (resampler);
+	  const struct ow_device *device = ow_engine_get_device (engine);
+	  const gchar *name = ow_engine_get_overbridge_name (engine);
+	  ow_resampler_get_state_copy (resampler, &state);
+
+	  if (full)
+	    {
+	      message_state_variant_add_device (&devices, i, name, device,
+						&state);
+	    }
+	  else if (is_device_changed (pjc, name, &state, throttled))
+	    {
+	      message_state_variant_add_device (&devices, i, name, device,
+						&state);
+	      pjc->published = TRUE;
+	      pjc->published_state = state;
+	      g_snprintf (pjc->published_name, OW_LABEL_MAX_LEN, "%s", name);
+	      changes++;
+	    }
+	}
+      else if (pjc->published && !full)
+	{
+	  g_variant_builder_add (&removed, "u", i);
+	  pjc->published = FALSE;
+	  changes++;
+	}
+    }
+
+  if (resampler)
+    {
+      server.samplerate = ow_resampler_get_samplerate (resampler);
+      server.buffer_size = ow_resampler_get_buffer_size (resampler);
+      server.target_delay_ms = ow_resampler_get_target_delay_ms (resampler);
+    }
+
+  pthread_spin_unlock (&lock);
+
+  if (!full)
+    {
+      if (server.samplerate != published_server.samplerate ||
+	  server.buffer_size != published_server.buffer_size ||
+	  (!throttled &&
+	   server.target_delay_ms != published_server.target_delay_ms))
+	{
+	  published_server = server;
+	  changes++;
+	}
+
+      if (!changes)
+	{
+	  g_variant_builder_clear (&devices);
+	  g_variant_builder_clear (&removed);
+	  return NULL;
+	}
+
+      published_usecs = now;
+    }
+
+  return message_state_variant_new (&devices, &removed, server.samplerate,
+				    server.buffer_size,
+				    server.target_delay_ms);
+}
+
+static gboolean
+publish_state (gpointer data)
+{
+  GError *error = NULL;
+  GDBusConnection *conn = data;
+  GVariant *state = get_state_variant (FALSE);
+
+  if (state)
+    {
+      g_dbus_connection_emit_signal (conn, NULL,
+				     "/io/github/dagargo/OverwitchService",
+				     PACKAGE_SERVICE_DBUS_NAME,
+				     "StateChanged", state, &error);
+      if (error)
+	{
+	  error_print ("Error emitting signal 'StateChanged': %s",
+		       error->message);
+	  g_error_free (error);
+	}
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
 static gint
 handle_set_device_name (guint id, const gchar *name)
 {
@@ -426,16 +943,9 @@ handle_set_device_name (guint id, const gchar *name)
       struct ow_resampler *resampler = pjc->jclient.resampler;
       struct ow_engine *engine = ow_resampler_get_engine (resampler);
 
-      struct ow_device *copy = malloc (sizeof (struct ow_device));
-      memcpy (copy, pjc->jclient.device, sizeof (struct ow_device));
-
       ow_engine_set_overbridge_name (engine, name);
 
-      jclient_stop (&pjc->jclient);
-      pthread_join (pjc->thread, NULL);
-      pjc->status = PJC_AVAILABLE;
-
-      start_single (pjc, id, copy);
+      restart_single (pjc, id);
     }
 
   pthread_spin_unlock (&lock);
@@ -465,6 +975,11 @@ handle_method_call (GDBusConnection *connection, const gchar *sender,
       handle_stop ();
       g_dbus_method_invocation_return_value (invocation, NULL);
     }
+  else if (g_strcmp0 (method_name, "Reload") == 0)
+    {
+      handle_reload ();
+      g_dbus_method_invocation_return_value (invocation, NULL);
+    }
   else if (g_strcmp0 (method_name, "GetState") == 0)
     {
       gchar *state = handle_get_state ();
@@ -472,6 +987,11 @@ handle_method_call (GDBusConnection *connection, const gchar *sender,
       g_dbus_method_invocation_return_value (invocation, v);
       g_free (state);
     }
+  else if (g_strcmp0 (method_name, "GetFullState") == 0)
+    {
+      GVariant *v = get_state_variant (TRUE);
+      g_dbus_method_invocation_return_value (invocation, v);
+    }
   else if (g_strcmp0 (method_name, "SetDeviceName") == 0)
     {
       guint id;
@@ -497,7 +1017,7 @@ static const GDBusInterfaceVTable interface_vtable = {
 static void
 startup ()
 {
-  g_free (preferences.pipewire_props);
+  ow_free_preferences (&preferences);
 
   ow_load_preferences (&preferences);
 
@@ -513,6 +1033,26 @@ startup ()
       setenv (PIPEWIRE_PROPS_ENV_VAR, preferences.pipewire_props, TRUE);
     }
 
+  metrics_stop ();
+  if (preferences.metrics_address)
+    {
+      metrics_start (preferences.metrics_address, stats_page);
+    }
+
+  aggregate_active = 0;
+  if (preferences.aggregate)
+    {
+      if (jaggregate_init (&aggregate))
+	{
+	  error_print
+	    ("Could not start the aggregate client. Using a client per device...");
+	}
+      else
+	{
+	  aggregate_active = 1;
+	}
+    }
+
   force_stop = 0;
   if (start_all ())
     {
@@ -546,6 +1086,13 @@ app_startup (GApplication *app, gpointer *user_data)
 
   if (id)
     {
+      stats_page = ow_stats_page_new ("overwitch-service");
+      //The enumerator lives as long as the service to keep the device table.
+      if (ow_enumerator_init (&enumerator))
+	{
+	  error_print ("Could not initialize the device enumerator");
+	}
+      g_timeout_add (STATE_CHECK_MS, publish_state, conn);
       startup ();
       g_application_hold (app);
       g_application_activate (app);
@@ -572,9 +1119,10 @@ main (gint argc, gchar *argv[])
   sigemptyset (&action.sa_mask);
   action.sa_flags = 0;
   sigaction (SIGTERM, &action, NULL);
-  sigaction (SIGHUP, &action, NULL);
   sigaction (SIGINT, &action, NULL);
 
+  g_unix_signal_add (SIGHUP, sighup_handler, NULL);
+
   pthread_setname_np (pthread_self (), "overwitch-srv");
 
   pthread_spin_init (&lock, PTHREAD_PROCESS_PRIVATE);
@@ -591,7 +1139,19 @@ main (gint argc, gchar *argv[])
 
   g_object_unref (app);
 
-  g_free (preferences.pipewire_props);
+  metrics_stop ();
+
+  if (enumerator)
+    {
+      ow_enumerator_destroy (enumerator);
+    }
+
+  if (stats_page)
+    {
+      ow_stats_page_free (stats_page);
+    }
+
+  ow_free_preferences (&preferences);
 
   pthread_spin_destroy (&lock);
 
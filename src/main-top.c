@@ -0,0 +1,245 @@
+/*
+ *   main-top.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include "../config.h"
+#include "utils.h"
+#include "common.h"
+#include "stats.h"
+
+#define SHM_DIR "/dev/shm"
+#define DEFAULT_REFRESH_MS 500
+#define MIN_REFRESH_MS 10
+
+static struct option options[] = {
+  {"refresh-ms", 1, NULL, 'r'},
+  {"once", 0, NULL, 'o'},
+  {"verbose", 0, NULL, 'v'},
+  {"help", 0, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static const char *STATUS_STRINGS[] = {
+  "Error", "Stopped", "Ready", "Booting", "Tuning", "Running", "Retuning"
+};
+
+static const char *
+get_status_string (ow_resampler_status_t status)
+{
+  if (status < OW_RESAMPLER_STATUS_ERROR ||
+      status > OW_RESAMPLER_STATUS_RETUNE)
+    {
+      return "";
+    }
+  return STATUS_STRINGS[status - OW_RESAMPLER_STATUS_ERROR];
+}
+
+//Upper bound of the bin containing the given percentile
+static uint64_t
+get_percentile_usecs (atomic_uint_least64_t *hist, double percentile)
+{
+  uint64_t count[OW_STATS_HIST_BINS];
+  uint64_t total = 0, acc = 0;
+
+  for (int i = 0; i < OW_STATS_HIST_BINS; i++)
+    {
+      count[i] = atomic_load_explicit (&hist[i], memory_order_relaxed);
+      total += count[i];
+    }
+
+  if (!total)
+    {
+      return 0;
+    }
+
+  for (int i = 0; i < OW_STATS_HIST_BINS; i++)
+    {
+      acc += count[i];
+      if (acc >= total * percentile)
+	{
+	  return (i + 1) * OW_STATS_HIST_BIN_USECS;
+	}
+    }
+
+  return OW_STATS_HIST_BINS * OW_STATS_HIST_BIN_USECS;
+}
+
+static void
+print_page (struct ow_stats_page *page)
+{
+  struct ow_stats_device copy;
+  struct ow_stats_device *stats = page->devices;
+
+  for (int i = 0; i < OW_STATS_MAX_DEVICES; i++, stats++)
+    {
+      if (ow_stats_device_read (stats, &copy))
+	{
+	  debug_print (1, "Slot %d of process %d is busy", i, page->pid);
+	  continue;
+	}
+
+      if (!copy.active)
+	{
+	  continue;
+	}
+
+      printf ("%7d %-18.18s %3d %-16.16s %-16.16s %03d,%03d %-8s "
+	      "%5.1f %5.1f %8.6f %5u %5u %10" PRIu64 " %6" PRIu64 " %6"
+	      PRIu64 " %6" PRIu64 " %5" PRIu64 " %5" PRIu64 " %5" PRIu64
+	      " %5" PRIu64 "\n", page->pid, page->program, i, copy.name,
+	      copy.device, copy.bus, copy.address,
+	      get_status_string (copy.state.status),
+	      copy.state.t_latency_o2h, copy.state.t_latency_h2o,
+	      copy.state.ratio_o2h, copy.samplerate, copy.buffer_size,
+	      copy.counters.o2h_transfers, copy.counters.usb_errors,
+	      copy.counters.o2h_overflows, copy.counters.h2o_underflows,
+	      get_percentile_usecs (stats->host_cycles, .5),
+	      get_percentile_usecs (stats->host_cycles, .99),
+	      get_percentile_usecs (stats->usb_cycles, .5),
+	      get_percentile_usecs (stats->usb_cycles, .99));
+    }
+}
+
+static int
+print_all ()
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct ow_stats_page *page;
+  size_t prefix_len = strlen (OW_STATS_SHM_PREFIX) - 1;
+
+  dir = opendir (SHM_DIR);
+  if (!dir)
+    {
+      error_print ("Error while opening %s: %s", SHM_DIR, strerror (errno));
+      return -1;
+    }
+
+  printf ("%7s %-18s %3s %-16s %-16s %-7s %-8s %5s %5s %8s %5s %5s %10s "
+	  "%6s %6s %6s %5s %5s %5s %5s\n", "PID", "PROGRAM", "ID", "NAME",
+	  "DEVICE", "BUS,ADR", "STATUS", "O2H", "H2O", "RATIO", "RATE",
+	  "BUF", "XFERS", "ERR", "OVF", "UNF", "H50", "H99", "U50", "U99");
+
+  while ((entry = readdir (dir)))
+    {
+      //Skip the leading slash of the prefix.
+      if (strncmp (entry->d_name, OW_STATS_SHM_PREFIX + 1, prefix_len))
+	{
+	  continue;
+	}
+
+      page = ow_stats_page_map (entry->d_name);
+      if (!page)
+	{
+	  debug_print (1, "Ignoring %s...", entry->d_name);
+	  continue;
+	}
+
+      //Segments left by processes that did not exit properly
+      if (kill (page->pid, 0) && errno == ESRCH)
+	{
+	  debug_print (1, "Process %d is not running", page->pid);
+	}
+      else
+	{
+	  print_page (page);
+	}
+
+      ow_stats_page_unmap (page);
+    }
+
+  closedir (dir);
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int opt;
+  int vflg = 0, oflg = 0, errflg = 0;
+  char *endstr;
+  int long_index = 0;
+  int refresh_ms = DEFAULT_REFRESH_MS;
+
+  while ((opt = getopt_long (argc, argv, "r:ovh",
+			     options, &long_index)) != -1)
+    {
+      switch (opt)
+	{
+	case 'r':
+	  errno = 0;
+	  refresh_ms = (int) strtol (optarg, &endstr, 10);
+	  if (errno || endstr == optarg || *endstr != '\0' ||
+	      refresh_ms < MIN_REFRESH_MS)
+	    {
+	      refresh_ms = DEFAULT_REFRESH_MS;
+	      fprintf (stderr,
+		       "Refresh value must be at least %d ms. Using value %d...\n",
+		       MIN_REFRESH_MS, refresh_ms);
+	    }
+	  break;
+	case 'o':
+	  oflg++;
+	  break;
+	case 'v':
+	  vflg++;
+	  break;
+	case 'h':
+	  print_help (argv[0], PACKAGE_STRING, options, NULL);
+	  exit (EXIT_SUCCESS);
+	case '?':
+	  errflg++;
+	}
+    }
+
+  if (errflg > 0)
+    {
+      exit (EXIT_FAILURE);
+    }
+
+  if (vflg)
+    {
+      debug_level = vflg;
+    }
+
+  if (oflg)
+    {
+      return print_all ()? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+  while (1)
+    {
+      printf ("\033[H\033[2J");
+      if (print_all ())
+	{
+	  return EXIT_FAILURE;
+	}
+      fflush (stdout);
+      usleep (refresh_ms * 1000);
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -29,7 +29,7 @@
 #include "preferences.h"
 #include "message.h"
 
-#define REFRESH_TIMEOUT_MS 2000
+#define SERVICE_PATH "/io/github/dagargo/OverwitchService"
 
 #define PLAY_IMAGE_NAME "media-playback-start-symbolic"
 #define STOP_IMAGE_NAME "media-playback-stop-symbolic"
@@ -37,7 +37,9 @@
 static GDBusConnection *connection;
 
 static gint devices;
-static guint source_id;
+static guint state_changed_id;
+static guint watcher_id;
+static gboolean editing;	//Updates are ignored while renaming a device
 
 static GtkApplication *app;
 
@@ -61,7 +63,6 @@ static GtkLabel *jack_status_label;
 static GtkLabel *target_delay_label;
 
 static void control_service (const gchar * method);
-static gboolean refresh_state (gpointer data);
 
 static gboolean
 overwitch_increment_debug_level (const gchar *option_name,
@@ -114,6 +115,10 @@ save_preferences ()
   GVariant *v;
   GAction *a;
 
+  //Members not shown in the GUI are kept.
+  ow_load_preferences (&prefs);
+  g_free (prefs.pipewire_props);
+
   a = g_action_map_lookup_action (G_ACTION_MAP (app), "show_all_columns");
   v = g_action_get_state (a);
   g_variant_get (v, "b", &prefs.show_all_columns);
@@ -127,7 +132,7 @@ save_preferences ()
   prefs.pipewire_props = strdup (props);
 
   ow_save_preferences (&prefs);
-  g_free (prefs.pipewire_props);
+  ow_free_preferences (&prefs);
 }
 
 static void
@@ -152,10 +157,11 @@ load_preferences ()
     {
       buf = gtk_entry_get_buffer (GTK_ENTRY (pipewire_props_dialog_entry));
       gtk_entry_buffer_set_text (buf, prefs.pipewire_props, -1);
-      g_free (prefs.pipewire_props);
     }
 
   update_all_metrics (prefs.show_all_columns);
+
+  ow_free_preferences (&prefs);
 }
 
 static void
@@ -213,13 +219,7 @@ click_save_preferences (GtkButton *self, gpointer data)
 
   save_preferences ();
 
-  g_source_remove (source_id);
-
-  g_list_store_remove_all (status_list_store);
-
-  control_service ("Start");	//Stop, reload and start
-
-  source_id = g_timeout_add (REFRESH_TIMEOUT_MS, refresh_state, NULL);
+  control_service ("Reload");	//Only what changed is applied
 }
 
 static void
@@ -235,11 +235,6 @@ app_exit ()
 
   save_preferences ();		//Needed for preference show_all_columns.
 
-  if (source_id)
-    {
-      g_source_remove (source_id);
-    }
-
   gtk_window_destroy (GTK_WINDOW (main_window));
 }
 
@@ -250,73 +245,199 @@ delete_main_window (GtkWidget *widget, GdkEvent *event, gpointer data)
   return FALSE;
 }
 
+//Devices are kept sorted by id, which is the order used by the service.
 static void
-set_state (const gchar *state)
+set_device (OverwitchDevice *device)
 {
+  OverwitchDevice *d;
+  guint32 id;
+  GListModel *model = G_LIST_MODEL (status_list_store);
+  guint items = g_list_model_get_n_items (model);
+
+  for (guint i = 0; i < items; i++)
+    {
+      d = g_list_model_get_item (model, i);
+      id = d->id;
+      g_object_unref (d);
+
+      if (id == device->id)
+	{
+	  g_list_store_splice (status_list_store, i, 1,
+			       (gpointer *) &device, 1);
+	  return;
+	}
+
+      if (id > device->id)
+	{
+	  g_list_store_insert (status_list_store, i, device);
+	  return;
+	}
+    }
+
+  g_list_store_append (status_list_store, device);
+}
+
+static void
+remove_device (guint32 id)
+{
+  OverwitchDevice *d;
+  guint32 item_id;
+  GListModel *model = G_LIST_MODEL (status_list_store);
+  guint items = g_list_model_get_n_items (model);
+
+  for (guint i = 0; i < items; i++)
+    {
+      d = g_list_model_get_item (model, i);
+      item_id = d->id;
+      g_object_unref (d);
+
+      if (item_id == id)
+	{
+	  g_list_store_remove (status_list_store, i);
+	  return;
+	}
+    }
+}
+
+//A full state replaces all the devices while a partial one only contains the
+//changed devices and the removed ids.
+static void
+set_state (GVariant *state, gboolean full)
+{
+  guint32 id;
+  GVariant *v;
+  GVariantIter *devices_iter, *removed_iter;
   OverwitchDevice *device;
-  guint udevices;
   guint32 samplerate, buffer_size;
-  double target_delay_ms;
+  gdouble target_delay_ms;
+
+  g_variant_get (state, MESSAGE_STATE_TYPE, &devices_iter, &removed_iter,
+		 &samplerate, &buffer_size, &target_delay_ms);
 
-  JsonReader *reader = message_state_reader_start (state, &udevices);
-  if (reader == NULL)
+  if (full)
     {
-      devices = -1;
-      return;
+      g_list_store_remove_all (status_list_store);
+    }
+
+  while ((v = g_variant_iter_next_value (devices_iter)))
+    {
+      device = message_state_variant_get_device (v);
+      set_device (device);
+      g_object_unref (device);
+      g_variant_unref (v);
+    }
+
+  while (g_variant_iter_next (removed_iter, "u", &id))
+    {
+      remove_device (id);
     }
 
-  devices = udevices;
+  g_variant_iter_free (devices_iter);
+  g_variant_iter_free (removed_iter);
+
+  devices = g_list_model_get_n_items (G_LIST_MODEL (status_list_store));
+
+  set_service_state (samplerate, buffer_size, target_delay_ms);
+  set_widgets_to_running_state ();
+}
 
+static void
+set_service_unavailable ()
+{
+  devices = -1;
   g_list_store_remove_all (status_list_store);
+  set_service_state (0, 0, 0);
+  set_widgets_to_running_state ();
+}
 
-  for (guint i = 0; i < devices; i++)
+static void
+get_full_state_cb (GObject *source_object, GAsyncResult *res, gpointer data)
+{
+  GVariant *result;
+  GError *error = NULL;
+
+  result = g_dbus_connection_call_finish (connection, res, &error);
+  if (error == NULL)
     {
-      device = message_state_reader_get_device (reader, i);
-      if (device)
+      if (!editing)
 	{
-	  g_list_store_append (status_list_store, device);
+	  set_state (result, TRUE);
 	}
+      g_variant_unref (result);
+    }
+  else
+    {
+      error_print ("Error calling method 'GetFullState': %s",
+		   error->message);
+      g_error_free (error);
+      set_service_unavailable ();
     }
+}
 
-  message_state_reader_end (reader, &samplerate, &buffer_size,
-			    &target_delay_ms);
+static void
+request_state ()
+{
+  g_dbus_connection_call (connection, PACKAGE_SERVICE_DBUS_NAME,
+			  SERVICE_PATH, PACKAGE_SERVICE_DBUS_NAME,
+			  "GetFullState", NULL,
+			  G_VARIANT_TYPE (MESSAGE_STATE_TYPE),
+			  G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+			  get_full_state_cb, NULL);
+}
 
-  set_service_state (samplerate, buffer_size, target_delay_ms);
+static void
+state_changed (GDBusConnection *connection, const gchar *sender_name,
+	       const gchar *object_path, const gchar *interface_name,
+	       const gchar *signal_name, GVariant *parameters, gpointer data)
+{
+  if (editing)
+    {
+      return;
+    }
+
+  debug_print (2, "State changed");
+  set_state (parameters, FALSE);
 }
 
-static gboolean
-refresh_state (gpointer data)
+static void
+service_appeared (GDBusConnection *connection, const gchar *name,
+		  const gchar *name_owner, gpointer data)
+{
+  debug_print (1, "Service appeared");
+  request_state ();
+}
+
+static void
+service_vanished (GDBusConnection *connection, const gchar *name,
+		  gpointer data)
+{
+  debug_print (1, "Service vanished");
+  set_service_unavailable ();
+}
+
+static void
+set_device_name_cb (GObject *source_object, GAsyncResult *res,
+		    gpointer data)
 {
+  gint err;
   GVariant *result;
-  const gchar *state;
   GError *error = NULL;
 
-  result = g_dbus_connection_call_sync (connection,
-					PACKAGE_SERVICE_DBUS_NAME,
-					"/io/github/dagargo/OverwitchService",
-					PACKAGE_SERVICE_DBUS_NAME,
-					"GetState", NULL,
-					G_VARIANT_TYPE ("(s)"),
-					G_DBUS_CALL_FLAGS_NONE, -1, NULL,
-					&error);
-
+  result = g_dbus_connection_call_finish (connection, res, &error);
   if (error == NULL)
     {
-      g_variant_get (result, "(&s)", &state);
-      debug_print (1, "State: %s", state);
-      set_state (state);
+      g_variant_get (result, "(i)", &err);
+      debug_print (1, "Err: %d", err);
       g_variant_unref (result);
     }
   else
     {
-      devices = -1;
-      error_print ("Error calling method 'GetState': %s", error->message);
+      error_print ("Error calling method 'SetDeviceName': %s",
+		   error->message);
       g_error_free (error);
     }
 
-  set_widgets_to_running_state ();
-
-  return G_SOURCE_CONTINUE;
+  request_state ();
 }
 
 static void
@@ -325,65 +446,50 @@ device_name_changed (GtkEditableLabel *label, GParamSpec *pspec,
 {
   if (gtk_editable_label_get_editing (label))
     {
-      g_source_remove (source_id);
+      editing = TRUE;
     }
   else
     {
       OverwitchDevice *d =
 	OVERWITCH_DEVICE (gtk_column_view_cell_get_item (cell));
-      GVariant *result;
-      GError *error = NULL;
       const char *new_name = gtk_editable_get_text (GTK_EDITABLE (label));
       const char *old_name = d->name;
 
+      editing = FALSE;
+
       if (g_strcmp0 (new_name, old_name))
 	{
-	  result = g_dbus_connection_call_sync (connection,
-						PACKAGE_SERVICE_DBUS_NAME,
-						"/io/github/dagargo/OverwitchService",
-						PACKAGE_SERVICE_DBUS_NAME,
-						"SetDeviceName",
-						g_variant_new ("(us)", d->id,
-							       new_name),
-						G_VARIANT_TYPE ("(i)"),
-						G_DBUS_CALL_FLAGS_NONE, -1,
-						NULL, &error);
-
-	  if (error == NULL)
-	    {
-	      gint err;
-	      g_variant_get (result, "(i)", &err);
-	      debug_print (1, "Err: %d", err);
-	      g_variant_unref (result);
-	    }
-	  else
-	    {
-	      error_print ("Error calling method 'SetDeviceName': %s",
-			   error->message);
-	      g_error_free (error);
-	    }
+	  g_dbus_connection_call (connection, PACKAGE_SERVICE_DBUS_NAME,
+				  SERVICE_PATH, PACKAGE_SERVICE_DBUS_NAME,
+				  "SetDeviceName",
+				  g_variant_new ("(us)", d->id, new_name),
+				  G_VARIANT_TYPE ("(i)"),
+				  G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+				  set_device_name_cb, NULL);
+	}
+      else
+	{
+	  request_state ();	//Updates were ignored while editing.
 	}
-
-      source_id = g_timeout_add (REFRESH_TIMEOUT_MS, refresh_state, NULL);
     }
 }
 
 static void
-control_service (const gchar *method)
+control_service_cb (GObject *source_object, GAsyncResult *res,
+		    gpointer data)
 {
-  GError *error = NULL;
   GVariant *result;
-  result = g_dbus_connection_call_sync (connection,
-					PACKAGE_SERVICE_DBUS_NAME,
-					"/io/github/dagargo/OverwitchService",
-					PACKAGE_SERVICE_DBUS_NAME,
-					method, NULL, NULL,
-					G_DBUS_CALL_FLAGS_NONE, -1, NULL,
-					&error);
+  GError *error = NULL;
+  const gchar *method = data;
 
+  result = g_dbus_connection_call_finish (connection, res, &error);
   if (error == NULL)
     {
       g_variant_unref (result);
+      if (!g_strcmp0 (method, "Start"))
+	{
+	  request_state ();	//The list was cleared before restarting.
+	}
     }
   else
     {
@@ -392,6 +498,16 @@ control_service (const gchar *method)
     }
 }
 
+//Methods are static strings so they can be used as callback data.
+static void
+control_service (const gchar *method)
+{
+  g_dbus_connection_call (connection, PACKAGE_SERVICE_DBUS_NAME,
+			  SERVICE_PATH, PACKAGE_SERVICE_DBUS_NAME, method,
+			  NULL, NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+			  control_service_cb, (gpointer) method);
+}
+
 static void
 click_start_stop (GtkWidget *object, gpointer data)
 {
@@ -403,6 +519,7 @@ exit_service_and_exit (GSimpleAction *simple_action, GVariant *parameter,
 		       gpointer data)
 {
   control_service ("Exit");
+  g_dbus_connection_flush_sync (connection, NULL, NULL);
   app_exit ();
 }
 
@@ -520,8 +637,20 @@ app_startup (GApplication *gapp, gpointer *user_data)
   connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
   if (error == NULL)
     {
-      refresh_state (NULL);	// If the D-Bus service is not started, it will be started. In this case, it will fail to get the state.
-      source_id = g_timeout_add (REFRESH_TIMEOUT_MS, refresh_state, NULL);
+      state_changed_id =
+	g_dbus_connection_signal_subscribe (connection,
+					    PACKAGE_SERVICE_DBUS_NAME,
+					    PACKAGE_SERVICE_DBUS_NAME,
+					    "StateChanged", SERVICE_PATH,
+					    NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+					    state_changed, NULL, NULL);
+      // If the D-Bus service is not started, it will be started.
+      watcher_id =
+	g_bus_watch_name_on_connection (connection,
+					PACKAGE_SERVICE_DBUS_NAME,
+					G_BUS_NAME_WATCHER_FLAGS_AUTO_START,
+					service_appeared, service_vanished,
+					NULL, NULL);
     }
   else
     {
@@ -539,6 +668,14 @@ app_activate (GApplication *gapp, gpointer *user_data)
 static void
 app_shutdown (GApplication *gapp, gpointer *user_data)
 {
+  if (watcher_id)
+    {
+      g_bus_unwatch_name (watcher_id);
+    }
+  if (state_changed_id)
+    {
+      g_dbus_connection_signal_unsubscribe (connection, state_changed_id);
+    }
   g_object_unref (connection);
 }
 
@@ -148,6 +148,42 @@ get_status_string (ow_resampler_status_t status)
   return NULL;
 }
 
+static OverwitchDevice *
+message_state_new_device (guint32 id, const gchar *name,
+			  const gchar *device_name, guint32 bus,
+			  guint32 address, struct ow_resampler_state *state)
+{
+  static gchar o2h_latency[OW_LABEL_MAX_LEN];
+  static gchar h2o_latency[OW_LABEL_MAX_LEN];
+
+  if (state->t_latency_o2h >= 0)
+    {
+      g_snprintf (o2h_latency, OW_LABEL_MAX_LEN,
+		  "%.1f [%.1f, %.1f] ms", state->t_latency_o2h,
+		  state->t_latency_o2h_min, state->t_latency_o2h_max);
+    }
+  else
+    {
+      o2h_latency[0] = '\0';
+    }
+
+  if (state->t_latency_h2o >= 0)
+    {
+      g_snprintf (h2o_latency, OW_LABEL_MAX_LEN,
+		  "%.1f [%.1f, %.1f] ms", state->t_latency_h2o,
+		  state->t_latency_h2o_min, state->t_latency_h2o_max);
+    }
+  else
+    {
+      h2o_latency[0] = '\0';
+    }
+
+  return overwitch_device_new (id, name, device_name, bus, address,
+				 get_status_string (state->status),
+				 o2h_latency, h2o_latency,
+				 state->ratio_o2h, state->ratio_h2o);
+}
+
 JsonReader *
 message_state_reader_start (const gchar *state, guint32 *devices)
 {
@@ -182,8 +218,6 @@ message_state_reader_get_device (JsonReader *reader, guint index)
   OverwitchDevice *device = NULL;
   guint32 id, bus, address;
   struct ow_resampler_state state;
-  static gchar o2h_latency[OW_LABEL_MAX_LEN];
-  static gchar h2o_latency[OW_LABEL_MAX_LEN];
   const gchar *name, *device_name;
 
   state.t_latency_o2h = 0;
@@ -336,32 +370,8 @@ message_state_reader_get_device (JsonReader *reader, guint index)
       goto end;
     }
 
-  if (state.t_latency_o2h >= 0)
-    {
-      g_snprintf (o2h_latency, OW_LABEL_MAX_LEN,
-		  "%.1f [%.1f, %.1f] ms", state.t_latency_o2h,
-		  state.t_latency_o2h_min, state.t_latency_o2h_max);
-    }
-  else
-    {
-      o2h_latency[0] = '\0';
-    }
-
-  if (state.t_latency_h2o >= 0)
-    {
-      g_snprintf (h2o_latency, OW_LABEL_MAX_LEN,
-		  "%.1f [%.1f, %.1f] ms", state.t_latency_h2o,
-		  state.t_latency_h2o_min, state.t_latency_h2o_max);
-    }
-  else
-    {
-      h2o_latency[0] = '\0';
-    }
-
-  device = overwitch_device_new (id, name, device_name, bus, address,
-				 get_status_string (state.status),
-				 o2h_latency, h2o_latency,
-				 state.ratio_o2h, state.ratio_h2o);
+  device = message_state_new_device (id, name, device_name, bus, address,
+				     &state);
 
 end:
   json_reader_end_element (reader);
@@ -394,3 +404,47 @@ message_state_reader_end (JsonReader *reader, guint32 *samplerate,
 
   g_object_unref (reader);
 }
+
+void
+message_state_variant_add_device (GVariantBuilder *devices, guint32 id,
+				  const gchar *overbridge_name,
+				  const struct ow_device *device,
+				  struct ow_resampler_state *state)
+{
+  g_variant_builder_add (devices, MESSAGE_DEVICE_TYPE, id, overbridge_name,
+			 device->desc.name, device->bus, device->address,
+			 state->status, state->t_latency_o2h,
+			 state->t_latency_o2h_min, state->t_latency_o2h_max,
+			 state->t_latency_h2o, state->t_latency_h2o_min,
+			 state->t_latency_h2o_max, state->ratio_o2h,
+			 state->ratio_h2o);
+}
+
+GVariant *
+message_state_variant_new (GVariantBuilder *devices,
+			   GVariantBuilder *removed, guint32 samplerate,
+			   guint32 buffer_size, gdouble target_delay_ms)
+{
+  return g_variant_new (MESSAGE_STATE_TYPE, devices, removed, samplerate,
+			buffer_size, target_delay_ms);
+}
+
+OverwitchDevice *
+message_state_variant_get_device (GVariant *device)
+{
+  gint status;
+  guint32 id, bus, address;
+  const gchar *name, *device_name;
+  struct ow_resampler_state state;
+
+  //Strings are borrowed from the variant.
+  g_variant_get (device, "(u&s&suuidddddddd)", &id, &name, &device_name,
+		 &bus, &address, &status, &state.t_latency_o2h,
+		 &state.t_latency_o2h_min, &state.t_latency_o2h_max,
+		 &state.t_latency_h2o, &state.t_latency_h2o_min,
+		 &state.t_latency_h2o_max, &state.ratio_o2h, &state.ratio_h2o);
+  state.status = status;
+
+  return message_state_new_device (id, name, device_name, bus, address,
+				   &state);
+}
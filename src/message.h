@@ -25,6 +25,12 @@
 #include "overwitch.h"
 #include "overwitch_device.h"
 
+//id, name, device, bus, address, status, o2h latency (current, min and max),
+//h2o latency (current, min and max) and ratios.
+#define MESSAGE_DEVICE_TYPE "(ussuuidddddddd)"
+//Changed devices, removed ids, sample rate, buffer size and target delay.
+#define MESSAGE_STATE_TYPE "(a" MESSAGE_DEVICE_TYPE "auuud)"
+
 JsonBuilder *message_state_builder_start ();
 
 void message_state_builder_add_device (JsonBuilder * builder, guint32 id,
@@ -45,3 +51,16 @@ OverwitchDevice *message_state_reader_get_device (JsonReader * reader,
 void message_state_reader_end (JsonReader * reader, guint32 * samplerate,
 			       guint32 * buffer_size,
 			       gdouble * target_delay_ms);
+
+void message_state_variant_add_device (GVariantBuilder * devices,
+				       guint32 id,
+				       const gchar * overbridge_name,
+				       const struct ow_device *device,
+				       struct ow_resampler_state *state);
+
+GVariant *message_state_variant_new (GVariantBuilder * devices,
+				     GVariantBuilder * removed,
+				     guint32 samplerate, guint32 buffer_size,
+				     gdouble target_delay_ms);
+
+OverwitchDevice *message_state_variant_get_device (GVariant * device);
@@ -0,0 +1,508 @@
+/*
+ *   metrics.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include "metrics.h"
+#include "overwitch.h"
+#include "utils.h"
+
+#define METRICS_DEFAULT_HOST "127.0.0.1"
+#define METRICS_MAX_THREADS 4
+#define METRICS_REQUEST_MAX_LEN 4096
+#define METRICS_TIMEOUT_S 5
+#define METRICS_CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+#define METRICS_RESPONSE_OK "HTTP/1.0 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE "\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n"
+#define METRICS_RESPONSE_NOT_ALLOWED "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+//Bucket upper bounds are aligned with the histogram bins in stats.h.
+static const guint CYCLE_BUCKETS_USECS[] = {
+  500, 1000, 1500, 2000, 3000, 4000, 6000, 8000
+};
+
+static const guint LATENCY_BUCKETS_FRAMES[] = {
+  64, 128, 256, 384, 512, 768, 1024, 1536
+};
+
+struct metrics_device
+{
+  gint id;
+  gchar *labels;
+  struct ow_stats_device copy;
+};
+
+static GSocketService *service;
+static struct ow_stats_page *stats_page;
+static gchar *unix_path;
+
+static void
+metrics_append_escaped (GString *text, const gchar *value)
+{
+  for (const gchar *c = value; *c; c++)
+    {
+      if (*c == '"' || *c == '\\')
+	{
+	  g_string_append_c (text, '\\');
+	}
+      else if (*c == '\n')
+	{
+	  g_string_append (text, "\\n");
+	  continue;
+	}
+      g_string_append_c (text, *c);
+    }
+}
+
+static gchar *
+metrics_get_labels (gint id, struct ow_stats_device *copy)
+{
+  GString *labels = g_string_new (NULL);
+
+  g_string_append_printf (labels, "id=\"%d\",name=\"", id);
+  metrics_append_escaped (labels, copy->name);
+  g_string_append (labels, "\",device=\"");
+  metrics_append_escaped (labels, copy->device);
+  g_string_append_printf (labels, "\",bus=\"%d\",address=\"%d\"", copy->bus,
+			  copy->address);
+
+  return g_string_free (labels, FALSE);
+}
+
+static void
+metrics_append_family (GString *text, const gchar *name, const gchar *type,
+		       const gchar *help)
+{
+  g_string_append_printf (text, "# TYPE %s %s\n# HELP %s %s\n", name, type,
+			  name, help);
+}
+
+static void
+metrics_append_histogram (GString *text, const gchar *name,
+			  const gchar *labels, atomic_uint_least64_t *hist,
+			  gint bins, guint bin_width, const guint *buckets,
+			  gint bucket_count, gdouble scale)
+{
+  guint64 count[MAX (OW_STATS_HIST_BINS, OW_STATS_LATENCY_BINS)];
+  guint64 acc = 0, total = 0;
+  gint bin = 0;
+
+  for (gint i = 0; i < bins; i++)
+    {
+      count[i] = atomic_load_explicit (&hist[i], memory_order_relaxed);
+      total += count[i];
+    }
+
+  //A bin is included when all its values are less than or equal to the bound.
+  for (gint i = 0; i < bucket_count; i++)
+    {
+      for (; bin < bins && (bin + 1) * bin_width <= buckets[i]; bin++)
+	{
+	  acc += count[bin];
+	}
+      g_string_append_printf (text, "%s_bucket{%s,le=\"%g\"} %" PRIu64 "\n",
+			      name, labels, buckets[i] * scale, acc);
+    }
+
+  g_string_append_printf (text, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n",
+			  name, labels, total);
+  g_string_append_printf (text, "%s_count{%s} %" PRIu64 "\n", name, labels,
+			  total);
+}
+
+gchar *
+metrics_get_text (struct ow_stats_page *page)
+{
+  gint n = 0;
+  struct metrics_device *d;
+  struct metrics_device *devices;
+  struct ow_stats_device *stats;
+  GString *text = g_string_new (NULL);
+
+  devices = g_new (struct metrics_device, OW_STATS_MAX_DEVICES);
+
+  for (gint i = 0; i < OW_STATS_MAX_DEVICES; i++)
+    {
+      d = &devices[n];
+      if (ow_stats_device_read (&page->devices[i], &d->copy) ||
+	  !d->copy.active)
+	{
+	  continue;
+	}
+      d->id = i;
+      d->labels = metrics_get_labels (i, &d->copy);
+      n++;
+    }
+
+  //All the samples of a family must be together.
+
+  metrics_append_family (text, "overwitch_status", "gauge",
+			 "Resampler status (-1 error, 0 stopped, 1 ready, "
+			 "2 booting, 3 tuning, 4 running, 5 retuning).");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text, "overwitch_status{%s} %d\n", d->labels,
+			      d->copy.state.status);
+    }
+
+  metrics_append_family (text, "overwitch_usb_transfers", "counter",
+			 "Completed USB audio transfers.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text,
+			      "overwitch_usb_transfers_total{%s,direction=\"o2h\"} %"
+			      PRIu64 "\n", d->labels,
+			      d->copy.counters.o2h_transfers);
+      g_string_append_printf (text,
+			      "overwitch_usb_transfers_total{%s,direction=\"h2o\"} %"
+			      PRIu64 "\n", d->labels,
+			      d->copy.counters.h2o_transfers);
+    }
+
+  metrics_append_family (text, "overwitch_usb_errors", "counter",
+			 "Failed USB audio transfers.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text, "overwitch_usb_errors_total{%s} %"
+			      PRIu64 "\n", d->labels,
+			      d->copy.counters.usb_errors);
+    }
+
+  metrics_append_family (text, "overwitch_usb_reconnections", "counter",
+			 "Times the device was opened again after USB errors.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text, "overwitch_usb_reconnections_total{%s} %"
+			      PRIu64 "\n", d->labels,
+			      d->copy.counters.usb_reconnections);
+    }
+
+  metrics_append_family (text, "overwitch_o2h_overflows", "counter",
+			 "Overbridge to host ring buffer overflows.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text, "overwitch_o2h_overflows_total{%s} %"
+			      PRIu64 "\n", d->labels,
+			      d->copy.counters.o2h_overflows);
+    }
+
+  metrics_append_family (text, "overwitch_h2o_underflows", "counter",
+			 "Host to Overbridge ring buffer underflows.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text, "overwitch_h2o_underflows_total{%s} %"
+			      PRIu64 "\n", d->labels,
+			      d->copy.counters.h2o_underflows);
+    }
+
+  metrics_append_family (text, "overwitch_xruns", "counter", "Host xruns.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text, "overwitch_xruns_total{%s} %" PRIu64
+			      "\n", d->labels, d->copy.xruns);
+    }
+
+  metrics_append_family (text, "overwitch_retunes", "counter",
+			 "Resampler retunes.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text, "overwitch_retunes_total{%s} %" PRIu64
+			      "\n", d->labels, d->copy.retunes);
+    }
+
+  metrics_append_family (text, "overwitch_ratio", "gauge",
+			 "Resampling ratio.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text,
+			      "overwitch_ratio{%s,direction=\"o2h\"} %.9f\n",
+			      d->labels, d->copy.state.ratio_o2h);
+      g_string_append_printf (text,
+			      "overwitch_ratio{%s,direction=\"h2o\"} %.9f\n",
+			      d->labels, d->copy.state.ratio_h2o);
+    }
+
+  metrics_append_family (text, "overwitch_dll_error_frames", "gauge",
+			 "DLL error in frames.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text, "overwitch_dll_error_frames{%s} %f\n",
+			      d->labels, d->copy.dll_error);
+    }
+
+  metrics_append_family (text, "overwitch_target_delay_seconds", "gauge",
+			 "Target delay.");
+  for (d = devices; d < devices + n; d++)
+    {
+      g_string_append_printf (text,
+			      "overwitch_target_delay_seconds{%s} %f\n",
+			      d->labels, d->copy.target_delay_ms / 1000);
+    }
+
+  metrics_append_family (text, "overwitch_latency_seconds", "histogram",
+			 "Ring buffer latency sampled every 100 ms.");
+  for (d = devices; d < devices + n; d++)
+    {
+      gchar *labels;
+      stats = &page->devices[d->id];
+
+      labels = g_strdup_printf ("%s,direction=\"o2h\"", d->labels);
+      metrics_append_histogram (text, "overwitch_latency_seconds", labels,
+				stats->o2h_latency, OW_STATS_LATENCY_BINS,
+				OW_STATS_LATENCY_BIN_FRAMES,
+				LATENCY_BUCKETS_FRAMES,
+				G_N_ELEMENTS (LATENCY_BUCKETS_FRAMES),
+				1.0 / OB_SAMPLE_RATE);
+      g_free (labels);
+
+      labels = g_strdup_printf ("%s,direction=\"h2o\"", d->labels);
+      metrics_append_histogram (text, "overwitch_latency_seconds", labels,
+				stats->h2o_latency, OW_STATS_LATENCY_BINS,
+				OW_STATS_LATENCY_BIN_FRAMES,
+				LATENCY_BUCKETS_FRAMES,
+				G_N_ELEMENTS (LATENCY_BUCKETS_FRAMES),
+				1.0 / OB_SAMPLE_RATE);
+      g_free (labels);
+    }
+
+  metrics_append_family (text, "overwitch_host_cycle_seconds", "histogram",
+			 "Time between host cycles.");
+  for (d = devices; d < devices + n; d++)
+    {
+      stats = &page->devices[d->id];
+      metrics_append_histogram (text, "overwitch_host_cycle_seconds",
+				d->labels, stats->host_cycles,
+				OW_STATS_HIST_BINS, OW_STATS_HIST_BIN_USECS,
+				CYCLE_BUCKETS_USECS,
+				G_N_ELEMENTS (CYCLE_BUCKETS_USECS), 1e-6);
+    }
+
+  metrics_append_family (text, "overwitch_usb_cycle_seconds", "histogram",
+			 "Time between USB cycles.");
+  for (d = devices; d < devices + n; d++)
+    {
+      stats = &page->devices[d->id];
+      metrics_append_histogram (text, "overwitch_usb_cycle_seconds",
+				d->labels, stats->usb_cycles,
+				OW_STATS_HIST_BINS, OW_STATS_HIST_BIN_USECS,
+				CYCLE_BUCKETS_USECS,
+				G_N_ELEMENTS (CYCLE_BUCKETS_USECS), 1e-6);
+    }
+
+  g_string_append (text, "# EOF\n");
+
+  for (d = devices; d < devices + n; d++)
+    {
+      g_free (d->labels);
+    }
+  g_free (devices);
+
+  return g_string_free (text, FALSE);
+}
+
+//Every connection runs in its own thread so the main loop is never blocked.
+static gboolean
+metrics_run (GThreadedSocketService *service, GSocketConnection *connection,
+	     GObject *source_object, gpointer user_data)
+{
+  gsize len = 0;
+  gssize bytes;
+  gchar *text, *header;
+  gchar request[METRICS_REQUEST_MAX_LEN];
+  GInputStream *input = g_io_stream_get_input_stream (G_IO_STREAM
+						      (connection));
+  GOutputStream *output = g_io_stream_get_output_stream (G_IO_STREAM
+							 (connection));
+
+  //A client that never completes the request must not keep the thread.
+  g_socket_set_timeout (g_socket_connection_get_socket (connection),
+			METRICS_TIMEOUT_S);
+
+  //Only the request line matters but the headers are consumed too.
+  while (len < METRICS_REQUEST_MAX_LEN - 1)
+    {
+      bytes = g_input_stream_read (input, request + len,
+				   METRICS_REQUEST_MAX_LEN - 1 - len, NULL,
+				   NULL);
+      if (bytes <= 0)
+	{
+	  break;
+	}
+      len += bytes;
+      request[len] = 0;
+      if (strstr (request, "\r\n\r\n") || strstr (request, "\n\n"))
+	{
+	  break;
+	}
+    }
+  request[len] = 0;
+
+  if (strncmp (request, "GET ", 4))
+    {
+      g_output_stream_write_all (output, METRICS_RESPONSE_NOT_ALLOWED,
+				 strlen (METRICS_RESPONSE_NOT_ALLOWED), NULL,
+				 NULL, NULL);
+      return TRUE;
+    }
+
+  text = metrics_get_text (stats_page);
+  header = g_strdup_printf (METRICS_RESPONSE_OK, strlen (text));
+
+  g_output_stream_write_all (output, header, strlen (header), NULL, NULL,
+			     NULL);
+  g_output_stream_write_all (output, text, strlen (text), NULL, NULL, NULL);
+
+  g_free (header);
+  g_free (text);
+
+  return TRUE;
+}
+
+static GSocketAddress *
+metrics_get_address (const gchar *address)
+{
+  guint64 port;
+  gchar *host, *sep, *end;
+  GStatBuf st;
+  GSocketAddress *socket_address;
+
+  if (address[0] == '/')
+    {
+      //A previous instance might have left the socket file but nothing else
+      //is ever removed.
+      if (!g_lstat (address, &st))
+	{
+	  if (!S_ISSOCK (st.st_mode))
+	    {
+	      error_print ("'%s' exists and is not a socket", address);
+	      return NULL;
+	    }
+	  g_unlink (address);
+	}
+      return g_unix_socket_address_new (address);
+    }
+
+  sep = strrchr (address, ':');
+  if (!sep)
+    {
+      return NULL;
+    }
+
+  port = g_ascii_strtoull (sep + 1, &end, 10);
+  if (end == sep + 1 || *end || port > G_MAXUINT16)
+    {
+      return NULL;
+    }
+
+  if (sep == address)
+    {
+      host = g_strdup (METRICS_DEFAULT_HOST);
+    }
+  else if (address[0] == '[' && sep[-1] == ']')
+    {
+      host = g_strndup (address + 1, sep - address - 2);
+    }
+  else
+    {
+      host = g_strndup (address, sep - address);
+    }
+
+  socket_address = g_inet_socket_address_new_from_string (host, port);
+  g_free (host);
+
+  return socket_address;
+}
+
+gint
+metrics_start (const gchar *address, struct ow_stats_page *page)
+{
+  GError *error = NULL;
+  GSocketAddress *socket_address;
+
+  if (!page)
+    {
+      error_print ("Stats not available. Metrics disabled...");
+      return -1;
+    }
+
+  socket_address = metrics_get_address (address);
+  if (!socket_address)
+    {
+      error_print ("Invalid metrics address '%s'", address);
+      return -1;
+    }
+
+  stats_page = page;
+  service = g_threaded_socket_service_new (METRICS_MAX_THREADS);
+
+  g_socket_listener_add_address (G_SOCKET_LISTENER (service),
+				 socket_address, G_SOCKET_TYPE_STREAM,
+				 G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+				 &error);
+  g_object_unref (socket_address);
+  if (error)
+    {
+      error_print ("Error while listening on '%s': %s", address,
+		   error->message);
+      g_error_free (error);
+      metrics_stop ();
+      return -1;
+    }
+
+  //Only the socket created here is removed when stopping.
+  if (address[0] == '/')
+    {
+      unix_path = g_strdup (address);
+    }
+
+  g_signal_connect (service, "run", G_CALLBACK (metrics_run), NULL);
+  g_socket_service_start (service);
+
+  debug_print (1, "Exporting metrics on '%s'...", address);
+
+  return 0;
+}
+
+void
+metrics_stop ()
+{
+  if (!service)
+    {
+      return;
+    }
+
+  debug_print (1, "Stopping metrics...");
+
+  g_socket_service_stop (service);
+  g_socket_listener_close (G_SOCKET_LISTENER (service));
+  g_object_unref (service);
+  service = NULL;
+
+  if (unix_path)
+    {
+      g_unlink (unix_path);
+      g_free (unix_path);
+      unix_path = NULL;
+    }
+}
@@ -22,7 +22,9 @@
 #include <string.h>
 #include <sched.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include "overwitch.h"
+#include "device_table.h"
 #include "utils.h"
 
 #define DEVICES_DIR "/devices.d"
@@ -38,77 +40,10 @@
 
 static int ow_get_device_desc (uint16_t, struct ow_device_desc *);
 
-int
-ow_get_device_list (struct ow_device **ow_devices, size_t *size)
-{
-  int err;
-  uint8_t bus, address;
-  libusb_device **usb_device;
-  struct libusb_device_descriptor desc;
-  struct ow_device *ow_device;
-  ssize_t total = 0;
-  libusb_context *context = NULL;
-  libusb_device **usb_devices = NULL;
-
-  if (libusb_init (&context) != LIBUSB_SUCCESS)
-    {
-      return 1;
-    }
-
-  *size = 0;
-
-  total = libusb_get_device_list (context, &usb_devices);
-  if (!total)
-    {
-      *ow_devices = NULL;
-      return 0;
-    }
-
-  *ow_devices = malloc (sizeof (struct ow_device) * total);
-  ow_device = *ow_devices;
-  usb_device = usb_devices;
-  for (int i = 0; i < total; i++, usb_device++)
-    {
-      err = libusb_get_device_descriptor (*usb_device, &desc);
-      if (err)
-	{
-	  error_print ("Error while getting USB device description: %s",
-		       libusb_error_name (err));
-	  continue;
-	}
-
-      if (desc.idVendor != ELEKTRON_VID)
-	{
-	  debug_print (3, "Non Elektron USB device found. Skipping...");
-	  continue;
-	}
-
-      if (!ow_get_device_desc (desc.idProduct, &ow_device->desc))
-	{
-	  bus = libusb_get_bus_number (*usb_device);
-	  address = libusb_get_device_address (*usb_device);
-	  debug_print (1, "Found %s (bus %03d, address %03d, ID %04x:%04x)",
-		       ow_device->desc.name, bus, address, desc.idVendor,
-		       desc.idProduct);
-	  ow_device->vid = desc.idVendor;
-	  ow_device->pid = desc.idProduct;
-	  ow_device->bus = bus;
-	  ow_device->address = address;
-	  ow_device++;
-	  (*size)++;
-	}
-    }
-
-  if (!*size)
-    {
-      free (*ow_devices);
-      *ow_devices = NULL;
-    }
-
-  libusb_free_device_list (usb_devices, total);
-  libusb_exit (context);
-  return 0;
-}
+//Cache of the user device descriptions
+static GArray *user_descs;
+static gchar *user_descs_signature;
+static pthread_mutex_t user_descs_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void
 ow_copy_device_desc (struct ow_device_desc *device_desc,
@@ -136,34 +71,99 @@ ow_copy_device_desc (struct ow_device_desc *device_desc,
 }
 
 static int
-ow_get_device_desc_reader (uint16_t pid, struct ow_device_desc *device_desc,
-			   JsonReader *reader)
+ow_load_device_tracks_reader (JsonReader *reader, const char *member,
+			      struct ow_device_track *tracks)
+{
+  int total;
+
+  if (!json_reader_read_member (reader, member))
+    {
+      error_print ("Cannot read member '%s'", member);
+      json_reader_end_member (reader);
+      return -EINVAL;
+    }
+
+  if (!json_reader_is_array (reader))
+    {
+      error_print ("Not an array");
+      json_reader_end_member (reader);
+      return -EINVAL;
+    }
+
+  total = json_reader_count_elements (reader);
+  if (!total || total > OB_MAX_TRACKS)
+    {
+      error_print ("Invalid number of tracks (%d)", total);
+      json_reader_end_member (reader);
+      return -EINVAL;
+    }
+
+  for (int j = 0; j < total; j++)
+    {
+      if (!json_reader_read_element (reader, j))
+	{
+	  error_print ("Cannot read track %d", j);
+	  json_reader_end_element (reader);
+	  json_reader_end_member (reader);
+	  return -EINVAL;
+	}
+
+      if (!json_reader_read_member (reader, DEV_TAG_TRACK_NAME))
+	{
+	  error_print ("No name found");
+	  json_reader_end_member (reader);
+	  json_reader_end_element (reader);
+	  json_reader_end_member (reader);
+	  return -EINVAL;
+	}
+      snprintf (tracks[j].name, OW_LABEL_MAX_LEN, "%s",
+		json_reader_get_string_value (reader));
+      json_reader_end_member (reader);
+
+      if (!json_reader_read_member (reader, DEV_TAG_TRACK_SIZE))
+	{
+	  error_print ("No size found");
+	  json_reader_end_member (reader);
+	  json_reader_end_element (reader);
+	  json_reader_end_member (reader);
+	  return -EINVAL;
+	}
+      tracks[j].size = json_reader_get_int_value (reader);
+      json_reader_end_member (reader);
+
+      json_reader_end_element (reader);
+    }
+  json_reader_end_member (reader);
+
+  return total;
+}
+
+static gint
+ow_compare_paths (gconstpointer a, gconstpointer b)
 {
-  gint dpid;
+  return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
+}
 
+static int
+ow_load_device_desc_reader (struct ow_device_desc *device_desc,
+			    JsonReader *reader)
+{
   device_desc->inputs = 0;
   device_desc->outputs = 0;
 
   if (!json_reader_read_member (reader, DEV_TAG_PID))
     {
       error_print ("Cannot read member '%s'", DEV_TAG_PID);
-      return -ENODEV;
+      json_reader_end_member (reader);
+      return -EINVAL;
     }
-
-  dpid = json_reader_get_int_value (reader);
+  device_desc->pid = json_reader_get_int_value (reader);
   json_reader_end_member (reader);
-  if (dpid != pid)
-    {
-      return -ENODEV;
-    }
-  device_desc->pid = dpid;
-
-  debug_print (1, "Device with PID %d found", dpid);
 
   if (!json_reader_read_member (reader, DEV_TAG_NAME))
     {
       error_print ("Cannot read member '%s'", DEV_TAG_NAME);
-      json_reader_end_element (reader);
+      json_reader_end_member (reader);
       return -EINVAL;
     }
   snprintf (device_desc->name, OW_LABEL_MAX_LEN, "%s",
@@ -173,6 +173,7 @@ ow_get_device_desc_reader (uint16_t pid, struct ow_device_desc *device_desc,
   if (!json_reader_read_member (reader, DEV_TAG_TYPE))
     {
       error_print ("Cannot read member '%s'", DEV_TAG_TYPE);
+      json_reader_end_member (reader);
       return -EINVAL;
     }
   device_desc->type = json_reader_get_int_value (reader);
@@ -185,306 +186,743 @@ ow_get_device_desc_reader (uint16_t pid, struct ow_device_desc *device_desc,
       return -EINVAL;
     }
 
-  if (!json_reader_read_member (reader, DEV_TAG_INPUT_TRACKS))
+  device_desc->inputs = ow_load_device_tracks_reader (reader,
+						      DEV_TAG_INPUT_TRACKS,
+						      device_desc->input_tracks);
+  if (device_desc->inputs < 0)
     {
-      error_print ("Cannot read member '%s'", DEV_TAG_INPUT_TRACKS);
-      json_reader_end_element (reader);
       return -EINVAL;
     }
-  if (!json_reader_is_array (reader))
+
+  device_desc->outputs = ow_load_device_tracks_reader (reader,
+						       DEV_TAG_OUTPUT_TRACKS,
+						       device_desc->output_tracks);
+  if (device_desc->outputs < 0)
     {
-      error_print ("Not an array");
-      json_reader_end_element (reader);
       return -EINVAL;
     }
-  device_desc->inputs = json_reader_count_elements (reader);
-  if (!device_desc->inputs)
+
+  return 0;
+}
+
+//Every valid device in the file, which contains an object or an array, is appended.
+static void
+ow_load_device_descs_file (const char *file, GArray *descs)
+{
+  gint devices;
+  JsonParser *parser;
+  JsonReader *reader;
+  GError *error = NULL;
+  struct ow_device_desc device_desc;
+
+  debug_print (1, "Loading devices from %s...", file);
+
+  parser = json_parser_new_immutable ();
+
+  if (!json_parser_load_from_file (parser, file, &error))
+    {
+      error_print ("%s", error->message);
+      g_clear_error (&error);
+      goto cleanup_parser;
+    }
+
+  reader = json_reader_new (json_parser_get_root (parser));
+  if (!reader)
     {
-      debug_print (1, "No tracks found");
-      return -EINVAL;
+      error_print ("Unable to read from parser");
+      goto cleanup_parser;
+    }
+
+  if (!json_reader_is_array (reader))
+    {
+      if (!ow_load_device_desc_reader (&device_desc, reader))
+	{
+	  g_array_append_val (descs, device_desc);
+	}
+      goto cleanup_reader;
     }
 
-  for (int j = 0; j < device_desc->inputs; j++)
+  devices = json_reader_count_elements (reader);
+  for (gint i = 0; i < devices; i++)
     {
-      if (json_reader_read_element (reader, j))
+      if (!json_reader_read_element (reader, i))
 	{
-	  if (!json_reader_read_member (reader, DEV_TAG_TRACK_NAME))
-	    {
-	      debug_print (1, "No name found");
-	      return -EINVAL;
-	    }
-	  snprintf (device_desc->input_tracks[j].name, OW_LABEL_MAX_LEN,
-		    "%s", json_reader_get_string_value (reader));
+	  error_print ("Cannot read element %d. Continuing...", i);
+	  json_reader_end_element (reader);
+	  continue;
+	}
 
-	  json_reader_end_member (reader);
+      if (!ow_load_device_desc_reader (&device_desc, reader))
+	{
+	  g_array_append_val (descs, device_desc);
+	}
 
-	  if (!json_reader_read_member (reader, DEV_TAG_TRACK_SIZE))
+      json_reader_end_element (reader);
+    }
+
+cleanup_reader:
+  g_object_unref (reader);
+cleanup_parser:
+  g_object_unref (parser);
+}
+
+//User files in priority order, i.e., the ones in devices.d sorted by name and
+//then devices.json.
+static GPtrArray *
+ow_get_user_device_files ()
+{
+  gchar *dir;
+  GDir *gdir;
+  const gchar *name;
+  GPtrArray *files = g_ptr_array_new_with_free_func (g_free);
+
+  dir = get_expanded_dir (CONF_DIR DEVICES_DIR);
+  if ((gdir = g_dir_open (dir, 0, NULL)) != NULL)
+    {
+      while ((name = g_dir_read_name (gdir)) != NULL)
+	{
+	  if (name[0] == '.' || !g_str_has_suffix (name, ".json"))
 	    {
-	      debug_print (1, "No size found");
-	      return -EINVAL;
+	      continue;
 	    }
-	  device_desc->input_tracks[j].size =
-	    json_reader_get_int_value (reader);
-
-	  json_reader_end_member (reader);
 
-	  json_reader_end_element (reader);
+	  g_ptr_array_add (files, g_build_path (G_DIR_SEPARATOR_S, dir, name,
+						NULL));
 	}
-      else
+      g_dir_close (gdir);
+      g_ptr_array_sort (files, (GCompareFunc) ow_compare_paths);
+    }
+  g_free (dir);
+
+  g_ptr_array_add (files, get_expanded_dir (CONF_DIR DEVICES_FILE));
+
+  return files;
+}
+
+//The user descriptions are only parsed again when a file is added, removed
+//or modified.
+static void
+ow_update_user_device_descs ()
+{
+  struct stat st;
+  GString *signature;
+  GPtrArray *files = ow_get_user_device_files ();
+
+  signature = g_string_new (NULL);
+  for (guint i = 0; i < files->len; i++)
+    {
+      const gchar *file = g_ptr_array_index (files, i);
+      if (stat (file, &st) || !S_ISREG (st.st_mode))
 	{
-	  error_print ("Cannot read input track name %d", j);
-	  return -EINVAL;
+	  g_ptr_array_index (files, i) = NULL;
+	  g_free ((gchar *) file);
+	  continue;
 	}
+      g_string_append_printf (signature, "%s %jd.%09ld %jd\n", file,
+			      (intmax_t) st.st_mtim.tv_sec,
+			      st.st_mtim.tv_nsec, (intmax_t) st.st_size);
     }
-  json_reader_end_member (reader);
 
-  if (!json_reader_read_member (reader, DEV_TAG_OUTPUT_TRACKS))
+  if (user_descs && !g_strcmp0 (signature->str, user_descs_signature))
     {
-      error_print ("Cannot read member '%s'", DEV_TAG_OUTPUT_TRACKS);
-      json_reader_end_element (reader);
-      return -EINVAL;
+      goto end;
     }
-  if (!json_reader_is_array (reader))
+
+  debug_print (1, "Loading user device descriptions...");
+
+  if (user_descs)
     {
-      error_print ("Not an array");
-      return -EINVAL;
+      g_array_set_size (user_descs, 0);
     }
-  device_desc->outputs = json_reader_count_elements (reader);
-  if (!device_desc->outputs)
+  else
     {
-      debug_print (1, "No tracks found");
-      return -EINVAL;
+      user_descs = g_array_new (FALSE, FALSE, sizeof (struct ow_device_desc));
     }
 
-  for (int j = 0; j < device_desc->outputs; j++)
+  for (guint i = 0; i < files->len; i++)
     {
-      if (json_reader_read_element (reader, j))
+      const gchar *file = g_ptr_array_index (files, i);
+      if (file)
 	{
-	  if (!json_reader_read_member (reader, DEV_TAG_TRACK_NAME))
-	    {
-	      debug_print (1, "No name found");
-	      return -EINVAL;
-	    }
-	  snprintf (device_desc->output_tracks[j].name, OW_LABEL_MAX_LEN,
-		    "%s", json_reader_get_string_value (reader));
+	  ow_load_device_descs_file (file, user_descs);
+	}
+    }
 
-	  json_reader_end_member (reader);
+  g_free (user_descs_signature);
+  user_descs_signature = g_strdup (signature->str);
 
-	  if (!json_reader_read_member (reader, DEV_TAG_TRACK_SIZE))
-	    {
-	      debug_print (1, "No size found");
-	      return -EINVAL;
-	    }
-	  device_desc->output_tracks[j].size =
-	    json_reader_get_int_value (reader);
+end:
+  g_string_free (signature, TRUE);
+  g_ptr_array_free (files, TRUE);
+}
 
-	  json_reader_end_member (reader);
+const struct ow_device_desc *
+ow_device_table_get (uint16_t pid)
+{
+  int i;
 
-	  json_reader_end_element (reader);
+  if (pid < OW_DEVICE_TABLE_PID_MIN ||
+      pid - OW_DEVICE_TABLE_PID_MIN >= OW_DEVICE_TABLE_INDEX_LEN)
+    {
+      return NULL;
+    }
+
+  i = OW_DEVICE_TABLE_INDEX[pid - OW_DEVICE_TABLE_PID_MIN];
+
+  return i < 0 ? NULL : &OW_DEVICE_TABLE[i];
+}
+
+static int
+ow_get_device_desc (uint16_t pid, struct ow_device_desc *device_desc)
+{
+  int err = -ENODEV;
+  const struct ow_device_desc *d;
+
+  pthread_mutex_lock (&user_descs_lock);
+
+  ow_update_user_device_descs ();
+
+  for (guint i = 0; i < user_descs->len; i++)
+    {
+      d = &g_array_index (user_descs, struct ow_device_desc, i);
+      if (d->pid == pid)
+	{
+	  debug_print (1, "Device with PID %d found in the user devices",
+		       pid);
+	  ow_copy_device_desc (device_desc, d);
+	  err = 0;
+	  break;
 	}
-      else
+    }
+
+  pthread_mutex_unlock (&user_descs_lock);
+
+  if (err)
+    {
+      d = ow_device_table_get (pid);
+      if (d)
 	{
-	  error_print ("Cannot read output track name %d", j);
-	  return -EINVAL;
+	  debug_print (1, "Device with PID %d found", pid);
+	  ow_copy_device_desc (device_desc, d);
+	  err = 0;
 	}
     }
-  json_reader_end_member (reader);
 
-  return 0;
+  return err;
+}
+
+struct ow_enumerator_entry
+{
+  struct ow_device device;
+  libusb_device *usb_device;
+};
+
+struct ow_enumerator
+{
+  libusb_context *context;
+  pthread_mutex_t lock;
+  int hotplug;
+  int running;
+  libusb_hotplug_callback_handle callback_handle;
+  ow_hotplug_callback_t cb;
+  ow_hotplug_left_callback_t left_cb;
+  GPtrArray *entries;		//In enumeration order
+  GHashTable *locations;	//Entries by bus and address
+  GHashTable *names;		//First entry with every name
+};
+
+#define OW_ENUMERATOR_LOCATION(bus,address) GUINT_TO_POINTER((bus) << 8 | (address))
+
+static void
+ow_enumerator_entry_free (gpointer data)
+{
+  struct ow_enumerator_entry *entry = data;
+  libusb_unref_device (entry->usb_device);
+  g_free (entry);
 }
 
 static int
-ow_get_device_desc_file (uint16_t pid, struct ow_device_desc *device_desc,
-			 const char *file, int array)
+ow_enumerator_add (struct ow_enumerator *enumerator,
+		   libusb_device *usb_device,
+		   struct ow_enumerator_entry **added)
 {
-  gint err, devices;
-  JsonParser *parser;
-  JsonReader *reader;
-  GError *error = NULL;
+  int err;
+  uint8_t bus, address;
+  struct libusb_device_descriptor desc;
+  struct ow_enumerator_entry *entry;
 
-  device_desc->inputs = 0;
-  device_desc->outputs = 0;
+  err = libusb_get_device_descriptor (usb_device, &desc);
+  if (err)
+    {
+      error_print ("Error while getting USB device description: %s",
+		   libusb_error_name (err));
+      return -EIO;
+    }
 
-  debug_print (1, "Searching device in %s", file);
+  if (desc.idVendor != ELEKTRON_VID)
+    {
+      debug_print (3, "Non Elektron USB device found. Skipping...");
+      return -ENODEV;
+    }
 
-  parser = json_parser_new_immutable ();
+  bus = libusb_get_bus_number (usb_device);
+  address = libusb_get_device_address (usb_device);
+  if (g_hash_table_contains (enumerator->locations,
+			     OW_ENUMERATOR_LOCATION (bus, address)))
+    {
+      return -EEXIST;
+    }
 
-  if (!json_parser_load_from_file (parser, file, &error))
+  entry = g_malloc (sizeof (struct ow_enumerator_entry));
+  if (ow_get_device_desc (desc.idProduct, &entry->device.desc))
     {
-      debug_print (1, "%s", error->message);
-      g_clear_error (&error);
-      err = -ENODEV;
-      goto cleanup_parser;
+      g_free (entry);
+      return -ENODEV;
     }
 
-  reader = json_reader_new (json_parser_get_root (parser));
-  if (!reader)
+  debug_print (1, "Found %s (bus %03d, address %03d, ID %04x:%04x)",
+	       entry->device.desc.name, bus, address, desc.idVendor,
+	       desc.idProduct);
+
+  entry->device.vid = desc.idVendor;
+  entry->device.pid = desc.idProduct;
+  entry->device.bus = bus;
+  entry->device.address = address;
+  entry->usb_device = libusb_ref_device (usb_device);
+
+  g_ptr_array_add (enumerator->entries, entry);
+  g_hash_table_insert (enumerator->locations,
+		       OW_ENUMERATOR_LOCATION (bus, address), entry);
+  if (!g_hash_table_contains (enumerator->names, entry->device.desc.name))
     {
-      error_print ("Unable to read from parser");
-      err = -ENODEV;
-      goto cleanup_parser;
+      g_hash_table_insert (enumerator->names, entry->device.desc.name,
+			   entry);
+    }
+
+  if (added)
+    {
+      *added = entry;
+    }
+
+  return 0;
+}
+
+static void
+ow_enumerator_remove (struct ow_enumerator *enumerator,
+		      libusb_device *usb_device)
+{
+  uint8_t bus = libusb_get_bus_number (usb_device);
+  uint8_t address = libusb_get_device_address (usb_device);
+  gpointer location = OW_ENUMERATOR_LOCATION (bus, address);
+  struct ow_enumerator_entry *entry, *next;
+
+  entry = g_hash_table_lookup (enumerator->locations, location);
+  if (!entry)
+    {
+      return;
+    }
+
+  debug_print (1, "Removing %s (bus %03d, address %03d)",
+	       entry->device.desc.name, bus, address);
+
+  g_hash_table_remove (enumerator->locations, location);
+
+  //The next device with the same name, if any, takes its place.
+  if (g_hash_table_lookup (enumerator->names, entry->device.desc.name) ==
+      entry)
+    {
+      g_hash_table_remove (enumerator->names, entry->device.desc.name);
+      for (guint i = 0; i < enumerator->entries->len; i++)
+	{
+	  next = g_ptr_array_index (enumerator->entries, i);
+	  if (next != entry &&
+	      !strcmp (next->device.desc.name, entry->device.desc.name))
+	    {
+	      g_hash_table_insert (enumerator->names, next->device.desc.name,
+				   next);
+	      break;
+	    }
+	}
     }
 
-  if (array)
+  g_ptr_array_remove (enumerator->entries, entry);
+}
+
+static void
+ow_enumerator_scan (struct ow_enumerator *enumerator)
+{
+  ssize_t total;
+  libusb_device **usb_devices;
+
+  g_hash_table_remove_all (enumerator->names);
+  g_hash_table_remove_all (enumerator->locations);
+  g_ptr_array_set_size (enumerator->entries, 0);
+
+  total = libusb_get_device_list (enumerator->context, &usb_devices);
+  for (int i = 0; i < total; i++)
+    {
+      ow_enumerator_add (enumerator, usb_devices[i], NULL);
+    }
+
+  if (total >= 0)
+    {
+      libusb_free_device_list (usb_devices, 1);
+    }
+}
+
+static int LIBUSB_CALL
+ow_enumerator_hotplug_callback (libusb_context *context,
+				libusb_device *usb_device,
+				libusb_hotplug_event event, void *user_data)
+{
+  int err;
+  ow_hotplug_callback_t cb;
+  ow_hotplug_left_callback_t left_cb;
+  libusb_device_handle *handle;
+  struct ow_device *device = NULL;
+  struct ow_device left_device;
+  struct ow_enumerator_entry *entry;
+  struct ow_enumerator *enumerator = user_data;
+
+  if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event)
     {
-      if (!json_reader_is_array (reader))
+      debug_print (1, "USB hotplug: device arrived");
+
+      pthread_mutex_lock (&enumerator->lock);
+      cb = enumerator->cb;
+      if (!ow_enumerator_add (enumerator, usb_device, &entry) && cb)
 	{
-	  error_print ("Not an array");
-	  err = -ENODEV;
-	  goto cleanup_reader;
+	  device = malloc (sizeof (struct ow_device));
+	  memcpy (device, &entry->device, sizeof (struct ow_device));
 	}
+      pthread_mutex_unlock (&enumerator->lock);
 
-      devices = json_reader_count_elements (reader);
-      if (!devices)
+      if (!device)
 	{
-	  debug_print (1, "No devices found");
-	  err = -ENODEV;
-	  goto cleanup_reader;
+	  return 0;
 	}
 
-      err = -ENODEV;
-      for (int i = 0; i < devices; i++)
+      //The device might not be accessible yet.
+      err = libusb_open (usb_device, &handle);
+      if (err)
 	{
-	  if (!json_reader_read_element (reader, i))
-	    {
-	      error_print ("Cannot read element %d. Continuing...", i);
-	      continue;
-	    }
+	  error_print ("Could not open USB device: %s",
+		       libusb_error_name (err));
+	  free (device);
+	  return 0;
+	}
+      libusb_close (handle);
 
-	  err = ow_get_device_desc_reader (pid, device_desc, reader);
-	  if (err == -ENODEV)
-	    {
-	      json_reader_end_element (reader);
-	      continue;
-	    }
-	  else
-	    {
-	      break;
-	    }
+      cb (device);
+    }
+  else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event)
+    {
+      debug_print (1, "USB hotplug: device left");
+
+      pthread_mutex_lock (&enumerator->lock);
+      left_cb = enumerator->left_cb;
+      entry = g_hash_table_lookup (enumerator->locations,
+				   OW_ENUMERATOR_LOCATION
+				   (libusb_get_bus_number (usb_device),
+				    libusb_get_device_address (usb_device)));
+      if (entry)
+	{
+	  memcpy (&left_device, &entry->device, sizeof (struct ow_device));
+	  ow_enumerator_remove (enumerator, usb_device);
+	}
+      pthread_mutex_unlock (&enumerator->lock);
+
+      if (entry && left_cb)
+	{
+	  left_cb (&left_device);
 	}
     }
   else
     {
-      err = ow_get_device_desc_reader (pid, device_desc, reader);
+      debug_print (1, "Unhandled event %d", event);
     }
 
-cleanup_reader:
-  g_object_unref (reader);
-cleanup_parser:
-  g_object_unref (parser);
-  return err;
+  return 0;
 }
 
-static int
-ow_get_device_desc (uint16_t pid, struct ow_device_desc *device_desc)
+ow_err_t
+ow_enumerator_init (struct ow_enumerator **enumerator_)
 {
-  char *file, *dir;
   int err;
+  struct ow_enumerator *enumerator;
 
-  dir = get_expanded_dir (CONF_DIR DEVICES_DIR);
+  enumerator = g_malloc (sizeof (struct ow_enumerator));
 
-  err = -ENODEV;
-  if (g_file_test (dir, G_FILE_TEST_IS_DIR))
+#if LIBUSBX_API_VERSION >= 0x0100010A
+  err = libusb_init_context (&enumerator->context, NULL, 0);
+#else
+  err = libusb_init (&enumerator->context);
+#endif
+  if (err != LIBUSB_SUCCESS)
     {
-      GDir *gdir;
-      const gchar *name;
+      g_free (enumerator);
+      return OW_USB_ERROR_LIBUSB_INIT_FAILED;
+    }
 
-      if ((gdir = g_dir_open (dir, 0, NULL)) != NULL)
+  pthread_mutex_init (&enumerator->lock, NULL);
+  enumerator->running = 0;
+  enumerator->cb = NULL;
+  enumerator->left_cb = NULL;
+  enumerator->entries =
+    g_ptr_array_new_with_free_func (ow_enumerator_entry_free);
+  enumerator->locations = g_hash_table_new (g_direct_hash, g_direct_equal);
+  enumerator->names = g_hash_table_new (g_str_hash, g_str_equal);
+
+  //Without hotplug support, the bus is scanned again on every query.
+  enumerator->hotplug = libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG);
+  if (enumerator->hotplug)
+    {
+      debug_print (1, "Registering USB hotplug callback...");
+
+      err = libusb_hotplug_register_callback (enumerator->context,
+					      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+					      |
+					      LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					      0, ELEKTRON_VID,
+					      LIBUSB_HOTPLUG_MATCH_ANY,
+					      LIBUSB_HOTPLUG_MATCH_ANY,
+					      ow_enumerator_hotplug_callback,
+					      enumerator,
+					      &enumerator->callback_handle);
+      if (err != LIBUSB_SUCCESS)
 	{
-	  while ((name = g_dir_read_name (gdir)) != NULL)
-	    {
-	      if (name[0] == '.')
-		{
-		  continue;
-		}
-
-	      if (!g_str_has_suffix (name, ".json"))
-		{
-		  continue;
-		}
-
-	      file = g_build_path (G_DIR_SEPARATOR_S, dir, name, NULL);
-	      if (g_file_test (file, G_FILE_TEST_IS_REGULAR))
-		{
-		  err = ow_get_device_desc_file (pid, device_desc, file, 0);
-		}
-	      g_free (file);
-	    }
+	  error_print ("Error creating a hotplug callback");
+	  enumerator->hotplug = 0;
 	}
     }
-  g_free (dir);
 
-  if (err)
+  ow_enumerator_scan (enumerator);
+
+  *enumerator_ = enumerator;
+
+  return OW_OK;
+}
+
+void
+ow_enumerator_destroy (struct ow_enumerator *enumerator)
+{
+  if (enumerator->hotplug)
     {
-      file = get_expanded_dir (CONF_DIR DEVICES_FILE);
-      err = ow_get_device_desc_file (pid, device_desc, file, 1);
-      g_free (file);
+      debug_print (1, "Deregistering USB hotplug callback...");
+      libusb_hotplug_deregister_callback (enumerator->context,
+					  enumerator->callback_handle);
     }
 
-  if (err)
+  g_hash_table_destroy (enumerator->names);
+  g_hash_table_destroy (enumerator->locations);
+  g_ptr_array_free (enumerator->entries, TRUE);
+  libusb_exit (enumerator->context);
+  pthread_mutex_destroy (&enumerator->lock);
+  g_free (enumerator);
+}
+
+//Hotplug events received while the loop is not running are only used to
+//update the table. Afterwards, the lock is held.
+static void
+ow_enumerator_update (struct ow_enumerator *enumerator)
+{
+  int running;
+  struct timeval tv = { 0, 0 };
+
+  pthread_mutex_lock (&enumerator->lock);
+  running = enumerator->running;
+  if (!enumerator->hotplug)
     {
-      file = strdup (DATADIR DEVICES_FILE);
-      err = ow_get_device_desc_file (pid, device_desc, file, 1);
-      g_free (file);
+      ow_enumerator_scan (enumerator);
     }
+  pthread_mutex_unlock (&enumerator->lock);
 
-  return err;
+  if (enumerator->hotplug && !running)
+    {
+      libusb_handle_events_timeout_completed (enumerator->context, &tv,
+					      NULL);
+    }
+
+  pthread_mutex_lock (&enumerator->lock);
 }
 
 int
-ow_get_device_from_device_attrs (int device_num, const char *device_name,
-				 uint8_t bus, uint8_t address,
-				 struct ow_device **dev)
+ow_enumerator_get_device_list (struct ow_enumerator *enumerator,
+			       struct ow_device **devices, size_t *size)
 {
-  int i;
-  size_t total;
-  struct ow_device *devices;
-  struct ow_device *device;
-  ow_err_t err = ow_get_device_list (&devices, &total);
+  struct ow_enumerator_entry *entry;
 
-  if (err)
+  ow_enumerator_update (enumerator);
+
+  *size = enumerator->entries->len;
+  *devices = NULL;
+
+  if (*size)
     {
-      return 1;
+      *devices = malloc (sizeof (struct ow_device) * *size);
+      for (guint i = 0; i < *size; i++)
+	{
+	  entry = g_ptr_array_index (enumerator->entries, i);
+	  memcpy (&(*devices)[i], &entry->device, sizeof (struct ow_device));
+	}
+    }
+
+  pthread_mutex_unlock (&enumerator->lock);
+
+  return 0;
+}
+
+int
+ow_enumerator_get_device (struct ow_enumerator *enumerator, int device_num,
+			  const char *device_name, uint8_t bus,
+			  uint8_t address, struct ow_device **device)
+{
+  struct ow_enumerator_entry *entry = NULL;
+
+  ow_enumerator_update (enumerator);
+
+  if (device_num >= 0)
+    {
+      if (device_num < enumerator->entries->len)
+	{
+	  entry = g_ptr_array_index (enumerator->entries, device_num);
+	}
+    }
+  else if (device_name)
+    {
+      entry = g_hash_table_lookup (enumerator->names, device_name);
+    }
+  else
+    {
+      entry = g_hash_table_lookup (enumerator->locations,
+				   OW_ENUMERATOR_LOCATION (bus, address));
+    }
+
+  if (entry)
+    {
+      *device = malloc (sizeof (struct ow_device));
+      memcpy (*device, &entry->device, sizeof (struct ow_device));
     }
 
-  device = devices;
-  for (i = 0; i < total; i++, device++)
+  pthread_mutex_unlock (&enumerator->lock);
+
+  if (!entry)
     {
       if (device_num >= 0)
 	{
-	  if (i == device_num)
-	    {
-	      break;
-	    }
+	  error_print ("Device %d not found", device_num);
 	}
       else if (device_name)
 	{
-	  if (strcmp (device->desc.name, device_name) == 0)
-	    {
-	      break;
-	    }
+	  error_print ("Device '%s' not found", device_name);
 	}
       else
 	{
-	  if (device->bus == bus && device->address == address)
-	    {
-	      break;
-	    }
+	  error_print ("Device at bus %03d, address %03d not found", bus,
+		       address);
 	}
+      return 1;
     }
 
-  if (i == total)
+  return 0;
+}
+
+int
+ow_enumerator_hotplug_loop (struct ow_enumerator *enumerator, int *running,
+			    pthread_spinlock_t *lock,
+			    ow_hotplug_callback_t cb,
+			    ow_hotplug_left_callback_t left_cb)
+{
+  int end;
+  struct timeval tv = { 1, 0UL };
+
+  if (!enumerator->hotplug)
     {
-      err = 1;
-      error_print ("Device %d not found", device_num);
+      error_print ("USB hotplug not available");
+      return OW_USB_ERROR_LIBUSB_INIT_FAILED;
     }
-  else
+
+  pthread_mutex_lock (&enumerator->lock);
+  enumerator->running = 1;
+  enumerator->cb = cb;
+  enumerator->left_cb = left_cb;
+  pthread_mutex_unlock (&enumerator->lock);
+
+  while (1)
+    {
+      libusb_handle_events_timeout_completed (enumerator->context, &tv, NULL);
+
+      pthread_spin_lock (lock);
+      end = !*running;
+      pthread_spin_unlock (lock);
+
+      if (end)
+	{
+	  break;
+	}
+    }
+
+  pthread_mutex_lock (&enumerator->lock);
+  enumerator->running = 0;
+  enumerator->cb = NULL;
+  enumerator->left_cb = NULL;
+  pthread_mutex_unlock (&enumerator->lock);
+
+  return 0;
+}
+
+int
+ow_hotplug_loop (int *running, pthread_spinlock_t *lock,
+		 ow_hotplug_callback_t cb)
+{
+  int err;
+  struct ow_enumerator *enumerator;
+
+  err = ow_enumerator_init (&enumerator);
+  if (err)
     {
-      *dev = malloc (sizeof (struct ow_device));
-      memcpy (*dev, device, sizeof (struct ow_device));
+      return err;
+    }
+
+  err = ow_enumerator_hotplug_loop (enumerator, running, lock, cb, NULL);
+  ow_enumerator_destroy (enumerator);
+
+  return err;
+}
+
+int
+ow_get_device_list (struct ow_device **devices, size_t *size)
+{
+  int err;
+  struct ow_enumerator *enumerator;
+
+  if (ow_enumerator_init (&enumerator))
+    {
+      return 1;
+    }
+
+  err = ow_enumerator_get_device_list (enumerator, devices, size);
+  ow_enumerator_destroy (enumerator);
+
+  return err;
+}
+
+int
+ow_get_device_from_device_attrs (int device_num, const char *device_name,
+				 uint8_t bus, uint8_t address,
+				 struct ow_device **device)
+{
+  int err;
+  struct ow_enumerator *enumerator;
+
+  if (ow_enumerator_init (&enumerator))
+    {
+      return 1;
     }
 
-  free (devices);
+  err = ow_enumerator_get_device (enumerator, device_num, device_name, bus,
+				  address, device);
+  ow_enumerator_destroy (enumerator);
 
   return err;
 }
@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 #define ELEKTRON_VID 0x1935
@@ -83,6 +84,8 @@ typedef enum
   OW_INIT_ERROR_NO_DLL
 } ow_err_t;
 
+//New values are appended to keep the library ABI so OW_ENGINE_STATUS_RECONNECT,
+//which happens between stopping and being ready, does not follow the order.
 typedef enum
 {
   OW_ENGINE_STATUS_ERROR = -1,
@@ -92,7 +95,8 @@ typedef enum
   OW_ENGINE_STATUS_BOOT,
   OW_ENGINE_STATUS_CLEAR,
   OW_ENGINE_STATUS_WAIT,
-  OW_ENGINE_STATUS_RUN
+  OW_ENGINE_STATUS_RUN,
+  OW_ENGINE_STATUS_RECONNECT
 } ow_engine_status_t;
 
 typedef enum
@@ -109,7 +113,8 @@ typedef enum
 typedef enum
 {
   OW_ENGINE_OPTION_O2H_AUDIO = 1,
-  OW_ENGINE_OPTION_H2O_AUDIO = 2
+  OW_ENGINE_OPTION_H2O_AUDIO = 2,
+  OW_ENGINE_OPTION_O2H_INT = 4	//o2h audio as left aligned int32 samples
 } ow_engine_option_t;
 
 typedef enum
@@ -189,10 +194,27 @@ struct ow_resampler_state
   uint32_t f_latency_h2o_max;
 };
 
+//Only written by the engine thread but read from others so they are updated
+//with relaxed atomics.
+struct ow_engine_counters
+{
+  atomic_uint_least64_t o2h_transfers;
+  atomic_uint_least64_t h2o_transfers;
+  atomic_uint_least64_t o2h_overflows;
+  atomic_uint_least64_t h2o_underflows;
+  atomic_uint_least64_t usb_errors;
+  atomic_uint_least64_t usb_reconnections;
+};
+
 typedef void (*ow_hotplug_callback_t) (struct ow_device * device);
+typedef void (*ow_hotplug_left_callback_t) (const struct ow_device * device);
 
 struct ow_engine;
 struct ow_resampler;
+struct ow_stats_device;
+struct ow_enumerator;
+struct libusb_context;
+struct libusb_device;
 
 //Common
 const char *ow_get_err_str (ow_err_t);
@@ -203,6 +225,23 @@ int ow_get_device_from_device_attrs (int id, const char *name,
 				     uint8_t bus, uint8_t address,
 				     struct ow_device **);
 
+//Enumerator
+ow_err_t ow_enumerator_init (struct ow_enumerator **enumerator);
+
+void ow_enumerator_destroy (struct ow_enumerator *enumerator);
+
+int ow_enumerator_get_device_list (struct ow_enumerator *enumerator,
+				   struct ow_device **, size_t *);
+
+int ow_enumerator_get_device (struct ow_enumerator *enumerator, int id,
+			      const char *name, uint8_t bus, uint8_t address,
+			      struct ow_device **);
+
+int ow_enumerator_hotplug_loop (struct ow_enumerator *enumerator,
+				int *running, pthread_spinlock_t * lock,
+				ow_hotplug_callback_t cb,
+				ow_hotplug_left_callback_t left_cb);
+
 void ow_set_thread_rt_priority (pthread_t, int);
 
 void ow_copy_device_desc (struct ow_device_desc *,
@@ -218,6 +257,13 @@ ow_err_t ow_engine_init_from_device (struct ow_engine **engine,
 				     unsigned int blocks_per_transfer,
 				     unsigned int xfr_timeout);
 
+ow_err_t ow_engine_init_from_libusb_device (struct ow_engine **engine,
+					    struct ow_device *device,
+					    struct libusb_context *context,
+					    struct libusb_device *usb_device,
+					    unsigned int blocks_per_transfer,
+					    unsigned int xfr_timeout);
+
 ow_err_t ow_engine_init_from_libusb_device_descriptor (struct ow_engine **,
 						       int, unsigned int,
 						       unsigned int);
@@ -243,10 +289,17 @@ const struct ow_device *ow_engine_get_device (struct ow_engine *engine);
 
 void ow_engine_stop (struct ow_engine *engine);
 
+void ow_engine_set_reconnect (struct ow_engine *engine, int reconnect);
+
+void ow_engine_set_cpus (struct ow_engine *engine, uint64_t cpus);
+
 void ow_engine_set_overbridge_name (struct ow_engine *engine, const char *);
 
 const char *ow_engine_get_overbridge_name (struct ow_engine *engine);
 
+void ow_engine_get_counters (struct ow_engine *engine,
+			     struct ow_engine_counters *counters);
+
 int ow_hotplug_loop (int *running, pthread_spinlock_t * lock,
 		     ow_hotplug_callback_t cb);
 
@@ -263,6 +316,27 @@ ow_err_t ow_resampler_start (struct ow_resampler *resampler,
 
 void ow_resampler_wait (struct ow_resampler *resampler);
 
+void ow_resampler_set_host_name (struct ow_resampler *resampler,
+				 const char *host_name);
+
+int ow_resampler_get_dll_state (struct ow_resampler *resampler,
+				double *ratio, double *ob_rate);
+
+void ow_resampler_set_dll_state (struct ow_resampler *resampler,
+				 double ratio, double ob_rate);
+
+void ow_resampler_set_low_latency (struct ow_resampler *resampler,
+				   int low_latency);
+
+void ow_resampler_set_reconnect (struct ow_resampler *resampler,
+				 int reconnect);
+
+int ow_resampler_set_quality (struct ow_resampler *resampler,
+			      unsigned int quality);
+
+void ow_resampler_set_stats (struct ow_resampler *resampler,
+			     struct ow_stats_device *stats);
+
 void ow_resampler_destroy (struct ow_resampler *resampler);
 
 void ow_resampler_clear_buffers (struct ow_resampler *resampler);
@@ -29,6 +29,277 @@
 #define PREF_QUALITY "quality"
 #define PREF_TIMEOUT "timeout"
 #define PREF_PIPEWIRE_PROPS "pipewireProps"
+#define PREF_AGGREGATE "aggregate"
+#define PREF_METRICS_ADDRESS "metricsAddress"
+#define PREF_RECONNECT "reconnect"
+#define PREF_DEVICES "devices"
+#define PREF_DEVICE_PID "pid"
+#define PREF_DEVICE_NAME "name"
+#define PREF_DEVICE_PRIORITY "priority"
+#define PREF_DEVICE_CPUS "cpus"
+#define PREF_DEVICE_LOW_LATENCY "lowLatency"
+#define PREF_DEVICE_OUTPUT_MASK "outputMask"
+#define PREF_DEVICE_INPUT_MASK "inputMask"
+
+#define MAX_CPUS 64
+
+static void
+ow_init_device_profile (struct ow_device_profile *profile)
+{
+  profile->pid = OW_PROFILE_UNSET;
+  profile->name = NULL;
+  profile->blocks = OW_PROFILE_UNSET;
+  profile->timeout = OW_PROFILE_UNSET;
+  profile->quality = OW_PROFILE_UNSET;
+  profile->priority = OW_PROFILE_UNSET;
+  profile->cpus = 0;
+  profile->low_latency = OW_PROFILE_UNSET;
+  profile->output_mask = OW_PROFILE_ALL_TRACKS;
+  profile->input_mask = OW_PROFILE_ALL_TRACKS;
+}
+
+static void
+ow_clear_device_profile (gpointer data)
+{
+  struct ow_device_profile *profile = data;
+  g_free (profile->name);
+}
+
+static void
+ow_builder_add_int_member (JsonBuilder *builder, const gchar *name,
+			   gint64 value)
+{
+  json_builder_set_member_name (builder, name);
+  json_builder_add_int_value (builder, value);
+}
+
+static void
+ow_save_device_profile (JsonBuilder *builder,
+			struct ow_device_profile *profile)
+{
+  json_builder_begin_object (builder);
+
+  if (profile->pid != OW_PROFILE_UNSET)
+    {
+      ow_builder_add_int_member (builder, PREF_DEVICE_PID, profile->pid);
+    }
+
+  if (profile->name)
+    {
+      json_builder_set_member_name (builder, PREF_DEVICE_NAME);
+      json_builder_add_string_value (builder, profile->name);
+    }
+
+  if (profile->blocks != OW_PROFILE_UNSET)
+    {
+      ow_builder_add_int_member (builder, PREF_BLOCKS, profile->blocks);
+    }
+
+  if (profile->timeout != OW_PROFILE_UNSET)
+    {
+      ow_builder_add_int_member (builder, PREF_TIMEOUT, profile->timeout);
+    }
+
+  if (profile->quality != OW_PROFILE_UNSET)
+    {
+      ow_builder_add_int_member (builder, PREF_QUALITY, profile->quality);
+    }
+
+  if (profile->priority != OW_PROFILE_UNSET)
+    {
+      ow_builder_add_int_member (builder, PREF_DEVICE_PRIORITY,
+				 profile->priority);
+    }
+
+  if (profile->cpus)
+    {
+      json_builder_set_member_name (builder, PREF_DEVICE_CPUS);
+      json_builder_begin_array (builder);
+      for (gint i = 0; i < MAX_CPUS; i++)
+	{
+	  if (profile->cpus & (1ULL << i))
+	    {
+	      json_builder_add_int_value (builder, i);
+	    }
+	}
+      json_builder_end_array (builder);
+    }
+
+  if (profile->low_latency != OW_PROFILE_UNSET)
+    {
+      json_builder_set_member_name (builder, PREF_DEVICE_LOW_LATENCY);
+      json_builder_add_boolean_value (builder, profile->low_latency);
+    }
+
+  if (profile->output_mask != OW_PROFILE_ALL_TRACKS)
+    {
+      ow_builder_add_int_member (builder, PREF_DEVICE_OUTPUT_MASK,
+				 profile->output_mask);
+    }
+
+  if (profile->input_mask != OW_PROFILE_ALL_TRACKS)
+    {
+      ow_builder_add_int_member (builder, PREF_DEVICE_INPUT_MASK,
+				 profile->input_mask);
+    }
+
+  json_builder_end_object (builder);
+}
+
+static gint64
+ow_reader_get_int_member (JsonReader *reader, const gchar *name,
+			  gint64 value)
+{
+  if (json_reader_read_member (reader, name))
+    {
+      value = json_reader_get_int_value (reader);
+    }
+  json_reader_end_member (reader);
+  return value;
+}
+
+static gint
+ow_load_device_profile (JsonReader *reader,
+			struct ow_device_profile *profile)
+{
+  ow_init_device_profile (profile);
+
+  profile->pid = ow_reader_get_int_member (reader, PREF_DEVICE_PID,
+					   OW_PROFILE_UNSET);
+
+  if (json_reader_read_member (reader, PREF_DEVICE_NAME))
+    {
+      profile->name = g_strdup (json_reader_get_string_value (reader));
+    }
+  json_reader_end_member (reader);
+
+  if (profile->pid == OW_PROFILE_UNSET && !profile->name)
+    {
+      error_print ("Device profile without '%s' or '%s'. Ignoring...",
+		   PREF_DEVICE_PID, PREF_DEVICE_NAME);
+      return -1;
+    }
+
+  profile->blocks = ow_reader_get_int_member (reader, PREF_BLOCKS,
+					      OW_PROFILE_UNSET);
+  profile->timeout = ow_reader_get_int_member (reader, PREF_TIMEOUT,
+					       OW_PROFILE_UNSET);
+  profile->quality = ow_reader_get_int_member (reader, PREF_QUALITY,
+					       OW_PROFILE_UNSET);
+  profile->priority = ow_reader_get_int_member (reader, PREF_DEVICE_PRIORITY,
+						OW_PROFILE_UNSET);
+
+  if (json_reader_read_member (reader, PREF_DEVICE_CPUS))
+    {
+      gint n = json_reader_count_elements (reader);
+      for (gint i = 0; i < n; i++)
+	{
+	  json_reader_read_element (reader, i);
+	  gint64 cpu = json_reader_get_int_value (reader);
+	  if (cpu >= 0 && cpu < MAX_CPUS)
+	    {
+	      profile->cpus |= 1ULL << cpu;
+	    }
+	  json_reader_end_element (reader);
+	}
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_DEVICE_LOW_LATENCY))
+    {
+      profile->low_latency = json_reader_get_boolean_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  profile->output_mask = ow_reader_get_int_member (reader,
+						   PREF_DEVICE_OUTPUT_MASK,
+						   OW_PROFILE_ALL_TRACKS);
+  profile->input_mask = ow_reader_get_int_member (reader,
+						  PREF_DEVICE_INPUT_MASK,
+						  OW_PROFILE_ALL_TRACKS);
+
+  return 0;
+}
+
+static void
+ow_apply_device_profile (struct ow_device_profile *profile,
+			 const struct ow_device_profile *p)
+{
+  if (p->blocks != OW_PROFILE_UNSET)
+    {
+      profile->blocks = p->blocks;
+    }
+  if (p->timeout != OW_PROFILE_UNSET)
+    {
+      profile->timeout = p->timeout;
+    }
+  if (p->quality != OW_PROFILE_UNSET)
+    {
+      profile->quality = p->quality;
+    }
+  if (p->priority != OW_PROFILE_UNSET)
+    {
+      profile->priority = p->priority;
+    }
+  if (p->cpus)
+    {
+      profile->cpus = p->cpus;
+    }
+  if (p->low_latency != OW_PROFILE_UNSET)
+    {
+      profile->low_latency = p->low_latency;
+    }
+  if (p->output_mask != OW_PROFILE_ALL_TRACKS)
+    {
+      profile->output_mask = p->output_mask;
+    }
+  if (p->input_mask != OW_PROFILE_ALL_TRACKS)
+    {
+      profile->input_mask = p->input_mask;
+    }
+}
+
+//Profiles matching the PID are applied first so that the ones matching the
+//name, which are more specific, take precedence. The returned profile does
+//not own any memory.
+void
+ow_preferences_get_device_profile (struct ow_preferences *prefs,
+				   guint16 pid, const gchar *name,
+				   struct ow_device_profile *profile)
+{
+  struct ow_device_profile *p;
+
+  ow_init_device_profile (profile);
+  profile->pid = pid;
+  profile->blocks = prefs->blocks;
+  profile->timeout = prefs->timeout;
+  profile->quality = prefs->quality;
+  profile->low_latency = FALSE;
+
+  if (!prefs->profiles)
+    {
+      return;
+    }
+
+  for (guint i = 0; i < prefs->profiles->len; i++)
+    {
+      p = &g_array_index (prefs->profiles, struct ow_device_profile, i);
+      if (!p->name && p->pid == pid)
+	{
+	  ow_apply_device_profile (profile, p);
+	}
+    }
+
+  for (guint i = 0; i < prefs->profiles->len; i++)
+    {
+      p = &g_array_index (prefs->profiles, struct ow_device_profile, i);
+      if (p->name && !g_strcmp0 (p->name, name) &&
+	  (p->pid == OW_PROFILE_UNSET || p->pid == pid))
+	{
+	  ow_apply_device_profile (profile, p);
+	}
+    }
+}
 
 gint
 ow_save_preferences (struct ow_preferences *prefs)
@@ -73,6 +344,29 @@ ow_save_preferences (struct ow_preferences *prefs)
   json_builder_set_member_name (builder, PREF_PIPEWIRE_PROPS);
   json_builder_add_string_value (builder, prefs->pipewire_props);
 
+  json_builder_set_member_name (builder, PREF_AGGREGATE);
+  json_builder_add_boolean_value (builder, prefs->aggregate);
+
+  json_builder_set_member_name (builder, PREF_METRICS_ADDRESS);
+  json_builder_add_string_value (builder, prefs->metrics_address);
+
+  json_builder_set_member_name (builder, PREF_RECONNECT);
+  json_builder_add_boolean_value (builder, prefs->reconnect);
+
+  if (prefs->profiles && prefs->profiles->len)
+    {
+      json_builder_set_member_name (builder, PREF_DEVICES);
+      json_builder_begin_array (builder);
+      for (guint i = 0; i < prefs->profiles->len; i++)
+	{
+	  ow_save_device_profile (builder,
+				  &g_array_index (prefs->profiles,
+						  struct ow_device_profile,
+						  i));
+	}
+      json_builder_end_array (builder);
+    }
+
   json_builder_end_object (builder);
 
   gen = json_generator_new ();
@@ -103,6 +397,12 @@ ow_load_preferences (struct ow_preferences *prefs)
   prefs->timeout = 10;
   prefs->show_all_columns = FALSE;
   prefs->pipewire_props = NULL;
+  prefs->aggregate = FALSE;
+  prefs->metrics_address = NULL;
+  prefs->reconnect = FALSE;
+  prefs->profiles = g_array_new (FALSE, FALSE,
+				 sizeof (struct ow_device_profile));
+  g_array_set_clear_func (prefs->profiles, ow_clear_device_profile);
 
   error = NULL;
   json_parser_load_from_file (parser, preferences_file, &error);
@@ -149,6 +449,46 @@ ow_load_preferences (struct ow_preferences *prefs)
     }
   json_reader_end_member (reader);
 
+  if (json_reader_read_member (reader, PREF_AGGREGATE))
+    {
+      prefs->aggregate = json_reader_get_boolean_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_METRICS_ADDRESS))
+    {
+      prefs->metrics_address = g_strdup (json_reader_get_string_value
+					 (reader));
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_RECONNECT))
+    {
+      prefs->reconnect = json_reader_get_boolean_value (reader);
+    }
+  json_reader_end_member (reader);
+
+  if (json_reader_read_member (reader, PREF_DEVICES))
+    {
+      gint n = json_reader_count_elements (reader);
+      for (gint i = 0; i < n; i++)
+	{
+	  struct ow_device_profile profile;
+
+	  json_reader_read_element (reader, i);
+	  if (ow_load_device_profile (reader, &profile))
+	    {
+	      ow_clear_device_profile (&profile);
+	    }
+	  else
+	    {
+	      g_array_append_val (prefs->profiles, profile);
+	    }
+	  json_reader_end_element (reader);
+	}
+    }
+  json_reader_end_member (reader);
+
   g_object_unref (reader);
 
 end:
@@ -157,3 +497,17 @@ end:
 
   return err;
 }
+
+void
+ow_free_preferences (struct ow_preferences *prefs)
+{
+  g_free (prefs->pipewire_props);
+  g_free (prefs->metrics_address);
+  if (prefs->profiles)
+    {
+      g_array_free (prefs->profiles, TRUE);
+    }
+  prefs->pipewire_props = NULL;
+  prefs->metrics_address = NULL;
+  prefs->profiles = NULL;
+}
@@ -20,6 +20,25 @@
 
 #include <glib.h>
 
+#define OW_PROFILE_UNSET -1
+#define OW_PROFILE_ALL_TRACKS G_MAXUINT64
+
+//Performance settings of a device. Profiles in the preferences only set some
+//of them and the rest are taken from the global preferences.
+struct ow_device_profile
+{
+  gint pid;			//OW_PROFILE_UNSET matches any device
+  gchar *name;			//Overbridge name. NULL matches any device.
+  gint64 blocks;
+  gint64 timeout;
+  gint64 quality;
+  gint64 priority;
+  guint64 cpus;			//Engine thread CPU affinity mask. 0 means any CPU.
+  gint low_latency;
+  guint64 output_mask;		//Enabled tracks
+  guint64 input_mask;
+};
+
 struct ow_preferences
 {
   gboolean show_all_columns;
@@ -27,8 +46,18 @@ struct ow_preferences
   gint64 timeout;
   gint64 quality;
   gchar *pipewire_props;
+  gboolean aggregate;		//A single JACK client for all the devices
+  gchar *metrics_address;	//OpenMetrics exporter address
+  gboolean reconnect;		//Open the devices again after USB errors
+  GArray *profiles;
 };
 
 gint ow_load_preferences (struct ow_preferences *preferences);
 
 gint ow_save_preferences (struct ow_preferences *preferences);
+
+void ow_free_preferences (struct ow_preferences *preferences);
+
+void ow_preferences_get_device_profile (struct ow_preferences *preferences,
+					guint16 pid, const gchar * name,
+					struct ow_device_profile *profile);
@@ -0,0 +1,565 @@
+/*
+ *   pwclient.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <spa/param/latency-utils.h>
+#include <spa/pod/builder.h>
+#include <pipewire/filter.h>
+
+#include "utils.h"
+#include "pwclient.h"
+#include "ringbuffer.h"
+
+#define MSG_ERROR_PORT_REGISTER "Error while registering PipeWire port"
+
+#define MAX_LATENCY (8192 * 2)	//As in jclient.c
+
+//The actual quantum and rate are only known while processing.
+#define PWCLIENT_DEFAULT_QUANTUM 1024
+
+#define PWCLIENT_HOST_NAME "PipeWire"
+
+struct pwclient_clock
+{
+  uint32_t quantum;
+  uint32_t rate;
+};
+
+//PipeWire uses the monotonic clock for the graph time.
+static uint64_t
+pwclient_get_time ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+pwclient_set_port_latency (struct pwclient *pwclient, void *port,
+			   enum spa_direction direction, int min, int max)
+{
+  uint8_t buffer[1024];
+  const struct spa_pod *params[1];
+  struct spa_pod_builder b = SPA_POD_BUILDER_INIT (buffer, sizeof (buffer));
+  struct spa_latency_info latency = SPA_LATENCY_INFO (direction,.min_rate =
+						      min,.max_rate = max);
+
+  params[0] = spa_latency_build (&b, SPA_PARAM_Latency, &latency);
+  pw_filter_update_params (pwclient->filter, port, params, 1);
+}
+
+//This runs in the PipeWire loop thread.
+static int
+pwclient_set_latency (struct spa_loop *loop, bool async, uint32_t seq,
+		      const void *data, size_t size, void *user_data)
+{
+  struct pwclient *pwclient = user_data;
+  struct ow_engine *engine = ow_resampler_get_engine (pwclient->resampler);
+  const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
+  struct ow_resampler_state *state =
+    ow_resampler_get_state (pwclient->resampler);
+
+  debug_print (2, "o2h latency: [ %d, %d ]", state->f_latency_o2h_min,
+	       state->f_latency_o2h_max);
+
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      pwclient_set_port_latency (pwclient, pwclient->output_ports[i],
+				 SPA_DIRECTION_OUTPUT,
+				 state->f_latency_o2h_min,
+				 state->f_latency_o2h_max);
+    }
+
+  debug_print (2, "h2o latency: [ %d, %d ]", state->f_latency_h2o_min,
+	       state->f_latency_h2o_max);
+
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      pwclient_set_port_latency (pwclient, pwclient->input_ports[i],
+				 SPA_DIRECTION_INPUT,
+				 state->f_latency_h2o_min,
+				 state->f_latency_h2o_max);
+    }
+
+  return 0;
+}
+
+static void
+pwclient_audio_running (void *data)
+{
+  struct pwclient *pwclient = data;
+  pw_loop_invoke (pw_thread_loop_get_loop (pwclient->loop),
+		  pwclient_set_latency, 0, NULL, 0, false, pwclient);
+}
+
+//This runs in the PipeWire loop thread as resizing the resampler buffers
+//allocates memory. The process callback does not use the resampler meanwhile.
+static int
+pwclient_reconfigure (struct spa_loop *loop, bool async, uint32_t seq,
+		      const void *data, size_t size, void *user_data)
+{
+  struct pwclient *pwclient = user_data;
+  const struct pwclient_clock *clock = data;
+
+  if (clock->quantum != ow_resampler_get_buffer_size (pwclient->resampler))
+    {
+      debug_print (1, "PipeWire quantum: %d", clock->quantum);
+      ow_resampler_set_buffer_size (pwclient->resampler, clock->quantum);
+    }
+
+  if (clock->rate != ow_resampler_get_samplerate (pwclient->resampler))
+    {
+      debug_print (1, "PipeWire rate: %d", clock->rate);
+      ow_resampler_set_samplerate (pwclient->resampler, clock->rate);
+    }
+
+  atomic_store_explicit (&pwclient->reconfiguring, 0, memory_order_release);
+
+  return 0;
+}
+
+static void
+pwclient_clear_outputs (struct pwclient *pwclient,
+			const struct ow_device_desc *desc, uint32_t nframes)
+{
+  float *buffer;
+
+  for (int j = 0; j < desc->outputs; j++)
+    {
+      buffer = pw_filter_get_dsp_buffer (pwclient->output_ports[j], nframes);
+      if (buffer)
+	{
+	  memset (buffer, 0, nframes * sizeof (float));
+	}
+    }
+}
+
+//This is posted only once, when the filter is ready or when it fails.
+static void
+pwclient_post_started (struct pwclient *pwclient)
+{
+  if (!atomic_exchange (&pwclient->started_posted, 1))
+    {
+      sem_post (&pwclient->started);
+    }
+}
+
+static void
+pwclient_state_changed_cb (void *data, enum pw_filter_state old,
+			   enum pw_filter_state state, const char *error)
+{
+  struct pwclient *pwclient = data;
+
+  debug_print (1, "PipeWire filter state: %s",
+	       pw_filter_state_as_string (state));
+
+  if (state == PW_FILTER_STATE_ERROR)
+    {
+      error_print ("PipeWire filter error: %s", error);
+      pwclient_stop (pwclient);
+    }
+
+  if (state == PW_FILTER_STATE_PAUSED || state == PW_FILTER_STATE_STREAMING
+      || state == PW_FILTER_STATE_ERROR)
+    {
+      pwclient_post_started (pwclient);
+    }
+}
+
+static void
+pwclient_process_cb (void *data, struct spa_io_position *position)
+{
+  float *f;
+  int xrun;
+  uint32_t nframes, samplerate;
+  float *buffer;
+  struct pwclient *pwclient = data;
+  struct ow_engine *engine = ow_resampler_get_engine (pwclient->resampler);
+  const struct ow_device_desc *desc = &ow_engine_get_device (engine)->desc;
+
+  nframes = position->clock.duration;
+  samplerate = position->clock.rate.denom;
+
+  //Silence is output until the loop thread has applied the changes.
+  if (atomic_load_explicit (&pwclient->reconfiguring, memory_order_acquire))
+    {
+      goto silence;
+    }
+
+  if (nframes != ow_resampler_get_buffer_size (pwclient->resampler) ||
+      samplerate != ow_resampler_get_samplerate (pwclient->resampler))
+    {
+      struct pwclient_clock clock = {.quantum = nframes,.rate = samplerate };
+
+      atomic_store_explicit (&pwclient->reconfiguring, 1,
+			     memory_order_relaxed);
+      pw_loop_invoke (pw_thread_loop_get_loop (pwclient->loop),
+		      pwclient_reconfigure, 0, &clock, sizeof (clock), false,
+		      pwclient);
+      goto silence;
+    }
+
+  //A gap in the graph position means that some cycles were missed.
+  xrun = pwclient->next_position &&
+    pwclient->next_position != position->clock.position;
+  if (xrun)
+    {
+      error_print ("PipeWire xrun");
+    }
+  pwclient->next_position = position->clock.position + nframes;
+
+  if (ow_resampler_compute_ratios (pwclient->resampler,
+				   position->clock.nsec / 1000, xrun,
+				   pwclient_audio_running, pwclient))
+    {
+      goto err;
+    }
+
+  //o2h
+
+  f = ow_resampler_get_o2h_audio_buffer (pwclient->resampler);
+  if (ow_resampler_read_audio (pwclient->resampler))
+    {
+      goto err;
+    }
+
+  for (int j = 0; j < desc->outputs; j++)
+    {
+      buffer = pw_filter_get_dsp_buffer (pwclient->output_ports[j], nframes);
+      if (buffer)
+	{
+	  for (int i = 0; i < nframes; i++)
+	    {
+	      buffer[i] = f[i * desc->outputs + j];
+	    }
+	}
+    }
+
+  //h2o
+
+  f = ow_resampler_get_h2o_audio_buffer (pwclient->resampler);
+
+  for (int j = 0; j < desc->inputs; j++)
+    {
+      buffer = pw_filter_get_dsp_buffer (pwclient->input_ports[j], nframes);
+      for (int i = 0; i < nframes; i++)
+	{
+	  f[i * desc->inputs + j] = buffer ? buffer[i] : 0.0;
+	}
+    }
+
+  if (ow_resampler_write_audio (pwclient->resampler))
+    {
+      goto err;
+    }
+
+  return;
+
+silence:
+  //The resampler is reset so the missed cycles are not an xrun.
+  pwclient->next_position = 0;
+  pwclient_clear_outputs (pwclient, desc, nframes);
+  return;
+
+err:
+  pwclient_stop (pwclient);
+}
+
+static const struct pw_filter_events filter_events = {
+  PW_VERSION_FILTER_EVENTS,
+  .state_changed = pwclient_state_changed_cb,
+  .process = pwclient_process_cb,
+};
+
+void
+pwclient_stop (struct pwclient *pwclient)
+{
+  debug_print (1, "Stopping client...");
+  ow_resampler_stop (pwclient->resampler);
+}
+
+int
+pwclient_init (struct pwclient *pwclient, struct ow_device *device,
+	       unsigned int blocks_per_transfer, unsigned int xfr_timeout,
+	       int quality)
+{
+  ow_err_t err;
+  struct ow_resampler *resampler;
+
+  pwclient->device = device;
+  pwclient->running = 0;
+
+  pthread_spin_init (&pwclient->lock, PTHREAD_PROCESS_PRIVATE);
+  sem_init (&pwclient->started, 0, 0);
+
+  err = ow_resampler_init_from_device (&resampler, device,
+				       blocks_per_transfer, xfr_timeout,
+				       quality);
+
+  if (err)
+    {
+      error_print ("Overwitch error: %s", ow_get_err_str (err));
+      return -1;
+    }
+
+  pwclient->resampler = resampler;
+
+  return 0;
+}
+
+void
+pwclient_destroy (struct pwclient *pwclient)
+{
+  ow_resampler_destroy (pwclient->resampler);
+  pthread_spin_destroy (&pwclient->lock);
+  sem_destroy (&pwclient->started);
+}
+
+static void *
+pwclient_add_port (struct pwclient *pwclient, enum pw_direction direction,
+		   const char *name)
+{
+  debug_print (2, "Registering %s port %s...",
+	       direction == PW_DIRECTION_OUTPUT ? "output" : "input", name);
+
+  return pw_filter_add_port (pwclient->filter, direction,
+			     PW_FILTER_PORT_FLAG_MAP_BUFFERS, 0,
+			     pw_properties_new (PW_KEY_FORMAT_DSP,
+						"32 bit float mono audio",
+						PW_KEY_PORT_NAME, name,
+						NULL), NULL, 0);
+}
+
+static ow_err_t
+pwclient_run (struct pwclient *pwclient)
+{
+  ow_err_t err = OW_OK;
+  const char *name;
+  struct pw_properties *props;
+  struct ow_engine *engine;
+  const struct ow_device_desc *desc;
+
+  pwclient->next_position = 0;
+  atomic_init (&pwclient->reconfiguring, 0);
+  atomic_init (&pwclient->started_posted, 0);
+  pwclient->output_ports = NULL;
+  pwclient->input_ports = NULL;
+  pwclient->context.h2o_audio = NULL;
+  pwclient->context.o2h_audio = NULL;
+
+  pthread_spin_lock (&pwclient->lock);
+  pwclient->running = 1;
+  pthread_spin_unlock (&pwclient->lock);
+
+  engine = ow_resampler_get_engine (pwclient->resampler);
+  desc = &ow_engine_get_device (engine)->desc;
+  name = ow_engine_get_overbridge_name (engine);
+
+  pwclient->loop = pw_thread_loop_new (name, NULL);
+  if (!pwclient->loop)
+    {
+      error_print ("Unable to create PipeWire loop");
+      return OW_GENERIC_ERROR;
+    }
+
+  //Asking for the Overbridge rate lets PipeWire switch the graph rate, if allowed, and keeps the ratio close to 1.
+  props = pw_properties_new (PW_KEY_MEDIA_TYPE, "Audio",
+			     PW_KEY_MEDIA_CATEGORY, "Duplex",
+			     PW_KEY_MEDIA_ROLE, "Production",
+			     PW_KEY_NODE_NAME, name, NULL);
+  pw_properties_setf (props, PW_KEY_NODE_RATE, "1/%d", (int) OB_SAMPLE_RATE);
+
+  pw_thread_loop_lock (pwclient->loop);
+
+  pwclient->filter = pw_filter_new_simple (pw_thread_loop_get_loop
+					   (pwclient->loop), name, props,
+					   &filter_events, pwclient);
+  if (!pwclient->filter)
+    {
+      error_print ("Unable to create PipeWire filter");
+      err = OW_GENERIC_ERROR;
+      goto cleanup_loop;
+    }
+
+  debug_print (1, "Registering ports...");
+  pwclient->output_ports = malloc (sizeof (void *) * desc->outputs);
+  for (int i = 0; i < desc->outputs; i++)
+    {
+      pwclient->output_ports[i] = pwclient_add_port (pwclient,
+						     PW_DIRECTION_OUTPUT,
+						     desc->output_tracks
+						     [i].name);
+      if (pwclient->output_ports[i] == NULL)
+	{
+	  error_print (MSG_ERROR_PORT_REGISTER);
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_filter;
+	}
+    }
+
+  pwclient->input_ports = malloc (sizeof (void *) * desc->inputs);
+  for (int i = 0; i < desc->inputs; i++)
+    {
+      pwclient->input_ports[i] = pwclient_add_port (pwclient,
+						    PW_DIRECTION_INPUT,
+						    desc->input_tracks
+						    [i].name);
+      if (pwclient->input_ports[i] == NULL)
+	{
+	  error_print (MSG_ERROR_PORT_REGISTER);
+	  err = OW_GENERIC_ERROR;
+	  goto cleanup_filter;
+	}
+    }
+
+  //Ring buffers are the lock-free ones also used by overwitch-alsa so JACK
+  //is not needed at all.
+  pwclient->context.o2h_audio = ow_ringbuffer_new (MAX_LATENCY *
+						   ow_resampler_get_o2h_frame_size
+						   (pwclient->resampler));
+  pwclient->context.h2o_audio = ow_ringbuffer_new (MAX_LATENCY *
+						   ow_resampler_get_h2o_frame_size
+						   (pwclient->resampler));
+  if (!pwclient->context.o2h_audio || !pwclient->context.h2o_audio)
+    {
+      error_print ("Unable to allocate buffers");
+      err = OW_GENERIC_ERROR;
+      goto cleanup_filter;
+    }
+
+  pwclient->context.read_space = ow_ringbuffer_read_space;
+  pwclient->context.write_space = ow_ringbuffer_write_space;
+  pwclient->context.read = ow_ringbuffer_read;
+  pwclient->context.write = ow_ringbuffer_write;
+  pwclient->context.get_time = pwclient_get_time;
+
+  //PipeWire manages the priority of its own threads.
+  pwclient->context.set_rt_priority = NULL;
+
+  pwclient->context.options = OW_ENGINE_OPTION_O2H_AUDIO |
+    OW_ENGINE_OPTION_H2O_AUDIO;
+
+  ow_resampler_set_host_name (pwclient->resampler, PWCLIENT_HOST_NAME);
+
+  err = ow_resampler_start (pwclient->resampler, &pwclient->context,
+			    OB_SAMPLE_RATE, PWCLIENT_DEFAULT_QUANTUM);
+  if (err)
+    {
+      goto cleanup_filter;
+    }
+
+  debug_print (1, "Connecting...");
+
+  if (pw_filter_connect (pwclient->filter, PW_FILTER_FLAG_RT_PROCESS, NULL,
+			 0))
+    {
+      error_print ("Cannot connect filter");
+      err = OW_GENERIC_ERROR;
+      ow_resampler_stop (pwclient->resampler);
+    }
+  else if (pw_thread_loop_start (pwclient->loop))
+    {
+      error_print ("Cannot start PipeWire loop");
+      err = OW_GENERIC_ERROR;
+      ow_resampler_stop (pwclient->resampler);
+    }
+  else
+    {
+      debug_print (1, "Connected");
+    }
+
+  pw_thread_loop_unlock (pwclient->loop);
+
+  ow_resampler_wait (pwclient->resampler);
+
+  debug_print (1, "Exiting...");
+
+  pw_thread_loop_lock (pwclient->loop);
+  pw_filter_disconnect (pwclient->filter);
+
+cleanup_filter:
+  pw_filter_destroy (pwclient->filter);
+  pw_thread_loop_unlock (pwclient->loop);
+  pw_thread_loop_stop (pwclient->loop);
+  ow_ringbuffer_free (pwclient->context.h2o_audio);
+  ow_ringbuffer_free (pwclient->context.o2h_audio);
+  free (pwclient->output_ports);
+  free (pwclient->input_ports);
+  pw_thread_loop_destroy (pwclient->loop);
+  return err;
+
+cleanup_loop:
+  pw_thread_loop_unlock (pwclient->loop);
+  pw_thread_loop_destroy (pwclient->loop);
+  return err;
+}
+
+static void *
+pwclient_thread_runner (void *data)
+{
+  struct pwclient *pwclient = data;
+  pwclient_run (pwclient);
+  //In case the filter never got ready
+  pwclient_post_started (pwclient);
+  return NULL;
+}
+
+int
+pwclient_start (struct pwclient *pwclient)
+{
+  char buf[OW_LABEL_MAX_LEN];
+
+  debug_print (1, "Starting thread...");
+
+  if (pthread_create (&pwclient->thread, NULL, pwclient_thread_runner,
+		      pwclient))
+    {
+      return -1;
+    }
+
+  snprintf (buf, OW_LABEL_MAX_LEN, "pwclient-%.6s",
+	    pwclient->device->desc.name);
+  pthread_setname_np (pwclient->thread, buf);
+
+  debug_print (2, "Waiting for the filter to be ready...");
+
+  //Posted from the state callback so there is no polling delay.
+  while (sem_wait (&pwclient->started))
+    {
+      if (errno != EINTR)
+	{
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+void
+pwclient_wait (struct pwclient *pwclient)
+{
+  pthread_join (pwclient->thread, NULL);
+  pwclient->running = 0;
+}
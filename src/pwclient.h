@@ -0,0 +1,58 @@
+/*
+ *   pwclient.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <pipewire/pipewire.h>
+#include "overwitch.h"
+
+struct pwclient
+{
+  //PipeWire stuff
+  struct pw_thread_loop *loop;
+  struct pw_filter *filter;
+  void **output_ports;
+  void **input_ports;
+  uint64_t next_position;
+  atomic_int reconfiguring;	//Set while the loop thread applies a new quantum or rate
+  //Parameters
+  struct ow_device *device;
+  // Overwitch stuff
+  struct ow_resampler *resampler;
+  struct ow_context context;
+  // Thread stuff
+  pthread_spinlock_t lock;
+  int running;
+  sem_t started;
+  atomic_int started_posted;
+  pthread_t thread;
+};
+
+int pwclient_init (struct pwclient *pwclient, struct ow_device *device,
+		   unsigned int blocks_per_transfer, unsigned int xfr_timeout,
+		   int quality);
+
+int pwclient_start (struct pwclient *);
+
+void pwclient_destroy (struct pwclient *);
+
+void pwclient_wait (struct pwclient *);
+
+void pwclient_stop (struct pwclient *);
@@ -18,25 +18,44 @@
  *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "resampler.h"
+#include "stats.h"
 #include "overwitch.h"
 
-#define MAX_READ_FRAMES 5
 #define DEFAULT_REPORT_PERIOD 2
+#define STATS_PERIOD_US 100000
 
-#define BOOTING_PERIOD_US (3 * USEC_PER_SEC)
-#define TUNING_PERIOD_US (4 * USEC_PER_SEC)
+#define OB_PERIOD_MS (1000.0 / OB_SAMPLE_RATE)
 
-#define BOOTING_ERROR 0.001
-#define TUNING_ERROR 0.00001
+//In low latency mode, the o2h target delay is learned from the buffer headroom.
+//It shrinks by small steps while the 0.1 % lowest headroom is above the margin
+//and grows by a whole transfer on underflows.
+#define LOW_LATENCY_PERIOD_US (2 * USEC_PER_SEC)
+#define LOW_LATENCY_QUANTILE 0.001
+#define LOW_LATENCY_MARGIN (2 * OB_FRAMES_PER_BLOCK)
+#define LOW_LATENCY_SHRINK_STEP OB_FRAMES_PER_BLOCK
 
-#define OB_PERIOD_MS (1000.0 / OB_SAMPLE_RATE)
+//After an xrun or a ratio clamp, the o2h buffer is recentered by dropping or
+//inserting frames in small crossfaded steps while the audio keeps flowing.
+#define RECENTER_XFADE_FRAMES 32
+#define RECENTER_MIN_FRAMES OW_RESAMPLER_MAX_READ_FRAMES
+
+#define DLL_FILE "/dll.json"
+#define DLL_RATIO "ratio"
+#define DLL_OB_RATE "overbridgeRate"
 
 #define HOST_UPDATE_ERROR 0.05
 
+//All the resamplers of a process share the DLL file.
+static pthread_mutex_t dll_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 inline ow_resampler_status_t
 ow_resampler_get_status (struct ow_resampler *resampler)
 {
@@ -158,6 +177,9 @@ ow_resampler_clear_buffers (struct ow_resampler *resampler)
 
   resampler->h2o_queue_len = 0;
   resampler->reading_at_o2h_end = 0;
+  resampler->o2h_align = 0;
+  resampler->o2h_hold = 0;
+  resampler->o2h_recenter = 0;
 
   if (context && context->o2h_audio)
     {
@@ -185,6 +207,7 @@ ow_resampler_reset_buffers (struct ow_resampler *resampler)
       free (resampler->h2o_queue);
       free (resampler->o2h_buf_in);
       free (resampler->o2h_buf_out);
+      free (resampler->o2h_xfade);
     }
 
   //The 8 times scale allow up to more than 192 kHz sample rate in JACK.
@@ -195,6 +218,9 @@ ow_resampler_reset_buffers (struct ow_resampler *resampler)
 
   resampler->o2h_buf_in = malloc (resampler->o2h_bufsize);
   resampler->o2h_buf_out = malloc (resampler->o2h_bufsize);
+  //Source and output of a single crossfade step
+  resampler->o2h_xfade = malloc (RECENTER_XFADE_FRAMES * 4 *
+				 resampler->o2h_frame_size);
 
   memset (resampler->h2o_aux, 0, resampler->h2o_bufsize);
   memset (resampler->o2h_buf_in, 0, resampler->h2o_bufsize);
@@ -208,6 +234,54 @@ ow_resampler_get_target_delay_ms (struct ow_resampler *resampler)
   return resampler->dll.target_delay * 1000 / OB_SAMPLE_RATE;
 }
 
+//The histogram is updated every cycle while the rest of the slot is only
+//published every STATS_PERIOD_US.
+static void
+ow_resampler_update_stats (struct ow_resampler *resampler,
+			   uint64_t current_usecs)
+{
+  struct ow_stats_device *stats = resampler->stats;
+  struct ow_engine *engine = resampler->engine;
+
+  if (resampler->stats_cycle_usecs)
+    {
+      ow_stats_hist_add (stats->host_cycles,
+			 current_usecs - resampler->stats_cycle_usecs);
+    }
+  resampler->stats_cycle_usecs = current_usecs;
+
+  if (current_usecs - resampler->stats_usecs < STATS_PERIOD_US)
+    {
+      return;
+    }
+  resampler->stats_usecs = current_usecs;
+
+  ow_resampler_set_state (resampler);
+
+  ow_stats_device_write_begin (stats);
+  stats->active = 1;
+  snprintf (stats->name, OW_LABEL_MAX_LEN, "%s", engine->overbridge_name);
+  snprintf (stats->device, OW_LABEL_MAX_LEN, "%s", engine->device->desc.name);
+  stats->bus = engine->device->bus;
+  stats->address = engine->device->address;
+  stats->samplerate = resampler->samplerate;
+  stats->buffer_size = resampler->bufsize;
+  stats->target_delay_ms = ow_resampler_get_target_delay_ms (resampler);
+  stats->updated_usecs = current_usecs;
+  stats->state = resampler->state;
+  ow_engine_get_counters (engine, &stats->counters);
+  stats->xruns = resampler->xruns;
+  stats->retunes = resampler->retunes;
+  stats->dll_error = resampler->dll.err;
+  ow_stats_device_write_end (stats);
+
+  if (ow_engine_get_status (engine) == OW_ENGINE_STATUS_RUN)
+    {
+      ow_stats_latency_add (stats->o2h_latency, resampler->state.f_latency_o2h);
+      ow_stats_latency_add (stats->h2o_latency, resampler->state.f_latency_h2o);
+    }
+}
+
 static inline void
 ow_resampler_set_ratios_from_dll (struct ow_resampler *resampler)
 {
@@ -222,9 +296,211 @@ ow_resampler_reset_dll (struct ow_resampler *resampler)
 		     resampler->bufsize,
 		     resampler->engine->frames_per_transfer);
 
+  if (resampler->dll_ratio > 0)
+    {
+      ow_dll_host_warm_start (&resampler->dll,
+			      resampler->dll_ratio * resampler->samplerate /
+			      OB_SAMPLE_RATE, resampler->dll_ob_rate);
+    }
+
   ow_resampler_set_ratios_from_dll (resampler);
 }
 
+//The DLL state is only meaningful once the DLL has been tuned.
+static inline int
+ow_resampler_is_tuned (ow_resampler_status_t status)
+{
+  return status == OW_RESAMPLER_STATUS_RUN ||
+    status == OW_RESAMPLER_STATUS_RETUNE;
+}
+
+//The DLL state depends on both the device and the host clocks.
+static gchar *
+ow_resampler_get_dll_key (struct ow_resampler *resampler)
+{
+  const struct ow_device *device = ow_engine_get_device (resampler->engine);
+
+  if (!resampler->host_name)
+    {
+      return NULL;
+    }
+
+  return g_strdup_printf ("%04x:%s:%s", device->pid,
+			  resampler->engine->overbridge_name,
+			  resampler->host_name);
+}
+
+static void
+ow_resampler_load_dll (struct ow_resampler *resampler)
+{
+  gchar *key, *path;
+  JsonParser *parser;
+  JsonReader *reader;
+  GError *error = NULL;
+
+  if (resampler->dll_cached)
+    {
+      debug_print (1, "Using cached DLL state: ratio %f, %f Hz",
+		   resampler->dll_ratio, resampler->dll_ob_rate);
+      resampler->dll_cached = 0;
+      return;
+    }
+
+  resampler->dll_ratio = 0;
+  resampler->dll_ob_rate = 0;
+
+  key = ow_resampler_get_dll_key (resampler);
+  if (!key)
+    {
+      return;
+    }
+
+  path = get_expanded_dir (CONF_DIR DLL_FILE);
+  parser = json_parser_new ();
+
+  pthread_mutex_lock (&dll_file_mutex);
+  if (!json_parser_load_from_file (parser, path, &error))
+    {
+      pthread_mutex_unlock (&dll_file_mutex);
+      debug_print (1, "Error while loading DLL state from '%s': %s", path,
+		   error->message);
+      g_clear_error (&error);
+      goto end;
+    }
+  pthread_mutex_unlock (&dll_file_mutex);
+
+  reader = json_reader_new (json_parser_get_root (parser));
+
+  if (json_reader_read_member (reader, key))
+    {
+      if (json_reader_read_member (reader, DLL_RATIO))
+	{
+	  resampler->dll_ratio = json_reader_get_double_value (reader);
+	}
+      json_reader_end_member (reader);
+
+      if (json_reader_read_member (reader, DLL_OB_RATE))
+	{
+	  resampler->dll_ob_rate = json_reader_get_double_value (reader);
+	}
+      json_reader_end_member (reader);
+
+      debug_print (1, "Previous DLL state for '%s': ratio %f, %f Hz", key,
+		   resampler->dll_ratio, resampler->dll_ob_rate);
+    }
+  json_reader_end_member (reader);
+
+  g_object_unref (reader);
+
+end:
+  g_object_unref (parser);
+  g_free (path);
+  g_free (key);
+}
+
+//The ratio is normalized as if the host were running at the device sample rate.
+static void
+ow_resampler_get_dll_values (struct ow_resampler *resampler, double *ratio,
+			     double *ob_rate)
+{
+  struct ow_dll_overbridge *dll_ob = &resampler->dll.dll_overbridge;
+
+  *ratio = resampler->dll.ratio * OB_SAMPLE_RATE / resampler->samplerate;
+  *ob_rate = dll_ob->frames / dll_ob->dt;
+}
+
+//The file is replaced atomically so that other processes never read it half
+//written.
+static void
+ow_resampler_save_dll (struct ow_resampler *resampler)
+{
+  gchar *key, *path, *tmp_path;
+  double ratio, ob_rate;
+  JsonParser *parser;
+  JsonNode *root;
+  JsonObject *object, *state;
+  JsonGenerator *gen;
+  GError *error = NULL;
+
+  key = ow_resampler_get_dll_key (resampler);
+  if (!key)
+    {
+      return;
+    }
+
+  path = get_expanded_dir (CONF_DIR);
+  if (g_mkdir_with_parents (path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH |
+			    S_IXOTH))
+    {
+      error_print ("Error while creating dir '%s'", CONF_DIR);
+      goto end;
+    }
+  g_free (path);
+
+  path = get_expanded_dir (CONF_DIR DLL_FILE);
+
+  debug_print (1, "Saving DLL state to '%s'...", path);
+
+  pthread_mutex_lock (&dll_file_mutex);
+
+  //Other devices states are kept.
+  object = NULL;
+  parser = json_parser_new ();
+  if (json_parser_load_from_file (parser, path, NULL))
+    {
+      root = json_parser_get_root (parser);
+      if (JSON_NODE_HOLDS_OBJECT (root))
+	{
+	  object = json_object_ref (json_node_get_object (root));
+	}
+    }
+  g_object_unref (parser);
+
+  if (!object)
+    {
+      object = json_object_new ();
+    }
+
+  ow_resampler_get_dll_values (resampler, &ratio, &ob_rate);
+  state = json_object_new ();
+  json_object_set_double_member (state, DLL_RATIO, ratio);
+  json_object_set_double_member (state, DLL_OB_RATE, ob_rate);
+  json_object_set_object_member (object, key, state);
+
+  root = json_node_alloc ();
+  json_node_init_object (root, object);
+
+  tmp_path = g_strdup_printf ("%s.%d", path, getpid ());
+
+  gen = json_generator_new ();
+  json_generator_set_root (gen, root);
+  json_generator_set_pretty (gen, TRUE);
+  if (!json_generator_to_file (gen, tmp_path, &error))
+    {
+      error_print ("Error while saving DLL state to '%s': %s", tmp_path,
+		   error->message);
+      g_clear_error (&error);
+      unlink (tmp_path);
+    }
+  else if (rename (tmp_path, path))
+    {
+      error_print ("Error while renaming '%s' to '%s': %s", tmp_path, path,
+		   strerror (errno));
+      unlink (tmp_path);
+    }
+
+  pthread_mutex_unlock (&dll_file_mutex);
+
+  g_free (tmp_path);
+  g_object_unref (gen);
+  json_node_free (root);
+  json_object_unref (object);
+
+end:
+  g_free (path);
+  g_free (key);
+}
+
 void
 ow_resampler_reset (struct ow_resampler *resampler)
 {
@@ -239,7 +515,8 @@ ow_resampler_reset (struct ow_resampler *resampler)
   ow_resampler_reset_dll (resampler);
 
   //If the engine has not booted yet, we need to let it boot by itself and can not force the transition.
-  if (engine_status > OW_ENGINE_STATUS_BOOT)
+  if (engine_status > OW_ENGINE_STATUS_BOOT &&
+      engine_status != OW_ENGINE_STATUS_RECONNECT)
     {
       ow_engine_set_status (resampler->engine, OW_ENGINE_STATUS_BOOT);
     }
@@ -247,6 +524,33 @@ ow_resampler_reset (struct ow_resampler *resampler)
   ow_resampler_clear_buffers (resampler);
 }
 
+//Used while the engine reconnects. The ports get silence and the DLL starts
+//again from the last ratio as the host clock has not changed.
+static void
+ow_resampler_restart (struct ow_resampler *resampler)
+{
+  ow_resampler_status_t status = ow_resampler_get_status (resampler);
+
+  debug_print (1, "%s (%s): Restarting resampler...",
+	       resampler->engine->name, resampler->engine->overbridge_name);
+
+  if (ow_resampler_is_tuned (status))
+    {
+      ow_resampler_get_dll_values (resampler, &resampler->dll_ratio,
+				   &resampler->dll_ob_rate);
+    }
+
+  pthread_spin_lock (&resampler->engine->lock);
+  ow_dll_host_init (&resampler->dll);
+  pthread_spin_unlock (&resampler->engine->lock);
+
+  ow_resampler_reset_dll (resampler);
+
+  ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_READY);
+  ow_resampler_clear_buffers (resampler);
+  memset (resampler->o2h_buf_in, 0, resampler->o2h_bufsize);
+}
+
 static long
 resampler_h2o_reader (void *cb_data, float **data)
 {
@@ -269,6 +573,102 @@ resampler_h2o_reader (void *cb_data, float **data)
   return ret;
 }
 
+//These frames are not accounted in the DLL as nothing is read from the o2h buffer.
+static long
+resampler_o2h_hold (struct ow_resampler *resampler)
+{
+  long frames = resampler->o2h_hold > OW_RESAMPLER_MAX_READ_FRAMES ?
+    OW_RESAMPLER_MAX_READ_FRAMES : resampler->o2h_hold;
+  memset (resampler->o2h_buf_in, 0, frames * resampler->o2h_frame_size);
+  resampler->o2h_hold -= frames;
+  return frames;
+}
+
+static inline void
+ow_resampler_reset_headroom (struct ow_resampler *resampler,
+			     uint64_t current_usecs)
+{
+  memset (resampler->headroom, 0, sizeof (resampler->headroom));
+  resampler->headroom_count = 0;
+  resampler->headroom_start_usecs = current_usecs;
+}
+
+//Each step consumes RECENTER_XFADE_FRAMES plus the dropped frames or produces
+//RECENTER_XFADE_FRAMES plus the inserted frames by crossfading the audio with
+//a shifted copy of itself. The difference was already accounted in the DLL.
+static long
+resampler_o2h_recenter (struct ow_resampler *resampler, size_t rso2h,
+			float **data)
+{
+  float g, *src, *dst;
+  long in_frames, out_frames;
+  int n, max, offset, channels;
+  struct ow_context *context = resampler->engine->context;
+
+  //Inserting needs some overlap to crossfade.
+  max = resampler->o2h_recenter > 0 ? RECENTER_XFADE_FRAMES :
+    RECENTER_XFADE_FRAMES / 2;
+  n = abs (resampler->o2h_recenter);
+  n = n > max ? max : n;
+  in_frames = RECENTER_XFADE_FRAMES + (resampler->o2h_recenter > 0 ? n : 0);
+  if (rso2h < in_frames * resampler->o2h_frame_size)
+    {
+      return 0;
+    }
+
+  out_frames = RECENTER_XFADE_FRAMES + (resampler->o2h_recenter < 0 ? n : 0);
+  channels = resampler->o2h_frame_size / sizeof (float);
+  src = resampler->o2h_xfade;
+  dst = &resampler->o2h_xfade[RECENTER_XFADE_FRAMES * 2 * channels];
+
+  context->read (context->o2h_audio, (void *) src,
+		 in_frames * resampler->o2h_frame_size);
+
+  for (int i = 0; i < out_frames; i++)
+    {
+      if (resampler->o2h_recenter > 0)
+	{
+	  //Output i fades from input i to input i + n.
+	  g = (i + 0.5) / RECENTER_XFADE_FRAMES;
+	  offset = n;
+	}
+      else
+	{
+	  //Output i fades from input i to input i - n.
+	  g = i < n ? 0.0 : i >= RECENTER_XFADE_FRAMES ? 1.0 :
+	    (i - n + 0.5) / (RECENTER_XFADE_FRAMES - n);
+	  offset = -n;
+	}
+
+      for (int j = 0; j < channels; j++)
+	{
+	  float a = i < RECENTER_XFADE_FRAMES ? src[i * channels + j] : 0.0;
+	  float b = i + offset >= 0 ? src[(i + offset) * channels + j] : 0.0;
+	  dst[i * channels + j] = (1.0 - g) * a + g * b;
+	}
+    }
+
+  resampler->o2h_recenter += resampler->o2h_recenter > 0 ? -n : n;
+  *data = dst;
+
+  return out_frames;
+}
+
+//The target delay only grows up to half of the o2h buffer or the buffer would
+//overflow before reaching it. Past that, underflows are handled as when not
+//in low latency mode.
+static int
+resampler_o2h_can_grow_target_delay (struct ow_resampler *resampler)
+{
+  struct ow_context *context = resampler->engine->context;
+  size_t frames = (context->read_space (context->o2h_audio) +
+		   context->write_space (context->o2h_audio)) /
+    resampler->o2h_frame_size;
+
+  return resampler->dll.target_delay +
+    resampler->engine->frames_per_transfer <= frames / 2;
+}
+
 static long
 resampler_o2h_reader (void *cb_data, float **data)
 {
@@ -280,17 +680,55 @@ resampler_o2h_reader (void *cb_data, float **data)
 
   *data = resampler->o2h_buf_in;
 
+  if (resampler->o2h_hold)
+    {
+      return resampler_o2h_hold (resampler);
+    }
+
   rso2h = context->read_space (context->o2h_audio);
+
+  if (resampler->reading_at_o2h_end && resampler->o2h_recenter)
+    {
+      frames = resampler_o2h_recenter (resampler, rso2h, data);
+      if (frames)
+	{
+	  resampler->dll.frames += frames;
+	  return frames;
+	}
+    }
+
   if (resampler->reading_at_o2h_end)
     {
       if (rso2h >= resampler->o2h_frame_size)
 	{
 	  frames = rso2h / resampler->o2h_frame_size;
-	  frames = frames > MAX_READ_FRAMES ? MAX_READ_FRAMES : frames;
+	  frames = frames > OW_RESAMPLER_MAX_READ_FRAMES ?
+	    OW_RESAMPLER_MAX_READ_FRAMES : frames;
 	  bytes = frames * resampler->o2h_frame_size;
 	  context->read (context->o2h_audio, (void *) resampler->o2h_buf_in,
 			 bytes);
 	}
+      else if (resampler->low_latency &&
+	       resampler_o2h_can_grow_target_delay (resampler))
+	{
+	  uint32_t frames_per_transfer =
+	    resampler->engine->frames_per_transfer;
+
+	  //The buffer grows by holding the reads and the DLL keeps its error as the target grows by the same amount.
+	  resampler->o2h_hold = frames_per_transfer;
+	  ow_dll_host_set_target_delay (&resampler->dll,
+					resampler->dll.target_delay +
+					frames_per_transfer);
+
+	  debug_print (2,
+		       "o2h: Audio ring buffer underflow (%zu B < %zu B). Target delay increased to %.1f ms",
+		       rso2h, resampler->engine->o2h_transfer_size,
+		       ow_resampler_get_target_delay_ms (resampler));
+	  ow_resampler_reset_headroom (resampler,
+				       resampler->headroom_start_usecs);
+
+	  return resampler_o2h_hold (resampler);
+	}
       else
 	{
 	  debug_print (3,
@@ -303,7 +741,7 @@ resampler_o2h_reader (void *cb_data, float **data)
 	    resampler->engine->latency_o2h_min;
 	  pthread_spin_unlock (&resampler->engine->lock);
 
-	  frames = MAX_READ_FRAMES;
+	  frames = OW_RESAMPLER_MAX_READ_FRAMES;
 	}
     }
   else
@@ -315,8 +753,9 @@ resampler_o2h_reader (void *cb_data, float **data)
 		       bytes);
 	  context->read (context->o2h_audio, NULL, bytes);
 	  resampler->reading_at_o2h_end = 1;
+	  resampler->o2h_align = resampler->low_latency;
 	}
-      frames = MAX_READ_FRAMES;
+      frames = OW_RESAMPLER_MAX_READ_FRAMES;
     }
 
   resampler->dll.frames += frames;
@@ -340,9 +779,109 @@ ow_resampler_read_audio (struct ow_resampler *resampler)
       return -1;
     }
 
+  //The headroom is what is left in the buffer at the end of the cycle.
+  if (resampler->low_latency && resampler->reading_at_o2h_end &&
+      !resampler->o2h_align && !resampler->o2h_hold)
+    {
+      struct ow_context *context = resampler->engine->context;
+      size_t headroom = context->read_space (context->o2h_audio) /
+	resampler->o2h_frame_size;
+      if (headroom >= OW_RESAMPLER_HEADROOM_BINS)
+	{
+	  headroom = OW_RESAMPLER_HEADROOM_BINS - 1;
+	}
+      resampler->headroom[headroom]++;
+      resampler->headroom_count++;
+    }
+
   return 0;
 }
 
+static void
+ow_resampler_align_o2h (struct ow_resampler *resampler,
+			uint64_t current_usecs)
+{
+  struct ow_context *context = resampler->engine->context;
+  int frames = context->read_space (context->o2h_audio) /
+    resampler->o2h_frame_size;
+
+  debug_print (2, "%s (%s): Aligning o2h buffer (%d frames)...",
+	       resampler->engine->name, resampler->engine->overbridge_name,
+	       frames);
+
+  ow_dll_host_align (&resampler->dll, frames);
+
+  //Starting at the current target avoids underflows while learning.
+  if (frames < resampler->dll.target_delay)
+    {
+      resampler->o2h_hold = resampler->dll.target_delay - frames;
+    }
+
+  resampler->o2h_align = 0;
+  ow_resampler_reset_headroom (resampler, current_usecs);
+}
+
+//The DLL is realigned to its target at once and the o2h buffer follows it.
+static void
+ow_resampler_recenter_o2h (struct ow_resampler *resampler,
+			   uint64_t current_usecs)
+{
+  int frames = floor (resampler->dll.err + 0.5);
+
+  if (abs (frames) < RECENTER_MIN_FRAMES)
+    {
+      return;
+    }
+
+  debug_print (2, "%s (%s): Recentering o2h buffer (%d frames)...",
+	       resampler->engine->name, resampler->engine->overbridge_name,
+	       frames);
+
+  ow_dll_host_align (&resampler->dll, resampler->dll.target_delay);
+  resampler->o2h_recenter += frames;
+  ow_resampler_reset_headroom (resampler, current_usecs);
+}
+
+static void
+ow_resampler_adapt_target_delay (struct ow_resampler *resampler,
+				 uint64_t current_usecs)
+{
+  int headroom, shrink;
+  uint32_t count = 0;
+  uint32_t max_count = resampler->headroom_count * LOW_LATENCY_QUANTILE;
+
+  if (!resampler->headroom_count)
+    {
+      ow_resampler_reset_headroom (resampler, current_usecs);
+      return;
+    }
+
+  for (headroom = 0; headroom < OW_RESAMPLER_HEADROOM_BINS - 1; headroom++)
+    {
+      count += resampler->headroom[headroom];
+      if (count > max_count)
+	{
+	  break;
+	}
+    }
+
+  shrink = headroom - LOW_LATENCY_MARGIN;
+  if (shrink > 0)
+    {
+      shrink = shrink > LOW_LATENCY_SHRINK_STEP ? LOW_LATENCY_SHRINK_STEP :
+	shrink;
+      ow_dll_host_set_target_delay (&resampler->dll,
+				    resampler->dll.target_delay - shrink);
+      debug_print (2,
+		   "%s (%s): o2h headroom is %d frames. Target delay decreased to %.1f ms",
+		   resampler->engine->name,
+		   resampler->engine->overbridge_name, headroom,
+		   ow_resampler_get_target_delay_ms (resampler));
+    }
+
+  ow_resampler_reset_headroom (resampler, current_usecs);
+}
+
 int
 ow_resampler_write_audio (struct ow_resampler *resampler)
 {
@@ -351,7 +890,6 @@ ow_resampler_write_audio (struct ow_resampler *resampler)
   int frames;
   size_t bytes;
   size_t wsh2o;
-  static double h2o_acc = .0;
   ow_resampler_status_t status = ow_resampler_get_status (resampler);
   struct ow_context *context = resampler->engine->context;
 
@@ -366,9 +904,9 @@ ow_resampler_write_audio (struct ow_resampler *resampler)
 	  resampler->h2o_bufsize);
   resampler->h2o_queue_len += resampler->bufsize;
 
-  h2o_acc += resampler->bufsize * (resampler->h2o_ratio - 1.0);
-  inc = trunc (h2o_acc);
-  h2o_acc -= inc;
+  resampler->h2o_acc += resampler->bufsize * (resampler->h2o_ratio - 1.0);
+  inc = trunc (resampler->h2o_acc);
+  resampler->h2o_acc -= inc;
   frames = resampler->bufsize + inc;
 
   gen_frames = src_callback_read (resampler->h2o_state, resampler->h2o_ratio,
@@ -398,23 +936,75 @@ ow_resampler_write_audio (struct ow_resampler *resampler)
   return 0;
 }
 
+//Called from the audio thread at the beginning of every cycle.
+static inline int
+ow_resampler_swap_states (struct ow_resampler *resampler)
+{
+  int swapped = 0;
+
+  pthread_spin_lock (&resampler->lock);
+  if (resampler->o2h_state_next)
+    {
+      swapped = 1;
+      resampler->h2o_state_prev = resampler->h2o_state;
+      resampler->o2h_state_prev = resampler->o2h_state;
+      resampler->h2o_state = resampler->h2o_state_next;
+      resampler->o2h_state = resampler->o2h_state_next;
+      resampler->h2o_state_next = NULL;
+      resampler->o2h_state_next = NULL;
+    }
+  pthread_spin_unlock (&resampler->lock);
+
+  return swapped;
+}
+
 int
 ow_resampler_compute_ratios (struct ow_resampler *resampler,
 			     uint64_t current_usecs, int xrun,
 			     void (*audio_running_cb) (void *), void *cb_data)
 {
-  int retune_required = xrun;
   ow_engine_status_t engine_status;
   struct ow_dll *dll = &resampler->dll;
   ow_resampler_status_t status;
+  //New states fill their history with the frames read in the cycle they are
+  //swapped in, so the DLL only sees that delay change in the next one.
+  int retune_required = xrun || resampler->states_swapped;
 
   engine_status = ow_engine_get_status (resampler->engine);
   status = ow_resampler_get_status (resampler);
 
+  resampler->states_swapped = ow_resampler_swap_states (resampler);
+
+  if (xrun)
+    {
+      resampler->xruns++;
+    }
+
+  if (resampler->stats)
+    {
+      ow_resampler_update_stats (resampler, current_usecs);
+    }
+
+  //The engine restarts the handshake after reconnecting.
+  if (status > OW_RESAMPLER_STATUS_READY &&
+      (engine_status == OW_ENGINE_STATUS_RECONNECT ||
+       (engine_status > OW_ENGINE_STATUS_STOP &&
+	engine_status < OW_ENGINE_STATUS_BOOT)))
+    {
+      ow_resampler_restart (resampler);
+      return 0;
+    }
+
   if (status == OW_RESAMPLER_STATUS_READY &&
-      engine_status <= OW_ENGINE_STATUS_BOOT)
+      (engine_status <= OW_ENGINE_STATUS_BOOT ||
+       engine_status == OW_ENGINE_STATUS_RECONNECT))
     {
-      if (engine_status <= OW_ENGINE_STATUS_STOP)
+      if (engine_status == OW_ENGINE_STATUS_ERROR &&
+	  resampler->engine->reconnect)
+	{
+	  return 0;
+	}
+      else if (engine_status <= OW_ENGINE_STATUS_STOP)
 	{
 	  return 1;
 	}
@@ -435,7 +1025,7 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
 	}
       else
 	{
-	  // OW_ENGINE_STATUS_BOOT
+	  // OW_ENGINE_STATUS_BOOT or OW_ENGINE_STATUS_RECONNECT
 	  return 0;
 	}
     }
@@ -446,6 +1036,11 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
 
   ow_dll_host_update_error (dll, current_usecs);
 
+  if (resampler->o2h_align)
+    {
+      ow_resampler_align_o2h (resampler, current_usecs);
+    }
+
   if (status == OW_RESAMPLER_STATUS_READY &&
       engine_status == OW_ENGINE_STATUS_WAIT)
     {
@@ -453,10 +1048,33 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
 		   resampler->engine->name,
 		   resampler->engine->overbridge_name);
 
-      ow_dll_host_set_loop_filter (dll, 1.0, resampler->bufsize,
-				   resampler->samplerate);
+      if (dll->warm)
+	{
+	  //The previous state only needs to be verified.
+	  debug_print (1, "%s (%s): Tuning resampler from previous state...",
+		       resampler->engine->name,
+		       resampler->engine->overbridge_name);
+
+	  ow_dll_host_set_loop_filter (dll, TUNING_BANDWIDTH,
+				       resampler->bufsize,
+				       resampler->samplerate);
+
+	  ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_TUNE);
+
+	  resampler->log_control_cycles =
+	    resampler->report_period * resampler->samplerate /
+	    resampler->bufsize;
+	  resampler->log_cycles = 0;
+	}
+      else
+	{
+	  ow_dll_host_set_loop_filter (dll, BOOTING_BANDWIDTH,
+				       resampler->bufsize,
+				       resampler->samplerate);
+
+	  ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_BOOT);
+	}
 
-      ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_BOOT);
       ow_resampler_report_state (resampler);
 
       resampler->phase_start_usecs = current_usecs;
@@ -464,22 +1082,34 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
       return 0;
     }
 
+  //Missed cycles and new states leave a step in the error that the loop must not see.
+  if (retune_required && status >= OW_RESAMPLER_STATUS_RUN)
+    {
+      ow_resampler_recenter_o2h (resampler, current_usecs);
+    }
+
   if (ow_dll_host_update (dll))
     {
       retune_required = 1;		// Something serious happened to the ratio.
+
+      if (status >= OW_RESAMPLER_STATUS_RUN)
+	{
+	  ow_dll_host_set_ratio (dll, resampler->run_ratio);
+	  ow_resampler_recenter_o2h (resampler, current_usecs);
+	}
     }
 
   ow_resampler_set_ratios_from_dll (resampler);
 
   if (status == OW_RESAMPLER_STATUS_BOOT &&
       current_usecs - resampler->phase_start_usecs > BOOTING_PERIOD_US &&
-      ow_dll_tuned (dll, BOOTING_ERROR))
+      ow_dll_tuned (dll, BOOTING_ERROR, BOOTING_DEVIATION))
     {
       debug_print (1, "%s (%s): Tuning resampler...", resampler->engine->name,
 		   resampler->engine->overbridge_name);
 
-      ow_dll_host_set_loop_filter (dll, 0.5, resampler->bufsize,
-				   resampler->samplerate);
+      ow_dll_host_set_loop_filter (dll, TUNING_BANDWIDTH,
+				   resampler->bufsize, resampler->samplerate);
 
       ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_TUNE);
 
@@ -498,39 +1128,57 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
 	  resampler->phase_start_usecs = current_usecs;
 	}
       else if (current_usecs - resampler->phase_start_usecs > TUNING_PERIOD_US
-	       && ow_dll_tuned (dll, TUNING_ERROR))
+	       && ow_dll_tuned (dll, TUNING_ERROR, TUNING_DEVIATION))
 	{
 	  debug_print (1, "%s (%s): Running resampler...",
 		       resampler->engine->name,
 		       resampler->engine->overbridge_name);
 
-	  ow_dll_host_set_loop_filter (dll, 0.05, resampler->bufsize,
+	  ow_dll_host_set_loop_filter (dll, RUNNING_BANDWIDTH,
+				       resampler->bufsize,
 				       resampler->samplerate);
 
-	  ow_engine_set_status (resampler->engine, OW_ENGINE_STATUS_RUN);
-
 	  ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_RUN);
+	  resampler->run_ratio = dll->ratio;
 
-	  audio_running_cb (cb_data);
+	  //When retuning, the audio never stopped.
+	  if (status == OW_RESAMPLER_STATUS_TUNE)
+	    {
+	      ow_engine_set_status (resampler->engine, OW_ENGINE_STATUS_RUN);
 
-	  ow_resampler_clear_buffers (resampler);
+	      audio_running_cb (cb_data);
+
+	      ow_resampler_clear_buffers (resampler);
+	    }
 	}
     }
 
+  //The loop is widened for a while but the buffers are kept and the audio keeps flowing.
   if (status == OW_RESAMPLER_STATUS_RUN && retune_required)
     {
       debug_print (1, "%s (%s): Retuning resampler...",
 		   resampler->engine->name,
 		   resampler->engine->overbridge_name);
 
-      ow_dll_host_set_loop_filter (dll, 0.5, resampler->bufsize,
-				   resampler->samplerate);
+      ow_dll_host_set_loop_filter (dll, TUNING_BANDWIDTH,
+				   resampler->bufsize, resampler->samplerate);
 
       ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_RETUNE);
+      resampler->retunes++;
 
-      ow_resampler_clear_buffers (resampler);
       resampler->phase_start_usecs = current_usecs;
     }
+  else if (status == OW_RESAMPLER_STATUS_RUN)
+    {
+      resampler->run_ratio = dll->ratio;
+    }
+
+  if (status == OW_RESAMPLER_STATUS_RUN && resampler->low_latency &&
+      current_usecs - resampler->headroom_start_usecs >
+      LOW_LATENCY_PERIOD_US)
+    {
+      ow_resampler_adapt_target_delay (resampler, current_usecs);
+    }
 
   resampler->log_cycles++;
   if (resampler->log_cycles == resampler->log_control_cycles)
@@ -542,24 +1190,13 @@ ow_resampler_compute_ratios (struct ow_resampler *resampler,
   return 0;
 }
 
-ow_err_t
-ow_resampler_init_from_device (struct ow_resampler **resampler_,
-			       struct ow_device *device,
-			       unsigned int blocks_per_transfer,
-			       unsigned int xfr_timeout, unsigned int quality)
+void
+ow_resampler_init_mem (struct ow_resampler *resampler,
+		       struct ow_engine *engine, unsigned int quality)
 {
-  struct ow_resampler *resampler = malloc (sizeof (struct ow_resampler));
-  ow_err_t err = ow_engine_init_from_device (&resampler->engine,
-					     device,
-					     blocks_per_transfer,
-					     xfr_timeout);
-  if (err)
-    {
-      free (resampler);
-      return err;
-    }
+  const struct ow_device *device = engine->device;
 
-  *resampler_ = resampler;
+  resampler->engine = engine;
 
   pthread_spin_init (&resampler->lock, PTHREAD_PROCESS_SHARED);
 
@@ -569,6 +1206,19 @@ ow_resampler_init_from_device (struct ow_resampler **resampler_,
   resampler->h2o_frame_size = device->desc.inputs * OW_BYTES_PER_SAMPLE;
   resampler->h2o_aux = NULL;
   resampler->status = OW_RESAMPLER_STATUS_STOP;
+  resampler->host_name = NULL;
+  resampler->dll_ratio = 0;
+  resampler->dll_ob_rate = 0;
+  resampler->dll_cached = 0;
+  resampler->low_latency = 0;
+  resampler->o2h_align = 0;
+  resampler->o2h_hold = 0;
+  resampler->o2h_recenter = 0;
+  resampler->run_ratio = 1.0;
+  resampler->h2o_acc = .0;
+  resampler->stats = NULL;
+  resampler->xruns = 0;
+  resampler->retunes = 0;
 
   resampler->h2o_state = src_callback_new (resampler_h2o_reader, quality,
 					   device->desc.inputs, NULL,
@@ -576,6 +1226,11 @@ ow_resampler_init_from_device (struct ow_resampler **resampler_,
   resampler->o2h_state = src_callback_new (resampler_o2h_reader, quality,
 					   device->desc.outputs, NULL,
 					   resampler);
+  resampler->h2o_state_next = NULL;
+  resampler->o2h_state_next = NULL;
+  resampler->h2o_state_prev = NULL;
+  resampler->o2h_state_prev = NULL;
+  resampler->states_swapped = 0;
 
   resampler->report_period = DEFAULT_REPORT_PERIOD;
   resampler->log_control_cycles = 0;
@@ -583,16 +1238,55 @@ ow_resampler_init_from_device (struct ow_resampler **resampler_,
   pthread_spin_lock (&resampler->engine->lock);
   ow_dll_host_init (&resampler->dll);
   pthread_spin_unlock (&resampler->engine->lock);
+}
+
+ow_err_t
+ow_resampler_init_from_device (struct ow_resampler **resampler_,
+			       struct ow_device *device,
+			       unsigned int blocks_per_transfer,
+			       unsigned int xfr_timeout, unsigned int quality)
+{
+  struct ow_engine *engine;
+  struct ow_resampler *resampler;
+  ow_err_t err = ow_engine_init_from_device (&engine, device,
+					     blocks_per_transfer,
+					     xfr_timeout);
+  if (err)
+    {
+      return err;
+    }
+
+  resampler = malloc (sizeof (struct ow_resampler));
+  ow_resampler_init_mem (resampler, engine, quality);
+  *resampler_ = resampler;
 
   return OW_OK;
 }
 
+static void
+ow_resampler_delete_states (SRC_STATE *h2o_state, SRC_STATE *o2h_state)
+{
+  if (h2o_state)
+    {
+      src_delete (h2o_state);
+    }
+  if (o2h_state)
+    {
+      src_delete (o2h_state);
+    }
+}
+
 void
-ow_resampler_destroy (struct ow_resampler *resampler)
+ow_resampler_free_mem (struct ow_resampler *resampler)
 {
   src_delete (resampler->h2o_state);
   src_delete (resampler->o2h_state);
+  ow_resampler_delete_states (resampler->h2o_state_next,
+			      resampler->o2h_state_next);
+  ow_resampler_delete_states (resampler->h2o_state_prev,
+			      resampler->o2h_state_prev);
   pthread_spin_destroy (&resampler->lock);
+  g_free (resampler->host_name);
   if (resampler->h2o_aux)
     {
       free (resampler->h2o_aux);
@@ -601,7 +1295,14 @@ ow_resampler_destroy (struct ow_resampler *resampler)
       free (resampler->h2o_queue);
       free (resampler->o2h_buf_in);
       free (resampler->o2h_buf_out);
+      free (resampler->o2h_xfade);
     }
+}
+
+void
+ow_resampler_destroy (struct ow_resampler *resampler)
+{
+  ow_resampler_free_mem (resampler);
   ow_engine_destroy (resampler->engine);
   free (resampler);
 }
@@ -623,20 +1324,31 @@ ow_resampler_init_samplerate (struct ow_resampler *resampler,
   resampler->samplerate = samplerate;
 }
 
-ow_err_t
-ow_resampler_start (struct ow_resampler *resampler,
-		    struct ow_context *context, uint32_t samplerate,
-		    uint32_t bufsize)
+void
+ow_resampler_init_host (struct ow_resampler *resampler,
+			struct ow_context *context, uint32_t samplerate,
+			uint32_t bufsize)
 {
   ow_resampler_init_samplerate (resampler, samplerate);
   ow_resampler_init_buffer_size (resampler, bufsize);
+  ow_resampler_load_dll (resampler);
   ow_resampler_reset_dll (resampler);
+  resampler->stats_usecs = 0;
+  resampler->stats_cycle_usecs = 0;
 
   context->dll = &resampler->dll;
   context->dll_overbridge_init = ow_dll_overbridge_init;
   context->dll_overbridge_update = ow_dll_overbridge_update;
 
   ow_resampler_set_status (resampler, OW_RESAMPLER_STATUS_READY);
+}
+
+ow_err_t
+ow_resampler_start (struct ow_resampler *resampler,
+		    struct ow_context *context, uint32_t samplerate,
+		    uint32_t bufsize)
+{
+  ow_resampler_init_host (resampler, context, samplerate, bufsize);
 
   return ow_engine_start (resampler->engine, context);
 }
@@ -646,6 +1358,122 @@ ow_resampler_wait (struct ow_resampler *resampler)
 {
   ow_engine_wait (resampler->engine);
   ow_resampler_report_state (resampler);
+
+  if (ow_resampler_is_tuned (ow_resampler_get_status (resampler)))
+    {
+      ow_resampler_save_dll (resampler);
+    }
+}
+
+//Only a locked DLL is worth keeping.
+int
+ow_resampler_get_dll_state (struct ow_resampler *resampler, double *ratio,
+			    double *ob_rate)
+{
+  ow_resampler_status_t status = ow_resampler_get_status (resampler);
+
+  if (!ow_resampler_is_tuned (status))
+    {
+      return -1;
+    }
+
+  ow_resampler_get_dll_values (resampler, ratio, ob_rate);
+
+  return 0;
+}
+
+//This replaces the state stored in the file the next time the resampler
+//starts, e.g., when a device is attached again.
+void
+ow_resampler_set_dll_state (struct ow_resampler *resampler, double ratio,
+			    double ob_rate)
+{
+  resampler->dll_ratio = ratio;
+  resampler->dll_ob_rate = ob_rate;
+  resampler->dll_cached = 1;
+}
+
+void
+ow_resampler_set_low_latency (struct ow_resampler *resampler,
+			      int low_latency)
+{
+  resampler->low_latency = low_latency;
+}
+
+void
+ow_resampler_set_reconnect (struct ow_resampler *resampler, int reconnect)
+{
+  ow_engine_set_reconnect (resampler->engine, reconnect);
+}
+
+//The states are created here and swapped by the audio thread at the
+//beginning of the next cycle so that the audio is never interrupted.
+//As they start without history, the delay changes, so the o2h buffer is
+//recentered and the DLL retunes right after.
+int
+ow_resampler_set_quality (struct ow_resampler *resampler,
+			  unsigned int quality)
+{
+  int err;
+  SRC_STATE *h2o_state, *o2h_state;
+  SRC_STATE *h2o_unused, *o2h_unused, *h2o_prev, *o2h_prev;
+  const struct ow_device_desc *desc = &resampler->engine->device->desc;
+
+  h2o_state = src_callback_new (resampler_h2o_reader, quality, desc->inputs,
+				&err, resampler);
+  if (!h2o_state)
+    {
+      error_print ("Error while creating h2o resampler: %s",
+		   src_strerror (err));
+      return -1;
+    }
+
+  o2h_state = src_callback_new (resampler_o2h_reader, quality, desc->outputs,
+				&err, resampler);
+  if (!o2h_state)
+    {
+      error_print ("Error while creating o2h resampler: %s",
+		   src_strerror (err));
+      src_delete (h2o_state);
+      return -1;
+    }
+
+  debug_print (1, "Setting resampler quality to %d...", quality);
+
+  pthread_spin_lock (&resampler->lock);
+  h2o_unused = resampler->h2o_state_next;
+  o2h_unused = resampler->o2h_state_next;
+  h2o_prev = resampler->h2o_state_prev;
+  o2h_prev = resampler->o2h_state_prev;
+  resampler->h2o_state_next = h2o_state;
+  resampler->o2h_state_next = o2h_state;
+  resampler->h2o_state_prev = NULL;
+  resampler->o2h_state_prev = NULL;
+  pthread_spin_unlock (&resampler->lock);
+
+  ow_resampler_delete_states (h2o_unused, o2h_unused);
+  ow_resampler_delete_states (h2o_prev, o2h_prev);
+
+  return 0;
+}
+
+//The engine also updates the USB cycle histogram in the same slot.
+void
+ow_resampler_set_stats (struct ow_resampler *resampler,
+			struct ow_stats_device *stats)
+{
+  resampler->stats = stats;
+  resampler->stats_usecs = 0;
+  resampler->stats_cycle_usecs = 0;
+  resampler->engine->stats = stats;
+}
+
+void
+ow_resampler_set_host_name (struct ow_resampler *resampler,
+			    const char *host_name)
+{
+  g_free (resampler->host_name);
+  resampler->host_name = host_name ? g_strdup (host_name) : NULL;
 }
 
 inline void
@@ -22,6 +22,12 @@
 #include "engine.h"
 #include "overwitch.h"
 
+//Histogram size used to learn the o2h buffer headroom in low latency mode
+#define OW_RESAMPLER_HEADROOM_BINS 1024
+
+//Maximum frames read from the o2h buffer at once
+#define OW_RESAMPLER_MAX_READ_FRAMES 5
+
 struct ow_resampler
 {
   pthread_spinlock_t lock;
@@ -32,6 +38,13 @@ struct ow_resampler
   double h2o_ratio;
   SRC_STATE *h2o_state;
   SRC_STATE *o2h_state;
+  //States with a new quality to be used from the next cycle on and the
+  //replaced ones, which are freed outside the audio thread.
+  SRC_STATE *h2o_state_next;
+  SRC_STATE *o2h_state_next;
+  SRC_STATE *h2o_state_prev;
+  SRC_STATE *o2h_state_prev;
+  int states_swapped;		//Set in the cycle the new states start to be used
   float *h2o_buf_in;
   float *h2o_buf_out;
   float *h2o_aux;
@@ -39,6 +52,7 @@ struct ow_resampler
   float *o2h_buf_in;
   float *o2h_buf_out;
   size_t h2o_queue_len;
+  double h2o_acc;
   int log_control_cycles;
   int log_cycles;
   int reading_at_o2h_end;
@@ -54,4 +68,38 @@ struct ow_resampler
   int report_period;
   struct ow_resampler_state state;
   uint64_t phase_start_usecs;
+  //Identifies the host clock in the stored DLL states
+  char *host_name;
+  //Previous DLL state with the ratio normalized to OB_SAMPLE_RATE
+  double dll_ratio;
+  double dll_ob_rate;
+  int dll_cached;		//Set by the caller instead of loaded from the file
+  //Low latency mode
+  int low_latency;
+  int o2h_align;
+  uint32_t o2h_hold;		//Silent frames to produce without reading from the o2h buffer
+  uint32_t headroom[OW_RESAMPLER_HEADROOM_BINS];
+  uint32_t headroom_count;
+  uint64_t headroom_start_usecs;
+  //Recovery from xruns and ratio clamps without clearing the buffers
+  int o2h_recenter;		//Frames to drop (positive) or insert (negative) with a crossfade
+  float *o2h_xfade;
+  double run_ratio;		//Last ratio used while running
+  //Live statistics
+  struct ow_stats_device *stats;
+  uint64_t stats_usecs;
+  uint64_t stats_cycle_usecs;
+  uint64_t xruns;
+  uint64_t retunes;
 };
+
+//These do not touch the device so the DLL simulator can drive a resampler
+//with a simulated engine.
+
+void ow_resampler_init_mem (struct ow_resampler *, struct ow_engine *,
+			    unsigned int);
+
+void ow_resampler_free_mem (struct ow_resampler *);
+
+void ow_resampler_init_host (struct ow_resampler *, struct ow_context *,
+			     uint32_t, uint32_t);
@@ -0,0 +1,146 @@
+/*
+ *   ringbuffer.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "ringbuffer.h"
+#include "utils.h"
+
+struct ow_ringbuffer *
+ow_ringbuffer_new (size_t size)
+{
+  struct ow_ringbuffer *rb;
+
+  if (size > SIZE_MAX / 2 + 1)
+    {
+      return NULL;
+    }
+
+  rb = malloc (sizeof (struct ow_ringbuffer));
+  if (!rb)
+    {
+      return NULL;
+    }
+
+  //A power of 2 size allows masking instead of modulo.
+  rb->size = 1;
+  while (rb->size < size)
+    {
+      rb->size <<= 1;
+    }
+  rb->mask = rb->size - 1;
+  rb->data = malloc (rb->size);
+  if (!rb->data)
+    {
+      free (rb);
+      return NULL;
+    }
+
+  //The ring still works but might cause page faults in RT threads.
+  if (mlock (rb->data, rb->size))
+    {
+      error_print ("Could not lock %zu bytes in memory: %s", rb->size,
+		   strerror (errno));
+    }
+
+  atomic_init (&rb->write_ptr, 0);
+  atomic_init (&rb->read_ptr, 0);
+
+  return rb;
+}
+
+void
+ow_ringbuffer_free (struct ow_ringbuffer *rb)
+{
+  if (!rb)
+    {
+      return;
+    }
+  munlock (rb->data, rb->size);
+  free (rb->data);
+  free (rb);
+}
+
+size_t
+ow_ringbuffer_read_space (void *buffer)
+{
+  struct ow_ringbuffer *rb = buffer;
+  size_t w = atomic_load_explicit (&rb->write_ptr, memory_order_acquire);
+  size_t r = atomic_load_explicit (&rb->read_ptr, memory_order_relaxed);
+  return w - r;
+}
+
+size_t
+ow_ringbuffer_write_space (void *buffer)
+{
+  struct ow_ringbuffer *rb = buffer;
+  size_t w = atomic_load_explicit (&rb->write_ptr, memory_order_relaxed);
+  size_t r = atomic_load_explicit (&rb->read_ptr, memory_order_acquire);
+  return rb->size - (w - r);
+}
+
+//As with jack_ringbuffer_read_advance, a NULL destination just discards the data.
+size_t
+ow_ringbuffer_read (void *buffer, char *dst, size_t size)
+{
+  size_t r, pos, n;
+  struct ow_ringbuffer *rb = buffer;
+  size_t available = ow_ringbuffer_read_space (buffer);
+
+  size = size > available ? available : size;
+  r = atomic_load_explicit (&rb->read_ptr, memory_order_relaxed);
+
+  if (dst)
+    {
+      pos = r & rb->mask;
+      n = rb->size - pos;
+      n = n > size ? size : n;
+      memcpy (dst, &rb->data[pos], n);
+      memcpy (dst + n, rb->data, size - n);
+    }
+
+  atomic_store_explicit (&rb->read_ptr, r + size, memory_order_release);
+
+  return dst ? size : 0;
+}
+
+size_t
+ow_ringbuffer_write (void *buffer, const char *src, size_t size)
+{
+  size_t w, pos, n;
+  struct ow_ringbuffer *rb = buffer;
+  size_t available = ow_ringbuffer_write_space (buffer);
+
+  size = size > available ? available : size;
+  w = atomic_load_explicit (&rb->write_ptr, memory_order_relaxed);
+
+  pos = w & rb->mask;
+  n = rb->size - pos;
+  n = n > size ? size : n;
+  memcpy (&rb->data[pos], src, n);
+  memcpy (rb->data, src + n, size - n);
+
+  atomic_store_explicit (&rb->write_ptr, w + size, memory_order_release);
+
+  return size;
+}
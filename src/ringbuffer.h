@@ -0,0 +1,49 @@
+/*
+ *   ringbuffer.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+//Lock-free single producer and single consumer ring buffer.
+//The functions follow the ow_context buffer signatures so it can be used
+//by the clients that do not depend on JACK.
+
+struct ow_ringbuffer
+{
+  char *data;
+  size_t size;
+  size_t mask;
+  atomic_size_t write_ptr;
+  atomic_size_t read_ptr;
+};
+
+struct ow_ringbuffer *ow_ringbuffer_new (size_t);
+
+void ow_ringbuffer_free (struct ow_ringbuffer *);
+
+size_t ow_ringbuffer_read_space (void *);
+
+size_t ow_ringbuffer_write_space (void *);
+
+size_t ow_ringbuffer_read (void *, char *, size_t);
+
+size_t ow_ringbuffer_write (void *, const char *, size_t);
@@ -0,0 +1,235 @@
+/*
+ *   stats.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stats.h"
+#include "utils.h"
+
+#define STATS_READ_RETRIES 64
+
+static void
+ow_stats_get_shm_name (char *name, size_t size, pid_t pid)
+{
+  snprintf (name, size, OW_STATS_SHM_PREFIX "%d", pid);
+}
+
+struct ow_stats_page *
+ow_stats_page_new (const char *program)
+{
+  int fd;
+  char name[NAME_MAX];
+  struct ow_stats_page *page;
+  size_t size = sizeof (struct ow_stats_page);
+
+  ow_stats_get_shm_name (name, NAME_MAX, getpid ());
+
+  //Only the same user can read the statistics.
+  fd = shm_open (name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  if (fd < 0)
+    {
+      error_print ("Error while creating shared memory %s", name);
+      return NULL;
+    }
+
+  if (ftruncate (fd, size))
+    {
+      error_print ("Error while sizing shared memory %s", name);
+      goto error;
+    }
+
+  page = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (page == MAP_FAILED)
+    {
+      error_print ("Error while mapping shared memory %s", name);
+      goto error;
+    }
+
+  close (fd);
+
+  //ftruncate fills the segment with zeros so all the slots are inactive.
+  page->version = OW_STATS_VERSION;
+  page->size = size;
+  page->pid = getpid ();
+  snprintf (page->program, OW_LABEL_MAX_LEN, "%s", program);
+  atomic_thread_fence (memory_order_release);
+  page->magic = OW_STATS_MAGIC;
+
+  debug_print (1, "Publishing stats in %s...", name);
+
+  return page;
+
+error:
+  close (fd);
+  shm_unlink (name);
+  return NULL;
+}
+
+void
+ow_stats_page_free (struct ow_stats_page *page)
+{
+  char name[NAME_MAX];
+
+  ow_stats_get_shm_name (name, NAME_MAX, page->pid);
+  munmap (page, sizeof (struct ow_stats_page));
+  shm_unlink (name);
+}
+
+//Readers map the segments read only. The name is the one in /dev/shm.
+struct ow_stats_page *
+ow_stats_page_map (const char *name)
+{
+  int fd;
+  struct stat st;
+  char path[NAME_MAX];
+  struct ow_stats_page *page;
+
+  snprintf (path, NAME_MAX, "/%s", name);
+
+  fd = shm_open (path, O_RDONLY, 0);
+  if (fd < 0)
+    {
+      return NULL;
+    }
+
+  if (fstat (fd, &st) || st.st_size != sizeof (struct ow_stats_page))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  page = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (page == MAP_FAILED)
+    {
+      return NULL;
+    }
+
+  if (page->magic != OW_STATS_MAGIC || page->version != OW_STATS_VERSION ||
+      page->size != sizeof (struct ow_stats_page))
+    {
+      munmap (page, st.st_size);
+      return NULL;
+    }
+
+  return page;
+}
+
+void
+ow_stats_page_unmap (struct ow_stats_page *page)
+{
+  munmap (page, sizeof (struct ow_stats_page));
+}
+
+//Only to be called when the writer of the slot has finished.
+void
+ow_stats_device_clear (struct ow_stats_device *stats)
+{
+  ow_stats_device_write_begin (stats);
+  stats->active = 0;
+  ow_stats_device_write_end (stats);
+
+  for (int i = 0; i < OW_STATS_HIST_BINS; i++)
+    {
+      atomic_store_explicit (&stats->host_cycles[i], 0,
+			     memory_order_relaxed);
+      atomic_store_explicit (&stats->usb_cycles[i], 0, memory_order_relaxed);
+    }
+
+  for (int i = 0; i < OW_STATS_LATENCY_BINS; i++)
+    {
+      atomic_store_explicit (&stats->o2h_latency[i], 0,
+			     memory_order_relaxed);
+      atomic_store_explicit (&stats->h2o_latency[i], 0,
+			     memory_order_relaxed);
+    }
+}
+
+inline void
+ow_stats_device_write_begin (struct ow_stats_device *stats)
+{
+  unsigned int seq = atomic_load_explicit (&stats->seq, memory_order_relaxed);
+  atomic_store_explicit (&stats->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+}
+
+inline void
+ow_stats_device_write_end (struct ow_stats_device *stats)
+{
+  unsigned int seq = atomic_load_explicit (&stats->seq, memory_order_relaxed);
+  atomic_store_explicit (&stats->seq, seq + 1, memory_order_release);
+}
+
+//Copies the seqlock protected part of the slot. The histograms are not copied.
+int
+ow_stats_device_read (struct ow_stats_device *stats,
+		      struct ow_stats_device *copy)
+{
+  unsigned int seq0, seq1;
+  size_t size = offsetof (struct ow_stats_device, host_cycles);
+
+  for (int i = 0; i < STATS_READ_RETRIES; i++)
+    {
+      seq0 = atomic_load_explicit (&stats->seq, memory_order_acquire);
+      if (seq0 & 1)
+	{
+	  continue;
+	}
+
+      memcpy (copy, stats, size);
+      atomic_thread_fence (memory_order_acquire);
+
+      seq1 = atomic_load_explicit (&stats->seq, memory_order_relaxed);
+      if (seq0 == seq1)
+	{
+	  return 0;
+	}
+    }
+
+  return -1;
+}
+
+inline void
+ow_stats_hist_add (atomic_uint_least64_t *hist, uint64_t usecs)
+{
+  uint64_t bin = usecs ? (usecs - 1) / OW_STATS_HIST_BIN_USECS : 0;
+  if (bin >= OW_STATS_HIST_BINS)
+    {
+      bin = OW_STATS_HIST_BINS - 1;
+    }
+  atomic_fetch_add_explicit (&hist[bin], 1, memory_order_relaxed);
+}
+
+inline void
+ow_stats_latency_add (atomic_uint_least64_t *hist, uint32_t frames)
+{
+  uint32_t bin = frames ? (frames - 1) / OW_STATS_LATENCY_BIN_FRAMES : 0;
+  if (bin >= OW_STATS_LATENCY_BINS)
+    {
+      bin = OW_STATS_LATENCY_BINS - 1;
+    }
+  atomic_fetch_add_explicit (&hist[bin], 1, memory_order_relaxed);
+}
@@ -0,0 +1,100 @@
+/*
+ *   stats.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "overwitch.h"
+
+//Live statistics published in a POSIX shared memory segment named after the
+//process id so that any number of monitoring tools can map it and read it at
+//any rate without D-Bus calls and without touching the locks of the audio
+//threads. Every device slot is versioned with a seqlock: the sequence is odd
+//while the slot is being written and readers retry if it changed.
+
+#define OW_STATS_SHM_PREFIX "/overwitch-"
+#define OW_STATS_MAGIC 0x5453574f	//"OWST"
+#define OW_STATS_VERSION 3
+#define OW_STATS_MAX_DEVICES 64
+
+//Histograms of the time between cycles with bins of 100 us. Every bin
+//includes its upper bound and the last one also counts everything above.
+#define OW_STATS_HIST_BINS 100
+#define OW_STATS_HIST_BIN_USECS 100
+
+//Histograms of the buffer latencies, sampled every time the slot is
+//published, with bins of 16 frames.
+#define OW_STATS_LATENCY_BINS 128
+#define OW_STATS_LATENCY_BIN_FRAMES 16
+
+struct ow_stats_device
+{
+  atomic_uint seq;
+  uint32_t active;
+  char name[OW_LABEL_MAX_LEN];	//Overbridge name
+  char device[OW_LABEL_MAX_LEN];
+  uint8_t bus;
+  uint8_t address;
+  uint32_t samplerate;
+  uint32_t buffer_size;
+  double target_delay_ms;
+  uint64_t updated_usecs;
+  struct ow_resampler_state state;
+  struct ow_engine_counters counters;
+  uint64_t xruns;
+  uint64_t retunes;
+  double dll_error;		//In frames
+  //Histograms are updated every cycle out of the seqlock.
+  atomic_uint_least64_t host_cycles[OW_STATS_HIST_BINS];
+  atomic_uint_least64_t usb_cycles[OW_STATS_HIST_BINS];
+  atomic_uint_least64_t o2h_latency[OW_STATS_LATENCY_BINS];
+  atomic_uint_least64_t h2o_latency[OW_STATS_LATENCY_BINS];
+};
+
+struct ow_stats_page
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;
+  int32_t pid;
+  char program[OW_LABEL_MAX_LEN];
+  struct ow_stats_device devices[OW_STATS_MAX_DEVICES];
+};
+
+struct ow_stats_page *ow_stats_page_new (const char *program);
+
+void ow_stats_page_free (struct ow_stats_page *);
+
+struct ow_stats_page *ow_stats_page_map (const char *name);
+
+void ow_stats_page_unmap (struct ow_stats_page *);
+
+void ow_stats_device_clear (struct ow_stats_device *);
+
+void ow_stats_device_write_begin (struct ow_stats_device *);
+
+void ow_stats_device_write_end (struct ow_stats_device *);
+
+int ow_stats_device_read (struct ow_stats_device *, struct ow_stats_device *);
+
+void ow_stats_hist_add (atomic_uint_least64_t *, uint64_t);
+
+void ow_stats_latency_add (atomic_uint_least64_t *, uint32_t);
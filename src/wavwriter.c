@@ -0,0 +1,403 @@
+/*
+ *   wavwriter.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include "../config.h"
+#include "overwitch.h"
+#include "utils.h"
+#include "wavwriter.h"
+
+#define FMT_EXTENSIBLE 0xfffe
+#define FMT_CHUNK_SIZE 40
+#define DS64_CHUNK_SIZE 28
+#define DATA_OFFSET OW_WAV_WRITER_ALIGNMENT
+
+static const uint8_t SUBFORMAT_GUID_TAIL[] = {
+  0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+  0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+static char *
+set_id (char *p, const char *id)
+{
+  memcpy (p, id, 4);
+  return p + 4;
+}
+
+static char *
+set_le16 (char *p, uint16_t v)
+{
+  v = htole16 (v);
+  memcpy (p, &v, sizeof (v));
+  return p + sizeof (v);
+}
+
+static char *
+set_le32 (char *p, uint32_t v)
+{
+  v = htole32 (v);
+  memcpy (p, &v, sizeof (v));
+  return p + sizeof (v);
+}
+
+static char *
+set_le64 (char *p, uint64_t v)
+{
+  v = htole64 (v);
+  memcpy (p, &v, sizeof (v));
+  return p + sizeof (v);
+}
+
+//The ds64 chunk replaces the first JUNK chunk, which has the same size, when
+//the sizes do not fit in 32 bits.
+int
+ow_wav_writer_write_header (struct ow_wav_writer *w, uint64_t data_size)
+{
+  char *p = w->header;
+  uint16_t block_align = w->channels * w->bytes_per_sample;
+  uint64_t riff_size = DATA_OFFSET - 8 + data_size + (data_size & 1);
+  int rf64 = riff_size > UINT32_MAX;
+
+  memset (w->header, 0, OW_WAV_WRITER_ALIGNMENT);
+
+  p = set_id (p, rf64 ? "RF64" : "RIFF");
+  p = set_le32 (p, rf64 ? UINT32_MAX : riff_size);
+  p = set_id (p, "WAVE");
+
+  p = set_id (p, rf64 ? "ds64" : "JUNK");
+  p = set_le32 (p, DS64_CHUNK_SIZE);
+  if (rf64)
+    {
+      set_le64 (p, riff_size);
+      set_le64 (p + 8, data_size);
+      set_le64 (p + 16, data_size / block_align);
+    }
+  p += DS64_CHUNK_SIZE;
+
+  p = set_id (p, "fmt ");
+  p = set_le32 (p, FMT_CHUNK_SIZE);
+  p = set_le16 (p, FMT_EXTENSIBLE);
+  p = set_le16 (p, w->channels);
+  p = set_le32 (p, OB_SAMPLE_RATE);
+  p = set_le32 (p, OB_SAMPLE_RATE * block_align);
+  p = set_le16 (p, block_align);
+  p = set_le16 (p, w->bytes_per_sample * 8);
+  p = set_le16 (p, 22);		//Extension size
+  p = set_le16 (p, w->valid_bits);
+  p = set_le32 (p, 0);		//No speaker positions
+  p = set_le16 (p, w->format);
+  memcpy (p, SUBFORMAT_GUID_TAIL, sizeof (SUBFORMAT_GUID_TAIL));
+  p += sizeof (SUBFORMAT_GUID_TAIL);
+
+  //Padding up to the data chunk
+  p = set_id (p, "JUNK");
+  p = set_le32 (p, DATA_OFFSET - 8 - (p + 4 - w->header));
+
+  p = w->header + DATA_OFFSET - 8;
+  p = set_id (p, "data");
+  set_le32 (p, rf64 ? UINT32_MAX : data_size);
+
+  if (pwrite (w->fd, w->header, OW_WAV_WRITER_ALIGNMENT, 0) !=
+      OW_WAV_WRITER_ALIGNMENT)
+    {
+      error_print ("Error while writing header: %s", strerror (errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+//Extents are allocated ahead without changing the file size so that the
+//file system does not need to allocate blocks while writing.
+static void
+ow_wav_writer_preallocate (struct ow_wav_writer *w, uint64_t end)
+{
+  while (end > w->allocated)
+    {
+      if (fallocate (w->fd, FALLOC_FL_KEEP_SIZE, w->allocated,
+		     OW_WAV_WRITER_EXTENT_SIZE))
+	{
+	  debug_print (1, "Could not preallocate file: %s", strerror (errno));
+	  w->allocated = UINT64_MAX;
+	  return;
+	}
+      w->allocated += OW_WAV_WRITER_EXTENT_SIZE;
+    }
+}
+
+//Writes might complete out of order so only the data before the oldest
+//pending write is known to be on disk.
+static void
+ow_wav_writer_update_written (struct ow_wav_writer *w)
+{
+  uint64_t end = w->offset;
+
+  for (int i = 0; i < OW_WAV_WRITER_QUEUE_LEN; i++)
+    {
+      if (w->queued[i] && w->starts[i] < end)
+	{
+	  end = w->starts[i];
+	}
+    }
+
+  w->written = end - DATA_OFFSET;
+}
+
+static int
+ow_wav_writer_reap (struct ow_wav_writer *w, int wait)
+{
+  int err = 0;
+#if HAVE_LIBURING
+  int index;
+  struct io_uring_cqe *cqe;
+
+  while (!(wait ? io_uring_wait_cqe (&w->ring, &cqe) :
+	   io_uring_peek_cqe (&w->ring, &cqe)))
+    {
+      index = (intptr_t) io_uring_cqe_get_data (cqe);
+      if (cqe->res < 0 || cqe->res != w->queued[index])
+	{
+	  error_print ("Error while writing: %s",
+		       cqe->res < 0 ? strerror (-cqe->res) : "short write");
+	  err = -1;
+	}
+      w->queued[index] = 0;
+      io_uring_cqe_seen (&w->ring, cqe);
+      wait = 0;
+    }
+#endif
+  ow_wav_writer_update_written (w);
+  return err;
+}
+
+static int
+ow_wav_writer_submit (struct ow_wav_writer *w, size_t size)
+{
+  char *chunk = w->chunks[w->current];
+
+  ow_wav_writer_preallocate (w, w->offset + size);
+
+#if HAVE_LIBURING
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&w->ring);
+  io_uring_prep_write (sqe, w->fd, chunk, size, w->offset);
+  io_uring_sqe_set_data (sqe, (void *) (intptr_t) w->current);
+  w->queued[w->current] = size;
+  w->starts[w->current] = w->offset;
+  if (io_uring_submit (&w->ring) < 0)
+    {
+      error_print ("Error while submitting write");
+      w->queued[w->current] = 0;
+      return -1;
+    }
+#else
+  if (pwrite (w->fd, chunk, size, w->offset) != size)
+    {
+      error_print ("Error while writing: %s", strerror (errno));
+      return -1;
+    }
+#endif
+
+  w->offset += size;
+  w->current = (w->current + 1) % OW_WAV_WRITER_QUEUE_LEN;
+  w->fill = 0;
+
+  return 0;
+}
+
+static int
+ow_wav_writer_flush_chunk (struct ow_wav_writer *w)
+{
+  int err = ow_wav_writer_submit (w, OW_WAV_WRITER_CHUNK_SIZE);
+
+  //The next chunk might still be being written.
+  while (w->queued[w->current])
+    {
+      err |= ow_wav_writer_reap (w, 1);
+    }
+  err |= ow_wav_writer_reap (w, 0);
+
+  w->header_countdown--;
+  if (!w->header_countdown)
+    {
+      w->header_countdown = OW_WAV_WRITER_HEADER_PERIOD;
+      err |= ow_wav_writer_write_header (w, w->written);
+    }
+
+  return err;
+}
+
+static void
+ow_wav_writer_free (struct ow_wav_writer *w)
+{
+  free (w->header);
+  for (int i = 0; i < OW_WAV_WRITER_QUEUE_LEN; i++)
+    {
+      free (w->chunks[i]);
+    }
+  free (w);
+}
+
+struct ow_wav_writer *
+ow_wav_writer_open (const char *path, uint16_t format, uint16_t channels,
+		    uint16_t bytes_per_sample, uint16_t valid_bits)
+{
+  struct ow_wav_writer *w = calloc (1, sizeof (struct ow_wav_writer));
+
+  if (!w)
+    {
+      error_print ("Error while allocating writer");
+      return NULL;
+    }
+
+  w->format = format;
+  w->channels = channels;
+  w->bytes_per_sample = bytes_per_sample;
+  w->valid_bits = valid_bits;
+  w->offset = DATA_OFFSET;
+  w->header_countdown = OW_WAV_WRITER_HEADER_PERIOD;
+
+  if (posix_memalign ((void **) &w->header, OW_WAV_WRITER_ALIGNMENT,
+		      OW_WAV_WRITER_ALIGNMENT))
+    {
+      goto error;
+    }
+  for (int i = 0; i < OW_WAV_WRITER_QUEUE_LEN; i++)
+    {
+      if (posix_memalign ((void **) &w->chunks[i], OW_WAV_WRITER_ALIGNMENT,
+			  OW_WAV_WRITER_CHUNK_SIZE))
+	{
+	  goto error;
+	}
+    }
+
+  w->direct = 1;
+  w->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT,
+		0644);
+  if (w->fd < 0 && errno == EINVAL)
+    {
+      debug_print (1, "O_DIRECT not supported. Using the page cache...");
+      w->direct = 0;
+      w->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+  if (w->fd < 0)
+    {
+      error_print ("Error while opening '%s': %s", path, strerror (errno));
+      goto error;
+    }
+
+#if HAVE_LIBURING
+  int err = io_uring_queue_init (OW_WAV_WRITER_QUEUE_LEN, &w->ring, 0);
+  if (err)
+    {
+      error_print ("Error while initializing io_uring: %s", strerror (-err));
+      close (w->fd);
+      goto error;
+    }
+#endif
+
+  ow_wav_writer_preallocate (w, DATA_OFFSET);
+
+  if (ow_wav_writer_write_header (w, 0))
+    {
+      ow_wav_writer_close (w);
+      return NULL;
+    }
+
+  return w;
+
+error:
+  ow_wav_writer_free (w);
+  return NULL;
+}
+
+int
+ow_wav_writer_write (struct ow_wav_writer *w, const void *data, size_t frames)
+{
+  size_t n;
+  int err = 0;
+  const char *src = data;
+  size_t size = frames * w->channels * w->bytes_per_sample;
+
+  while (size)
+    {
+      n = OW_WAV_WRITER_CHUNK_SIZE - w->fill;
+      n = n > size ? size : n;
+      memcpy (w->chunks[w->current] + w->fill, src, n);
+      w->fill += n;
+      w->data_size += n;
+      src += n;
+      size -= n;
+
+      if (w->fill == OW_WAV_WRITER_CHUNK_SIZE)
+	{
+	  err |= ow_wav_writer_flush_chunk (w);
+	}
+    }
+
+  return err;
+}
+
+//The last chunk is padded to the alignment, as required by O_DIRECT, and the
+//file is truncated afterwards to the actual size, which also releases the
+//preallocated extents.
+int
+ow_wav_writer_close (struct ow_wav_writer *w)
+{
+  size_t size;
+  int err = 0;
+
+  if (w->fill)
+    {
+      size = (w->fill + OW_WAV_WRITER_ALIGNMENT - 1) &
+	~(OW_WAV_WRITER_ALIGNMENT - 1);
+      memset (w->chunks[w->current] + w->fill, 0, size - w->fill);
+      err |= ow_wav_writer_submit (w, size);
+    }
+
+  for (int i = 0; i < OW_WAV_WRITER_QUEUE_LEN; i++)
+    {
+      while (w->queued[i])
+	{
+	  err |= ow_wav_writer_reap (w, 1);
+	}
+    }
+
+  err |= ow_wav_writer_write_header (w, w->data_size);
+
+  if (ftruncate (w->fd, DATA_OFFSET + w->data_size + (w->data_size & 1)))
+    {
+      error_print ("Error while truncating file: %s", strerror (errno));
+      err = -1;
+    }
+
+#if HAVE_LIBURING
+  io_uring_queue_exit (&w->ring);
+#endif
+  close (w->fd);
+  ow_wav_writer_free (w);
+
+  return err;
+}
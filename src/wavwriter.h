@@ -0,0 +1,80 @@
+/*
+ *   wavwriter.h
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#if HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+//Sequential WAVE file writer that does not depend on libsndfile.
+//The header takes a whole block with space reserved for the RF64 ds64 chunk
+//so that the audio data is always aligned and the file becomes RF64 only if
+//it grows past 4 GiB. The audio is written in aligned chunks with O_DIRECT,
+//when the file system supports it, and through io_uring, when available,
+//over extents preallocated with fallocate. The header is patched every few
+//chunks with the data already on disk so that an interrupted recording is
+//still readable.
+
+#define OW_WAV_WRITER_ALIGNMENT 4096
+#define OW_WAV_WRITER_CHUNK_SIZE (1024 * 1024)
+#define OW_WAV_WRITER_QUEUE_LEN 4
+#define OW_WAV_WRITER_EXTENT_SIZE (64 * 1024 * 1024)
+#define OW_WAV_WRITER_HEADER_PERIOD 16	//In chunks
+
+#define OW_WAV_FORMAT_PCM 1
+#define OW_WAV_FORMAT_FLOAT 3
+
+struct ow_wav_writer
+{
+  int fd;
+  int direct;
+  uint16_t format;
+  uint16_t channels;
+  uint16_t bytes_per_sample;
+  uint16_t valid_bits;
+  uint64_t data_size;
+  uint64_t allocated;
+  char *header;
+  char *chunks[OW_WAV_WRITER_QUEUE_LEN];
+  size_t queued[OW_WAV_WRITER_QUEUE_LEN];	//Bytes being written
+  uint64_t starts[OW_WAV_WRITER_QUEUE_LEN];	//Where they are written
+  int current;
+  size_t fill;
+  uint64_t offset;		//Where the current chunk goes
+  uint64_t written;		//Data bytes whose writes have completed
+  int header_countdown;
+#if HAVE_LIBURING
+  struct io_uring ring;
+#endif
+};
+
+struct ow_wav_writer *ow_wav_writer_open (const char *path, uint16_t format,
+					  uint16_t channels,
+					  uint16_t bytes_per_sample,
+					  uint16_t valid_bits);
+
+int ow_wav_writer_write (struct ow_wav_writer *, const void *, size_t);
+
+int ow_wav_writer_write_header (struct ow_wav_writer *, uint64_t);
+
+int ow_wav_writer_close (struct ow_wav_writer *);
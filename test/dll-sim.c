@@ -0,0 +1,516 @@
+/*
+ *   dll-sim.c
+ *   Copyright (C) 2025 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Overwitch.
+ *
+ *   Overwitch is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Overwitch is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Overwitch. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This simulates the resampler with synthetic clocks to measure how fast the
+// DLL converges and how stable it is without any hardware involved. The
+// resampler code is the same used with devices. Only the engine is replaced by
+// a simulated one that follows the same states and updates the Overbridge side
+// of the DLL and the o2h buffer as the USB callbacks do.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include "../src/resampler.h"
+#include "../src/ringbuffer.h"
+#include "../src/utils.h"
+
+#define DEFAULT_QUALITY 2
+#define MAX_LATENCY (8192 * 2)	//As in jclient.c
+#define SETTLING_TIME 2.0	//Time after running before measuring
+#define WRAP_TIME 268.435456	//28 bits of microseconds
+
+static const char *SIM_STATUS_NAMES[] = {
+  "stop", "ready", "boot", "tune", "run", "retune"
+};
+
+static const struct ow_device_desc SIM_DEVICE_DESC = {
+  .pid = 0,
+  .type = OW_DEVICE_TYPE_2,
+  .name = "Simulated Device",
+  .inputs = 1,
+  .outputs = 1,
+  .input_tracks = {{.name = "In",.size = 4}},
+  .output_tracks = {{.name = "Out",.size = 4}}
+};
+
+struct sim_params
+{
+  double ob_ppm;
+  double host_ppm;
+  double usb_jitter;		//us
+  double jack_jitter;		//us
+  int bufsize;
+  double samplerate;
+  int blocks;
+  double duration;		//s
+  double xrun_period;		//s
+  double start;			//s
+  int warm;
+  int quality;
+  unsigned int seed;
+};
+
+struct sim_result
+{
+  double run_time;
+  int retunes;
+  double ratio_err;		//ppm
+  double err_mean;		//frames
+  double err_dev;		//frames
+};
+
+static const struct sim_params DEFAULT_PARAMS = {
+  .ob_ppm = 50,
+  .host_ppm = -30,
+  .usb_jitter = 250,
+  .jack_jitter = 20,
+  .bufsize = 128,
+  .samplerate = 48000,
+  .blocks = OW_DEFAULT_BLOCKS,
+  .duration = 30,
+  .xrun_period = 0,
+  .start = WRAP_TIME - 0.5,
+  .warm = 0,
+  .quality = DEFAULT_QUALITY,
+  .seed = 1
+};
+
+static const struct sim_params BENCHMARK[] = {
+  {.ob_ppm = 50,.host_ppm = -30,.usb_jitter = 250,.jack_jitter = 20,
+   .bufsize = 128,.samplerate = 48000,.blocks = 24},
+  {.ob_ppm = 100,.host_ppm = -100,.usb_jitter = 500,.jack_jitter = 20,
+   .bufsize = 64,.samplerate = 48000,.blocks = 24},
+  {.ob_ppm = -80,.host_ppm = 60,.usb_jitter = 1000,.jack_jitter = 50,
+   .bufsize = 32,.samplerate = 48000,.blocks = 6},
+  {.ob_ppm = 0,.host_ppm = 0,.usb_jitter = 250,.jack_jitter = 20,
+   .bufsize = 1024,.samplerate = 44100,.blocks = 24},
+  {.ob_ppm = 20,.host_ppm = 0,.usb_jitter = 100,.jack_jitter = 5,
+   .bufsize = 512,.samplerate = 44100,.blocks = 32},
+  {.ob_ppm = 50,.host_ppm = -30,.usb_jitter = 250,.jack_jitter = 20,
+   .bufsize = 256,.samplerate = 96000,.blocks = 8},
+  {.ob_ppm = 50,.host_ppm = -30,.usb_jitter = 250,.jack_jitter = 20,
+   .bufsize = 128,.samplerate = 48000,.blocks = 24,.xrun_period = 5},
+  {.ob_ppm = 50,.host_ppm = -30,.usb_jitter = 250,.jack_jitter = 20,
+   .bufsize = 128,.samplerate = 48000,.blocks = 24,.warm = 1}
+};
+
+static struct option options[] = {
+  {"overbridge-ppm", 1, NULL, 'o'},
+  {"host-ppm", 1, NULL, 'p'},
+  {"usb-jitter", 1, NULL, 'u'},
+  {"jack-jitter", 1, NULL, 'j'},
+  {"buffer-size", 1, NULL, 'b'},
+  {"sample-rate", 1, NULL, 's'},
+  {"blocks-per-transfer", 1, NULL, 'k'},
+  {"duration", 1, NULL, 'd'},
+  {"xrun-period", 1, NULL, 'x'},
+  {"start-time", 1, NULL, 't'},
+  {"warm-start", 0, NULL, 'w'},
+  {"resampling-quality", 1, NULL, 'q'},
+  {"random-seed", 1, NULL, 'r'},
+  {"verbose", 0, NULL, 'v'},
+  {"help", 0, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static double
+gaussian (double sd)
+{
+  double u1 = (rand () + 1.0) / (RAND_MAX + 2.0);
+  double u2 = (rand () + 1.0) / (RAND_MAX + 2.0);
+  return sd * sqrt (-2.0 * log (u1)) * cos (2.0 * M_PI * u2);
+}
+
+static inline uint64_t
+sim_get_usecs (double t)
+{
+  return (uint64_t) (t * USEC_PER_SEC);
+}
+
+static void
+sim_audio_running (void *data)
+{
+}
+
+//As the transitions in ow_engine_run in engine.c. Transfers are only handled
+//while waiting or running.
+static ow_engine_status_t
+sim_engine_step (struct ow_engine *engine)
+{
+  ow_engine_status_t status;
+
+  pthread_spin_lock (&engine->lock);
+  if (engine->status == OW_ENGINE_STATUS_STEADY ||
+      engine->status == OW_ENGINE_STATUS_CLEAR)
+    {
+      engine->latency_o2h = engine->latency_o2h_min;
+      engine->latency_o2h_max = engine->latency_o2h_min;
+      engine->status = engine->status == OW_ENGINE_STATUS_STEADY ?
+	OW_ENGINE_STATUS_WAIT : OW_ENGINE_STATUS_RUN;
+    }
+  status = engine->status;
+  pthread_spin_unlock (&engine->lock);
+
+  return status;
+}
+
+//As set_usb_input_data_blks in engine.c
+static void
+sim_usb_input (struct ow_engine *engine, uint64_t usecs)
+{
+  ow_engine_status_t status;
+  struct ow_context *context = engine->context;
+
+  if (sim_engine_step (engine) < OW_ENGINE_STATUS_WAIT)
+    {
+      return;
+    }
+
+  pthread_spin_lock (&engine->lock);
+  context->dll_overbridge_update (context->dll, engine->frames_per_transfer,
+				  usecs);
+  status = engine->status;
+  pthread_spin_unlock (&engine->lock);
+
+  if (status < OW_ENGINE_STATUS_RUN)
+    {
+      return;
+    }
+
+  if (engine->o2h_transfer_size <= context->write_space (context->o2h_audio))
+    {
+      context->write (context->o2h_audio, (void *) engine->o2h_transfer_buf,
+		      engine->o2h_transfer_size);
+    }
+
+  pthread_spin_lock (&engine->lock);
+  engine->latency_o2h = context->read_space (context->o2h_audio) /
+    engine->o2h_frame_size;
+  if (engine->latency_o2h > engine->latency_o2h_max)
+    {
+      engine->latency_o2h_max = engine->latency_o2h;
+    }
+  pthread_spin_unlock (&engine->lock);
+}
+
+static void
+sim_run (const struct sim_params *params, struct sim_result *result,
+	 int trace)
+{
+  struct ow_engine engine;
+  struct ow_device device;
+  struct ow_resampler resampler;
+  struct ow_context context;
+  struct ow_dll *dll = &resampler.dll;
+  ow_resampler_status_t status;
+  uint32_t frames = params->blocks * OB_FRAMES_PER_BLOCK;
+  double ob_rate = OB_SAMPLE_RATE * (1.0 + params->ob_ppm * 1e-6);
+  double host_rate = params->samplerate * (1.0 + params->host_ppm * 1e-6);
+  double ratio = host_rate / ob_rate;
+  double period = params->bufsize / host_rate;
+  double t_ob = params->start;
+  double t_host = params->start + period / 2;
+  double end = params->start + params->duration;
+  double next_xrun = params->xrun_period > 0 ?
+    params->start + params->xrun_period : end;
+  double run_time = -1;
+  double sum_err = 0, sum_err2 = 0, sum_ratio_err2 = 0;
+  int xrun = 0, n = 0;
+
+  srand (params->seed);
+
+  memset (&engine, 0, sizeof (engine));
+  device.desc = SIM_DEVICE_DESC;
+  engine.device = &device;
+  snprintf (engine.name, OW_ENGINE_NAME_MAX_LEN, "%s", device.desc.name);
+  ow_engine_init_mem (&engine, params->blocks);
+
+  memset (&context, 0, sizeof (context));
+  context.o2h_audio = ow_ringbuffer_new (MAX_LATENCY * engine.o2h_frame_size);
+  context.read_space = ow_ringbuffer_read_space;
+  context.write_space = ow_ringbuffer_write_space;
+  context.read = ow_ringbuffer_read;
+  context.write = ow_ringbuffer_write;
+  engine.context = &context;
+
+  ow_resampler_init_mem (&resampler, &engine, params->quality);
+  if (params->warm)
+    {
+      //The state is stored normalized to the device sample rate.
+      ow_resampler_set_dll_state (&resampler,
+				  ratio * OB_SAMPLE_RATE / params->samplerate,
+				  ob_rate);
+    }
+  ow_resampler_init_host (&resampler, &context, params->samplerate,
+			  params->bufsize);
+
+  context.dll_overbridge_init (context.dll, OB_SAMPLE_RATE, frames);
+  engine.status = OW_ENGINE_STATUS_READY;
+
+  while (t_host < end)
+    {
+      double t;
+      uint64_t usecs;
+
+      //USB callbacks always happen after the transfer has completed.
+      if (t_ob < t_host)
+	{
+	  usecs = sim_get_usecs (t_ob + fabs (gaussian (params->usb_jitter *
+							SEC_PER_USEC)));
+	  sim_usb_input (&engine, usecs);
+	  t_ob += frames / ob_rate;
+	  continue;
+	}
+
+      usecs = sim_get_usecs (t_host + gaussian (params->jack_jitter *
+						SEC_PER_USEC));
+      t = t_host - params->start;
+      t_host += period;
+
+      //A missed cycle is reported in the next one.
+      if (t_host > next_xrun)
+	{
+	  next_xrun += params->xrun_period;
+	  xrun = 1;
+	  continue;
+	}
+
+      if (ow_resampler_compute_ratios (&resampler, usecs, xrun,
+				       sim_audio_running, NULL))
+	{
+	  break;
+	}
+      xrun = 0;
+
+      if (ow_resampler_read_audio (&resampler))
+	{
+	  break;
+	}
+
+      status = ow_resampler_get_status (&resampler);
+
+      if (status == OW_RESAMPLER_STATUS_RUN)
+	{
+	  if (run_time < 0)
+	    {
+	      run_time = t;
+	    }
+	  else if (t > run_time + SETTLING_TIME)
+	    {
+	      double ratio_err = (dll->ratio - ratio) / ratio;
+	      sum_err += dll->err;
+	      sum_err2 += dll->err * dll->err;
+	      sum_ratio_err2 += ratio_err * ratio_err;
+	      n++;
+	    }
+	}
+
+      if (trace)
+	{
+	  printf ("%9.6f %-6s err: %8.3f; mean: %8.3f; dev: %7.3f; ratio: %.7f (%.7f)\n",
+		  t, SIM_STATUS_NAMES[status], dll->err, dll->err_mean,
+		  sqrt (dll->err_var), dll->ratio, ratio);
+	}
+    }
+
+  result->run_time = run_time;
+  result->retunes = resampler.retunes;
+  if (n)
+    {
+      result->err_mean = sum_err / n;
+      result->err_dev = sqrt (sum_err2 / n - result->err_mean *
+			      result->err_mean);
+      result->ratio_err = sqrt (sum_ratio_err2 / n) * 1e6;
+    }
+  else
+    {
+      result->err_mean = NAN;
+      result->err_dev = NAN;
+      result->ratio_err = NAN;
+    }
+
+  ow_resampler_free_mem (&resampler);
+  ow_engine_free_mem (&engine);
+  ow_ringbuffer_free (context.o2h_audio);
+}
+
+static void
+sim_print_header ()
+{
+  printf ("%6s %6s %6s %6s %5s %6s %3s %5s %4s | %7s %7s %9s %8s %8s\n",
+	  "OB ppm", "H ppm", "USB us", "JCK us", "buf", "rate", "blk", "xrun",
+	  "warm", "run (s)", "retunes", "ratio ppm", "err mean",
+	  "lat (ms)");
+}
+
+static void
+sim_print_result (const struct sim_params *params,
+		  const struct sim_result *result)
+{
+  printf ("%6.0f %6.0f %6.0f %6.0f %5d %6.0f %3d %5.1f %4s | ",
+	  params->ob_ppm, params->host_ppm, params->usb_jitter,
+	  params->jack_jitter, params->bufsize, params->samplerate,
+	  params->blocks, params->xrun_period, params->warm ? "yes" : "no");
+  if (result->run_time < 0)
+    {
+      printf ("%7s\n", "never");
+      return;
+    }
+  //The latency deviation is the deviation of the DLL error, which is measured in device frames.
+  printf ("%7.3f %7d %9.3f %8.3f %8.4f\n", result->run_time,
+	  result->retunes, result->ratio_err, result->err_mean,
+	  result->err_dev * 1000.0 / OB_SAMPLE_RATE);
+}
+
+static int
+sim_get_double (const char *arg, double *value)
+{
+  char *endstr;
+
+  errno = 0;
+  *value = strtod (arg, &endstr);
+  if (errno || endstr == arg || *endstr != '\0')
+    {
+      fprintf (stderr, "Invalid value '%s'\n", arg);
+      return -EINVAL;
+    }
+  return 0;
+}
+
+static void
+sim_print_help (const char *exec_name)
+{
+  struct option *option = options;
+
+  fprintf (stderr, "Usage: %s [options]\n", exec_name);
+  fprintf (stderr,
+	   "Without options, a predefined set of scenarios is simulated.\n");
+  fprintf (stderr, "Options:\n");
+  while (option->name)
+    {
+      fprintf (stderr, "  --%s, -%c", option->name, option->val);
+      if (option->has_arg)
+	{
+	  fprintf (stderr, " value");
+	}
+      fprintf (stderr, "\n");
+      option++;
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  int opt, long_index = 0, vflg = 0, err = 0;
+  double value;
+  struct sim_params params = DEFAULT_PARAMS;
+  struct sim_result result;
+
+  if (argc == 1)
+    {
+      sim_print_header ();
+      for (int i = 0; i < sizeof (BENCHMARK) / sizeof (struct sim_params);
+	   i++)
+	{
+	  params = BENCHMARK[i];
+	  params.duration = DEFAULT_PARAMS.duration;
+	  params.start = DEFAULT_PARAMS.start;
+	  params.quality = DEFAULT_PARAMS.quality;
+	  params.seed = DEFAULT_PARAMS.seed;
+	  sim_run (&params, &result, 0);
+	  sim_print_result (&params, &result);
+	}
+      return EXIT_SUCCESS;
+    }
+
+  while ((opt = getopt_long (argc, argv, "o:p:u:j:b:s:k:d:x:t:wq:r:vh",
+			     options, &long_index)) != -1)
+    {
+      switch (opt)
+	{
+	case 'o':
+	  err |= sim_get_double (optarg, &params.ob_ppm);
+	  break;
+	case 'p':
+	  err |= sim_get_double (optarg, &params.host_ppm);
+	  break;
+	case 'u':
+	  err |= sim_get_double (optarg, &params.usb_jitter);
+	  break;
+	case 'j':
+	  err |= sim_get_double (optarg, &params.jack_jitter);
+	  break;
+	case 'b':
+	  err |= sim_get_double (optarg, &value);
+	  params.bufsize = value;
+	  break;
+	case 's':
+	  err |= sim_get_double (optarg, &params.samplerate);
+	  break;
+	case 'k':
+	  err |= sim_get_double (optarg, &value);
+	  params.blocks = value;
+	  break;
+	case 'd':
+	  err |= sim_get_double (optarg, &params.duration);
+	  break;
+	case 'x':
+	  err |= sim_get_double (optarg, &params.xrun_period);
+	  break;
+	case 't':
+	  err |= sim_get_double (optarg, &params.start);
+	  break;
+	case 'w':
+	  params.warm = 1;
+	  break;
+	case 'q':
+	  err |= sim_get_double (optarg, &value);
+	  params.quality = value;
+	  break;
+	case 'r':
+	  err |= sim_get_double (optarg, &value);
+	  params.seed = value;
+	  break;
+	case 'v':
+	  vflg++;
+	  break;
+	case 'h':
+	  sim_print_help (argv[0]);
+	  return EXIT_SUCCESS;
+	case '?':
+	  err = -EINVAL;
+	}
+    }
+
+  if (err || params.bufsize <= 0 || params.blocks <= 0
+      || params.samplerate <= 0)
+    {
+      sim_print_help (argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  sim_run (&params, &result, vflg);
+  sim_print_header ();
+  sim_print_result (&params, &result);
+
+  return EXIT_SUCCESS;
+}
@@ -1,16 +1,32 @@
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sndfile.h>
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
+#include "../config.h"
 #include "../src/jclient.h"
 #include "../src/engine.h"
 #include "../src/common.h"
 #include "../src/message.h"
+#include "../src/stats.h"
+#include "../src/metrics.h"
+#include "../src/device_table.h"
+#include "../src/preferences.h"
+#include "../src/wavwriter.h"
+#include "../src/ringbuffer.h"
 
 #define BLOCKS 4
 #define TRACKS 6
 #define NFRAMES 64
 
+//More than a chunk and not a multiple of the alignment
+#define WAV_FRAMES 300001
+#define WAV_CHANNELS 2
+#define WAV_DATA_OFFSET OW_WAV_WRITER_ALIGNMENT
+
 static const struct ow_device_desc TESTDEV_DESC_T2 = {
   .pid = 0,
   .type = OW_DEVICE_TYPE_2,
@@ -253,6 +269,86 @@ test_usb_blocks_t2 ()
   test_usb_blocks (&TESTDEV_DESC_T3, 1e-6);
 }
 
+static void
+test_usb_blocks_int (const struct ow_device_desc *device_desc)
+{
+  int32_t *v;
+  uint8_t *s;
+  uint32_t raw, expected;
+  struct ow_engine engine;
+
+  printf ("\n");
+
+  engine.device = malloc (sizeof (struct ow_device));
+  ow_copy_device_desc (&engine.device->desc, device_desc);
+  engine.usb.audio_in_blk_len = 0;
+  engine.usb.audio_out_blk_len = 0;
+  ow_engine_init_mem (&engine, BLOCKS);
+  engine.o2h_int = 1;
+
+  for (int i = 0; i < BLOCKS; i++)
+    {
+      s = (uint8_t *) GET_NTH_INPUT_USB_BLK (&engine, i)->data;
+      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
+	{
+	  for (int k = 0; k < engine.device->desc.outputs; k++)
+	    {
+	      int size = engine.device->desc.output_tracks[k].size;
+	      raw = 0x87654321 * (i + 1) + 0x01234567 * (j + k);
+	      if (engine.device->desc.type == OW_DEVICE_TYPE_3 && size == 4)
+		{
+		  raw = htobe32 ((int32_t) raw >> 8);
+		}
+	      else
+		{
+		  raw = htobe32 (raw);
+		}
+	      memcpy (s, &raw, size);
+	      s += size;
+	    }
+	}
+    }
+
+  ow_engine_read_usb_input_blocks (&engine);
+
+  v = (int32_t *) engine.o2h_transfer_buf;
+  for (int i = 0; i < BLOCKS; i++)
+    {
+      for (int j = 0; j < OB_FRAMES_PER_BLOCK; j++)
+	{
+	  for (int k = 0; k < engine.device->desc.outputs; k++)
+	    {
+	      int size = engine.device->desc.output_tracks[k].size;
+	      expected = 0x87654321 * (i + 1) + 0x01234567 * (j + k);
+	      if (engine.device->desc.type == OW_DEVICE_TYPE_3)
+		{
+		  expected &= 0xffffff00;
+		}
+	      else if (size == 2)
+		{
+		  expected &= 0xffff0000;
+		}
+	      CU_ASSERT_EQUAL (*v, (int32_t) expected);
+	      v++;
+	    }
+	}
+    }
+
+  ow_engine_free_mem (&engine);
+}
+
+static void
+test_usb_blocks_int_t1 ()
+{
+  test_usb_blocks_int (&TESTDEV_DESC_T2);
+}
+
+static void
+test_usb_blocks_int_t2 ()
+{
+  test_usb_blocks_int (&TESTDEV_DESC_T3);
+}
+
 static void
 test_jack_buffers ()
 {
@@ -373,6 +469,425 @@ test_state_parser ()
   free (engine.device);
 }
 
+static void
+test_state_variant ()
+{
+  guint32 id;
+  GVariant *state, *v;
+  GVariantIter *devices_iter, *removed_iter;
+  GVariantBuilder devices, removed;
+  OverwitchDevice *device;
+  guint32 samplerate, buffer_size;
+  double target_delay_ms;
+  struct ow_device ow_device;
+  struct ow_resampler_state resampler_state;
+
+  ow_copy_device_desc (&ow_device.desc, &TESTDEV_DESC_T2);
+  ow_device.bus = 1;
+  ow_device.address = 2;
+
+  resampler_state.t_latency_o2h = 2;
+  resampler_state.t_latency_o2h_max = 3;
+  resampler_state.t_latency_o2h_min = 1;
+  resampler_state.t_latency_h2o = 2;
+  resampler_state.t_latency_h2o_max = 3;
+  resampler_state.t_latency_h2o_min = 1;
+  resampler_state.ratio_o2h = 0.9;
+  resampler_state.ratio_h2o = 1.0 / 0.9;
+  resampler_state.status = OW_RESAMPLER_STATUS_RUN;
+
+  g_variant_builder_init (&devices, G_VARIANT_TYPE ("a" MESSAGE_DEVICE_TYPE));
+  g_variant_builder_init (&removed, G_VARIANT_TYPE ("au"));
+
+  message_state_variant_add_device (&devices, 3, "name", &ow_device,
+				    &resampler_state);
+  g_variant_builder_add (&removed, "u", 5);
+
+  state = message_state_variant_new (&devices, &removed, 1, 2, 3);
+  g_variant_ref_sink (state);
+
+  CU_ASSERT_TRUE (g_variant_is_of_type (state,
+					G_VARIANT_TYPE (MESSAGE_STATE_TYPE)));
+
+  g_variant_get (state, MESSAGE_STATE_TYPE, &devices_iter, &removed_iter,
+		 &samplerate, &buffer_size, &target_delay_ms);
+
+  CU_ASSERT_EQUAL (g_variant_iter_n_children (devices_iter), 1);
+  v = g_variant_iter_next_value (devices_iter);
+  device = message_state_variant_get_device (v);
+  CU_ASSERT_EQUAL (device->id, 3);
+  CU_ASSERT_STRING_EQUAL (device->name, "name");
+  CU_ASSERT_STRING_EQUAL (device->device, TESTDEV_DESC_T2.name);
+  CU_ASSERT_EQUAL (device->bus, 1);
+  CU_ASSERT_EQUAL (device->address, 2);
+  CU_ASSERT_EQUAL (device->o2j_ratio, 0.9);
+  g_object_unref (device);
+  g_variant_unref (v);
+
+  CU_ASSERT_TRUE (g_variant_iter_next (removed_iter, "u", &id));
+  CU_ASSERT_EQUAL (id, 5);
+
+  CU_ASSERT_EQUAL (samplerate, 1);
+  CU_ASSERT_EQUAL (buffer_size, 2);
+  CU_ASSERT_EQUAL (target_delay_ms, 3);
+
+  g_variant_iter_free (devices_iter);
+  g_variant_iter_free (removed_iter);
+  g_variant_unref (state);
+}
+
+static void
+test_stats_device ()
+{
+  struct ow_stats_device stats, copy;
+
+  memset (&stats, 0, sizeof (stats));
+
+  ow_stats_device_write_begin (&stats);
+  CU_ASSERT_EQUAL (ow_stats_device_read (&stats, &copy), -1);
+  stats.active = 1;
+  stats.samplerate = 48000;
+  stats.counters.usb_errors = 3;
+  ow_stats_device_write_end (&stats);
+
+  CU_ASSERT_EQUAL (ow_stats_device_read (&stats, &copy), 0);
+  CU_ASSERT_EQUAL (copy.active, 1);
+  CU_ASSERT_EQUAL (copy.samplerate, 48000);
+  CU_ASSERT_EQUAL (copy.counters.usb_errors, 3);
+
+  ow_stats_hist_add (stats.host_cycles, 0);
+  ow_stats_hist_add (stats.host_cycles, 1333);
+  ow_stats_hist_add (stats.host_cycles, 1000000);
+  CU_ASSERT_EQUAL (stats.host_cycles[0], 1);
+  CU_ASSERT_EQUAL (stats.host_cycles[13], 1);
+  CU_ASSERT_EQUAL (stats.host_cycles[OW_STATS_HIST_BINS - 1], 1);
+
+  ow_stats_device_clear (&stats);
+  CU_ASSERT_EQUAL (ow_stats_device_read (&stats, &copy), 0);
+  CU_ASSERT_EQUAL (copy.active, 0);
+  CU_ASSERT_EQUAL (stats.host_cycles[13], 0);
+}
+
+static void
+test_ringbuffer ()
+{
+  char src[48], dst[48];
+  struct ow_ringbuffer *rb = ow_ringbuffer_new (40);
+
+  CU_ASSERT_PTR_NOT_NULL_FATAL (rb);
+  CU_ASSERT_EQUAL (rb->size, 64);
+  CU_ASSERT_EQUAL (ow_ringbuffer_read_space (rb), 0);
+  CU_ASSERT_EQUAL (ow_ringbuffer_write_space (rb), 64);
+
+  for (int i = 0; i < sizeof (src); i++)
+    {
+      src[i] = i;
+    }
+
+  //Wrapping around
+  CU_ASSERT_EQUAL (ow_ringbuffer_write (rb, src, 48), 48);
+  CU_ASSERT_EQUAL (ow_ringbuffer_read (rb, NULL, 40), 0);
+  CU_ASSERT_EQUAL (ow_ringbuffer_read_space (rb), 8);
+  CU_ASSERT_EQUAL (ow_ringbuffer_write (rb, src, 48), 48);
+  CU_ASSERT_EQUAL (ow_ringbuffer_read_space (rb), 56);
+  CU_ASSERT_EQUAL (ow_ringbuffer_write_space (rb), 8);
+  CU_ASSERT_EQUAL (ow_ringbuffer_read (rb, dst, 8), 8);
+  CU_ASSERT_EQUAL (memcmp (dst, &src[40], 8), 0);
+  CU_ASSERT_EQUAL (ow_ringbuffer_read (rb, dst, 48), 48);
+  CU_ASSERT_EQUAL (memcmp (dst, src, 48), 0);
+  CU_ASSERT_EQUAL (ow_ringbuffer_read (rb, dst, 48), 0);
+
+  //Writes are limited to the space available.
+  CU_ASSERT_EQUAL (ow_ringbuffer_write (rb, src, 48), 48);
+  CU_ASSERT_EQUAL (ow_ringbuffer_write (rb, src, 48), 16);
+  CU_ASSERT_EQUAL (ow_ringbuffer_write_space (rb), 0);
+  CU_ASSERT_EQUAL (ow_ringbuffer_read_space (rb), 64);
+
+  ow_ringbuffer_free (rb);
+}
+
+static uint16_t
+get_le16 (const char *p)
+{
+  uint16_t v;
+  memcpy (&v, p, sizeof (v));
+  return le16toh (v);
+}
+
+static uint32_t
+get_le32 (const char *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof (v));
+  return le32toh (v);
+}
+
+static uint64_t
+get_le64 (const char *p)
+{
+  uint64_t v;
+  memcpy (&v, p, sizeof (v));
+  return le64toh (v);
+}
+
+static int
+read_wav_header (const gchar *path, char *header)
+{
+  int fd = open (path, O_RDONLY);
+  ssize_t len = pread (fd, header, WAV_DATA_OFFSET, 0);
+  close (fd);
+  return len != WAV_DATA_OFFSET;
+}
+
+static void
+test_wav_writer ()
+{
+  int fd;
+  SF_INFO info;
+  SNDFILE *sndfile;
+  gchar *path;
+  struct stat st;
+  char header[WAV_DATA_OFFSET];
+  uint32_t data_size = WAV_FRAMES * WAV_CHANNELS * sizeof (float);
+  float *data = malloc (data_size);
+  float *read_data = malloc (data_size);
+  struct ow_wav_writer *w;
+
+  for (int i = 0; i < WAV_FRAMES * WAV_CHANNELS; i++)
+    {
+      data[i] = (i % 1000) / 1000.0 - 0.5;
+    }
+
+  fd = g_file_open_tmp ("overwitch-XXXXXX.wav", &path, NULL);
+  CU_ASSERT_FATAL (fd >= 0);
+  close (fd);
+
+  w = ow_wav_writer_open (path, OW_WAV_FORMAT_FLOAT, WAV_CHANNELS,
+			  sizeof (float), 32);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (w);
+  //Uneven writes
+  CU_ASSERT_EQUAL (ow_wav_writer_write (w, data, 1), 0);
+  CU_ASSERT_EQUAL (ow_wav_writer_write (w, &data[WAV_CHANNELS],
+					WAV_FRAMES - 1), 0);
+  CU_ASSERT_EQUAL (ow_wav_writer_close (w), 0);
+
+  CU_ASSERT_EQUAL (stat (path, &st), 0);
+  CU_ASSERT_EQUAL (st.st_size, WAV_DATA_OFFSET + data_size);
+
+  CU_ASSERT_EQUAL_FATAL (read_wav_header (path, header), 0);
+  CU_ASSERT_NSTRING_EQUAL (header, "RIFF", 4);
+  CU_ASSERT_EQUAL (get_le32 (&header[4]), st.st_size - 8);
+  CU_ASSERT_NSTRING_EQUAL (&header[8], "WAVE", 4);
+  CU_ASSERT_NSTRING_EQUAL (&header[12], "JUNK", 4);
+  CU_ASSERT_NSTRING_EQUAL (&header[48], "fmt ", 4);
+  CU_ASSERT_EQUAL (get_le32 (&header[52]), 40);
+  CU_ASSERT_EQUAL (get_le16 (&header[56]), 0xfffe);
+  CU_ASSERT_EQUAL (get_le16 (&header[58]), WAV_CHANNELS);
+  CU_ASSERT_EQUAL (get_le32 (&header[60]), 48000);
+  CU_ASSERT_EQUAL (get_le32 (&header[64]),
+		   48000 * WAV_CHANNELS * sizeof (float));
+  CU_ASSERT_EQUAL (get_le16 (&header[68]), WAV_CHANNELS * sizeof (float));
+  CU_ASSERT_EQUAL (get_le16 (&header[70]), 32);
+  CU_ASSERT_EQUAL (get_le16 (&header[74]), 32);
+  CU_ASSERT_EQUAL (get_le16 (&header[80]), OW_WAV_FORMAT_FLOAT);
+  CU_ASSERT_NSTRING_EQUAL (&header[WAV_DATA_OFFSET - 8], "data", 4);
+  CU_ASSERT_EQUAL (get_le32 (&header[WAV_DATA_OFFSET - 4]), data_size);
+
+  memset (&info, 0, sizeof (info));
+  sndfile = sf_open (path, SFM_READ, &info);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (sndfile);
+  CU_ASSERT_EQUAL (info.frames, WAV_FRAMES);
+  CU_ASSERT_EQUAL (info.channels, WAV_CHANNELS);
+  CU_ASSERT_EQUAL (info.samplerate, 48000);
+  CU_ASSERT_EQUAL (info.format & SF_FORMAT_SUBMASK, SF_FORMAT_FLOAT);
+  CU_ASSERT_EQUAL (sf_readf_float (sndfile, read_data, WAV_FRAMES),
+		   WAV_FRAMES);
+  CU_ASSERT_EQUAL (memcmp (data, read_data, data_size), 0);
+  sf_close (sndfile);
+
+  //Sizes above 4 GiB only fit in the ds64 chunk.
+  w = ow_wav_writer_open (path, OW_WAV_FORMAT_PCM, WAV_CHANNELS, 3, 24);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (w);
+  CU_ASSERT_EQUAL (ow_wav_writer_write_header (w, 6000000000), 0);
+
+  CU_ASSERT_EQUAL_FATAL (read_wav_header (path, header), 0);
+  CU_ASSERT_NSTRING_EQUAL (header, "RF64", 4);
+  CU_ASSERT_EQUAL (get_le32 (&header[4]), UINT32_MAX);
+  CU_ASSERT_NSTRING_EQUAL (&header[12], "ds64", 4);
+  CU_ASSERT_EQUAL (get_le32 (&header[16]), 28);
+  CU_ASSERT_EQUAL (get_le64 (&header[20]),
+		   WAV_DATA_OFFSET - 8 + 6000000000ULL);
+  CU_ASSERT_EQUAL (get_le64 (&header[28]), 6000000000ULL);
+  CU_ASSERT_EQUAL (get_le64 (&header[36]), 1000000000ULL);
+  CU_ASSERT_EQUAL (get_le16 (&header[80]), OW_WAV_FORMAT_PCM);
+  CU_ASSERT_EQUAL (get_le32 (&header[WAV_DATA_OFFSET - 4]), UINT32_MAX);
+
+  //Closing writes the actual sizes again.
+  CU_ASSERT_EQUAL (ow_wav_writer_close (w), 0);
+  CU_ASSERT_EQUAL_FATAL (read_wav_header (path, header), 0);
+  CU_ASSERT_NSTRING_EQUAL (header, "RIFF", 4);
+  CU_ASSERT_NSTRING_EQUAL (&header[12], "JUNK", 4);
+  CU_ASSERT_EQUAL (get_le32 (&header[WAV_DATA_OFFSET - 4]), 0);
+
+  //The periodic header only counts the data already on disk.
+  w = ow_wav_writer_open (path, OW_WAV_FORMAT_FLOAT, WAV_CHANNELS,
+			  sizeof (float), 32);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (w);
+  for (int i = 0; i < OW_WAV_WRITER_HEADER_PERIOD; i++)
+    {
+      CU_ASSERT_EQUAL (ow_wav_writer_write (w, data,
+					    OW_WAV_WRITER_CHUNK_SIZE /
+					    (WAV_CHANNELS * sizeof (float))),
+		       0);
+    }
+  CU_ASSERT_EQUAL_FATAL (read_wav_header (path, header), 0);
+  CU_ASSERT_EQUAL (stat (path, &st), 0);
+  CU_ASSERT (get_le32 (&header[WAV_DATA_OFFSET - 4]) > 0);
+  CU_ASSERT (get_le32 (&header[WAV_DATA_OFFSET - 4]) <=
+	     st.st_size - WAV_DATA_OFFSET);
+  CU_ASSERT_EQUAL (get_le32 (&header[WAV_DATA_OFFSET - 4]) %
+		   OW_WAV_WRITER_CHUNK_SIZE, 0);
+  CU_ASSERT_EQUAL (ow_wav_writer_close (w), 0);
+
+  unlink (path);
+  g_free (path);
+  free (data);
+  free (read_data);
+}
+
+static void
+test_device_table ()
+{
+  const struct ow_device_desc *desc;
+
+  desc = ow_device_table_get (2860);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (desc);
+  CU_ASSERT_EQUAL (desc->pid, 2860);
+  CU_ASSERT_STRING_EQUAL (desc->name, "Digitakt");
+  CU_ASSERT_EQUAL (desc->inputs, 2);
+  CU_ASSERT_EQUAL (desc->outputs, 12);
+  CU_ASSERT_STRING_EQUAL (desc->output_tracks[11].name, "Input R");
+
+  for (int i = 0; i < OW_DEVICE_TABLE_LEN; i++)
+    {
+      desc = &OW_DEVICE_TABLE[i];
+      CU_ASSERT_PTR_EQUAL (ow_device_table_get (desc->pid), desc);
+    }
+
+  CU_ASSERT_PTR_NULL (ow_device_table_get (0));
+  CU_ASSERT_PTR_NULL (ow_device_table_get (OW_DEVICE_TABLE_PID_MIN - 1));
+  CU_ASSERT_PTR_NULL (ow_device_table_get (OW_DEVICE_TABLE_PID_MIN +
+					   OW_DEVICE_TABLE_INDEX_LEN));
+}
+
+static void
+test_metrics_text ()
+{
+  gchar *text;
+  struct ow_stats_page *page = g_malloc0 (sizeof (struct ow_stats_page));
+  struct ow_stats_device *stats = &page->devices[1];
+
+  ow_stats_device_write_begin (stats);
+  stats->active = 1;
+  snprintf (stats->name, OW_LABEL_MAX_LEN, "Digi\"tone");
+  snprintf (stats->device, OW_LABEL_MAX_LEN, "Digitone");
+  stats->bus = 1;
+  stats->address = 7;
+  stats->xruns = 2;
+  stats->counters.usb_errors = 5;
+  stats->counters.usb_reconnections = 1;
+  ow_stats_device_write_end (stats);
+
+  ow_stats_hist_add (stats->host_cycles, 1000);
+  ow_stats_hist_add (stats->host_cycles, 1333);
+  ow_stats_hist_add (stats->host_cycles, 1000000);
+  ow_stats_latency_add (stats->o2h_latency, 100);
+
+  text = metrics_get_text (page);
+
+  CU_ASSERT_PTR_NOT_NULL (strstr (text, "overwitch_xruns_total{id=\"1\","
+				  "name=\"Digi\\\"tone\",device=\"Digitone\","
+				  "bus=\"1\",address=\"7\"} 2\n"));
+  CU_ASSERT_PTR_NOT_NULL (strstr (text, "overwitch_usb_errors_total{"));
+  CU_ASSERT_PTR_NOT_NULL (strstr (text, "overwitch_usb_reconnections_total{"
+				  "id=\"1\",name=\"Digi\\\"tone\",device=\"Digitone\","
+				  "bus=\"1\",address=\"7\"} 1\n"));
+  //The bounds are inclusive.
+  CU_ASSERT_PTR_NOT_NULL (strstr (text, "le=\"0.001\"} 1\n"));
+  CU_ASSERT_PTR_NOT_NULL (strstr (text, "le=\"0.0015\"} 2\n"));
+  CU_ASSERT_PTR_NOT_NULL (strstr (text, "le=\"+Inf\"} 3\n"));
+  CU_ASSERT_PTR_NOT_NULL (strstr (text, "direction=\"o2h\","
+				  "le=\"0.00266667\"} 1\n"));
+  CU_ASSERT_PTR_NULL (strstr (text, "id=\"0\""));
+  CU_ASSERT (g_str_has_suffix (text, "# EOF\n"));
+
+  g_free (text);
+  g_free (page);
+}
+
+static void
+test_device_profiles ()
+{
+  struct ow_preferences prefs;
+  struct ow_device_profile profile;
+  struct ow_device_profile by_pid = {
+    .pid = 2860,
+    .blocks = 4,
+    .timeout = OW_PROFILE_UNSET,
+    .quality = 0,
+    .priority = OW_PROFILE_UNSET,
+    .low_latency = OW_PROFILE_UNSET,
+    .output_mask = 0x3,
+    .input_mask = OW_PROFILE_ALL_TRACKS
+  };
+  struct ow_device_profile by_name = {
+    .pid = OW_PROFILE_UNSET,
+    .name = g_strdup ("Live"),
+    .blocks = 8,
+    .timeout = OW_PROFILE_UNSET,
+    .quality = OW_PROFILE_UNSET,
+    .priority = 80,
+    .cpus = 0x4,
+    .low_latency = TRUE,
+    .output_mask = OW_PROFILE_ALL_TRACKS,
+    .input_mask = OW_PROFILE_ALL_TRACKS
+  };
+
+  prefs.blocks = 24;
+  prefs.timeout = 10;
+  prefs.quality = 2;
+  prefs.profiles = g_array_new (FALSE, FALSE,
+				sizeof (struct ow_device_profile));
+  g_array_append_val (prefs.profiles, by_pid);
+  g_array_append_val (prefs.profiles, by_name);
+
+  ow_preferences_get_device_profile (&prefs, 2860, "Digitakt", &profile);
+  CU_ASSERT_EQUAL (profile.blocks, 4);
+  CU_ASSERT_EQUAL (profile.timeout, 10);
+  CU_ASSERT_EQUAL (profile.quality, 0);
+  CU_ASSERT_EQUAL (profile.priority, OW_PROFILE_UNSET);
+  CU_ASSERT_EQUAL (profile.output_mask, 0x3);
+  CU_ASSERT_EQUAL (profile.low_latency, FALSE);
+
+  //Name profiles are applied on top of the PID ones.
+  ow_preferences_get_device_profile (&prefs, 2860, "Live", &profile);
+  CU_ASSERT_EQUAL (profile.blocks, 8);
+  CU_ASSERT_EQUAL (profile.quality, 0);
+  CU_ASSERT_EQUAL (profile.priority, 80);
+  CU_ASSERT_EQUAL (profile.cpus, 0x4);
+  CU_ASSERT_EQUAL (profile.low_latency, TRUE);
+  CU_ASSERT_EQUAL (profile.output_mask, 0x3);
+
+  ow_preferences_get_device_profile (&prefs, 2861, "Digitone", &profile);
+  CU_ASSERT_EQUAL (profile.blocks, 24);
+  CU_ASSERT_EQUAL (profile.quality, 2);
+  CU_ASSERT_EQUAL (profile.cpus, 0);
+  CU_ASSERT_EQUAL (profile.output_mask, OW_PROFILE_ALL_TRACKS);
+
+  g_free (by_name.name);
+  g_array_free (prefs.profiles, TRUE);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -411,6 +926,16 @@ main (int argc, char *argv[])
       goto cleanup;
     }
 
+  if (!CU_add_test (suite, "test_usb_blocks_int_t1", test_usb_blocks_int_t1))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_usb_blocks_int_t2", test_usb_blocks_int_t2))
+    {
+      goto cleanup;
+    }
+
   if (!CU_add_test (suite, "test_jack_buffers", test_jack_buffers))
     {
       goto cleanup;
@@ -427,6 +952,41 @@ main (int argc, char *argv[])
       goto cleanup;
     }
 
+  if (!CU_add_test (suite, "state_variant", test_state_variant))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "stats_device", test_stats_device))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "ringbuffer", test_ringbuffer))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "wav_writer", test_wav_writer))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "device_table", test_device_table))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "metrics_text", test_metrics_text))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "device_profiles", test_device_profiles))
+    {
+      goto cleanup;
+    }
+
   CU_basic_set_mode (CU_BRM_VERBOSE);
 
   CU_basic_run_tests ();